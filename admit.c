@@ -0,0 +1,256 @@
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "admit.h"
+#include "discovery.h"
+#include "logger.h"
+#include "openflow13.h"
+
+#define ADMIT_ETH_IP        0x0800
+#define ADMIT_ETH_VLAN      0x8100
+
+struct admit *admit_new(struct event_base *base, const char *name)
+{
+    struct admit *a;
+
+    a = malloc(sizeof(*a));
+    if (a == NULL) {
+        LogError(name, "Unable to malloc %d bytes", sizeof(*a));
+        return NULL;
+    }
+    memset(a, 0, sizeof(*a));
+    a->name = strdup(name);
+    a->base = base;
+    return a;
+}
+
+void admit_free(struct admit *a)
+{
+    free(a->name);
+    free(a);
+}
+
+static uint64_t admit_now_us(struct admit *a)
+{
+    struct timeval tv;
+
+    event_base_gettimeofday_cached(a->base, &tv);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void admit_set_rate(struct admit *a, uint32_t rate, uint32_t burst,
+                    uint32_t flow_rate, uint32_t flow_burst, uint32_t sample)
+{
+    if (rate == a->rate && burst == a->burst && flow_rate == a->flow_rate &&
+        flow_burst == a->flow_burst && sample == a->sample) {
+        return;
+    }
+    a->rate = rate;
+    a->burst = burst > 0 ? burst : 1;
+    a->flow_rate = flow_rate;
+    a->flow_burst = flow_burst > 0 ? flow_burst : 1;
+    a->sample = sample;
+
+    a->tokens = a->burst;
+    a->refill_us = admit_now_us(a);
+    a->over = 0;
+    /* A zero key is a free slot, which starts full */
+    memset(a->flows, 0, sizeof(a->flows));
+}
+
+static uint32_t admit_hash(uint64_t a, uint64_t b)
+{
+    a ^= b * 0x9e3779b97f4a7c15ULL;
+    a ^= a >> 29;
+    a *= 0xbf58476d1ce4e5b9ULL;
+    a ^= a >> 32;
+
+    return (uint32_t)a | 1;
+}
+
+/*
+* Key a frame by its IPv4 addresses, protocol and ports, or failing that by
+* its source MAC and ethertype. Returns 0 for the frames that are never
+* shed: fox's own LLDP probes coming back (discovery.h).
+*/
+static uint32_t admit_frame_key(const uint8_t *p, size_t len, uint64_t salt)
+{
+    const uint8_t *ip;
+    uint16_t type;
+    size_t l3 = 14, ihl;
+    uint32_t src, dst, ports = 0;
+    uint64_t mac = 0;
+
+    if (len < l3) {
+        return admit_hash(salt, 0);
+    }
+    type = (p[12] << 8) | p[13];
+    if (type == ADMIT_ETH_VLAN && len >= l3 + 4) {
+        type = (p[16] << 8) | p[17];
+        l3 += 4;
+    }
+    if (type == LLDP_ETHERTYPE) {
+        return 0;
+    }
+
+    ip = p + l3;
+    if (type != ADMIT_ETH_IP || len < l3 + 20) {
+        memcpy(&mac, p + 6, 6);
+        return admit_hash(mac, salt ^ ((uint64_t)type << 48));
+    }
+
+    memcpy(&src, ip + 12, sizeof(src));
+    memcpy(&dst, ip + 16, sizeof(dst));
+    ihl = (ip[0] & 0x0f) * 4;
+    /* Only the first fragment has the ports */
+    if ((ip[9] == IPPROTO_TCP || ip[9] == IPPROTO_UDP) &&
+        (ip[6] & 0x1f) == 0 && ip[7] == 0 && len >= l3 + ihl + 4) {
+        memcpy(&ports, ip + ihl, sizeof(ports));
+    }
+    return admit_hash(((uint64_t)src << 32) | dst,
+                      salt ^ ((uint64_t)ip[9] << 32) ^ ports);
+}
+
+/*
+* Reason and flow key of a packet-in, from the first n of its len bytes.
+* A 1.3 packet-in has its in_port inside the match, which is not worth
+* parsing here; its flows are keyed on the frame alone.
+*/
+static uint32_t admit_classify(struct fox_state *state, const uint8_t *p,
+                               size_t n, size_t len, uint8_t *reason)
+{
+    uint64_t salt = state->datapath_id;
+    uint16_t in_port, match_len;
+    size_t off;
+
+    if (state->version == OFP13_VERSION) {
+        off = offsetof(struct ofp13_packet_in, match);
+        *reason = p[offsetof(struct ofp13_packet_in, reason)];
+        if (n < off + 4) {
+            return admit_hash(salt ^ ((uint64_t)*reason << 56), 0);
+        }
+        memcpy(&match_len, p + off + 2, sizeof(match_len));
+        off += ((ntohs(match_len) + 7) & ~7) + 2;
+    } else {
+        off = offsetof(struct ofp_packet_in, data);
+        *reason = p[offsetof(struct ofp_packet_in, reason)];
+        memcpy(&in_port, p + offsetof(struct ofp_packet_in, in_port),
+               sizeof(in_port));
+        salt ^= (uint64_t)in_port << 40;
+    }
+    salt ^= (uint64_t)*reason << 56;
+
+    if (off >= n || off >= len) {
+        return admit_hash(salt, 0);
+    }
+    return admit_frame_key(p + off, n - off, salt);
+}
+
+/* Take a token from the flow's slot; a different flow in it starts over */
+static int admit_flow_take(struct admit *a, uint32_t key, uint64_t now_us)
+{
+    struct admit_flow *f = &a->flows[key & (ADMIT_FLOW_SLOTS - 1)];
+    uint32_t now_ms = now_us / 1000;
+    float tokens;
+
+    if (a->flow_rate == 0) {
+        return 1;
+    }
+    if (f->key != key) {
+        f->key = key;
+        f->refill_ms = now_ms;
+        f->tokens = a->flow_burst;
+    }
+
+    tokens = f->tokens + (float)(now_ms - f->refill_ms) * a->flow_rate /
+             1000;
+    f->refill_ms = now_ms;
+    f->tokens = tokens < a->flow_burst ? tokens : a->flow_burst;
+    if (f->tokens < 1) {
+        return 0;
+    }
+    f->tokens -= 1;
+    return 1;
+}
+
+static int admit_global_take(struct admit *a, uint64_t now_us)
+{
+    if (a->rate == 0) {
+        return 1;
+    }
+    a->tokens += (double)(now_us - a->refill_us) * a->rate / 1000000;
+    a->refill_us = now_us;
+    if (a->tokens > a->burst) {
+        a->tokens = a->burst;
+    }
+    if (a->tokens < 1) {
+        return 0;
+    }
+    a->tokens -= 1;
+    return 1;
+}
+
+static void admit_report(struct admit *a, uint64_t now_us)
+{
+    uint64_t now_ms = now_us / 1000;
+    uint64_t shed = a->n_shed_flow + a->n_shed_global;
+
+    if (now_ms - a->report_ms < ADMIT_REPORT_MS) {
+        return;
+    }
+    LogWarn(a->name, "Shed %llu packet-ins (%llu in all: %llu over a flow's "
+            "budget, %llu over the total; %llu sampled)",
+            (unsigned long long)(shed - a->n_reported),
+            (unsigned long long)shed, (unsigned long long)a->n_shed_flow,
+            (unsigned long long)a->n_shed_global,
+            (unsigned long long)a->n_sampled);
+    a->n_reported = shed;
+    a->report_ms = now_ms;
+}
+
+int admit_packet_in(struct admit *a, struct fox_state *state,
+                    struct evbuffer *buf, size_t len)
+{
+    uint8_t peek[ADMIT_PEEK_LEN];
+    uint8_t reason;
+    uint32_t key;
+    uint64_t now;
+    ev_ssize_t n;
+
+    if (a->rate == 0 && a->flow_rate == 0) {
+        return 1;
+    }
+
+    n = evbuffer_copyout(buf, peek, len < sizeof(peek) ? len : sizeof(peek));
+    if (n < (ev_ssize_t)offsetof(struct ofp_packet_in, data)) {
+        return 1;
+    }
+    key = admit_classify(state, peek, n, len, &reason);
+    if (reason >= ADMIT_REASONS) {
+        reason = ADMIT_REASONS - 1;
+    }
+    if (key == 0) {
+        a->n_admitted[reason]++;
+        return 1;
+    }
+
+    now = admit_now_us(a);
+    if (!admit_flow_take(a, key, now)) {
+        if (a->sample == 0 || ++a->over < a->sample) {
+            a->n_shed_flow++;
+            admit_report(a, now);
+            return 0;
+        }
+        a->over = 0;
+        a->n_sampled++;
+    }
+    if (!admit_global_take(a, now)) {
+        a->n_shed_global++;
+        admit_report(a, now);
+        return 0;
+    }
+
+    a->n_admitted[reason]++;
+    return 1;
+}
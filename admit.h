@@ -0,0 +1,78 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include "fox.h"
+
+/* Per-flow budgets, direct mapped by flow hash; a power of two */
+#define ADMIT_FLOW_SLOTS        4096
+
+/* Bytes of a packet-in looked at to classify it: the header, a 1.3
+ * match of a few fields, and the frame's Ethernet, IPv4 and port
+ * headers */
+#define ADMIT_PEEK_LEN          192
+
+/* Shedding is logged at most this often */
+#define ADMIT_REPORT_MS         10000
+
+/* Counters by packet-in reason: OFPR_NO_MATCH, OFPR_ACTION, anything else */
+#define ADMIT_REASONS           3
+
+struct admit_flow {
+    uint32_t    key;
+    uint32_t    refill_ms;
+    float       tokens;
+};
+
+/*
+* Admission control for packet-ins, ahead of the copy and dispatch in
+* controller_read_cb. Each packet-in is classified from a short peek at the
+* input buffer, by its reason and a hash of the frame's addresses and
+* ports, and must take a token from its flow's bucket and then from the
+* global one. One in every sample packet-ins over their flow's budget is
+* let through anyway, so a single heavy flow still reaches the handlers;
+* everything else over budget is drained unread.
+*
+* One admit is shared by every switch that points at it, so rate bounds
+* what all of them together can push at the handlers. A rate of 0 is no
+* limit.
+*/
+struct admit {
+    char                *name;
+    struct event_base   *base;
+
+    uint32_t            rate;           /* per second, all flows */
+    uint32_t            burst;
+    uint32_t            flow_rate;      /* per second, each flow */
+    uint32_t            flow_burst;
+    uint32_t            sample;         /* 0: drop all of the excess */
+
+    double              tokens;
+    uint64_t            refill_us;
+    uint32_t            over;           /* flow excess since the last sample */
+    struct admit_flow   flows[ADMIT_FLOW_SLOTS];
+
+    uint64_t            n_admitted[ADMIT_REASONS];
+    uint64_t            n_sampled;
+    uint64_t            n_shed_flow;
+    uint64_t            n_shed_global;
+    uint64_t            n_reported;     /* shed as of the last report */
+    uint64_t            report_ms;
+};
+
+struct admit *admit_new(struct event_base *base, const char *name);
+void admit_free(struct admit *a);
+
+/* A change takes effect at once, with every bucket full */
+void admit_set_rate(struct admit *a, uint32_t rate, uint32_t burst,
+                    uint32_t flow_rate, uint32_t flow_burst, uint32_t sample);
+
+/* Whether the len byte packet-in at the front of buf goes on to the
+ * handlers; if not, the caller drains it */
+int admit_packet_in(struct admit *a, struct fox_state *state,
+                    struct evbuffer *buf, size_t len);
+
+#endif
@@ -0,0 +1,154 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include "aggregate.h"
+
+int agg_init(struct agg_table *agg, uint32_t threshold, uint8_t src_prefix,
+             uint8_t dst_prefix)
+{
+    int kind;
+
+    memset(agg, 0, sizeof(*agg));
+    agg->threshold = threshold;
+    agg->prefix_len[AGG_BY_SRC] = src_prefix;
+    agg->prefix_len[AGG_BY_DST] = dst_prefix;
+
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        if (block_table_init(&agg->groups[kind])) {
+            agg_free(agg);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void agg_free(struct agg_table *agg)
+{
+    int kind;
+
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        block_table_free(&agg->groups[kind]);
+    }
+}
+
+void agg_group_key(struct agg_table *agg, int kind,
+                   const struct block_key *key, struct block_key *out)
+{
+    uint32_t mask = htonl(~0U << agg_wild_bits(agg, kind));
+
+    *out = *key;
+    out->src_port = 0;
+    if (kind == AGG_BY_SRC) {
+        out->src_ip &= mask;
+    } else {
+        out->dst_ip &= mask;
+    }
+}
+
+int agg_join(struct agg_table *agg, struct block_table *blocks,
+             uint32_t entry)
+{
+    struct block_entry *e, *g;
+    struct block_key key;
+    uint32_t group;
+    int kind, err = 0;
+
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        if (!agg_enabled(agg, kind)) {
+            continue;
+        }
+        e = block_table_get(blocks, entry);
+        agg_group_key(agg, kind, &e->key, &key);
+
+        group = block_table_insert(&agg->groups[kind], &key);
+        if (group == BLOCK_NONE) {
+            err = -1;
+            continue;
+        }
+        g = agg_group(agg, kind, group);
+        if (g->members == 0) {
+            g->head = BLOCK_NONE;
+        }
+
+        /* Push onto the front of the member list */
+        e->group[kind] = group + 1;
+        e->group_prev[kind] = BLOCK_NONE;
+        e->group_next[kind] = g->head;
+        if (g->head != BLOCK_NONE) {
+            block_table_get(blocks, g->head)->group_prev[kind] = entry;
+        }
+        g->head = entry;
+        g->members++;
+    }
+
+    return err;
+}
+
+void agg_leave(struct agg_table *agg, struct block_table *blocks,
+               uint32_t entry)
+{
+    struct block_entry *e = block_table_get(blocks, entry);
+    struct block_entry *g;
+    uint32_t group;
+    int kind;
+
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        if (e->group[kind] == 0) {
+            continue;
+        }
+        group = e->group[kind] - 1;
+        g = agg_group(agg, kind, group);
+
+        if (e->group_prev[kind] != BLOCK_NONE) {
+            block_table_get(blocks, e->group_prev[kind])->group_next[kind] =
+                e->group_next[kind];
+        } else {
+            g->head = e->group_next[kind];
+        }
+        if (e->group_next[kind] != BLOCK_NONE) {
+            block_table_get(blocks, e->group_next[kind])->group_prev[kind] =
+                e->group_prev[kind];
+        }
+        e->group[kind] = 0;
+
+        if (--g->members == 0) {
+            block_table_remove(&agg->groups[kind], group);
+        }
+    }
+}
+
+uint32_t agg_covering(struct agg_table *agg, struct block_table *blocks,
+                      uint32_t entry, int *kind)
+{
+    struct block_entry *e = block_table_get(blocks, entry);
+
+    for (*kind=0; *kind<AGG_KINDS; (*kind)++) {
+        if (e->group[*kind] != 0 &&
+            agg_group(agg, *kind, e->group[*kind] - 1)->flags &
+            AGG_INSTALLED) {
+            return e->group[*kind] - 1;
+        }
+    }
+
+    return BLOCK_NONE;
+}
+
+uint32_t agg_ready(struct agg_table *agg, struct block_table *blocks,
+                   uint32_t entry, int *kind)
+{
+    struct block_entry *e = block_table_get(blocks, entry);
+    struct block_entry *g;
+
+    for (*kind=0; *kind<AGG_KINDS; (*kind)++) {
+        if (e->group[*kind] == 0) {
+            continue;
+        }
+        g = agg_group(agg, *kind, e->group[*kind] - 1);
+        if (g->members >= agg->threshold &&
+            !(g->flags & (AGG_INSTALLED | AGG_SPLIT))) {
+            return e->group[*kind] - 1;
+        }
+    }
+
+    return BLOCK_NONE;
+}
@@ -0,0 +1,98 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stdint.h>
+#include "blocktable.h"
+
+/*
+* Block aggregation. Blocks sharing a destination port form a group when
+* they also share either the destination host and a source prefix (many
+* sources hitting one service) or the source host and a destination
+* prefix (one source scanning many hosts). Once a group reaches threshold
+* members telex replaces their exact flows with one flow on the prefix,
+* any source port and the shared destination; those members are then
+* covered and have no flow of their own.
+*
+* Unblocking a covered member splits its group back into exact flows. A
+* split group is not aggregated again until it empties, so the unblocked
+* flow is not swept straight back in.
+*
+* Groups are kept in block tables of their own, keyed by a block_key with
+* the prefix side masked and the source port 0.
+*/
+
+#define AGG_BY_SRC          0   /* source prefix -> dst ip:port */
+#define AGG_BY_DST          1   /* source ip -> dst prefix:port */
+#define AGG_KINDS           BLOCK_GROUP_KINDS
+
+/* block_entry.flags */
+#define BLOCK_COVERED       0x01    /* block blocked by an aggregate */
+#define AGG_INSTALLED       0x02    /* group with its aggregate flow */
+#define AGG_SPLIT           0x04    /* group that may not aggregate */
+
+struct agg_table {
+    struct block_table  groups[AGG_KINDS];
+    uint32_t            threshold;              /* 0 turns it off */
+    uint8_t             prefix_len[AGG_KINDS];  /* 1-32; 32 turns off */
+};
+
+int agg_init(struct agg_table *agg, uint32_t threshold, uint8_t src_prefix,
+             uint8_t dst_prefix);
+
+void agg_free(struct agg_table *agg);
+
+static inline int agg_enabled(struct agg_table *agg, int kind)
+{
+    return agg->threshold != 0 && agg->prefix_len[kind] < 32;
+}
+
+/* Wildcarded address bits of kind's aggregate flows */
+static inline uint32_t agg_wild_bits(struct agg_table *agg, int kind)
+{
+    return 32 - agg->prefix_len[kind];
+}
+
+static inline struct block_entry *agg_group(struct agg_table *agg, int kind,
+                                            uint32_t group)
+{
+    return block_table_get(&agg->groups[kind], group);
+}
+
+/* The key of the group of kind a block on key falls in */
+void agg_group_key(struct agg_table *agg, int kind,
+                   const struct block_key *key, struct block_key *out);
+
+/* Count a new block towards its groups. Returns -1 if a group could not
+ * be allocated; the block is then simply never aggregated. */
+int agg_join(struct agg_table *agg, struct block_table *blocks,
+             uint32_t entry);
+
+/* Take a block out of its groups, forgetting groups it leaves empty. Call
+ * before removing it from blocks. */
+void agg_leave(struct agg_table *agg, struct block_table *blocks,
+               uint32_t entry);
+
+/* An installed group the block belongs to, or BLOCK_NONE; sets *kind */
+uint32_t agg_covering(struct agg_table *agg, struct block_table *blocks,
+                      uint32_t entry, int *kind);
+
+/* A group of the block that has reached the threshold and may be
+ * aggregated, or BLOCK_NONE; sets *kind */
+uint32_t agg_ready(struct agg_table *agg, struct block_table *blocks,
+                   uint32_t entry, int *kind);
+
+/* Walk a group's members: for (m = agg_first(); m != BLOCK_NONE;
+ * m = agg_next()). The next member must be fetched before leaving. */
+static inline uint32_t agg_first(struct agg_table *agg, int kind,
+                                 uint32_t group)
+{
+    return agg_group(agg, kind, group)->head;
+}
+
+static inline uint32_t agg_next(struct block_table *blocks, int kind,
+                                uint32_t entry)
+{
+    return block_table_get(blocks, entry)->group_next[kind];
+}
+
+#endif
@@ -0,0 +1,403 @@
+/*
+* Benchmark for fox's own message path: controller_read_cb, dispatch and
+* controller_send_hdr, against an in-process fake OpenFlow 1.0 switch
+* (fakeswitch.c) on the other end of a bufferevent pair.
+*
+* After the HELLO/FEATURES handshake the switch sends PACKET_INs at a
+* fixed rate (or, with -r 0, keeps -w of them in flight) plus an
+* ECHO_REQUEST every 1024. A minimal app answers each PACKET_IN with a
+* FLOW_MOD carrying the same xid and sends a BARRIER_REQUEST every -B
+* flow mods. Traffic is generated from a fixed seed, so runs differ only
+* in timing.
+*
+* Reported: messages/s through fox, PACKET_IN -> FLOW_MOD latency as seen
+* by the switch, and heap allocations per message made inside fox's read
+* path (malloc/calloc/realloc, libevent included).
+*
+* Build from the top of the tree with "make bench_controller" (Makefile).
+*
+* Usage: bench_controller [-n packet_ins] [-r msgs_per_sec] [-w window]
+*                         [-B barrier_every]
+*/
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fox.h"
+#include "controller.h"
+#include "logger.h"
+#include "bench/fakeswitch.h"
+
+#define BENCH_FRAME_LEN     64
+#define BENCH_PORTS         48
+#define BENCH_HOSTS         4096
+#define BENCH_ECHO_EVERY    1024
+#define BENCH_TICK_US       1000
+#define BENCH_MAX_PER_TICK  4096
+#define BENCH_STALL_NS      (5 * 1000000000ULL)
+
+struct bench {
+    struct event_base   *base;
+    struct fox_state    *fox;
+    struct fake_switch  *sw;
+    struct event        *tick;
+
+    uint32_t    n_msgs;
+    uint32_t    rate;           /* PACKET_INs per second, 0: closed loop */
+    uint32_t    window;
+    uint32_t    barrier_every;
+
+    uint32_t    sent;
+    uint32_t    answered;
+    uint32_t    flow_mods_sent;
+    uint32_t    barrier_replies;
+    uint64_t    start_ns;
+    uint64_t    last_progress_ns;
+
+    uint64_t    *sent_ns;
+    uint64_t    *latency_ns;
+
+    uint64_t    fox_msgs;       /* messages fox dispatched */
+};
+
+/* Heap allocations made while fox is handling input */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int counting_allocs;
+static uint64_t n_allocs;
+
+void *malloc(size_t size)
+{
+    n_allocs += counting_allocs;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    n_allocs += counting_allocs;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    n_allocs += counting_allocs;
+    return __libc_realloc(ptr, size);
+}
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void host_mac(uint32_t host, uint8_t *mac)
+{
+    mac[0] = 0x02;
+    mac[1] = 0x00;
+    mac[2] = host >> 24;
+    mac[3] = host >> 16;
+    mac[4] = host >> 8;
+    mac[5] = host;
+}
+
+/*
+* The controller side: a stand-in app doing the minimum any reactive app
+* does per PACKET_IN.
+*/
+static void bench_packet_in_cb(struct fox_state *state, void *payload)
+{
+    struct bench *b = state->user_ptr;
+    struct ofp_packet_in *pkt_in = payload;
+    struct {
+        struct ofp_flow_mod         mod;
+        struct ofp_action_output    output;
+    } __attribute__((__packed__)) msg;
+    struct ofp_header barrier;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.mod.header.type = OFPT_FLOW_MOD;
+    msg.mod.header.xid = pkt_in->header.xid;
+    msg.mod.match.wildcards = htonl(OFPFW_ALL & ~(OFPFW_IN_PORT |
+                                                  OFPFW_DL_DST));
+    msg.mod.match.in_port = pkt_in->in_port;
+    memcpy(msg.mod.match.dl_dst, pkt_in->data, OFP_ETH_ALEN);
+    msg.mod.command = htons(OFPFC_ADD);
+    msg.mod.idle_timeout = htons(60);
+    msg.mod.buffer_id = pkt_in->buffer_id;
+    msg.mod.out_port = htons(OFPP_NONE);
+    msg.output.type = htons(OFPAT_OUTPUT);
+    msg.output.len = htons(sizeof(msg.output));
+    msg.output.port = htons(OFPP_FLOOD);
+
+    controller_send_hdr(state, &msg, sizeof(msg));
+
+    if (++b->flow_mods_sent % b->barrier_every == 0) {
+        barrier.type = OFPT_BARRIER_REQUEST;
+        barrier.xid = htonl(b->flow_mods_sent);
+        controller_send_hdr(state, &barrier, sizeof(barrier));
+    }
+}
+
+static void bench_barrier_reply_cb(struct fox_state *state, void *payload)
+{
+    struct bench *b = state->user_ptr;
+
+    b->barrier_replies++;
+}
+
+static void bench_fox_read_cb(struct bufferevent *bev, void *arg)
+{
+    struct fox_state *state = arg;
+
+    counting_allocs = 1;
+    controller_read_cb(bev, state);
+    counting_allocs = 0;
+}
+
+/* Count what fox dispatches without touching controller.c */
+static void bench_count_cb(struct fox_state *state, void *payload)
+{
+    struct bench *b = state->user_ptr;
+
+    b->fox_msgs++;
+}
+
+/*
+* The switch side
+*/
+static void bench_send_packet_ins(struct bench *b, uint32_t n)
+{
+    uint8_t frame[BENCH_FRAME_LEN];
+    uint32_t i;
+
+    memset(frame, 0, sizeof(frame));
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+
+    for (i=0; i<n && b->sent < b->n_msgs; i++) {
+        uint32_t src = rng_next() % BENCH_HOSTS;
+        uint32_t dst = rng_next() % BENCH_HOSTS;
+
+        host_mac(dst, frame);
+        host_mac(src, frame + OFP_ETH_ALEN);
+
+        b->sent_ns[b->sent] = bench_now_ns();
+        fake_switch_send_packet_in(b->sw, b->sent, b->sent,
+                                   1 + src % BENCH_PORTS, frame,
+                                   sizeof(frame));
+        b->sent++;
+
+        if (b->sent % BENCH_ECHO_EVERY == 0) {
+            fake_switch_send_echo_request(b->sw, b->sent);
+        }
+    }
+}
+
+static void bench_flow_mod_cb(struct fake_switch *sw,
+                              struct ofp_flow_mod *mod, void *arg)
+{
+    struct bench *b = arg;
+    uint32_t xid = ntohl(mod->header.xid);
+    uint64_t now = bench_now_ns();
+
+    if (xid >= b->sent || b->latency_ns[xid] != 0) {
+        return;
+    }
+    b->latency_ns[xid] = now - b->sent_ns[xid] + 1;
+    b->answered++;
+    b->last_progress_ns = now;
+
+    if (b->answered == b->n_msgs) {
+        event_base_loopbreak(b->base);
+    } else if (b->rate == 0) {
+        bench_send_packet_ins(b, b->window - (b->sent - b->answered));
+    }
+}
+
+static void bench_tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct bench *b = arg;
+    uint64_t now = bench_now_ns();
+    uint64_t due;
+
+    if (now - b->last_progress_ns > BENCH_STALL_NS) {
+        fprintf(stderr, "No progress for %llus, giving up\n",
+                BENCH_STALL_NS / 1000000000ULL);
+        event_base_loopbreak(b->base);
+        return;
+    }
+    if (b->rate == 0) {
+        return;
+    }
+
+    due = (now - b->start_ns) * b->rate / 1000000000ULL;
+    if (due > b->n_msgs) {
+        due = b->n_msgs;
+    }
+    if (due > b->sent) {
+        bench_send_packet_ins(b, due - b->sent > BENCH_MAX_PER_TICK ?
+                                 BENCH_MAX_PER_TICK : due - b->sent);
+    }
+}
+
+static int bench_handshake(struct bench *b)
+{
+    uint64_t deadline = bench_now_ns() + 1000000000ULL;
+
+    controller_send_hello(b->fox);
+
+    while (b->fox->datapath_id != b->sw->datapath_id) {
+        if (bench_now_ns() > deadline) {
+            fprintf(stderr, "Handshake did not complete\n");
+            return -1;
+        }
+        event_base_loop(b->base, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench b;
+    struct bufferevent *pair[2];
+    struct fox_state state;
+    struct timeval tick = {0, BENCH_TICK_US};
+    uint64_t allocs, elapsed_ns;
+    double elapsed;
+    int opt;
+
+    memset(&b, 0, sizeof(b));
+    b.n_msgs = 1000000;
+    b.rate = 200000;
+    b.window = 256;
+    b.barrier_every = 64;
+
+    while ((opt = getopt(argc, argv, "n:r:w:B:")) != -1) {
+        switch (opt) {
+        case 'n': b.n_msgs = strtoul(optarg, NULL, 0); break;
+        case 'r': b.rate = strtoul(optarg, NULL, 0); break;
+        case 'w': b.window = strtoul(optarg, NULL, 0); break;
+        case 'B': b.barrier_every = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n packet_ins] [-r msgs_per_sec] "
+                    "[-w window] [-B barrier_every]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (b.n_msgs == 0 || b.window == 0 || b.barrier_every == 0) {
+        fprintf(stderr, "packet_ins, window and barrier_every must be "
+                "non-zero\n");
+        return 1;
+    }
+
+    LogOutputStream(stderr);
+    LogOutputLevel(LOG_ERROR);
+
+    b.sent_ns = calloc(b.n_msgs, sizeof(uint64_t));
+    b.latency_ns = calloc(b.n_msgs, sizeof(uint64_t));
+    if (b.sent_ns == NULL || b.latency_ns == NULL) {
+        fprintf(stderr, "Could not allocate %u samples\n", b.n_msgs);
+        return 1;
+    }
+
+    b.base = event_base_new();
+    /* Deferred callbacks, so each side runs from the loop as it would on
+     * a socket rather than recursing into the other */
+    if (bufferevent_pair_new(b.base, BEV_OPT_DEFER_CALLBACKS, pair)) {
+        fprintf(stderr, "Could not create bufferevent pair\n");
+        return 1;
+    }
+
+    memset(&state, 0, sizeof(state));
+    state.name = "bench";
+    state.base = b.base;
+    state.controller_bev = pair[0];
+    state.user_ptr = &b;
+    b.fox = &state;
+    bufferevent_setcb(pair[0], bench_fox_read_cb, NULL, NULL, &state);
+    bufferevent_enable(pair[0], EV_READ | EV_WRITE);
+
+    controller_register_handler(&state, OFPT_PACKET_IN, bench_packet_in_cb);
+    controller_register_handler(&state, OFPT_BARRIER_REPLY,
+                                bench_barrier_reply_cb);
+    controller_register_handler(&state, OFPT_PACKET_IN, bench_count_cb);
+    controller_register_handler(&state, OFPT_ECHO_REQUEST, bench_count_cb);
+    controller_register_handler(&state, OFPT_BARRIER_REPLY, bench_count_cb);
+
+    b.sw = fake_switch_new(pair[1], 0x00000000cafe0001ULL, BENCH_PORTS);
+    if (b.sw == NULL) {
+        return 1;
+    }
+    b.sw->flow_mod_cb = bench_flow_mod_cb;
+    b.sw->arg = &b;
+
+    if (bench_handshake(&b)) {
+        return 1;
+    }
+
+    if (b.rate) {
+        printf("controller: %u packet-ins at %u/s, barrier every %u\n",
+               b.n_msgs, b.rate, b.barrier_every);
+    } else {
+        printf("controller: %u packet-ins, %u in flight, barrier every %u\n",
+               b.n_msgs, b.window, b.barrier_every);
+    }
+
+    b.tick = event_new(b.base, -1, EV_PERSIST, bench_tick_cb, &b);
+    evtimer_add(b.tick, &tick);
+
+    n_allocs = 0;
+    b.fox_msgs = 0;
+    b.start_ns = b.last_progress_ns = bench_now_ns();
+    if (b.rate == 0) {
+        bench_send_packet_ins(&b, b.window);
+    }
+
+    event_base_dispatch(b.base);
+
+    elapsed_ns = b.last_progress_ns - b.start_ns;
+    elapsed = elapsed_ns / 1e9;
+    allocs = n_allocs;
+
+    printf("  fox:       %.0f msgs/s in, %.0f flow_mods/s out (%.2fs)\n",
+           b.fox_msgs / elapsed, b.answered / elapsed, elapsed);
+    printf("  allocs:    %.2f per message (%llu total)\n",
+           b.fox_msgs ? (double)allocs / b.fox_msgs : 0.0,
+           (unsigned long long)allocs);
+    printf("  switch:    %llu flow_mods, %llu barriers, %u barrier replies, "
+           "%llu echo replies\n", (unsigned long long)b.sw->flow_mods,
+           (unsigned long long)b.sw->barriers, b.barrier_replies,
+           (unsigned long long)b.sw->echo_replies);
+
+    /* latency_ns holds 0 for anything that was never answered */
+    {
+        uint32_t i, n = 0;
+
+        for (i=0; i<b.n_msgs; i++) {
+            if (b.latency_ns[i] != 0) {
+                b.latency_ns[n++] = b.latency_ns[i] - 1;
+            }
+        }
+        bench_report_latency("latency:", b.latency_ns, n);
+    }
+
+    event_free(b.tick);
+    fake_switch_free(b.sw);
+    bufferevent_free(pair[0]);
+    free(state.ports);
+    event_base_free(b.base);
+    free(b.sent_ns);
+    free(b.latency_ns);
+
+    return b.answered == b.n_msgs ? 0 : 1;
+}
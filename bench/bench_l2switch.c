@@ -0,0 +1,237 @@
+/*
+* Throughput benchmark for the l2switch app, and through it for fox's
+* read/dispatch, packet-in and flow_mod paths.
+*
+* Build from the top of the tree with "make bench_l2switch" (Makefile).
+*
+* Usage: bench_l2switch [-n packet_ins] [-h hosts] [-p ports] [-b batch]
+*                       [-1]
+*
+* -1 hands l2switch its packet-ins one at a time instead of a read's worth
+* at once.
+*/
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fox.h"
+#include "controller.h"
+#include "l2switch.h"
+#include "logger.h"
+
+#define BENCH_FRAME_LEN     64
+
+struct bench_pkt_in {
+    struct ofp_packet_in    pkt_in;
+    uint8_t                 frame[BENCH_FRAME_LEN];
+} __attribute__((__packed__));
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void host_mac(uint32_t host, uint8_t *mac)
+{
+    mac[0] = 0x02;      /* locally administered, unicast */
+    mac[1] = 0x00;
+    mac[2] = host >> 24;
+    mac[3] = host >> 16;
+    mac[4] = host >> 8;
+    mac[5] = host;
+}
+
+static void make_pkt_in(struct bench_pkt_in *msg, uint32_t src, uint32_t dst,
+                        uint16_t in_port, uint32_t buffer_id)
+{
+    /* The frame starts at data, inside the struct's tail padding */
+    uint8_t *frame = (uint8_t *)msg + offsetof(struct ofp_packet_in, data);
+
+    memset(msg, 0, sizeof(*msg));
+
+    msg->pkt_in.header.version = OFP_VERSION;
+    msg->pkt_in.header.type = OFPT_PACKET_IN;
+    msg->pkt_in.header.length = htons(offsetof(struct ofp_packet_in, data) +
+                                      BENCH_FRAME_LEN);
+    msg->pkt_in.buffer_id = htonl(buffer_id);
+    msg->pkt_in.total_len = htons(BENCH_FRAME_LEN);
+    msg->pkt_in.in_port = htons(in_port);
+    msg->pkt_in.reason = OFPR_NO_MATCH;
+
+    host_mac(dst, frame);
+    host_mac(src, frame + OFP_ETH_ALEN);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+}
+
+static void make_flow_removed(struct ofp_flow_removed *msg, uint32_t dst,
+                              uint16_t port)
+{
+    memset(msg, 0, sizeof(*msg));
+
+    msg->header.version = OFP_VERSION;
+    msg->header.type = OFPT_FLOW_REMOVED;
+    msg->header.length = htons(sizeof(*msg));
+    msg->match.wildcards = htonl(OFPFW_ALL & ~OFPFW_DL_DST);
+    host_mac(dst, msg->match.dl_dst);
+    msg->cookie = htobe64(L2SWITCH_COOKIE | port);
+    msg->reason = OFPRR_IDLE_TIMEOUT;
+}
+
+static void bench_table(uint32_t n_hosts, uint32_t n_ops)
+{
+    struct l2_table table;
+    double start, elapsed;
+    uint32_t i, found = 0;
+    uint16_t port;
+
+    table.slots = calloc(L2SWITCH_TABLE_MIN, sizeof(uint64_t));
+    table.mask = L2SWITCH_TABLE_MIN - 1;
+    table.count = 0;
+
+    for (i=0; i<n_hosts; i++) {
+        l2_table_learn(&table, 0x020000000000ULL | i, 1 + i % 48);
+    }
+
+    start = now_sec();
+    for (i=0; i<n_ops; i++) {
+        found += l2_table_lookup(&table,
+                                 0x020000000000ULL | (rng_next() % n_hosts),
+                                 &port);
+    }
+    elapsed = now_sec() - start;
+
+    printf("  table:    %.1f Mlookups/s (%.1f ns/lookup), %u slots, "
+           "%u found\n", n_ops / elapsed / 1e6, elapsed * 1e9 / n_ops,
+           table.mask + 1, found);
+
+    free(table.slots);
+}
+
+int main(int argc, char *argv[])
+{
+    struct event_base *base;
+    struct bufferevent *pair[2];
+    struct fox_state state;
+    struct l2switch_state *l2;
+    struct evbuffer *input, *output;
+    uint32_t n_msgs = 1000000, n_hosts = 8192, n_ports = 48, batch = 64;
+    uint64_t out_bytes = 0;
+    double start, elapsed;
+    uint32_t i, j;
+    int opt, single = 0;
+
+    while ((opt = getopt(argc, argv, "n:h:p:b:1")) != -1) {
+        switch (opt) {
+        case 'n': n_msgs = strtoul(optarg, NULL, 0); break;
+        case 'h': n_hosts = strtoul(optarg, NULL, 0); break;
+        case 'p': n_ports = strtoul(optarg, NULL, 0); break;
+        case 'b': batch = strtoul(optarg, NULL, 0); break;
+        case '1': single = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n packet_ins] [-h hosts] "
+                    "[-p ports] [-b batch] [-1]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (n_hosts == 0 || n_ports == 0 || batch == 0) {
+        fprintf(stderr, "hosts, ports and batch must be non-zero\n");
+        return 1;
+    }
+
+    LogOutputStream(stderr);
+    LogOutputLevel(LOG_ERROR);
+
+    base = event_base_new();
+    if (bufferevent_pair_new(base, 0, pair)) {
+        fprintf(stderr, "Could not create bufferevent pair\n");
+        return 1;
+    }
+    bufferevent_enable(pair[1], EV_READ);
+
+    /* A connected fox_state without a socket, already past the HELLO: the
+     * switch side of the pair just collects whatever fox writes */
+    memset(&state, 0, sizeof(state));
+    state.version = OFP_VERSION;
+    state.name = "bench";
+    state.base = base;
+    state.controller_bev = pair[0];
+
+    l2 = l2switch_attach(&state);
+    if (l2 == NULL) {
+        return 1;
+    }
+    if (single) {
+        controller_unregister_batch_handler(&state, OFPT_PACKET_IN,
+                                            l2switch_packet_in_batch_cb);
+        controller_register_handler(&state, OFPT_PACKET_IN,
+                                    l2switch_packet_in_cb);
+    }
+
+    /* Input is fed directly, as if it had come from the partner */
+    input = bufferevent_get_input(pair[0]);
+    evbuffer_unfreeze(input, 0);
+    output = bufferevent_get_input(pair[1]);
+
+    printf("l2switch: %u packet-ins, %u hosts, %u ports, batch %u%s\n",
+           n_msgs, n_hosts, n_ports, batch, single ? ", one at a time" : "");
+
+    bench_table(n_hosts, n_msgs);
+
+    start = now_sec();
+    for (i=0; i<n_msgs; i+=batch) {
+        for (j=0; j<batch && i+j<n_msgs; j++) {
+            struct bench_pkt_in msg;
+            uint32_t src = rng_next() % n_hosts;
+            uint32_t dst = rng_next() % n_hosts;
+
+            /* Every so often a flow times out on the switch */
+            if ((i + j) % 128 == 127) {
+                struct ofp_flow_removed removed;
+                make_flow_removed(&removed, dst, 1 + dst % n_ports);
+                evbuffer_add(input, &removed, sizeof(removed));
+            }
+
+            make_pkt_in(&msg, src, dst, 1 + src % n_ports, i + j);
+            evbuffer_add(input, &msg, ntohs(msg.pkt_in.header.length));
+        }
+
+        controller_read_cb(pair[0], &state);
+
+        out_bytes += evbuffer_get_length(output);
+        evbuffer_drain(output, evbuffer_get_length(output));
+    }
+    elapsed = now_sec() - start;
+
+    printf("  pipeline: %.0f msgs/s (%.0f ns/msg)\n",
+           l2->packet_ins / elapsed, elapsed * 1e9 / l2->packet_ins);
+    printf("            %llu flow_mods, %llu floods, %llu flows removed, "
+           "%.1f MB out\n", (unsigned long long)l2->flows_installed,
+           (unsigned long long)l2->floods,
+           (unsigned long long)l2->flows_removed, out_bytes / 1e6);
+
+    bufferevent_free(pair[0]);
+    bufferevent_free(pair[1]);
+    event_base_free(base);
+
+    return 0;
+}
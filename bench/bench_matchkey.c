@@ -0,0 +1,198 @@
+/*
+* Benchmark for match keys (matchkey.h): normalizing ofp_matches, and
+* hashing and comparing them as lookups in an open-addressed table would.
+*
+* Matches are drawn from -k distinct flows, each wildcarded one of a few
+* ways, with random bytes in the fields its wildcards leave out, so only
+* normalization makes the copies of a flow equal. Each round looks every
+* match up in a table of the distinct keys and checks it found its flow.
+*
+* Build from the top of the tree with "make bench_matchkey" (Makefile),
+* which uses -march=native for the CRC32 and vector kernels; add
+* MATCHKEY_ARCH= for the scalar ones, or e.g. MATCHKEY_ARCH=-msse4.2.
+*
+* Usage: bench_matchkey [-n matches] [-k keys] [-r rounds]
+*/
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "matchkey.h"
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Wildcards of a telex block, a telex aggregate, an l2switch flow and an
+ * exact 5-tuple on one port and VLAN */
+static const uint32_t bench_wildcards[] = {
+    OFPFW_ALL & ~(OFPFW_DL_TYPE | OFPFW_NW_PROTO | OFPFW_NW_SRC_MASK |
+                  OFPFW_NW_DST_MASK | OFPFW_TP_SRC | OFPFW_TP_DST),
+    (OFPFW_ALL & ~(OFPFW_DL_TYPE | OFPFW_NW_PROTO | OFPFW_NW_SRC_MASK |
+                   OFPFW_NW_DST_MASK | OFPFW_TP_DST)) |
+        8 << OFPFW_NW_SRC_SHIFT,
+    OFPFW_ALL & ~OFPFW_DL_DST,
+    OFPFW_DL_SRC | OFPFW_DL_VLAN_PCP | OFPFW_NW_TOS,
+};
+
+/* Flow k, with whatever its wildcards leave out made up */
+static void bench_match(struct ofp_match *m, uint32_t k)
+{
+    uint8_t *p = (uint8_t *)m;
+    uint32_t i, wc = bench_wildcards[k % 4];
+
+    for (i=0; i<sizeof(*m); i++) {
+        p[i] = rng_next();
+    }
+    m->wildcards = htonl(wc);
+    if (!(wc & OFPFW_IN_PORT)) {
+        m->in_port = htons(1 + k % 48);
+    }
+    if (!(wc & OFPFW_DL_DST)) {
+        memset(m->dl_dst, 0, OFP_ETH_ALEN);
+        memcpy(m->dl_dst + 2, &k, sizeof(k));
+    }
+    if (!(wc & OFPFW_DL_VLAN)) {
+        m->dl_vlan = htons(k % 4094 + 1);
+    }
+    if (!(wc & OFPFW_DL_TYPE)) {
+        m->dl_type = htons(0x0800);
+    }
+    if (!(wc & OFPFW_NW_PROTO)) {
+        m->nw_proto = 6;
+    }
+    /* An aggregate's source only counts down to its /24 */
+    m->nw_src = htonl(0xc0a80000 + (k << 8) + (rng_next() & 0xff));
+    if (!(wc & OFPFW_NW_SRC_MASK)) {
+        m->nw_src = htonl(0xc0a80000 + k);
+    }
+    if (!(wc & OFPFW_NW_DST_MASK)) {
+        m->nw_dst = htonl(0x0a000000 + k);
+    }
+    if (!(wc & OFPFW_TP_SRC)) {
+        m->tp_src = htons(1024 + k % 60000);
+    }
+    if (!(wc & OFPFW_TP_DST)) {
+        m->tp_dst = htons(80);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t n_matches = 1000000, n_keys = 65536, rounds = 10;
+    struct ofp_match *matches;
+    union match_key *keys, key;
+    uint32_t *index, *flow, mask, i, r, j;
+    uint64_t probes = 0;
+    double start, t_init = 0, t_lookup = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:k:r:")) != -1) {
+        switch (opt) {
+        case 'n': n_matches = strtoul(optarg, NULL, 0); break;
+        case 'k': n_keys = strtoul(optarg, NULL, 0); break;
+        case 'r': rounds = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n matches] [-k keys] [-r rounds]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (n_matches == 0 || n_keys == 0 || rounds == 0) {
+        fprintf(stderr, "matches, keys and rounds must be non-zero\n");
+        return 1;
+    }
+
+    for (mask=1; mask < n_keys * 2; mask <<= 1);
+    mask--;
+    matches = malloc(n_matches * sizeof(*matches));
+    flow = malloc(n_matches * sizeof(*flow));
+    keys = malloc(n_keys * sizeof(*keys));
+    index = calloc(mask + 1, sizeof(*index));
+    if (matches == NULL || flow == NULL || keys == NULL || index == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    /* The table holds each flow's key once; slots are key number + 1 */
+    for (i=0; i<n_keys; i++) {
+        struct ofp_match m;
+
+        bench_match(&m, i);
+        match_key_init(&keys[i], &m);
+        j = match_key_hash(&keys[i]) & mask;
+        while (index[j] != 0) {
+            j = (j + 1) & mask;
+        }
+        index[j] = i + 1;
+    }
+    for (i=0; i<n_matches; i++) {
+        flow[i] = rng_next() % n_keys;
+        bench_match(&matches[i], flow[i]);
+    }
+
+    printf("matchkey: %u matches over %u keys, %u rounds, %s hash, "
+           "%s compare\n", n_matches, n_keys, rounds,
+#if defined(__SSE4_2__)
+           "crc32",
+#else
+           "scalar",
+#endif
+#if defined(__AVX2__)
+           "avx2"
+#elif defined(__SSE4_2__)
+           "sse4.2"
+#else
+           "scalar"
+#endif
+           );
+
+    for (r=0; r<rounds; r++) {
+        start = now_sec();
+        for (i=0; i<n_matches; i++) {
+            match_key_init(&key, &matches[i]);
+        }
+        t_init += now_sec() - start;
+
+        start = now_sec();
+        for (i=0; i<n_matches; i++) {
+            match_key_init(&key, &matches[i]);
+            j = match_key_hash(&key) & mask;
+            while (index[j] != 0) {
+                probes++;
+                if (match_key_equal(&keys[index[j] - 1], &key)) {
+                    break;
+                }
+                j = (j + 1) & mask;
+            }
+            if (index[j] == 0 || index[j] - 1 != flow[i]) {
+                fprintf(stderr, "Match %u not found as flow %u\n", i,
+                        flow[i]);
+                return 1;
+            }
+        }
+        t_lookup += now_sec() - start;
+    }
+
+    printf("  init:   %.1f ns/match\n", t_init * 1e9 / rounds / n_matches);
+    printf("  lookup: %.1f ns/match (init, hash, %.2f compares)\n",
+           t_lookup * 1e9 / rounds / n_matches,
+           (double)probes / rounds / n_matches);
+    return 0;
+}
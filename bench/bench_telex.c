@@ -0,0 +1,572 @@
+/*
+* End to end block latency benchmark for telex: how long from a client
+* writing a telex_mod_flow to the FLOW_MOD reaching the switch, and to the
+* switch acknowledging it with a BARRIER_REPLY.
+*
+* By default telex runs in a child process, pointed by a generated config
+* at a stand-in switch (fakeswitch.c) on 127.0.0.1:-s. The switch stamps
+* each FLOW_MOD as it arrives and, on each BARRIER_REQUEST, every FLOW_MOD
+* before it. The parent is also the load generator: one TCP client
+* sending requests at -r per second (0: as fast as telex takes them, with
+* -w in flight) over -k flow keys picked uniformly or, with -z, from a
+* Zipf distribution of that exponent; -u percent are unblocks. Telex
+* handles a client's requests in order and sends one FLOW_MOD for each,
+* so the n-th FLOW_MOD answers the n-th request.
+*
+* With -P the rate starts at -r and doubles each step of -n requests until
+* telex falls behind (achieved under 95% of offered, or p99 over 10ms);
+* the last step that kept up is reported as the peak sustainable rate.
+*
+* To measure a telex started separately, give its address with -t and
+* start it with a config containing "switch 127.0.0.1 <-s port> connect",
+* after starting this benchmark with -x.
+*
+* Build from the top of the tree with "make bench_telex" (Makefile).
+*
+* Usage: bench_telex [-n requests] [-r rate] [-w window] [-k keys]
+*                    [-z zipf_s] [-u unblock_pct] [-s switch_port]
+*                    [-t telex_port] [-P] [-x]
+*/
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "telex.h"
+#include "logger.h"
+#include "bench/fakeswitch.h"
+
+#define BENCH_SWITCH_PORT   16633
+#define BENCH_TELEX_PORT    12603
+#define BENCH_TICK_US       1000
+#define BENCH_MAX_PER_TICK  8192
+#define BENCH_STALL_NS      (5 * 1000000000ULL)
+#define BENCH_PEAK_P99_NS   (10 * 1000000ULL)
+
+struct bench {
+    struct event_base   *base;
+    struct fake_switch  *sw;
+    struct bufferevent  *client;
+    struct event        *tick;
+
+    uint32_t    n_msgs;         /* per step */
+    uint32_t    rate;
+    uint32_t    window;
+    uint32_t    n_keys;
+    double      zipf_s;
+    uint32_t    unblock_pct;
+
+    double      *zipf_cdf;
+
+    /* Current step; requests are numbered from 0 in each step */
+    uint32_t    sent;
+    uint32_t    received;       /* FLOW_MODs */
+    uint32_t    acked;          /* covered by a BARRIER */
+    uint32_t    mismatched;
+    uint64_t    start_ns;
+    uint64_t    last_progress_ns;
+    int         running;
+
+    struct telex_mod_flow   *req;
+    uint64_t    *sent_ns;
+    uint64_t    *wire_ns;
+    uint64_t    *ack_ns;
+};
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static int bench_zipf_init(struct bench *b)
+{
+    double sum = 0;
+    uint32_t i;
+
+    b->zipf_cdf = malloc(b->n_keys * sizeof(double));
+    if (b->zipf_cdf == NULL) {
+        return -1;
+    }
+    for (i=0; i<b->n_keys; i++) {
+        sum += 1.0 / pow(i + 1, b->zipf_s);
+        b->zipf_cdf[i] = sum;
+    }
+    for (i=0; i<b->n_keys; i++) {
+        b->zipf_cdf[i] /= sum;
+    }
+    return 0;
+}
+
+static uint32_t bench_pick_key(struct bench *b)
+{
+    double u;
+    uint32_t lo = 0, hi;
+
+    if (b->zipf_cdf == NULL) {
+        return rng_next() % b->n_keys;
+    }
+
+    u = (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+    hi = b->n_keys - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (b->zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+* Switch side
+*/
+static void bench_flow_mod_cb(struct fake_switch *sw,
+                              struct ofp_flow_mod *mod, void *arg)
+{
+    struct bench *b = arg;
+    struct telex_mod_flow *req;
+    uint64_t now = bench_now_ns();
+
+    if (!b->running || b->received >= b->sent) {
+        return;
+    }
+
+    req = &b->req[b->received];
+    if (mod->match.nw_src != req->src_ip || mod->match.nw_dst != req->dst_ip ||
+        mod->match.tp_src != req->src_port ||
+        mod->match.tp_dst != req->dst_port) {
+        b->mismatched++;
+    }
+
+    b->wire_ns[b->received++] = now;
+    b->last_progress_ns = now;
+}
+
+static void bench_send_requests(struct bench *b, uint32_t n);
+
+static void bench_barrier_cb(struct fake_switch *sw, struct ofp_header *req,
+                             void *arg)
+{
+    struct bench *b = arg;
+    uint64_t now = bench_now_ns();
+
+    if (!b->running) {
+        return;
+    }
+
+    while (b->acked < b->received) {
+        b->ack_ns[b->acked++] = now;
+    }
+
+    if (b->acked == b->n_msgs) {
+        event_base_loopbreak(b->base);
+    } else if (b->rate == 0) {
+        bench_send_requests(b, b->window - (b->sent - b->acked));
+    }
+}
+
+static void bench_switch_accept_cb(struct evconnlistener *listener,
+                                   evutil_socket_t fd,
+                                   struct sockaddr *addr, int socklen,
+                                   void *arg)
+{
+    struct bench *b = arg;
+    struct bufferevent *bev;
+    int one = 1;
+
+    if (b->sw != NULL) {
+        fprintf(stderr, "Second switch connection, ignoring it\n");
+        evutil_closesocket(fd);
+        return;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    bev = bufferevent_socket_new(b->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    b->sw = fake_switch_new(bev, 0x00000000cafe0001ULL, 4);
+    if (b->sw == NULL) {
+        bufferevent_free(bev);
+        return;
+    }
+    b->sw->flow_mod_cb = bench_flow_mod_cb;
+    b->sw->barrier_cb = bench_barrier_cb;
+    b->sw->arg = b;
+}
+
+/*
+* Client side
+*/
+static void bench_send_requests(struct bench *b, uint32_t n)
+{
+    uint32_t i;
+
+    for (i=0; i<n && b->sent < b->n_msgs; i++) {
+        struct telex_mod_flow *req = &b->req[b->sent];
+        uint32_t key = bench_pick_key(b);
+
+        req->action = rng_next() % 100 < b->unblock_pct ?
+                      TELEX_MOD_UNBLOCK : TELEX_MOD_BLOCK;
+        req->src_ip = htonl(0x0a000000 | (key & 0xffffff));
+        req->dst_ip = htonl(0xc0a80001);
+        req->src_port = htons(1024 + key % 60000);
+        req->dst_port = htons(443);
+
+        b->sent_ns[b->sent++] = bench_now_ns();
+        bufferevent_write(b->client, req, sizeof(*req));
+    }
+}
+
+static void bench_client_event_cb(struct bufferevent *bev, short events,
+                                  void *arg)
+{
+    struct bench *b = arg;
+
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        fprintf(stderr, "Lost connection to telex\n");
+        event_base_loopbreak(b->base);
+    }
+}
+
+static void bench_tick_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct bench *b = arg;
+    uint64_t now = bench_now_ns();
+    uint64_t due;
+
+    if (!b->running) {
+        return;
+    }
+    if (now - b->last_progress_ns > BENCH_STALL_NS) {
+        fprintf(stderr, "No progress for %llus (%u sent, %u on the wire, "
+                "%u acked), giving up\n", BENCH_STALL_NS / 1000000000ULL,
+                b->sent, b->received, b->acked);
+        event_base_loopbreak(b->base);
+        return;
+    }
+    if (b->rate == 0) {
+        return;
+    }
+
+    due = (now - b->start_ns) * b->rate / 1000000000ULL;
+    if (due > b->n_msgs) {
+        due = b->n_msgs;
+    }
+    if (due > b->sent) {
+        bench_send_requests(b, due - b->sent > BENCH_MAX_PER_TICK ?
+                               BENCH_MAX_PER_TICK : due - b->sent);
+    }
+}
+
+static int bench_connect(struct bench *b, uint16_t port)
+{
+    struct sockaddr_in sin;
+    int fd = -1, i, one = 1;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+
+    /* Telex may still be starting */
+    for (i=0; i<200; i++) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&sin,
+                               sizeof(sin)) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+        usleep(10000);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Could not connect to telex on port %d\n", port);
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    evutil_make_socket_nonblocking(fd);
+    b->client = bufferevent_socket_new(b->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(b->client, NULL, NULL, bench_client_event_cb, b);
+    bufferevent_enable(b->client, EV_READ | EV_WRITE);
+
+    return 0;
+}
+
+static int bench_listen(uint16_t port)
+{
+    struct sockaddr_in sin;
+    int fd, one = 1;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(port);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+        listen(fd, 16) != 0) {
+        close(fd);
+        return -1;
+    }
+    evutil_make_socket_nonblocking(fd);
+    return fd;
+}
+
+/* Telex with no rate limit and no listeners besides TCP */
+static pid_t bench_start_telex(uint16_t switch_port, uint16_t telex_port)
+{
+    char path[] = "/tmp/bench_telex.XXXXXX";
+    struct event_base *base;
+    FILE *f;
+    pid_t pid;
+    int fd;
+
+    fd = mkstemp(path);
+    if (fd < 0 || (f = fdopen(fd, "w")) == NULL) {
+        perror("mkstemp");
+        return -1;
+    }
+    fprintf(f, "switch 127.0.0.1 %d connect\n", switch_port);
+    fprintf(f, "listen tcp 127.0.0.1 %d\n", telex_port);
+    fprintf(f, "client_rate %u\nclient_burst %u\n", 100000000, 1000000);
+    fprintf(f, "client_max_buffered %u\n", 16 * 1024 * 1024);
+    fclose(f);
+
+    pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    LogOutputStream(stderr);
+    LogOutputLevel(LOG_ERROR);
+
+    base = event_base_new();
+    if (telex_init(base, path)) {
+        fprintf(stderr, "telex did not start\n");
+        unlink(path);
+        _exit(1);
+    }
+    unlink(path);
+    event_base_dispatch(base);
+    _exit(0);
+}
+
+/* Returns 1 if telex kept up with this step */
+static int bench_step(struct bench *b)
+{
+    uint64_t *wire, *ack;
+    uint32_t i, n;
+    double elapsed, achieved;
+    int kept_up;
+
+    b->sent = b->received = b->acked = b->mismatched = 0;
+    b->start_ns = b->last_progress_ns = bench_now_ns();
+    b->running = 1;
+    if (b->rate == 0) {
+        bench_send_requests(b, b->window);
+    }
+
+    event_base_dispatch(b->base);
+    b->running = 0;
+
+    elapsed = (b->last_progress_ns - b->start_ns) / 1e9;
+    achieved = elapsed > 0 ? b->received / elapsed : 0;
+
+    if (b->rate) {
+        printf("offered %u/s: achieved %.0f/s, %u/%u acked", b->rate,
+               achieved, b->acked, b->n_msgs);
+    } else {
+        printf("closed loop, %u in flight: achieved %.0f/s, %u/%u acked",
+               b->window, achieved, b->acked, b->n_msgs);
+    }
+    if (b->mismatched) {
+        printf(", %u FLOW_MODs out of order", b->mismatched);
+    }
+    printf("\n");
+
+    /* Turn stamps into latencies, reusing the stamp arrays */
+    wire = b->wire_ns;
+    ack = b->ack_ns;
+    for (i=0; i<b->received; i++) {
+        wire[i] -= b->sent_ns[i];
+    }
+    for (i=0; i<b->acked; i++) {
+        ack[i] -= b->sent_ns[i];
+    }
+    n = b->received;
+    bench_report_latency("to wire:", wire, n);
+    bench_report_latency("to ack:", ack, b->acked);
+
+    kept_up = b->acked == b->n_msgs && achieved >= 0.95 * b->rate &&
+              n > 0 && wire[(size_t)(0.99 * (n - 1))] < BENCH_PEAK_P99_NS;
+
+    /* Let anything still in flight drain before the next step */
+    while (b->acked < b->received || b->received < b->sent) {
+        uint64_t deadline = bench_now_ns() + 100000000ULL;
+        if (event_base_loop(b->base, EVLOOP_ONCE | EVLOOP_NONBLOCK) ||
+            bench_now_ns() > deadline) {
+            break;
+        }
+    }
+
+    return kept_up;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench b;
+    struct evconnlistener *listener;
+    struct timeval tick = {0, BENCH_TICK_US};
+    uint16_t switch_port = BENCH_SWITCH_PORT, telex_port = BENCH_TELEX_PORT;
+    int peak = 0, external = 0, listen_fd, opt;
+    uint32_t best = 0;
+    pid_t child = 0;
+    uint64_t deadline;
+
+    memset(&b, 0, sizeof(b));
+    b.n_msgs = 200000;
+    b.rate = 50000;
+    b.window = 1024;
+    b.n_keys = 100000;
+
+    while ((opt = getopt(argc, argv, "n:r:w:k:z:u:s:t:Px")) != -1) {
+        switch (opt) {
+        case 'n': b.n_msgs = strtoul(optarg, NULL, 0); break;
+        case 'r': b.rate = strtoul(optarg, NULL, 0); break;
+        case 'w': b.window = strtoul(optarg, NULL, 0); break;
+        case 'k': b.n_keys = strtoul(optarg, NULL, 0); break;
+        case 'z': b.zipf_s = atof(optarg); break;
+        case 'u': b.unblock_pct = strtoul(optarg, NULL, 0); break;
+        case 's': switch_port = strtoul(optarg, NULL, 0); break;
+        case 't': telex_port = strtoul(optarg, NULL, 0); break;
+        case 'P': peak = 1; break;
+        case 'x': external = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n requests] [-r rate] [-w window] "
+                    "[-k keys] [-z zipf_s] [-u unblock_pct] "
+                    "[-s switch_port] [-t telex_port] [-P] [-x]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (b.n_msgs == 0 || b.window == 0 || b.n_keys == 0 ||
+        b.unblock_pct > 100 || (peak && b.rate == 0)) {
+        fprintf(stderr, "requests, window and keys must be non-zero, "
+                "unblock_pct at most 100, and -P needs a starting rate\n");
+        return 1;
+    }
+
+    if (b.zipf_s > 0 && bench_zipf_init(&b)) {
+        fprintf(stderr, "Could not allocate key distribution\n");
+        return 1;
+    }
+    b.req = malloc(b.n_msgs * sizeof(*b.req));
+    b.sent_ns = malloc(b.n_msgs * sizeof(uint64_t));
+    b.wire_ns = malloc(b.n_msgs * sizeof(uint64_t));
+    b.ack_ns = malloc(b.n_msgs * sizeof(uint64_t));
+    if (b.req == NULL || b.sent_ns == NULL || b.wire_ns == NULL ||
+        b.ack_ns == NULL) {
+        fprintf(stderr, "Could not allocate %u samples\n", b.n_msgs);
+        return 1;
+    }
+
+    /* The switch must be listening before telex starts, as telex does
+     * not retry its connection */
+    listen_fd = bench_listen(switch_port);
+    if (listen_fd < 0) {
+        perror("switch listen");
+        return 1;
+    }
+
+    if (!external) {
+        child = bench_start_telex(switch_port, telex_port);
+        if (child < 0) {
+            return 1;
+        }
+    }
+
+    b.base = event_base_new();
+    listener = evconnlistener_new(b.base, bench_switch_accept_cb, &b,
+                                  LEV_OPT_CLOSE_ON_FREE, -1, listen_fd);
+
+    printf("telex: %u requests per step over %u keys (%s), %u%% unblocks\n",
+           b.n_msgs, b.n_keys, b.zipf_cdf ? "zipf" : "uniform",
+           b.unblock_pct);
+    if (external) {
+        printf("waiting for telex to connect to 127.0.0.1:%d\n",
+               switch_port);
+    }
+
+    /* Wait for telex to finish its handshake with our switch */
+    deadline = bench_now_ns() + (external ? 60 : 5) * 1000000000ULL;
+    while (b.sw == NULL || b.sw->features_requests == 0) {
+        if (bench_now_ns() > deadline) {
+            fprintf(stderr, "telex never connected to the switch\n");
+            goto out;
+        }
+        event_base_loop(b.base, EVLOOP_ONCE | EVLOOP_NONBLOCK);
+        usleep(1000);
+    }
+    if (bench_connect(&b, telex_port)) {
+        goto out;
+    }
+
+    b.tick = event_new(b.base, -1, EV_PERSIST, bench_tick_cb, &b);
+    evtimer_add(b.tick, &tick);
+
+    if (!peak) {
+        bench_step(&b);
+    } else {
+        while (bench_step(&b)) {
+            best = b.rate;
+            if (b.rate > UINT32_MAX / 2) {
+                break;
+            }
+            b.rate *= 2;
+        }
+        if (best) {
+            printf("peak sustainable: %u requests/s\n", best);
+        } else {
+            printf("telex did not keep up even at the starting rate\n");
+        }
+    }
+
+    event_free(b.tick);
+    bufferevent_free(b.client);
+out:
+    if (b.sw != NULL) {
+        fake_switch_free(b.sw);
+    }
+    evconnlistener_free(listener);
+    event_base_free(b.base);
+    if (child > 0) {
+        kill(child, SIGTERM);
+        waitpid(child, NULL, 0);
+    }
+    free(b.zipf_cdf);
+    free(b.req);
+    free(b.sent_ns);
+    free(b.wire_ns);
+    free(b.ack_ns);
+
+    return 0;
+}
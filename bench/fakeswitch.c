@@ -0,0 +1,235 @@
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fakeswitch.h"
+
+#define FAKE_SWITCH_MAX_MSG     65535
+
+static void fake_switch_send(struct fake_switch *sw, void *msg, uint8_t type,
+                             uint32_t xid, size_t len)
+{
+    struct ofp_header *hdr = msg;
+
+    hdr->version = OFP_VERSION;
+    hdr->type = type;
+    hdr->length = htons(len);
+    hdr->xid = xid;
+
+    bufferevent_write(sw->bev, msg, len);
+}
+
+static void fake_switch_handle(struct fake_switch *sw, struct ofp_header *hdr)
+{
+    struct ofp_header reply;
+
+    switch (hdr->type) {
+    case OFPT_HELLO:
+        sw->hellos++;
+        break;
+    case OFPT_FEATURES_REQUEST:
+        sw->features_requests++;
+        fake_switch_send(sw, sw->features, OFPT_FEATURES_REPLY, hdr->xid,
+                         sw->features_len);
+        break;
+    case OFPT_ECHO_REQUEST:
+        sw->echo_requests++;
+        fake_switch_send(sw, &reply, OFPT_ECHO_REPLY, hdr->xid,
+                         sizeof(reply));
+        break;
+    case OFPT_ECHO_REPLY:
+        sw->echo_replies++;
+        break;
+    case OFPT_FLOW_MOD:
+        if (ntohs(hdr->length) < sizeof(struct ofp_flow_mod)) {
+            sw->errors++;
+            break;
+        }
+        sw->flow_mods++;
+        if (sw->flow_mod_cb) {
+            sw->flow_mod_cb(sw, (struct ofp_flow_mod *)hdr, sw->arg);
+        }
+        break;
+    case OFPT_BARRIER_REQUEST:
+        sw->barriers++;
+        if (sw->barrier_cb) {
+            sw->barrier_cb(sw, hdr, sw->arg);
+        }
+        fake_switch_send(sw, &reply, OFPT_BARRIER_REPLY, hdr->xid,
+                         sizeof(reply));
+        break;
+    case OFPT_PACKET_OUT:
+        sw->packet_outs++;
+        break;
+    default:
+        sw->other++;
+        break;
+    }
+}
+
+static void fake_switch_read_cb(struct bufferevent *bev, void *arg)
+{
+    struct fake_switch *sw = arg;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    static uint8_t msg[FAKE_SWITCH_MAX_MSG];
+    struct ofp_header *hdr = (struct ofp_header *)msg;
+    size_t len;
+
+    while (evbuffer_get_length(input) >= sizeof(*hdr)) {
+        evbuffer_copyout(input, hdr, sizeof(*hdr));
+        len = ntohs(hdr->length);
+
+        if (len < sizeof(*hdr)) {
+            /* No way to find the next message; stop listening */
+            sw->errors++;
+            bufferevent_disable(bev, EV_READ);
+            return;
+        }
+        if (evbuffer_get_length(input) < len) {
+            return;
+        }
+
+        evbuffer_remove(input, msg, len);
+        fake_switch_handle(sw, hdr);
+    }
+}
+
+static void fake_switch_event_cb(struct bufferevent *bev, short events,
+                                 void *arg)
+{
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        bufferevent_disable(bev, EV_READ | EV_WRITE);
+    }
+}
+
+struct fake_switch *fake_switch_new(struct bufferevent *bev,
+                                    uint64_t datapath_id, uint16_t n_ports)
+{
+    struct fake_switch *sw;
+    struct ofp_hello hello;
+    int i;
+
+    sw = malloc(sizeof(*sw));
+    if (sw == NULL) {
+        fprintf(stderr, "fakeswitch: could not malloc state\n");
+        return NULL;
+    }
+    memset(sw, 0, sizeof(*sw));
+
+    sw->bev = bev;
+    sw->datapath_id = datapath_id;
+    sw->features_len = sizeof(*sw->features) +
+                       n_ports * sizeof(struct ofp_phy_port);
+    sw->features = malloc(sw->features_len);
+    if (sw->features == NULL) {
+        fprintf(stderr, "fakeswitch: could not malloc features\n");
+        free(sw);
+        return NULL;
+    }
+    memset(sw->features, 0, sw->features_len);
+
+    sw->features->datapath_id = htobe64(datapath_id);
+    sw->features->n_buffers = htonl(256);
+    sw->features->n_tables = 1;
+    sw->features->capabilities = htonl(OFPC_FLOW_STATS | OFPC_PORT_STATS);
+    sw->features->actions = htonl(1 << OFPAT_OUTPUT);
+    for (i=0; i<n_ports; i++) {
+        struct ofp_phy_port *port = &sw->features->ports[i];
+
+        port->port_no = htons(i + 1);
+        port->hw_addr[0] = 0x02;
+        port->hw_addr[4] = datapath_id;
+        port->hw_addr[5] = i + 1;
+        snprintf(port->name, sizeof(port->name), "eth%d", i + 1);
+        port->curr = htonl(OFPPF_1GB_FD | OFPPF_COPPER);
+    }
+
+    bufferevent_setcb(bev, fake_switch_read_cb, NULL, fake_switch_event_cb,
+                      sw);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+
+    fake_switch_send(sw, &hello, OFPT_HELLO, 0, sizeof(hello));
+
+    return sw;
+}
+
+void fake_switch_free(struct fake_switch *sw)
+{
+    bufferevent_free(sw->bev);
+    free(sw->features);
+    free(sw);
+}
+
+void fake_switch_send_packet_in(struct fake_switch *sw, uint32_t xid,
+                                uint32_t buffer_id, uint16_t in_port,
+                                const void *frame, uint16_t frame_len)
+{
+    struct ofp_packet_in pkt_in;
+    size_t hdr_len = offsetof(struct ofp_packet_in, data);
+
+    memset(&pkt_in, 0, sizeof(pkt_in));
+    pkt_in.header.version = OFP_VERSION;
+    pkt_in.header.type = OFPT_PACKET_IN;
+    pkt_in.header.length = htons(hdr_len + frame_len);
+    pkt_in.header.xid = htonl(xid);
+    pkt_in.buffer_id = htonl(buffer_id);
+    pkt_in.total_len = htons(frame_len);
+    pkt_in.in_port = htons(in_port);
+    pkt_in.reason = OFPR_NO_MATCH;
+
+    bufferevent_write(sw->bev, &pkt_in, hdr_len);
+    bufferevent_write(sw->bev, frame, frame_len);
+}
+
+void fake_switch_send_echo_request(struct fake_switch *sw, uint32_t xid)
+{
+    struct ofp_header req;
+
+    fake_switch_send(sw, &req, OFPT_ECHO_REQUEST, htonl(xid), sizeof(req));
+}
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double bench_percentile(const uint64_t *sorted, size_t n, double p)
+{
+    return sorted[(size_t)(p * (n - 1))] / 1e3;
+}
+
+void bench_report_latency(const char *label, uint64_t *ns, size_t n)
+{
+    double sum = 0;
+    size_t i;
+
+    if (n == 0) {
+        printf("  %-10s no samples\n", label);
+        return;
+    }
+
+    qsort(ns, n, sizeof(*ns), bench_cmp_u64);
+    for (i=0; i<n; i++) {
+        sum += ns[i];
+    }
+
+    printf("  %-10s n=%zu mean %.1fus p50 %.1fus p99 %.1fus p999 %.1fus "
+           "max %.1fus\n", label, n, sum / n / 1e3,
+           bench_percentile(ns, n, 0.50), bench_percentile(ns, n, 0.99),
+           bench_percentile(ns, n, 0.999), ns[n - 1] / 1e3);
+}
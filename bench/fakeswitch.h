@@ -0,0 +1,60 @@
+#ifndef FAKESWITCH_H
+#define FAKESWITCH_H
+
+#include <event2/bufferevent.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "openflow.h"
+
+/*
+* Just enough of an OpenFlow 1.0 switch to benchmark a controller against:
+* it says HELLO, answers FEATURES_REQUEST, ECHO_REQUEST and
+* BARRIER_REQUEST, hands every FLOW_MOD to a callback, and can send
+* PACKET_INs and ECHO_REQUESTs on demand. It runs over any bufferevent
+* (one end of a pair for in-process runs, or a socket) and does not
+* allocate per message, so it stays out of allocation counts.
+*/
+struct fake_switch {
+    struct bufferevent  *bev;
+    uint64_t            datapath_id;
+
+    struct ofp_switch_features  *features;  /* prebuilt reply */
+    size_t                      features_len;
+
+    /* Optional hooks, called with the whole message */
+    void    (*flow_mod_cb)(struct fake_switch *sw, struct ofp_flow_mod *mod,
+                           void *arg);
+    void    (*barrier_cb)(struct fake_switch *sw, struct ofp_header *req,
+                          void *arg);
+    void    *arg;
+
+    uint64_t    hellos;
+    uint64_t    features_requests;
+    uint64_t    echo_requests;
+    uint64_t    echo_replies;
+    uint64_t    flow_mods;
+    uint64_t    barriers;
+    uint64_t    packet_outs;
+    uint64_t    other;
+    uint64_t    errors;         /* malformed messages */
+};
+
+/* Takes ownership of bev and sends HELLO */
+struct fake_switch *fake_switch_new(struct bufferevent *bev,
+                                    uint64_t datapath_id, uint16_t n_ports);
+
+void fake_switch_free(struct fake_switch *sw);
+
+void fake_switch_send_packet_in(struct fake_switch *sw, uint32_t xid,
+                                uint32_t buffer_id, uint16_t in_port,
+                                const void *frame, uint16_t frame_len);
+
+void fake_switch_send_echo_request(struct fake_switch *sw, uint32_t xid);
+
+/* Monotonic clock for latency measurements */
+uint64_t bench_now_ns(void);
+
+/* Sorts ns[] in place and prints count, mean, p50/p99/p999 and max */
+void bench_report_latency(const char *label, uint64_t *ns, size_t n);
+
+#endif
@@ -0,0 +1,744 @@
+/*
+* Replay a captured OpenFlow control channel through fox's parser and
+* dispatch (controller_read_cb -> controller_handle_msg), either to time
+* it or to fuzz it.
+*
+* Input is a pcap file (Ethernet, Linux cooked or raw IP; IPv4/IPv6 TCP)
+* or, if it has no pcap magic, a raw stream of OpenFlow messages. From a
+* pcap only the switch-to-controller direction is used (TCP source port
+* -p, default 6633 and 6653), one stream per connection; lost segments
+* end a stream, since the framing is gone after them.
+*
+* Replay mode feeds each stream -n times, -c bytes at a time, into a
+* fox_state with the l2switch app attached (-L leaves it off), and prints
+* ns and cycles per message along with a per-type message count.
+*
+* Fuzz mode (-F iterations) mutates the corpus (flipped bytes, rewritten
+* length and type fields, truncation, duplicated and spliced messages)
+* and feeds each result to a fresh fox_state. Run it under
+* -fsanitize=address,undefined; with -o, each input is written out before
+* it is fed, so the file left after a crash reproduces it. -s picks the
+* seed. Build with -DOFREPLAY_LIBFUZZER -fsanitize=fuzzer (in BENCH_CFLAGS,
+* with CC=clang) for a libFuzzer target instead of main().
+*
+* Each stream is fed as a new connection, so the switch's HELLO picks the
+* OpenFlow version as it would live. For captures that start after the
+* HELLO, -V sets the version to assume (1 for 1.0, 4 for 1.3).
+*
+* Build from the top of the tree with "make ofreplay" (Makefile).
+*
+* Usage: ofreplay [-n loops] [-c chunk] [-p port] [-L] [-V version]
+*                 [-F iterations] [-s seed] [-o crash_file] capture
+*/
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "fox.h"
+#include "controller.h"
+#include "l2switch.h"
+#include "logger.h"
+
+#define OFREPLAY_MAX_STREAMS    64
+#define OFREPLAY_MAX_MSG        65535
+
+#define PCAP_MAGIC_US           0xa1b2c3d4
+#define PCAP_MAGIC_NS           0xa1b23c4d
+
+#define LINKTYPE_NULL           0
+#define LINKTYPE_ETHERNET       1
+#define LINKTYPE_RAW            101
+#define LINKTYPE_LINUX_SLL      113
+#define LINKTYPE_LINUX_SLL2     276
+
+struct pcap_file_hdr {
+    uint32_t    magic;
+    uint16_t    version_major;
+    uint16_t    version_minor;
+    int32_t     thiszone;
+    uint32_t    sigfigs;
+    uint32_t    snaplen;
+    uint32_t    linktype;
+} __attribute__((__packed__));
+
+struct pcap_rec_hdr {
+    uint32_t    ts_sec;
+    uint32_t    ts_frac;
+    uint32_t    incl_len;
+    uint32_t    orig_len;
+} __attribute__((__packed__));
+
+struct stream {
+    uint8_t     key[37];        /* family, addresses, ports */
+    uint32_t    next_seq;
+    int         started;
+    int         broken;
+
+    uint8_t     *data;
+    size_t      len;
+    size_t      size;
+};
+
+struct replay {
+    struct stream   streams[OFREPLAY_MAX_STREAMS];
+    int             n_streams;
+    uint16_t        port;       /* 0: 6633 or 6653 */
+    uint64_t        gaps;
+    uint64_t        skipped;
+};
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int append(uint8_t **data, size_t *len, size_t *size,
+                  const void *p, size_t n)
+{
+    if (*len + n > *size) {
+        size_t new_size = *size ? *size : 4096;
+        uint8_t *new_data;
+
+        while (new_size < *len + n) {
+            new_size *= 2;
+        }
+        new_data = realloc(*data, new_size);
+        if (new_data == NULL) {
+            return -1;
+        }
+        *data = new_data;
+        *size = new_size;
+    }
+    memcpy(*data + *len, p, n);
+    *len += n;
+    return 0;
+}
+
+/*
+* Capture parsing
+*/
+static struct stream *replay_stream(struct replay *r, const uint8_t *key)
+{
+    int i;
+
+    for (i=0; i<r->n_streams; i++) {
+        if (memcmp(r->streams[i].key, key, sizeof(r->streams[i].key)) == 0) {
+            return &r->streams[i];
+        }
+    }
+    if (r->n_streams == OFREPLAY_MAX_STREAMS) {
+        return NULL;
+    }
+    memcpy(r->streams[r->n_streams].key, key, sizeof(r->streams[0].key));
+    return &r->streams[r->n_streams++];
+}
+
+static void replay_tcp(struct replay *r, uint8_t *key, const uint8_t *tcp,
+                       size_t len)
+{
+    struct stream *s;
+    uint16_t sport;
+    uint32_t seq;
+    size_t off;
+
+    if (len < 20 || (off = (tcp[12] >> 4) * 4) < 20 || off > len) {
+        r->skipped++;
+        return;
+    }
+    sport = tcp[0] << 8 | tcp[1];
+    seq = (uint32_t)tcp[4] << 24 | tcp[5] << 16 | tcp[6] << 8 | tcp[7];
+
+    if (r->port ? sport != r->port : sport != 6633 && sport != 6653) {
+        return;
+    }
+
+    memcpy(key + 33, tcp, 4);
+    s = replay_stream(r, key);
+    if (s == NULL || s->broken) {
+        return;
+    }
+
+    if (tcp[13] & 0x02) {       /* SYN */
+        s->next_seq = seq + 1;
+        s->started = 1;
+        return;
+    }
+    tcp += off;
+    len -= off;
+    if (len == 0) {
+        return;
+    }
+    if (!s->started) {
+        s->next_seq = seq;
+        s->started = 1;
+    }
+
+    /* Retransmissions overlap what we have; anything after a hole is
+     * unusable */
+    if ((int32_t)(seq - s->next_seq) > 0) {
+        r->gaps++;
+        s->broken = 1;
+        return;
+    }
+    if ((int32_t)(seq + len - s->next_seq) <= 0) {
+        return;
+    }
+    off = s->next_seq - seq;
+    if (append(&s->data, &s->len, &s->size, tcp + off, len - off)) {
+        s->broken = 1;
+        return;
+    }
+    s->next_seq = seq + len;
+}
+
+static void replay_ip(struct replay *r, const uint8_t *ip, size_t len)
+{
+    uint8_t key[37];
+    size_t hlen, total;
+
+    memset(key, 0, sizeof(key));
+
+    if (len >= 20 && (ip[0] >> 4) == 4) {
+        hlen = (ip[0] & 0x0f) * 4;
+        total = ip[2] << 8 | ip[3];
+        if (hlen < 20 || total < hlen || total > len || ip[9] != 6 ||
+            (ip[6] & 0x3f) != 0 || ip[7] != 0) {    /* fragments */
+            r->skipped++;
+            return;
+        }
+        key[0] = 4;
+        memcpy(key + 1, ip + 12, 8);
+        replay_tcp(r, key, ip + hlen, total - hlen);
+    } else if (len >= 40 && (ip[0] >> 4) == 6) {
+        total = 40 + (ip[4] << 8 | ip[5]);
+        if (ip[6] != 6 || total > len) {
+            r->skipped++;
+            return;
+        }
+        key[0] = 6;
+        memcpy(key + 1, ip + 8, 32);
+        replay_tcp(r, key, ip + 40, total - 40);
+    } else {
+        r->skipped++;
+    }
+}
+
+static void replay_frame(struct replay *r, uint32_t linktype,
+                         const uint8_t *p, size_t len)
+{
+    uint16_t ethertype;
+    size_t off;
+
+    switch (linktype) {
+    case LINKTYPE_ETHERNET:
+        off = 12;
+        break;
+    case LINKTYPE_LINUX_SLL:
+        off = 14;
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        off = 0;
+        break;
+    case LINKTYPE_RAW:
+        replay_ip(r, p, len);
+        return;
+    case LINKTYPE_NULL:
+        if (len >= 4) {
+            replay_ip(r, p + 4, len - 4);
+        }
+        return;
+    default:
+        r->skipped++;
+        return;
+    }
+
+    if (len < off + 2) {
+        r->skipped++;
+        return;
+    }
+    ethertype = p[off] << 8 | p[off + 1];
+    off += linktype == LINKTYPE_LINUX_SLL2 ? 20 : 2;
+    while (ethertype == 0x8100 && len >= off + 4) {
+        ethertype = p[off + 2] << 8 | p[off + 3];
+        off += 4;
+    }
+    if ((ethertype != 0x0800 && ethertype != 0x86dd) || len < off) {
+        r->skipped++;
+        return;
+    }
+    replay_ip(r, p + off, len - off);
+}
+
+static int replay_load(struct replay *r, const char *path)
+{
+    struct pcap_file_hdr fh;
+    struct pcap_rec_hdr rh;
+    uint8_t *buf;
+    int swapped;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    buf = malloc(1 << 18);
+    if (buf == NULL) {
+        fclose(f);
+        return -1;
+    }
+
+    if (fread(&fh, sizeof(fh), 1, f) != 1 ||
+        (fh.magic != PCAP_MAGIC_US && fh.magic != PCAP_MAGIC_NS &&
+         fh.magic != __builtin_bswap32(PCAP_MAGIC_US) &&
+         fh.magic != __builtin_bswap32(PCAP_MAGIC_NS))) {
+        /* Not a pcap: take the file as one raw stream */
+        struct stream *s = &r->streams[r->n_streams++];
+        size_t n;
+
+        rewind(f);
+        while ((n = fread(buf, 1, 1 << 18, f)) > 0) {
+            append(&s->data, &s->len, &s->size, buf, n);
+        }
+        fclose(f);
+        free(buf);
+        return 0;
+    }
+
+    swapped = fh.magic == __builtin_bswap32(PCAP_MAGIC_US) ||
+              fh.magic == __builtin_bswap32(PCAP_MAGIC_NS);
+    if (swapped) {
+        fh.linktype = __builtin_bswap32(fh.linktype);
+    }
+
+    while (fread(&rh, sizeof(rh), 1, f) == 1) {
+        uint32_t incl = swapped ? __builtin_bswap32(rh.incl_len) :
+                                  rh.incl_len;
+
+        if (incl > (1 << 18) || fread(buf, 1, incl, f) != incl) {
+            fprintf(stderr, "%s: truncated record\n", path);
+            break;
+        }
+        replay_frame(r, fh.linktype & 0xffff, buf, incl);
+    }
+
+    fclose(f);
+    free(buf);
+    return 0;
+}
+
+/*
+* Feeding fox
+*/
+static uint8_t feed_version;    /* 0: negotiate from the stream's HELLO */
+
+struct feeder {
+    struct event_base   *base;
+    struct bufferevent  *pair[2];
+    struct evbuffer     *input;
+    struct evbuffer     *output;
+    struct fox_state    state;
+    int                 with_l2switch;
+};
+
+static int feeder_open(struct feeder *fd, struct event_base *base,
+                       int with_l2switch)
+{
+    memset(fd, 0, sizeof(*fd));
+    fd->base = base;
+    fd->with_l2switch = with_l2switch;
+
+    if (bufferevent_pair_new(base, 0, fd->pair)) {
+        fprintf(stderr, "Could not create bufferevent pair\n");
+        return -1;
+    }
+    fd->state.name = "replay";
+    fd->state.base = base;
+    fd->state.controller_bev = fd->pair[0];
+
+    if (with_l2switch && l2switch_attach(&fd->state) == NULL) {
+        return -1;
+    }
+
+    fd->input = bufferevent_get_input(fd->pair[0]);
+    evbuffer_unfreeze(fd->input, 0);
+    fd->output = bufferevent_get_output(fd->pair[0]);
+    return 0;
+}
+
+static void feeder_close(struct feeder *fd)
+{
+    int i;
+
+    if (fd->with_l2switch) {
+        struct l2switch_state *l2 = fd->state.user_ptr;
+        free(l2->table.slots);
+        free(l2);
+    }
+    for (i=0; i<256; i++) {
+        while (fd->state.msg_handler[i] != NULL) {
+            struct handler_list *next = fd->state.msg_handler[i]->next;
+            free(fd->state.msg_handler[i]);
+            fd->state.msg_handler[i] = next;
+        }
+    }
+    free(fd->state.ports);
+    free(fd->state.pending_features);
+    bufferevent_free(fd->pair[0]);
+    bufferevent_free(fd->pair[1]);
+}
+
+static void feeder_feed(struct feeder *fd, const uint8_t *data, size_t len,
+                        size_t chunk)
+{
+    size_t off, n;
+
+    fd->state.version = feed_version;
+    fd->state.resyncing = 0;
+
+    for (off = 0; off < len; off += n) {
+        n = len - off < chunk ? len - off : chunk;
+        evbuffer_add(fd->input, data + off, n);
+        controller_read_cb(fd->pair[0], &fd->state);
+        evbuffer_drain(fd->output, evbuffer_get_length(fd->output));
+    }
+    /* Whatever is left is a partial message */
+    evbuffer_drain(fd->input, evbuffer_get_length(fd->input));
+}
+
+/* Whole messages at the front of a stream, and how many of each type */
+static size_t count_msgs(const uint8_t *data, size_t len, uint64_t *types)
+{
+    size_t off = 0, n = 0;
+
+    while (len - off >= sizeof(struct ofp_header)) {
+        const struct ofp_header *hdr = (const void *)(data + off);
+        size_t msg_len = ntohs(hdr->length);
+
+        if (msg_len < sizeof(*hdr) || msg_len > len - off) {
+            break;
+        }
+        if (types) {
+            types[hdr->type]++;
+        }
+        off += msg_len;
+        n++;
+    }
+    return n;
+}
+
+static void replay_run(struct replay *r, struct event_base *base,
+                       uint32_t loops, size_t chunk, int with_l2switch)
+{
+    uint64_t types[256];
+    uint64_t msgs = 0, ns = 0, cycles = 0, bytes = 0;
+    uint64_t bad_msgs = 0, resync_bytes = 0;
+    int i;
+    uint32_t j;
+
+    memset(types, 0, sizeof(types));
+
+    for (i=0; i<r->n_streams; i++) {
+        struct stream *s = &r->streams[i];
+        struct feeder fd;
+        size_t n = count_msgs(s->data, s->len, types);
+        uint64_t t0, c0;
+
+        if (n == 0 || feeder_open(&fd, base, with_l2switch)) {
+            continue;
+        }
+
+        t0 = now_ns();
+        c0 = now_cycles();
+        for (j=0; j<loops; j++) {
+            feeder_feed(&fd, s->data, s->len, chunk);
+        }
+        cycles += now_cycles() - c0;
+        ns += now_ns() - t0;
+        msgs += (uint64_t)n * loops;
+        bytes += (uint64_t)s->len * loops;
+        bad_msgs += fd.state.bad_msgs;
+        resync_bytes += fd.state.resync_bytes;
+
+        feeder_close(&fd);
+    }
+
+    printf("%d streams, %llu gaps, %llu packets skipped\n", r->n_streams,
+           (unsigned long long)r->gaps, (unsigned long long)r->skipped);
+    for (i=0; i<256; i++) {
+        if (types[i]) {
+            printf("  type %3d: %llu\n", i, (unsigned long long)types[i]);
+        }
+    }
+    if (bad_msgs) {
+        printf("%llu bad messages, %llu bytes skipped resyncing\n",
+               (unsigned long long)bad_msgs,
+               (unsigned long long)resync_bytes);
+    }
+    if (msgs == 0) {
+        printf("no messages\n");
+        return;
+    }
+    printf("%llu messages, %.1f MB: %.0f msgs/s, %.1f ns/msg",
+           (unsigned long long)msgs, bytes / 1e6, msgs * 1e9 / ns,
+           (double)ns / msgs);
+    if (cycles) {
+        printf(", %.0f cycles/msg", (double)cycles / msgs);
+    }
+    printf("\n");
+}
+
+/*
+* Fuzzing
+*/
+static size_t mutate(uint8_t *buf, size_t len, size_t max,
+                     const struct replay *r)
+{
+    int n_mutations = 1 + rng_next() % 4;
+    int i;
+
+    for (i=0; i<n_mutations && len > 0; i++) {
+        size_t at = rng_next() % len;
+        uint32_t what = rng_next() % 8;
+
+        /* Most mutations aim at a message boundary, where the header is */
+        if (what >= 2) {
+            size_t off = 0;
+
+            while (len - off >= sizeof(struct ofp_header)) {
+                size_t msg_len = buf[off + 2] << 8 | buf[off + 3];
+                if (msg_len < sizeof(struct ofp_header) || off + msg_len > at) {
+                    break;
+                }
+                off += msg_len;
+            }
+            at = off;
+        }
+
+        switch (what) {
+        case 0:         /* flip a byte */
+        case 1:
+            buf[at] ^= 1 + rng_next() % 255;
+            break;
+        case 2:         /* rewrite a length */
+        case 3:
+            if (at + 4 <= len) {
+                uint16_t v = rng_next() % 3 == 0 ? rng_next() % 16 :
+                                                   rng_next();
+                buf[at + 2] = v >> 8;
+                buf[at + 3] = v;
+            }
+            break;
+        case 4:         /* rewrite a type */
+            if (at + 2 <= len) {
+                buf[at + 1] = rng_next() % 32;
+            }
+            break;
+        case 5:         /* truncate */
+            len = at + rng_next() % (len - at + 1);
+            break;
+        case 6:         /* duplicate the tail */
+            if (len < max) {
+                size_t n = (len - at) < (max - len) ? len - at : max - len;
+                memmove(buf + at + n, buf + at, len - at);
+                len += n;
+            }
+            break;
+        case 7:         /* splice in part of another stream */
+            if (r != NULL && r->n_streams > 0) {
+                const struct stream *s = &r->streams[rng_next() %
+                                                     r->n_streams];
+                if (s->len > 0) {
+                    size_t from = rng_next() % s->len;
+                    size_t n = s->len - from;
+                    if (n > max - at) {
+                        n = max - at;
+                    }
+                    memcpy(buf + at, s->data + from, n);
+                    if (at + n > len) {
+                        len = at + n;
+                    }
+                }
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+static void fuzz_one(struct event_base *base, const uint8_t *data,
+                     size_t len, int with_l2switch)
+{
+    struct feeder fd;
+
+    if (feeder_open(&fd, base, with_l2switch)) {
+        return;
+    }
+    feeder_feed(&fd, data, len, 1 + rng_next() % 4096);
+    feeder_close(&fd);
+}
+
+#ifdef OFREPLAY_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t len)
+{
+    static struct event_base *base;
+
+    if (base == NULL) {
+        LogOutputStream(stderr);
+        LogOutputLevel(LOG_FATAL);
+        base = event_base_new();
+    }
+    fuzz_one(base, data, len, 1);
+    return 0;
+}
+
+#else
+
+static void fuzz_run(struct replay *r, struct event_base *base,
+                     uint64_t iterations, const char *crash_file,
+                     int with_l2switch)
+{
+    size_t max = 4 * OFREPLAY_MAX_MSG;
+    uint8_t *buf = malloc(max);
+    uint64_t i;
+
+    if (buf == NULL) {
+        return;
+    }
+
+    for (i=0; i<iterations; i++) {
+        const struct stream *s = &r->streams[rng_next() % r->n_streams];
+        size_t from = 0, len = s->len;
+
+        /* A window of the stream, starting on a message boundary */
+        if (len > max / 2) {
+            size_t skip = count_msgs(s->data, s->len, NULL);
+            skip = skip ? rng_next() % skip : 0;
+            while (skip-- > 0 && s->len - from >= sizeof(struct ofp_header)) {
+                from += s->data[from + 2] << 8 | s->data[from + 3];
+            }
+            len = s->len - from < max / 2 ? s->len - from : max / 2;
+        }
+        memcpy(buf, s->data + from, len);
+        len = mutate(buf, len, max, r);
+
+        if (crash_file != NULL) {
+            FILE *f = fopen(crash_file, "wb");
+            if (f != NULL) {
+                fwrite(buf, 1, len, f);
+                fclose(f);
+            }
+        }
+
+        fuzz_one(base, buf, len, with_l2switch);
+
+        if ((i + 1) % 100000 == 0) {
+            fprintf(stderr, "%llu iterations\n", (unsigned long long)i + 1);
+        }
+    }
+
+    if (crash_file != NULL) {
+        unlink(crash_file);
+    }
+    printf("%llu fuzz iterations, no crash\n",
+           (unsigned long long)iterations);
+    free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay r;
+    struct event_base *base;
+    uint32_t loops = 100;
+    size_t chunk = 64 * 1024;
+    uint64_t fuzz = 0;
+    char *crash_file = NULL;
+    int with_l2switch = 1, opt, i;
+
+    memset(&r, 0, sizeof(r));
+
+    while ((opt = getopt(argc, argv, "n:c:p:LV:F:s:o:")) != -1) {
+        switch (opt) {
+        case 'n': loops = strtoul(optarg, NULL, 0); break;
+        case 'c': chunk = strtoul(optarg, NULL, 0); break;
+        case 'p': r.port = strtoul(optarg, NULL, 0); break;
+        case 'L': with_l2switch = 0; break;
+        case 'V': feed_version = strtoul(optarg, NULL, 0); break;
+        case 'F': fuzz = strtoull(optarg, NULL, 0); break;
+        case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+        case 'o': crash_file = optarg; break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1 || chunk == 0 ||
+        (feed_version != 0 && feed_version != OFP_VERSION &&
+         feed_version != OFP13_VERSION)) {
+usage:
+        fprintf(stderr, "Usage: %s [-n loops] [-c chunk] [-p port] [-L] "
+                "[-V version] [-F iterations] [-s seed] [-o crash_file] "
+                "capture\n",
+                argv[0]);
+        return 1;
+    }
+
+    /* Quiet unless something is badly wrong; the tool is about the
+     * parser, not the logger */
+    LogOutputStream(stderr);
+    LogOutputLevel(LOG_FATAL);
+
+    if (replay_load(&r, argv[optind])) {
+        return 1;
+    }
+    if (r.n_streams == 0) {
+        fprintf(stderr, "No OpenFlow streams found in %s\n", argv[optind]);
+        return 1;
+    }
+
+    base = event_base_new();
+    if (fuzz) {
+        fuzz_run(&r, base, fuzz, crash_file, with_l2switch);
+    } else {
+        replay_run(&r, base, loops, chunk, with_l2switch);
+    }
+
+    for (i=0; i<r.n_streams; i++) {
+        free(r.streams[i].data);
+    }
+    event_base_free(base);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <string.h>
+#include "blocktable.h"
+
+static uint32_t block_key_hash(struct block_key *key)
+{
+    uint64_t a, b;
+
+    memcpy(&a, key, sizeof(a));
+    b = ((uint64_t)key->src_port << 16) | key->dst_port;
+
+    a ^= b * 0x9e3779b97f4a7c15ULL;
+    a ^= a >> 29;
+    a *= 0xbf58476d1ce4e5b9ULL;
+    a ^= a >> 32;
+
+    return (uint32_t)a;
+}
+
+static int block_key_equal(struct block_key *a, struct block_key *b)
+{
+    return a->src_ip == b->src_ip && a->dst_ip == b->dst_ip &&
+           a->src_port == b->src_port && a->dst_port == b->dst_port;
+}
+
+static void block_index_insert(struct block_table *table, uint32_t entry)
+{
+    uint32_t i = table->entries[entry].hash & table->index_mask;
+
+    while (table->index[i] != 0) {
+        i = (i + 1) & table->index_mask;
+    }
+    table->index[i] = entry + 1;
+}
+
+static int block_index_grow(struct block_table *table)
+{
+    uint32_t n_slots = (table->index_mask + 1) * 2;
+    uint32_t *old = table->index;
+    uint32_t i;
+
+    table->index = calloc(n_slots, sizeof(uint32_t));
+    if (table->index == NULL) {
+        table->index = old;
+        return -1;
+    }
+    table->index_mask = n_slots - 1;
+
+    for (i=0; i<table->n_entries; i++) {
+        if (table->entries[i].used) {
+            block_index_insert(table, i);
+        }
+    }
+    free(old);
+
+    return 0;
+}
+
+static int block_entries_grow(struct block_table *table)
+{
+    uint32_t n = table->n_entries ? table->n_entries * 2 : BLOCK_TABLE_MIN;
+    struct block_entry *entries;
+    uint32_t i;
+
+    entries = realloc(table->entries, n * sizeof(*entries));
+    if (entries == NULL) {
+        return -1;
+    }
+    memset(&entries[table->n_entries], 0,
+           (n - table->n_entries) * sizeof(*entries));
+
+    /* Chain the new entries onto the free list, lowest first */
+    for (i=n; i-- > table->n_entries; ) {
+        entries[i].next_free = table->free_head;
+        table->free_head = i;
+    }
+
+    table->entries = entries;
+    table->n_entries = n;
+
+    return 0;
+}
+
+int block_table_init(struct block_table *table)
+{
+    memset(table, 0, sizeof(*table));
+    table->free_head = BLOCK_NONE;
+
+    table->index = calloc(BLOCK_TABLE_MIN * 2, sizeof(uint32_t));
+    if (table->index == NULL) {
+        return -1;
+    }
+    table->index_mask = BLOCK_TABLE_MIN * 2 - 1;
+
+    return block_entries_grow(table);
+}
+
+void block_table_free(struct block_table *table)
+{
+    free(table->entries);
+    free(table->index);
+    memset(table, 0, sizeof(*table));
+}
+
+uint32_t block_table_find(struct block_table *table, struct block_key *key)
+{
+    uint32_t hash = block_key_hash(key);
+    uint32_t i = hash & table->index_mask;
+
+    while (table->index[i] != 0) {
+        struct block_entry *e = &table->entries[table->index[i] - 1];
+
+        if (e->hash == hash && block_key_equal(&e->key, key)) {
+            return table->index[i] - 1;
+        }
+        i = (i + 1) & table->index_mask;
+    }
+
+    return BLOCK_NONE;
+}
+
+uint32_t block_table_find_at(struct block_table *table, uint32_t entry,
+                             struct block_key *key)
+{
+    if (entry < table->n_entries && table->entries[entry].used &&
+        block_key_equal(&table->entries[entry].key, key)) {
+        return entry;
+    }
+    return block_table_find(table, key);
+}
+
+uint32_t block_table_insert(struct block_table *table, struct block_key *key)
+{
+    uint32_t entry = block_table_find(table, key);
+    struct block_entry *e;
+    uint16_t gen;
+
+    if (entry != BLOCK_NONE) {
+        return entry;
+    }
+
+    /* Index stays at most half full */
+    if ((table->count + 1) * 2 > table->index_mask + 1 &&
+        block_index_grow(table)) {
+        return BLOCK_NONE;
+    }
+    if (table->free_head == BLOCK_NONE && block_entries_grow(table)) {
+        return BLOCK_NONE;
+    }
+
+    entry = table->free_head;
+    e = &table->entries[entry];
+    table->free_head = e->next_free;
+
+    gen = e->gen + 1;
+    memset(e, 0, sizeof(*e));
+    e->gen = gen;
+    e->key = *key;
+    e->hash = block_key_hash(key);
+    e->used = 1;
+
+    block_index_insert(table, entry);
+    table->count++;
+
+    return entry;
+}
+
+void block_table_remove(struct block_table *table, uint32_t entry)
+{
+    struct block_entry *e = &table->entries[entry];
+    uint32_t i = e->hash & table->index_mask;
+    uint32_t j;
+
+    while (table->index[i] != entry + 1) {
+        if (table->index[i] == 0) {
+            return;
+        }
+        i = (i + 1) & table->index_mask;
+    }
+
+    /* Backward shift the rest of the cluster into the hole */
+    j = i;
+    while (1) {
+        uint32_t home;
+
+        j = (j + 1) & table->index_mask;
+        if (table->index[j] == 0) {
+            break;
+        }
+        home = table->entries[table->index[j] - 1].hash & table->index_mask;
+        if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+            table->index[i] = table->index[j];
+            i = j;
+        }
+    }
+    table->index[i] = 0;
+
+    e->used = 0;
+    e->next_free = table->free_head;
+    table->free_head = entry;
+    table->count--;
+}
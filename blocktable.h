@@ -0,0 +1,89 @@
+#ifndef BLOCKTABLE_H
+#define BLOCKTABLE_H
+
+#include <stdint.h>
+
+#define BLOCK_TABLE_MIN     1024    /* must be a power of two */
+#define BLOCK_NONE          UINT32_MAX
+#define BLOCK_GROUP_KINDS   2       /* see aggregate.h */
+
+/* All fields in network byte order, exactly as they appear in
+ * telex_mod_flow and ofp_match. */
+struct block_key {
+    uint32_t    src_ip;
+    uint32_t    dst_ip;
+    uint16_t    src_port;
+    uint16_t    dst_port;
+};
+
+struct block_entry {
+    struct block_key    key;
+    uint32_t            hash;
+    uint32_t            next_free;  /* free list link while unused */
+    uint8_t             used;
+    uint16_t            gen;        /* bumped each time the entry is reused */
+
+    uint64_t            installed_ms;
+    uint8_t             action;     /* telex_mod_flow action that added it */
+    uint8_t             flags;      /* see aggregate.h and telex.h */
+
+    /* Aggregation (aggregate.h). A block has the group it counts towards
+     * for each kind of aggregate (entry + 1, 0 for none) and its links
+     * among that group's members. A group has its members' count and the
+     * first of them. */
+    uint32_t            group[BLOCK_GROUP_KINDS];
+    uint32_t            group_next[BLOCK_GROUP_KINDS];
+    uint32_t            group_prev[BLOCK_GROUP_KINDS];
+    uint32_t            members;
+    uint32_t            head;
+
+    /* telex's eviction order (see telex_capacity) */
+    uint32_t            lru_prev;
+    uint32_t            lru_next;
+    uint32_t            sent;       /* when its flow was last sent */
+    uint32_t            pass;       /* the pass it was sent in */
+};
+
+/* Shadow copy of the blocks telex has installed. Entries live in a flat
+ * array and are referred to by index, which stays valid until the entry
+ * is removed (the array may move as it grows, so don't hold pointers
+ * across inserts). Lookups go through a separate open-addressing index
+ * of entry numbers. */
+struct block_table {
+    struct block_entry  *entries;
+    uint32_t            n_entries;  /* allocated */
+    uint32_t            free_head;
+
+    uint32_t            *index;     /* entry + 1, 0 is empty */
+    uint32_t            index_mask;
+
+    uint32_t            count;
+};
+
+int block_table_init(struct block_table *table);
+
+void block_table_free(struct block_table *table);
+
+/* Returns the entry number, or BLOCK_NONE */
+uint32_t block_table_find(struct block_table *table, struct block_key *key);
+
+/* The same, checking entry first: for an index remembered from earlier,
+ * which may have been reused or never have been this table's */
+uint32_t block_table_find_at(struct block_table *table, uint32_t entry,
+                             struct block_key *key);
+
+/* Returns the existing or newly added entry number (check
+ * entries[n].installed_ms == 0 for new), or BLOCK_NONE on error. A new
+ * entry is zeroed apart from gen. */
+uint32_t block_table_insert(struct block_table *table,
+                            struct block_key *key);
+
+void block_table_remove(struct block_table *table, uint32_t entry);
+
+static inline struct block_entry *block_table_get(struct block_table *table,
+                                                  uint32_t entry)
+{
+    return &table->entries[entry];
+}
+
+#endif
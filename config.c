@@ -0,0 +1,506 @@
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "config.h"
+#include "logger.h"
+#include "telex.h"
+#include "ha.h"
+#include "journal.h"
+
+#define CONFIG_LINE_LEN     512
+#define CONFIG_MAX_ARGS     12
+
+/* Plain numeric settings: "name value" */
+static const struct config_option {
+    const char  *name;
+    size_t      offset;
+    uint32_t    min;
+    uint32_t    max;
+} config_options[] = {
+    { "idle_timeout",        offsetof(struct fox_config, idle_timeout),
+      0, UINT16_MAX },
+    { "punt_max_len",        offsetof(struct fox_config, punt_max_len),
+      0, UINT16_MAX },
+    { "punt_sample_pps",     offsetof(struct fox_config, punt_sample_pps),
+      1, UINT32_MAX },
+    { "flow_capacity",       offsetof(struct fox_config, flow_capacity),
+      0, UINT32_MAX },
+    { "evict_high_pct",      offsetof(struct fox_config, evict_high_pct),
+      1, 100 },
+    { "evict_low_pct",       offsetof(struct fox_config, evict_low_pct),
+      1, 100 },
+    { "notify_window_ms",    offsetof(struct fox_config, notify_window_ms),
+      0, 60000 },
+    { "notify_batch",        offsetof(struct fox_config, notify_batch),
+      1, UINT16_MAX },
+    { "sched_quantum",       offsetof(struct fox_config, sched_quantum),
+      1, UINT32_MAX },
+    { "sched_budget",        offsetof(struct fox_config, sched_budget),
+      1, UINT32_MAX },
+    { "sched_retry_ms",      offsetof(struct fox_config, sched_retry_ms),
+      1, 60000 },
+    { "switch_high_water",   offsetof(struct fox_config, switch_high_water),
+      1, UINT32_MAX },
+    { "flow_mod_rate",       offsetof(struct fox_config, flow_mod_rate),
+      0, UINT32_MAX },
+    { "flow_mod_burst",      offsetof(struct fox_config, flow_mod_burst),
+      1, UINT32_MAX },
+    { "packet_in_rate",      offsetof(struct fox_config, packet_in_rate),
+      0, UINT32_MAX },
+    { "packet_in_burst",     offsetof(struct fox_config, packet_in_burst),
+      1, UINT32_MAX },
+    { "packet_in_flow_rate", offsetof(struct fox_config, packet_in_flow_rate),
+      0, UINT32_MAX },
+    { "packet_in_flow_burst",
+      offsetof(struct fox_config, packet_in_flow_burst), 1, UINT32_MAX },
+    { "packet_in_sample",    offsetof(struct fox_config, packet_in_sample),
+      0, UINT32_MAX },
+    { "client_rate",         offsetof(struct fox_config, client_rate),
+      1, UINT32_MAX / 16 },
+    { "client_burst",        offsetof(struct fox_config, client_burst),
+      1, UINT32_MAX / 16 },
+    { "client_max_buffered", offsetof(struct fox_config, client_max_buffered),
+      64, UINT32_MAX },
+    { "ack_requests",        offsetof(struct fox_config, ack_requests),
+      0, 1 },
+    { "ha_heartbeat_ms",     offsetof(struct fox_config, ha.heartbeat_ms),
+      10, 60000 },
+    { "ha_timeout_ms",       offsetof(struct fox_config, ha.timeout_ms),
+      10, 600000 },
+    { "ha_snapshot_s",       offsetof(struct fox_config, ha.snapshot_s),
+      0, 86400 },
+    { "journal_sync_ms",     offsetof(struct fox_config, journal_sync_ms),
+      1, 60000 },
+    { "ring_poll_ms",        offsetof(struct fox_config, ring_poll_ms),
+      1, 60000 },
+    { NULL, 0, 0, 0 }
+};
+
+void config_defaults(struct fox_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+
+    cfg->n_switches = 2;
+    strcpy(cfg->switches[0].ip, "10.1.0.1");
+    cfg->switches[0].port = OFP_TCP_PORT;
+    cfg->switches[0].connect = 1;
+    cfg->switches[0].echo_period_ms = 90*1000;
+    cfg->switches[0].blocks = CONFIG_BLOCKS_ALL;
+    /* Openflow only sends flow removed by connecting to us */
+    strcpy(cfg->switches[1].ip, "10.1.0.5");
+    cfg->switches[1].port = OFP_TCP_PORT;
+    cfg->switches[1].connect = 0;
+    cfg->switches[1].blocks = CONFIG_BLOCKS_NONE;
+
+    strcpy(cfg->listen_ip, TELEX_LISTEN_IP);
+    cfg->listen_port = TELEX_LISTEN_PORT;
+    strcpy(cfg->unix_path, TELEX_UNIX_PATH);
+    cfg->ring_slots = TELEX_RING_SLOTS;
+    cfg->ring_poll_ms = TELEX_RING_POLL_MS;
+
+    cfg->idle_timeout = TELEX_IDLE_FLOW_TIMEOUT;
+    cfg->block_action = TELEX_BLOCK_ACTION;
+    cfg->punt_max_len = TELEX_PUNT_MAX_LEN;
+    cfg->punt_sample_pps = TELEX_PUNT_SAMPLE_PPS;
+    cfg->evict_high_pct = TELEX_EVICT_HIGH_PCT;
+    cfg->evict_low_pct = TELEX_EVICT_LOW_PCT;
+    cfg->agg_threshold = TELEX_AGG_THRESHOLD;
+    cfg->agg_src_prefix = TELEX_AGG_PREFIX_LEN;
+    cfg->agg_dst_prefix = TELEX_AGG_PREFIX_LEN;
+    cfg->notify_window_ms = TELEX_NOTIFY_WINDOW_MS;
+    cfg->notify_batch = TELEX_NOTIFY_BATCH;
+    cfg->sched_quantum = TELEX_SCHED_QUANTUM;
+    cfg->sched_budget = TELEX_SCHED_BUDGET;
+    cfg->sched_retry_ms = TELEX_SCHED_RETRY_MS;
+    cfg->switch_high_water = TELEX_SWITCH_HIGH_WATER;
+    cfg->flow_mod_rate = TELEX_FLOW_MOD_RATE;
+    cfg->flow_mod_burst = TELEX_FLOW_MOD_BURST;
+    cfg->packet_in_rate = TELEX_PACKET_IN_RATE;
+    cfg->packet_in_burst = TELEX_PACKET_IN_BURST;
+    cfg->packet_in_flow_rate = TELEX_PACKET_IN_FLOW_RATE;
+    cfg->packet_in_flow_burst = TELEX_PACKET_IN_FLOW_BURST;
+    cfg->packet_in_sample = TELEX_PACKET_IN_SAMPLE;
+    cfg->client_rate = TELEX_CLIENT_RATE;
+    cfg->client_burst = TELEX_CLIENT_BURST;
+    cfg->client_max_buffered = TELEX_CLIENT_MAX_BUFFERED;
+    cfg->ha.heartbeat_ms = HA_HEARTBEAT_MS;
+    cfg->ha.timeout_ms = HA_TIMEOUT_MS;
+    cfg->ha.snapshot_s = HA_SNAPSHOT_S;
+    cfg->journal_sync_ms = JOURNAL_SYNC_MS;
+}
+
+int config_switch_equal(const struct config_switch *a,
+                        const struct config_switch *b)
+{
+    return strcmp(a->ip, b->ip) == 0 && a->port == b->port &&
+           a->connect == b->connect;
+}
+
+int config_ha_equal(const struct config_ha *a, const struct config_ha *b)
+{
+    return a->role == b->role &&
+           strcmp(a->listen_ip, b->listen_ip) == 0 &&
+           a->listen_port == b->listen_port &&
+           strcmp(a->peer_ip, b->peer_ip) == 0 &&
+           a->peer_port == b->peer_port &&
+           a->heartbeat_ms == b->heartbeat_ms &&
+           a->timeout_ms == b->timeout_ms &&
+           a->snapshot_s == b->snapshot_s;
+}
+
+static int config_uint(const char *str, uint32_t min, uint32_t max,
+                       uint32_t *out)
+{
+    char *end;
+    unsigned long val;
+
+    errno = 0;
+    val = strtoul(str, &end, 0);
+    if (errno != 0 || *end != '\0' || end == str || val < min || val > max) {
+        return -1;
+    }
+    *out = val;
+    return 0;
+}
+
+static int config_ip(const char *str, char *out)
+{
+    struct in_addr addr;
+
+    if (inet_pton(AF_INET, str, &addr) != 1) {
+        return -1;
+    }
+    strcpy(out, str);
+    return 0;
+}
+
+/* a.b.c.d[/len] */
+static int config_net(const char *str, struct config_net *net)
+{
+    char buf[INET_ADDRSTRLEN + 3];
+    char *slash;
+    struct in_addr addr;
+    uint32_t len = 32;
+
+    if (strlen(str) >= sizeof(buf)) {
+        return -1;
+    }
+    strcpy(buf, str);
+
+    slash = strchr(buf, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        if (config_uint(slash + 1, 0, 32, &len)) {
+            return -1;
+        }
+    }
+    if (inet_pton(AF_INET, buf, &addr) != 1) {
+        return -1;
+    }
+    net->mask = len == 0 ? 0 : htonl(~0u << (32 - len));
+    net->addr = addr.s_addr & net->mask;
+    return 0;
+}
+
+/* switch <ip> <port> connect|listen [echo_ms]. Switches we connect to get
+ * every block unless a blocks line says otherwise; ones that connect to us
+ * are usually the same switch again, for its flow removed messages. */
+static int config_parse_switch(struct fox_config *cfg, char **argv, int argc)
+{
+    struct config_switch *sw;
+    uint32_t port, echo = 90*1000;
+
+    if (argc < 4 || argc > 5 || cfg->n_switches == CONFIG_MAX_SWITCHES) {
+        return -1;
+    }
+    sw = &cfg->switches[cfg->n_switches];
+    memset(sw, 0, sizeof(*sw));
+
+    if (config_ip(argv[1], sw->ip) ||
+        config_uint(argv[2], 1, UINT16_MAX, &port)) {
+        return -1;
+    }
+    sw->port = port;
+
+    if (strcmp(argv[3], "connect") == 0) {
+        sw->connect = 1;
+        if (argc == 5 && config_uint(argv[4], 1, UINT32_MAX, &echo)) {
+            return -1;
+        }
+        sw->echo_period_ms = echo;
+        sw->blocks = CONFIG_BLOCKS_ALL;
+    } else if (strcmp(argv[3], "listen") == 0 && argc == 4) {
+        sw->connect = 0;
+        sw->blocks = CONFIG_BLOCKS_NONE;
+    } else {
+        return -1;
+    }
+
+    cfg->n_switches++;
+    return 0;
+}
+
+/* blocks <ip> <port> all|none|<net>[/len]..., after the switch's line */
+static int config_parse_blocks(struct fox_config *cfg, char **argv, int argc)
+{
+    struct config_switch *sw = NULL;
+    char ip[INET_ADDRSTRLEN];
+    uint32_t i, port;
+
+    if (argc < 4 || argc > 3 + CONFIG_MAX_NETS ||
+        config_ip(argv[1], ip) ||
+        config_uint(argv[2], 1, UINT16_MAX, &port)) {
+        return -1;
+    }
+    for (i=0; i<cfg->n_switches && sw == NULL; i++) {
+        if (strcmp(cfg->switches[i].ip, ip) == 0 &&
+            cfg->switches[i].port == port) {
+            sw = &cfg->switches[i];
+        }
+    }
+    if (sw == NULL) {
+        return -1;
+    }
+
+    sw->n_nets = 0;
+    if (argc == 4 && strcmp(argv[3], "all") == 0) {
+        sw->blocks = CONFIG_BLOCKS_ALL;
+        return 0;
+    } else if (argc == 4 && strcmp(argv[3], "none") == 0) {
+        sw->blocks = CONFIG_BLOCKS_NONE;
+        return 0;
+    }
+
+    sw->blocks = CONFIG_BLOCKS_NETS;
+    for (i=3; i<(uint32_t)argc; i++) {
+        if (config_net(argv[i], &sw->nets[sw->n_nets++])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* listen tcp <ip> <port> | listen unix <path> | listen none */
+static int config_parse_listen(struct fox_config *cfg, char **argv, int argc)
+{
+    if (argc == 4 && strcmp(argv[1], "tcp") == 0) {
+        return config_ip(argv[2], cfg->listen_ip) ||
+               config_uint(argv[3], 1, UINT16_MAX, &cfg->listen_port);
+    } else if (argc == 3 && strcmp(argv[1], "unix") == 0) {
+        if (strlen(argv[2]) >= sizeof(cfg->unix_path)) {
+            return -1;
+        }
+        strcpy(cfg->unix_path, argv[2]);
+        return 0;
+    } else if (argc == 2 && strcmp(argv[1], "none") == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+/* ring <name> [slots] */
+static int config_parse_ring(struct fox_config *cfg, char **argv, int argc)
+{
+    if (argc < 2 || argc > 3 || strlen(argv[1]) >= sizeof(cfg->ring_name)) {
+        return -1;
+    }
+    strcpy(cfg->ring_name, argv[1]);
+
+    if (argc == 3 &&
+        (config_uint(argv[2], 2, 1 << 24, &cfg->ring_slots) ||
+         (cfg->ring_slots & (cfg->ring_slots - 1)) != 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* discovery <tick_ms> <probes_per_tick> <link_timeout_ms> */
+static int config_parse_discovery(struct fox_config *cfg, char **argv,
+                                  int argc)
+{
+    if (argc != 4) {
+        return -1;
+    }
+    return config_uint(argv[1], 1, 60000, &cfg->discovery_tick_ms) ||
+           config_uint(argv[2], 1, UINT16_MAX, &cfg->discovery_probes) ||
+           config_uint(argv[3], 1, UINT32_MAX, &cfg->discovery_timeout_ms);
+}
+
+/* block_action drop|punt|sample */
+static int config_parse_block_action(struct fox_config *cfg, char **argv,
+                                     int argc)
+{
+    if (argc != 2) {
+        return -1;
+    }
+    if (strcmp(argv[1], "drop") == 0) {
+        cfg->block_action = TELEX_MOD_BLOCK_DROP;
+    } else if (strcmp(argv[1], "punt") == 0) {
+        cfg->block_action = TELEX_MOD_BLOCK_PUNT;
+    } else if (strcmp(argv[1], "sample") == 0) {
+        cfg->block_action = TELEX_MOD_BLOCK_SAMPLE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* aggregate <threshold> [src_prefix_len dst_prefix_len] */
+static int config_parse_aggregate(struct fox_config *cfg, char **argv,
+                                  int argc)
+{
+    if (argc != 2 && argc != 4) {
+        return -1;
+    }
+    if (config_uint(argv[1], 2, UINT32_MAX, &cfg->agg_threshold)) {
+        return -1;
+    }
+    if (argc == 4) {
+        return config_uint(argv[2], 1, 32, &cfg->agg_src_prefix) ||
+               config_uint(argv[3], 1, 32, &cfg->agg_dst_prefix);
+    }
+    return 0;
+}
+
+/* throttle <kbps> <port>|normal [queue] */
+static int config_parse_throttle(struct fox_config *cfg, char **argv,
+                                 int argc)
+{
+    if (argc < 3 || argc > 4 ||
+        config_uint(argv[1], 1, UINT32_MAX / 8, &cfg->throttle_kbps)) {
+        return -1;
+    }
+
+    if (strcmp(argv[2], "normal") == 0) {
+        cfg->throttle_port = OFPP_NORMAL;
+    } else if (config_uint(argv[2], 1, OFPP_MAX - 1, &cfg->throttle_port)) {
+        return -1;
+    }
+
+    cfg->throttle_queue = 0;
+    if (argc == 4) {
+        return config_uint(argv[3], 0, UINT32_MAX - 1, &cfg->throttle_queue);
+    }
+    return 0;
+}
+
+/* ha primary|standby <listen_ip> <listen_port> <peer_ip> <peer_port> */
+static int config_parse_ha(struct fox_config *cfg, char **argv, int argc)
+{
+    if (argc != 6) {
+        return -1;
+    }
+    if (strcmp(argv[1], "primary") == 0) {
+        cfg->ha.role = CONFIG_HA_PRIMARY;
+    } else if (strcmp(argv[1], "standby") == 0) {
+        cfg->ha.role = CONFIG_HA_STANDBY;
+    } else {
+        return -1;
+    }
+    return config_ip(argv[2], cfg->ha.listen_ip) ||
+           config_uint(argv[3], 1, UINT16_MAX, &cfg->ha.listen_port) ||
+           config_ip(argv[4], cfg->ha.peer_ip) ||
+           config_uint(argv[5], 1, UINT16_MAX, &cfg->ha.peer_port);
+}
+
+/* journal <path> */
+static int config_parse_journal(struct fox_config *cfg, char **argv,
+                                int argc)
+{
+    if (argc != 2 || strlen(argv[1]) >= sizeof(cfg->journal_path)) {
+        return -1;
+    }
+    strcpy(cfg->journal_path, argv[1]);
+    return 0;
+}
+
+int config_load(struct fox_config *cfg, const char *path)
+{
+    char line[CONFIG_LINE_LEN];
+    int seen_switch = 0, seen_listen = 0;
+    int line_no = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        LogError("config", "Could not open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *argv[CONFIG_MAX_ARGS];
+        char *comment, *tok, *save;
+        int argc = 0, err = 0;
+
+        line_no++;
+
+        comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        for (tok = strtok_r(line, " \t\r\n", &save);
+             tok != NULL && argc < CONFIG_MAX_ARGS;
+             tok = strtok_r(NULL, " \t\r\n", &save)) {
+            argv[argc++] = tok;
+        }
+        if (argc == 0) {
+            continue;
+        }
+
+        if (strcmp(argv[0], "switch") == 0) {
+            if (!seen_switch) {
+                cfg->n_switches = 0;
+                seen_switch = 1;
+            }
+            err = config_parse_switch(cfg, argv, argc);
+        } else if (strcmp(argv[0], "blocks") == 0) {
+            err = config_parse_blocks(cfg, argv, argc);
+        } else if (strcmp(argv[0], "listen") == 0) {
+            if (!seen_listen) {
+                cfg->listen_ip[0] = '\0';
+                cfg->unix_path[0] = '\0';
+                seen_listen = 1;
+            }
+            err = config_parse_listen(cfg, argv, argc);
+        } else if (strcmp(argv[0], "ring") == 0) {
+            err = config_parse_ring(cfg, argv, argc);
+        } else if (strcmp(argv[0], "discovery") == 0) {
+            err = config_parse_discovery(cfg, argv, argc);
+        } else if (strcmp(argv[0], "aggregate") == 0) {
+            err = config_parse_aggregate(cfg, argv, argc);
+        } else if (strcmp(argv[0], "block_action") == 0) {
+            err = config_parse_block_action(cfg, argv, argc);
+        } else if (strcmp(argv[0], "throttle") == 0) {
+            err = config_parse_throttle(cfg, argv, argc);
+        } else if (strcmp(argv[0], "ha") == 0) {
+            err = config_parse_ha(cfg, argv, argc);
+        } else if (strcmp(argv[0], "journal") == 0) {
+            err = config_parse_journal(cfg, argv, argc);
+        } else {
+            const struct config_option *opt;
+
+            for (opt = config_options; opt->name != NULL; opt++) {
+                if (strcmp(argv[0], opt->name) == 0) {
+                    break;
+                }
+            }
+            err = opt->name == NULL || argc != 2 ||
+                  config_uint(argv[1], opt->min, opt->max,
+                              (uint32_t *)((char *)cfg + opt->offset));
+        }
+
+        if (err) {
+            LogError("config", "%s:%d: bad '%s' line", path, line_no,
+                     argv[0]);
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
@@ -0,0 +1,122 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define CONFIG_MAX_SWITCHES     10
+#define CONFIG_PATH_LEN         108     /* sizeof(sun_path) */
+#define CONFIG_NAME_LEN         64
+#define CONFIG_MAX_NETS         8
+
+/* Which blocks a switch gets: every one, none (e.g. a second connection to
+ * a switch that already has them), or those with an address in nets */
+#define CONFIG_BLOCKS_NONE      0
+#define CONFIG_BLOCKS_ALL       1
+#define CONFIG_BLOCKS_NETS      2
+
+/* High availability (see ha.h): which instance is primary when both start
+ * together */
+#define CONFIG_HA_OFF           0
+#define CONFIG_HA_PRIMARY       1
+#define CONFIG_HA_STANDBY       2
+
+/* Network byte order; addr has no bits outside mask */
+struct config_net {
+    uint32_t    addr;
+    uint32_t    mask;
+};
+
+struct config_switch {
+    char        ip[INET_ADDRSTRLEN];
+    uint16_t    port;
+    uint8_t     connect;        /* 1: we connect to it, 0: it connects to us */
+    uint32_t    echo_period_ms;
+
+    uint8_t     blocks;         /* CONFIG_BLOCKS_* */
+    uint8_t     n_nets;
+    struct config_net nets[CONFIG_MAX_NETS];
+};
+
+struct config_ha {
+    uint32_t    role;                   /* CONFIG_HA_* */
+    char        listen_ip[INET_ADDRSTRLEN];
+    uint32_t    listen_port;
+    char        peer_ip[INET_ADDRSTRLEN];
+    uint32_t    peer_port;
+    uint32_t    heartbeat_ms;
+    uint32_t    timeout_ms;
+    uint32_t    snapshot_s;             /* 0: only when the standby joins */
+};
+
+/* Everything telex used to hardcode, parsed once from the config file.
+ * An empty string turns the corresponding listener off. */
+struct fox_config {
+    uint32_t                n_switches;
+    struct config_switch    switches[CONFIG_MAX_SWITCHES];
+
+    char        listen_ip[INET_ADDRSTRLEN];
+    uint32_t    listen_port;
+    char        unix_path[CONFIG_PATH_LEN];
+    char        ring_name[CONFIG_NAME_LEN];
+    uint32_t    ring_slots;
+    uint32_t    ring_poll_ms;
+
+    uint32_t    idle_timeout;
+    uint32_t    block_action;           /* TELEX_MOD_BLOCK_DROP/PUNT/SAMPLE */
+    uint32_t    punt_max_len;
+    uint32_t    punt_sample_pps;
+    uint32_t    notify_window_ms;
+    uint32_t    notify_batch;
+    uint32_t    sched_quantum;
+    uint32_t    sched_budget;
+    uint32_t    sched_retry_ms;
+    uint32_t    switch_high_water;
+    uint32_t    flow_mod_rate;          /* per switch; 0 is no limit */
+    uint32_t    flow_mod_burst;
+    uint32_t    packet_in_rate;         /* all switches; 0 is no limit */
+    uint32_t    packet_in_burst;
+    uint32_t    packet_in_flow_rate;    /* each flow; 0 is no limit */
+    uint32_t    packet_in_flow_burst;
+    uint32_t    packet_in_sample;       /* 0: drop all of a flow's excess */
+    uint32_t    client_rate;
+    uint32_t    client_burst;
+    uint32_t    client_max_buffered;
+    uint32_t    ack_requests;           /* send clients TELEX_MSG_APPLIED */
+
+    uint32_t    flow_capacity;          /* 0: learn it from the switch */
+    uint32_t    evict_high_pct;
+    uint32_t    evict_low_pct;
+
+    uint32_t    agg_threshold;          /* 0 turns aggregation off */
+    uint32_t    agg_src_prefix;         /* 32 turns a kind off */
+    uint32_t    agg_dst_prefix;
+
+    uint32_t    throttle_kbps;          /* 0 turns throttling off */
+    uint32_t    throttle_port;          /* OFPP_* (1.0 numbering) */
+    uint32_t    throttle_queue;         /* 1.0 switches only */
+
+    struct config_ha ha;
+
+    char        journal_path[CONFIG_PATH_LEN];  /* empty: no journal */
+    uint32_t    journal_sync_ms;
+
+    uint32_t    discovery_tick_ms;      /* 0 turns discovery off */
+    uint32_t    discovery_probes;
+    uint32_t    discovery_timeout_ms;
+};
+
+void config_defaults(struct fox_config *cfg);
+
+/* Parse path on top of cfg (normally the defaults). A switch or listen
+ * line replaces the default switches or listeners rather than adding to
+ * them. Returns 0, or -1 with cfg in an unspecified state. */
+int config_load(struct fox_config *cfg, const char *path);
+
+int config_ha_equal(const struct config_ha *a, const struct config_ha *b);
+
+/* Same connection; the blocks policy may differ */
+int config_switch_equal(const struct config_switch *a,
+                        const struct config_switch *b);
+
+#endif
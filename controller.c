@@ -1,15 +1,86 @@
 #include <event2/event.h>
 #include <event2/bufferevent.h>
+#include <event2/buffer.h>
 #include <event2/listener.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <stdio.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "fox.h"
 #include "controller.h"
 #include "logger.h"
 #include "openflow.h"
+#include "openflow13.h"
+#include "of13.h"
+#include "datapath.h"
+#include "admit.h"
 
+static void controller_send_reset(struct fox_state *state);
+static int controller_send_init(struct fox_state *state);
+static void controller_write_cb(struct bufferevent *bev, void *ctx);
+
+void cleanup_state(struct fox_state *state)
+{
+    if (state->controller_bev) {
+        bufferevent_free(state->controller_bev);
+        state->controller_bev = NULL;
+    }
+    free(state->ports);
+    state->ports = NULL;
+    state->n_ports = 0;
+    free(state->pending_features);
+    state->pending_features = NULL;
+}
+
+/*
+* Tear down a connection (or listener) and everything hanging off it.
+*/
+void controller_free(struct fox_state *state)
+{
+    int i;
+
+    if (state->echo_timer) {
+        event_free(state->echo_timer);
+    }
+    if (state->echo_timeout) {
+        event_free(state->echo_timeout);
+    }
+    if (state->listener) {
+        evconnlistener_free(state->listener);
+    }
+    if (state->send_ev) {
+        event_free(state->send_ev);
+    }
+    for (i=0; i<CONTROLLER_CLASSES; i++) {
+        if (state->send_queue[i]) {
+            evbuffer_free(state->send_queue[i]);
+        }
+    }
+    datapath_detach(state);
+    cleanup_state(state);
+
+    for (i=0; i<256; i++) {
+        while (state->msg_handler[i] != NULL) {
+            struct handler_list *next = state->msg_handler[i]->next;
+            free(state->msg_handler[i]);
+            state->msg_handler[i] = next;
+        }
+        while (state->batch_handler[i] != NULL) {
+            struct batch_handler_list *next = state->batch_handler[i]->next;
+            free(state->batch_handler[i]);
+            state->batch_handler[i] = next;
+        }
+    }
+    free(state->batch_buf);
+
+    free(state->name);
+    free(state);
+}
 
 /* only supports connecting to a controller.
 * TODO: support listen and SSL
@@ -27,8 +98,19 @@ struct fox_state *controller_new(struct event_base *base, char *ip,
     }
     memset(state, 0, sizeof(*state));
 
-    state->name = ip;
+    state->name = strdup(ip);
     state->base = base;
+    state->active = connect;
+    state->port = port;
+    if (state->name == NULL) {
+        LogError("controller", "Could not malloc name");
+        free(state);
+        return NULL;
+    }
+    if (controller_send_init(state)) {
+        controller_free(state);
+        return NULL;
+    }
 
 
     if (connect) {
@@ -37,11 +119,13 @@ struct fox_state *controller_new(struct event_base *base, char *ip,
         controller_init_echo(state);
 
         if (controller_connect(state, ip, port)) {
+            controller_free(state);
             return NULL;
         }
     } else {
         state->echo_period_ms = 0;
         if (controller_listen(state, ip, port)) {
+            controller_free(state);
             return NULL;
         }
     }
@@ -49,11 +133,19 @@ struct fox_state *controller_new(struct event_base *base, char *ip,
     return state;
 }
 
+/* Late but not given up on: the next echo goes out a period from now,
+ * and until one is answered the channel is not healthy */
 void controller_echo_timeout(evutil_socket_t fd, short what, void *arg)
 {
     struct fox_state *state = arg;
+    struct timeval tv;
 
     LogError(state->name, "Timout on echo request");
+    state->echo_late = 1;
+
+    tv.tv_sec = state->echo_period_ms / 1000;
+    tv.tv_usec = (state->echo_period_ms % 1000) * 1000;
+    evtimer_add(state->echo_timer, &tv);
 }
 
 
@@ -62,8 +154,11 @@ void controller_echo_cb(evutil_socket_t fd, short what, void *arg)
     struct fox_state *state = arg;
     struct timeval tv = {1, 0};
 
-    /* Check if we are connected */
+    /* Check if we are connected, and try again if we were */
     if (state->controller_bev == NULL) {
+        if (state->active && state->port != 0) {
+            controller_connect(state, state->name, state->port);
+        }
         evtimer_add(state->echo_timer, &tv);
         return;
     }
@@ -90,6 +185,36 @@ void controller_init_echo(struct fox_state *state)
     evtimer_add(state->echo_timer, &tv);
 }
 
+int controller_healthy(struct fox_state *state)
+{
+    return state->controller_bev != NULL && state->version != 0 &&
+           !state->echo_late;
+}
+
+/*
+* The connection is gone: stop writing into it. The switch connects back
+* to a passive channel by itself; an active one is reconnected from its
+* echo timer.
+*/
+static void controller_disconnected(struct fox_state *state)
+{
+    struct timeval tv = {1, 0};
+
+    if (state->controller_bev != NULL) {
+        bufferevent_free(state->controller_bev);
+        state->controller_bev = NULL;
+    }
+    controller_send_reset(state);
+    state->version = 0;
+    state->echo_late = 0;
+
+    if (state->echo_timer != NULL) {
+        evtimer_del(state->echo_timeout);
+        evtimer_del(state->echo_timer);
+        evtimer_add(state->echo_timer, &tv);
+    }
+}
+
 void controller_error_cb(struct bufferevent *bev, short events, void *ctx)
 {
     struct fox_state *state = ctx;
@@ -104,6 +229,9 @@ void controller_error_cb(struct bufferevent *bev, short events, void *ctx)
         LogError(state->name, "(%d) Could not getsockname for fd %d",
                  errno, fd);
         perror("   ");
+        if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+            controller_disconnected(state);
+        }
         return;
     }
 
@@ -117,6 +245,22 @@ void controller_error_cb(struct bufferevent *bev, short events, void *ctx)
     if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
         LogDebug(state->name, "%s:%d disconnected", src_ip,
                 ntohs(sin.sin_port));
+        controller_disconnected(state);
+    }
+}
+
+/*
+* Flow mods usually go out in bursts closed by a small barrier; with Nagle
+* the barrier sits behind the switch's delayed ACK for tens of ms.
+*/
+static void controller_set_nodelay(struct fox_state *state,
+                                   evutil_socket_t fd)
+{
+    int one = 1;
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0) {
+        LogWarn(state->name, "Could not set TCP_NODELAY: %s",
+                strerror(errno));
     }
 }
 
@@ -126,6 +270,14 @@ void controller_accept_cb(struct evconnlistener *listener,
 {
     struct fox_state *state = ctx;
 
+    /* The switch coming back replaces whatever it left behind */
+    if (state->controller_bev != NULL) {
+        bufferevent_free(state->controller_bev);
+        controller_send_reset(state);
+        state->version = 0;
+    }
+
+    controller_set_nodelay(state, fd);
     state->controller_bev = bufferevent_socket_new(
                 state->base, fd, BEV_OPT_CLOSE_ON_FREE);
     struct sockaddr_in *sin = (struct sockaddr_in *)address;
@@ -134,8 +286,10 @@ void controller_accept_cb(struct evconnlistener *listener,
     LogDebug(state->name, "%s:%d connected",
              src_ip, ntohs(sin->sin_port));
 
-    bufferevent_setcb(state->controller_bev, controller_read_cb, NULL,
-                      controller_error_cb, state);
+    bufferevent_setcb(state->controller_bev, controller_read_cb,
+                      controller_write_cb, controller_error_cb, state);
+    bufferevent_setwatermark(state->controller_bev, EV_WRITE,
+                             CONTROLLER_SEND_LOW_WATER, 0);
     bufferevent_enable(state->controller_bev, EV_READ);
 
     controller_send_hello(state);
@@ -166,6 +320,7 @@ int controller_listen(struct fox_state *state, char *listen_ip,
         perror("bind error");
         return -1;
     }
+    state->listener = listener;
 
     //evconnlistener_set_error_cb(listener, controller_accept_error_cb);
 
@@ -192,8 +347,10 @@ int controller_connect(struct fox_state *state, char *switch_ip,
     sin.sin_addr.s_addr = inet_addr(switch_ip);
     sin.sin_port = htons(switch_port);
 
-    bufferevent_setcb(state->controller_bev, controller_read_cb, NULL,
-                      controller_connect_cb, state);
+    bufferevent_setcb(state->controller_bev, controller_read_cb,
+                      controller_write_cb, controller_connect_cb, state);
+    bufferevent_setwatermark(state->controller_bev, EV_WRITE,
+                             CONTROLLER_SEND_LOW_WATER, 0);
 
     if (bufferevent_socket_connect(state->controller_bev,
         (struct sockaddr *)&sin, sizeof(sin)) < 0) {
@@ -217,12 +374,18 @@ void controller_connect_cb(struct bufferevent *bev, short events, void *user_dat
     if (events & BEV_EVENT_CONNECTED) {
         LogInfo(state->name, "Connected to controller");
 
+        controller_set_nodelay(state, bufferevent_getfd(bev));
+
         bufferevent_enable(state->controller_bev, EV_READ);
 
         controller_send_hello(state);
 
     } else if (events & BEV_EVENT_ERROR) {
         LogError(state->name, "Error connecting to controller");
+        controller_disconnected(state);
+    } else if (events & BEV_EVENT_EOF) {
+        LogInfo(state->name, "Disconnected from controller");
+        controller_disconnected(state);
     } else {
         LogError(state->name, "Unknown event %d", events);
     }
@@ -233,13 +396,291 @@ void controller_connect_cb(struct bufferevent *bev, short events, void *user_dat
     }
 }
 
+/*
+* What a switch may send us, and how big each message can be, per
+* negotiated version. Checking (len - min) > span as unsigned covers both
+* bounds with one compare, and MSG_NEVER (min past any 16-bit length)
+* rejects controller-to-switch types outright. Until the HELLO exchange
+* picks a version, state->version is 0 and every row there is MSG_NEVER,
+* so the switch's HELLO lands in controller_bad_msg, which negotiates.
+*/
+struct controller_msg_len {
+    uint32_t    min;
+    uint32_t    span;       /* max - min */
+};
+
+#define MSG_LEN(min, max)   { (min), (max) - (min) }
+#define MSG_EXACT(len)      { (len), 0 }
+#define MSG_NEVER           { 1 << 16, 0 }
+
+static const struct controller_msg_len controller_msg_len[OFP13_VERSION + 1][256] = {
+    [0 ... OFP13_VERSION][0 ... 255] = MSG_NEVER,
+
+    [OFP_VERSION] = {
+    [0 ... 255]                     = MSG_NEVER,
+    [OFPT_HELLO]                    = MSG_LEN(sizeof(struct ofp_header),
+                                              UINT16_MAX),
+    [OFPT_ERROR]                    = MSG_LEN(sizeof(struct ofp_error_msg),
+                                              UINT16_MAX),
+    [OFPT_ECHO_REQUEST]             = MSG_LEN(sizeof(struct ofp_header),
+                                              UINT16_MAX),
+    [OFPT_ECHO_REPLY]               = MSG_LEN(sizeof(struct ofp_header),
+                                              UINT16_MAX),
+    [OFPT_VENDOR]                   = MSG_LEN(sizeof(struct ofp_vendor_header),
+                                              UINT16_MAX),
+    [OFPT_FEATURES_REPLY]           = MSG_LEN(sizeof(struct ofp_switch_features),
+                                              UINT16_MAX),
+    [OFPT_GET_CONFIG_REPLY]         = MSG_EXACT(sizeof(struct ofp_switch_config)),
+    [OFPT_PACKET_IN]                = MSG_LEN(offsetof(struct ofp_packet_in, data),
+                                              UINT16_MAX),
+    [OFPT_FLOW_REMOVED]             = MSG_EXACT(sizeof(struct ofp_flow_removed)),
+    [OFPT_PORT_STATUS]              = MSG_EXACT(sizeof(struct ofp_port_status)),
+    [OFPT_STATS_REPLY]              = MSG_LEN(sizeof(struct ofp_stats_reply),
+                                              UINT16_MAX),
+    [OFPT_BARRIER_REPLY]            = MSG_EXACT(sizeof(struct ofp_header)),
+    [OFPT_QUEUE_GET_CONFIG_REPLY]   = MSG_LEN(
+                                sizeof(struct ofp_queue_get_config_reply),
+                                UINT16_MAX),
+    },
+
+    [OFP13_VERSION] = {
+    [0 ... 255]                     = MSG_NEVER,
+    [OFPT13_HELLO]                  = MSG_LEN(sizeof(struct ofp_header),
+                                              UINT16_MAX),
+    [OFPT13_ERROR]                  = MSG_LEN(sizeof(struct ofp_error_msg),
+                                              UINT16_MAX),
+    [OFPT13_ECHO_REQUEST]           = MSG_LEN(sizeof(struct ofp_header),
+                                              UINT16_MAX),
+    [OFPT13_ECHO_REPLY]             = MSG_LEN(sizeof(struct ofp_header),
+                                              UINT16_MAX),
+    [OFPT13_EXPERIMENTER]           = MSG_LEN(
+                                sizeof(struct ofp13_experimenter_header),
+                                UINT16_MAX),
+    [OFPT13_FEATURES_REPLY]         = MSG_EXACT(
+                                sizeof(struct ofp13_switch_features)),
+    [OFPT13_GET_CONFIG_REPLY]       = MSG_EXACT(sizeof(struct ofp_switch_config)),
+    /* The match is at least its own 8 bytes, then 2 bytes of pad */
+    [OFPT13_PACKET_IN]              = MSG_LEN(sizeof(struct ofp13_packet_in) + 2,
+                                              UINT16_MAX),
+    [OFPT13_FLOW_REMOVED]           = MSG_LEN(sizeof(struct ofp13_flow_removed),
+                                              UINT16_MAX),
+    [OFPT13_PORT_STATUS]            = MSG_EXACT(sizeof(struct ofp13_port_status)),
+    [OFPT13_MULTIPART_REPLY]        = MSG_LEN(
+                                sizeof(struct ofp13_multipart_reply),
+                                UINT16_MAX),
+    [OFPT13_BARRIER_REPLY]          = MSG_EXACT(sizeof(struct ofp_header)),
+    [OFPT13_QUEUE_GET_CONFIG_REPLY] = MSG_LEN(
+                                sizeof(struct ofp13_queue_get_config_reply),
+                                UINT16_MAX),
+    [OFPT13_ROLE_REPLY]             = MSG_EXACT(sizeof(struct ofp13_role_request)),
+    [OFPT13_GET_ASYNC_REPLY]        = MSG_EXACT(sizeof(struct ofp13_async_config)),
+    },
+};
+
+/*
+* Pick the version to speak from the switch's HELLO: the highest one in
+* both our bitmaps if it sent one, otherwise the lower of the two header
+* versions. Returns 0 if there is none we can speak.
+*/
+static uint8_t controller_negotiate(struct ofp_header *hello)
+{
+    size_t len = ntohs(hello->length);
+    size_t off = sizeof(*hello);
+    uint8_t version;
+
+    while (off + sizeof(struct ofp_hello_elem_header) <= len) {
+        struct ofp_hello_elem_header *elem =
+            (struct ofp_hello_elem_header *)((uint8_t *)hello + off);
+        size_t elem_len = ntohs(elem->length);
+
+        if (elem_len < sizeof(*elem) || elem_len > len - off) {
+            break;
+        }
+        if (ntohs(elem->type) == OFPHET_VERSIONBITMAP &&
+            elem_len >= sizeof(*elem) + sizeof(uint32_t)) {
+            uint32_t bitmap;
+
+            memcpy(&bitmap, &elem[1], sizeof(bitmap));
+            bitmap = ntohl(bitmap) & CONTROLLER_VERSIONS;
+            return bitmap ? 31 - __builtin_clz(bitmap) : 0;
+        }
+        off += (elem_len + 7) / 8 * 8;
+    }
+
+    version = hello->version < OFP13_VERSION ? hello->version : OFP13_VERSION;
+    return (CONTROLLER_VERSIONS >> version) & 1 ? version : 0;
+}
+
+/*
+* The switch's HELLO, before we have agreed on a version. Returns 1 if we
+* need more input first.
+*/
+static int controller_handle_hello(struct fox_state *state,
+                                   struct evbuffer *buf,
+                                   struct ofp_header *ofhdr)
+{
+    size_t len = ntohs(ofhdr->length);
+    struct ofp_header *hello;
+
+    if (evbuffer_get_length(buf) < len) {
+        return 1;
+    }
+
+    hello = malloc(len);
+    if (hello == NULL) {
+        LogError(state->name, "Error: could not malloc %d bytes", len);
+        return 1;
+    }
+    evbuffer_remove(buf, hello, len);
+
+    state->version = controller_negotiate(hello);
+    state->resyncing = 0;
+    if (state->version == 0) {
+        struct ofp_error_msg err;
+
+        LogError(state->name, "No OpenFlow version in common with the "
+                 "switch (it sent version %d)", hello->version);
+        memset(&err, 0, sizeof(err));
+        err.header.type = OFPT_ERROR;
+        err.type = htons(OFPET_HELLO_FAILED);
+        err.code = htons(OFPHFC_INCOMPATIBLE);
+        controller_send_raw(state, &err, sizeof(err));
+    } else {
+        LogInfo(state->name, "Speaking OpenFlow version %d", state->version);
+        hello->version = state->version;
+        controller_handle_msg(state, hello, hello);
+    }
+
+    free(hello);
+    return 0;
+}
+
+/*
+* Deal with a message that failed the length check. If the version is
+* right and the length is at least a header, the framing still holds and
+* we skip just that message; otherwise we have lost our place in the
+* stream and step forward a byte at a time until a header checks out.
+* Returns 1 if we need more input first.
+*/
+static int controller_bad_msg(struct fox_state *state, struct evbuffer *buf,
+                              struct ofp_header *ofhdr)
+{
+    size_t len = ntohs(ofhdr->length);
+
+    if (state->version == 0 && ofhdr->type == OFPT_HELLO &&
+        len >= sizeof(*ofhdr)) {
+        return controller_handle_hello(state, buf, ofhdr);
+    }
+
+    if (!state->resyncing) {
+        state->bad_msgs++;
+        /* Log the 1st, 2nd, 4th, 8th... so a broken switch can't flood us */
+        if ((state->bad_msgs & (state->bad_msgs - 1)) == 0) {
+            LogWarn(state->name, "Bad message: version %d type %d length %d "
+                    "(%llu so far)", ofhdr->version, ofhdr->type, len,
+                    (unsigned long long)state->bad_msgs);
+        }
+    }
+
+    if (ofhdr->version == state->version && len >= sizeof(*ofhdr)) {
+        if (evbuffer_get_length(buf) < len) {
+            return 1;
+        }
+        evbuffer_drain(buf, len);
+        return 0;
+    }
+
+    state->resyncing = 1;
+    state->resync_bytes++;
+    evbuffer_drain(buf, 1);
+    return 0;
+}
+
+/*
+* Messages of a type with batch handlers are kept in batch_buf and handed
+* over together once a message of another type comes in, the batch is
+* full, or the read is done, so they still reach the apps in order.
+*/
+static void controller_batch_flush(struct fox_state *state)
+{
+    void *payloads[CONTROLLER_BATCH_MAX];
+    struct batch_handler_list *handler, *next;
+    uint32_t i;
+
+    if (state->batch_count == 0) {
+        return;
+    }
+    for (i=0; i<state->batch_count; i++) {
+        payloads[i] = state->batch_buf + state->batch_off[i];
+    }
+
+    handler = state->batch_handler[state->batch_type];
+    while (handler) {
+        next = handler->next;
+        handler->func(state, payloads, state->batch_count);
+        handler = next;
+    }
+    state->batch_count = 0;
+    state->batch_len = 0;
+}
+
+/* Where the next message of type goes in batch_buf */
+static void *controller_batch_reserve(struct fox_state *state, uint8_t type,
+                                      size_t len)
+{
+    size_t size = state->batch_size ? state->batch_size :
+                  CONTROLLER_BATCH_BYTES;
+    char *p;
+
+    if (state->batch_count > 0 && type != state->batch_type) {
+        controller_batch_flush(state);
+    }
+    if (state->batch_len + len > state->batch_size) {
+        while (size < state->batch_len + len) {
+            size *= 2;
+        }
+        p = realloc(state->batch_buf, size);
+        if (p == NULL) {
+            LogError(state->name, "Error: could not realloc %d bytes", size);
+            return NULL;
+        }
+        state->batch_buf = p;
+        state->batch_size = size;
+    }
+    return state->batch_buf + state->batch_len;
+}
+
+/* Payload may already be where controller_batch_reserve said */
+static void controller_batch_add(struct fox_state *state, uint8_t type,
+                                 void *payload, size_t len)
+{
+    char *p = controller_batch_reserve(state, type, len);
+
+    if (p == NULL) {
+        return;
+    }
+    if (p != payload) {
+        memcpy(p, payload, len);
+    }
+    state->batch_type = type;
+    state->batch_off[state->batch_count++] = state->batch_len;
+    state->batch_len += len;
+
+    if (state->batch_count == CONTROLLER_BATCH_MAX ||
+        state->batch_len >= CONTROLLER_BATCH_BYTES) {
+        controller_batch_flush(state);
+    }
+}
+
 void controller_read_cb(struct bufferevent *bev, void *user_data)
 {
     struct fox_state *state = user_data;
     struct evbuffer *buf;
     size_t buf_len;
     struct ofp_header ofhdr;
+    const struct controller_msg_len *limit;
     char *payload = NULL;
+    int batched;
 
     assert(state->controller_bev == bev);
 
@@ -252,41 +693,89 @@ void controller_read_cb(struct bufferevent *bev, void *user_data)
 
         /* Must have at least one header's worth before we'll read */
         if (buf_len < sizeof(ofhdr)) {
-            return;
+            break;
         }
 
         evbuffer_copyout(buf, &ofhdr, sizeof(ofhdr));
 
         LogTrace(state->name, "Header tells us we want %d bytes", ntohs(ofhdr.length));
+
+        /* One branch for both the version and the per-type length */
+        limit = &controller_msg_len[state->version][ofhdr.type];
+        if ((ofhdr.version ^ state->version) |
+            (ntohs(ofhdr.length) - limit->min > limit->span)) {
+            if (controller_bad_msg(state, buf, &ofhdr)) {
+                break;
+            }
+            continue;
+        }
+        state->resyncing = 0;
+
         /* Check if we've received the whole message */
         if (buf_len < ntohs(ofhdr.length)) {
-            return;
+            break;
         }
 
         LogTrace(state->name, "Received message type %d", ofhdr.type);
 
-        payload = malloc(ntohs(ofhdr.length));
+        /* A packet-in nothing listens for, or one over its budget, is
+         * dropped before it costs a copy */
+        if (ofhdr.type == OFPT_PACKET_IN &&
+            ((state->msg_handler[OFPT_PACKET_IN] == NULL &&
+              state->batch_handler[OFPT_PACKET_IN] == NULL) ||
+             (state->admit != NULL &&
+              !admit_packet_in(state->admit, state, buf,
+                               ntohs(ofhdr.length))))) {
+            evbuffer_drain(buf, ntohs(ofhdr.length));
+            continue;
+        }
+
+        /* 1.0 messages for batch handlers are read straight into the
+         * batch; 1.3 ones are copied there once translated */
+        batched = state->version != OFP13_VERSION &&
+                  state->batch_handler[ofhdr.type] != NULL;
+        if (batched) {
+            payload = controller_batch_reserve(state, ofhdr.type,
+                                               ntohs(ofhdr.length));
+        } else {
+            payload = malloc(ntohs(ofhdr.length));
+        }
         if (payload == NULL) {
             LogError(state->name, "Error: could not malloc %d bytes",
                      ntohs(ofhdr.length));
-            return;
+            break;
         }
 
         evbuffer_remove(buf, payload, ntohs(ofhdr.length));
 
-        controller_handle_msg(state, &ofhdr, payload);
+        if (state->version == OFP13_VERSION) {
+            of13_handle_msg(state, &ofhdr, payload);
+        } else {
+            controller_handle_msg(state, &ofhdr, payload);
+        }
 
-        free(payload);
+        if (!batched) {
+            free(payload);
+        }
     }
+
+    controller_batch_flush(state);
 }
 
 void controller_handle_msg(struct fox_state *state, struct ofp_header *ofhdr,
                            void *payload)
 {
+    if (state->batch_count > 0 && ofhdr->type != state->batch_type) {
+        controller_batch_flush(state);
+    }
+
     switch (ofhdr->type) {
     case OFPT_HELLO:
         LogDebug(state->name, "Received hello message");
-        controller_send_echo_request(state);
+        /* Passive channels leave keepalives to the active one */
+        if (state->active) {
+            controller_send_echo_request(state);
+        }
         controller_send_features_request(state);
         break;
     case OFPT_ECHO_REQUEST:
@@ -306,10 +795,20 @@ void controller_handle_msg(struct fox_state *state, struct ofp_header *ofhdr,
         controller_handle_error_msg(state, payload);
         break; 
     default:
-        LogWarn(state->name, "Unknown/unimplemented type %d", ofhdr->type);
+        if (state->msg_handler[ofhdr->type] == NULL &&
+            state->batch_handler[ofhdr->type] == NULL) {
+            LogWarn(state->name, "Unknown/unimplemented type %d",
+                    ofhdr->type);
+        }
         break;
     }
 
+    if (datapath_duplicate(state, payload)) {
+        LogTrace(state->name, "Type %d already seen on another channel",
+                 ofhdr->type);
+        return;
+    }
+
     /* Issue user callback if they want it */
     if (state->msg_handler[ofhdr->type] != NULL) {
         struct handler_list *handler = state->msg_handler[ofhdr->type];
@@ -326,6 +825,11 @@ void controller_handle_msg(struct fox_state *state, struct ofp_header *ofhdr,
             handler = next_handler;
         }
     } 
+
+    if (state->batch_handler[ofhdr->type] != NULL) {
+        controller_batch_add(state, ofhdr->type, payload,
+                             ntohs(ofhdr->length));
+    }
 }
 
 void controller_handle_error_msg(struct fox_state *state,
@@ -357,9 +861,23 @@ void controller_handle_features(struct fox_state *state,
 
     LogTrace(state->name, "header type: %d", features->header.type);
 
-    assert(features->header.type == OFPT_FEATURES_REPLY);
+    /* A bad port count from the switch is its problem, not a reason to
+     * bring the controller down */
+    num_ports = ntohs(features->header.length);
+    if (num_ports < sizeof(*features) ||
+        (num_ports - sizeof(*features)) % sizeof(struct ofp_phy_port) != 0) {
+        LogError(state->name, "Malformed features reply (%d bytes)",
+                 num_ports);
+        return;
+    }
+    num_ports = (num_ports - sizeof(*features)) / sizeof(struct ofp_phy_port);
+
+    state->datapath_id = be64toh(features->datapath_id);
+    state->n_tables = features->n_tables;
+    datapath_attach(state);
 
-    LogInfo(state->name, "%016x Features:", features->datapath_id);
+    LogInfo(state->name, "%016llx Features:",
+            (unsigned long long)state->datapath_id);
     LogInfo(state->name, "  max buffer size: %d pkts",
             ntohl(features->n_buffers));
     LogInfo(state->name, "  tables         : %d",
@@ -369,16 +887,24 @@ void controller_handle_features(struct fox_state *state,
     LogInfo(state->name, "  actions        : %08x", 
             ntohl(features->actions));
     
-    num_ports = ntohs(features->header.length) - sizeof(*features);
-    assert((num_ports % sizeof(struct ofp_phy_port)) == 0);
-    num_ports /= sizeof(struct ofp_phy_port);
- 
     for (i=0; i<num_ports; i++) {
         struct ofp_phy_port *port = &features->ports[i];
         int speed = get_port_speed(ntohl(port->curr));
         LogInfo(state->name, "  Port %s: %d mbps",
                 port->name, speed);
     }
+
+    /* Keep a copy of the port list for apps (e.g. discovery) */
+    free(state->ports);
+    state->n_ports = 0;
+    state->ports = malloc(num_ports * sizeof(struct ofp_phy_port));
+    if (state->ports == NULL && num_ports > 0) {
+        LogError(state->name, "Could not malloc %d ports", num_ports);
+        return;
+    }
+    memcpy(state->ports, features->ports,
+           num_ports * sizeof(struct ofp_phy_port));
+    state->n_ports = num_ports;
 }
 
 /* TODO: make this a list
@@ -432,31 +958,389 @@ void controller_unregister_handler(struct fox_state *state, uint8_t type,
             free(tmp);
             return;
         }
+        handler = handler->next;
     }
     LogWarn(state->name, "Tried to remove %p from handler[%d]; not found",
             func, type);
 }
 
-int controller_send_hdr(struct fox_state *state, void *payload, size_t len)
+void controller_register_batch_handler(struct fox_state *state, uint8_t type,
+                                      void (*func)(struct fox_state *state,
+                                                   void **payloads,
+                                                   size_t n))
+{
+    struct batch_handler_list **last = &state->batch_handler[type];
+    struct batch_handler_list *new_handler;
+
+    new_handler = malloc(sizeof(*new_handler));
+    if (new_handler == NULL) {
+        LogError(state->name, "Could not malloc new batch handler");
+        return;
+    }
+    new_handler->next = NULL;
+    new_handler->func = func;
+
+    while (*last != NULL) {
+        last = &(*last)->next;
+    }
+    *last = new_handler;
+}
+
+void controller_unregister_batch_handler(struct fox_state *state,
+                                        uint8_t type,
+                                        void (*func)(struct fox_state *state,
+                                                     void **payloads,
+                                                     size_t n))
+{
+    struct batch_handler_list **handler = &state->batch_handler[type];
+    struct batch_handler_list *tmp;
+
+    while (*handler != NULL) {
+        if ((*handler)->func == func) {
+            tmp = *handler;
+            *handler = tmp->next;
+            free(tmp);
+            return;
+        }
+        handler = &(*handler)->next;
+    }
+    LogWarn(state->name, "Tried to remove %p from batch_handler[%d]; "
+            "not found", func, type);
+}
+
+/*
+* Outgoing queues (see controller_send_class). A barrier is queued behind
+* a fence: how many messages had gone into each class before it. It may
+* go once that many have come out of each.
+*/
+struct controller_fence {
+    uint64_t    after[CONTROLLER_CLASSES];
+};
+
+static uint64_t controller_now_us(struct fox_state *state)
+{
+    struct timeval tv;
+
+    event_base_gettimeofday_cached(state->base, &tv);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int controller_send_init(struct fox_state *state)
+{
+    int i;
+
+    for (i=CONTROLLER_CLASS_BARRIER; i<CONTROLLER_CLASSES; i++) {
+        state->send_queue[i] = evbuffer_new();
+        if (state->send_queue[i] == NULL) {
+            LogError(state->name, "Could not allocate send queues");
+            return -1;
+        }
+    }
+    state->send_ev = evtimer_new(state->base, controller_send_cb, state);
+    if (state->send_ev == NULL) {
+        LogError(state->name, "Could not allocate send event");
+        return -1;
+    }
+    return 0;
+}
+
+/* A new connection starts with nothing queued */
+static void controller_send_reset(struct fox_state *state)
+{
+    int i;
+
+    for (i=CONTROLLER_CLASS_BARRIER; i<CONTROLLER_CLASSES; i++) {
+        if (state->send_queue[i] != NULL) {
+            evbuffer_drain(state->send_queue[i],
+                           evbuffer_get_length(state->send_queue[i]));
+        }
+        state->send_sent[i] = state->send_queued[i];
+    }
+    state->barrier_sent = 0;
+}
+
+static int controller_limited(struct fox_state *state, int cls)
+{
+    return state->flow_mod_rate != 0 &&
+           (cls == CONTROLLER_CLASS_UNBLOCK || cls == CONTROLLER_CLASS_BLOCK);
+}
+
+static void controller_refill(struct fox_state *state)
+{
+    uint64_t now = controller_now_us(state);
+
+    if (now > state->flow_mod_refill_us) {
+        state->flow_mod_tokens += (double)(now - state->flow_mod_refill_us) *
+                                  state->flow_mod_rate / 1000000;
+        if (state->flow_mod_tokens > state->flow_mod_burst) {
+            state->flow_mod_tokens = state->flow_mod_burst;
+        }
+    }
+    state->flow_mod_refill_us = now;
+}
+
+/* The class to send from next, or -1 if none can */
+static int controller_next_class(struct fox_state *state)
+{
+    struct controller_fence fence;
+    int cls, i;
+
+    for (cls=CONTROLLER_CLASS_BARRIER; cls<CONTROLLER_CLASSES; cls++) {
+        if (evbuffer_get_length(state->send_queue[cls]) == 0) {
+            continue;
+        }
+        if (cls == CONTROLLER_CLASS_BARRIER) {
+            evbuffer_copyout(state->send_queue[cls], &fence, sizeof(fence));
+            for (i=CONTROLLER_CLASS_UNBLOCK; i<CONTROLLER_CLASSES; i++) {
+                if (state->send_sent[i] < fence.after[i]) {
+                    break;
+                }
+            }
+            if (i < CONTROLLER_CLASSES) {
+                continue;
+            }
+        } else if (controller_limited(state, cls) &&
+                   state->flow_mod_tokens < 1) {
+            continue;
+        }
+        return cls;
+    }
+    return -1;
+}
+
+static void controller_send_next(struct fox_state *state, int cls,
+                                 struct evbuffer *out)
+{
+    struct evbuffer *queue = state->send_queue[cls];
+    struct ofp_header hdr;
+
+    if (cls == CONTROLLER_CLASS_BARRIER) {
+        evbuffer_drain(queue, sizeof(struct controller_fence));
+    }
+    evbuffer_copyout(queue, &hdr, sizeof(hdr));
+    if (cls == CONTROLLER_CLASS_BARRIER) {
+        state->barrier_xid = ntohl(hdr.xid);
+        state->barrier_sent = 1;
+    }
+    evbuffer_remove_buffer(queue, out, ntohs(hdr.length));
+
+    state->send_sent[cls]++;
+    if (controller_limited(state, cls)) {
+        state->flow_mod_tokens -= 1;
+    }
+}
+
+/*
+* Fill the bufferevent up to the high water mark. If flow mods are left
+* for want of tokens, come back once there is one; if it is full, its
+* write callback brings us back when it drains.
+*/
+static void controller_send_drain(struct fox_state *state)
+{
+    struct evbuffer *out;
+    struct timeval tv;
+    uint64_t wait_us;
+    int cls;
+
+    if (state->controller_bev == NULL) {
+        return;
+    }
+    out = bufferevent_get_output(state->controller_bev);
+    if (state->flow_mod_rate != 0) {
+        controller_refill(state);
+    }
+
+    while (evbuffer_get_length(out) < CONTROLLER_SEND_HIGH_WATER &&
+           (cls = controller_next_class(state)) >= 0) {
+        controller_send_next(state, cls, out);
+    }
+
+    if (state->flow_mod_rate != 0 && state->flow_mod_tokens < 1 &&
+        evbuffer_get_length(out) < CONTROLLER_SEND_HIGH_WATER &&
+        (evbuffer_get_length(state->send_queue[CONTROLLER_CLASS_UNBLOCK]) ||
+         evbuffer_get_length(state->send_queue[CONTROLLER_CLASS_BLOCK]))) {
+        wait_us = (1 - state->flow_mod_tokens) * 1000000 /
+                  state->flow_mod_rate + 1;
+        tv.tv_sec = wait_us / 1000000;
+        tv.tv_usec = wait_us % 1000000;
+        evtimer_add(state->send_ev, &tv);
+    }
+}
+
+void controller_send_cb(evutil_socket_t fd, short what, void *arg)
+{
+    controller_send_drain(arg);
+}
+
+static void controller_write_cb(struct bufferevent *bev, void *ctx)
+{
+    controller_send_drain(ctx);
+}
+
+int controller_send_class(struct fox_state *state, int cls, void *payload,
+                          size_t len)
+{
+    struct controller_fence fence;
+
+    if (state->controller_bev == NULL) {
+        return -1;
+    }
+    if (cls == CONTROLLER_CLASS_CONTROL || state->send_ev == NULL) {
+        return bufferevent_write(state->controller_bev, payload, len);
+    }
+
+    if (cls == CONTROLLER_CLASS_BARRIER) {
+        memcpy(fence.after, state->send_queued, sizeof(fence.after));
+        if (evbuffer_add(state->send_queue[cls], &fence, sizeof(fence))) {
+            return -1;
+        }
+    }
+    if (evbuffer_add(state->send_queue[cls], payload, len)) {
+        return -1;
+    }
+    state->send_queued[cls]++;
+
+    /* Everything sent from one callback goes out in one go */
+    event_active(state->send_ev, EV_TIMEOUT, 1);
+    return 0;
+}
+
+size_t controller_pending(struct fox_state *state)
+{
+    size_t len = 0;
+    int i;
+
+    if (state->controller_bev != NULL) {
+        len = evbuffer_get_length(bufferevent_get_output(
+                                      state->controller_bev));
+    }
+    for (i=CONTROLLER_CLASS_BARRIER; i<CONTROLLER_CLASSES; i++) {
+        if (state->send_queue[i] != NULL) {
+            len += evbuffer_get_length(state->send_queue[i]);
+        }
+    }
+    return len;
+}
+
+void controller_set_flow_mod_rate(struct fox_state *state, uint32_t rate,
+                                  uint32_t burst)
+{
+    if (rate == state->flow_mod_rate && burst == state->flow_mod_burst) {
+        return;
+    }
+    state->flow_mod_rate = rate;
+    state->flow_mod_burst = burst > 0 ? burst : 1;
+    state->flow_mod_tokens = state->flow_mod_burst;
+    state->flow_mod_refill_us = controller_now_us(state);
+
+    /* Whatever was held back may go now */
+    if (state->send_ev != NULL) {
+        event_active(state->send_ev, EV_TIMEOUT, 1);
+    }
+}
+
+/* The class of a message whose sender did not give one. Every flow mod is
+ * a block, deletes included: only the sender knows whether a delete may
+ * go ahead of the adds before it. */
+static int controller_msg_class(struct fox_state *state, void *payload)
 {
     struct ofp_header *hdr = payload;
-    hdr->version = OFP_VERSION;
+
+    if (state->version == OFP13_VERSION) {
+        switch (hdr->type) {
+        case OFPT13_BARRIER_REQUEST:
+            return CONTROLLER_CLASS_BARRIER;
+        case OFPT13_PACKET_OUT:
+        case OFPT13_MULTIPART_REQUEST:
+            return CONTROLLER_CLASS_BULK;
+        case OFPT13_FLOW_MOD:
+            return CONTROLLER_CLASS_BLOCK;
+        default:
+            return CONTROLLER_CLASS_CONTROL;
+        }
+    } else {
+        switch (hdr->type) {
+        case OFPT_BARRIER_REQUEST:
+            return CONTROLLER_CLASS_BARRIER;
+        case OFPT_PACKET_OUT:
+        case OFPT_STATS_REQUEST:
+            return CONTROLLER_CLASS_BULK;
+        case OFPT_FLOW_MOD:
+            return CONTROLLER_CLASS_BLOCK;
+        default:
+            return CONTROLLER_CLASS_CONTROL;
+        }
+    }
+}
+
+/*
+* Send a message that is already laid out for the negotiated version
+* (1.0 if there is none yet); only the version and length are filled in.
+*/
+int controller_send_raw(struct fox_state *state, void *payload, size_t len)
+{
+    struct ofp_header *hdr = payload;
+    hdr->version = state->version ? state->version : OFP_VERSION;
     hdr->length = htons(len);
 
-    // TODO: check bufferevent_write return value
     // TODO: buffer data even if controller_bev is null...
     //          (e.g. before switch has connected)
-    if (state->controller_bev != NULL) {
-        bufferevent_write(state->controller_bev, payload, len);
+    return controller_send_class(state, controller_msg_class(state, payload),
+                                 payload, len);
+}
+
+/*
+* Send a 1.0 message. Over 1.3 only messages whose body is the same in
+* both go through (with the type renumbered); flow mods and packet outs
+* have their own version-neutral senders.
+*/
+int controller_send_hdr(struct fox_state *state, void *payload, size_t len)
+{
+    struct ofp_header *hdr = payload;
+
+    if (state->version == OFP13_VERSION) {
+        int type = of13_msg_type(hdr->type);
+
+        if (type < 0) {
+            LogError(state->name, "Type %d cannot be sent as OpenFlow 1.3",
+                     hdr->type);
+            return -1;
+        }
+        hdr->type = type;
     }
+
+    return controller_send_raw(state, payload, len);
 }
 
+/*
+* Sent before we know what the switch speaks: offer everything we do in a
+* version bitmap, with the highest in the header for switches that only
+* look there.
+*/
 void controller_send_hello(struct fox_state *state)
 {
-    struct ofp_hello hello_msg;
-    hello_msg.header.type = OFPT_HELLO;
+    struct {
+        struct ofp_hello                    hello;
+        struct ofp_hello_elem_versionbitmap elem;
+        uint32_t                            bitmap;
+    } __attribute__((__packed__)) msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.hello.header.version = OFP13_VERSION;
+    msg.hello.header.type = OFPT_HELLO;
+    msg.hello.header.length = htons(sizeof(msg));
+    msg.elem.type = htons(OFPHET_VERSIONBITMAP);
+    msg.elem.length = htons(sizeof(msg.elem) + sizeof(msg.bitmap));
+    msg.bitmap = htonl(CONTROLLER_VERSIONS);
+
+    /* A new connection starts over */
+    state->version = 0;
+    state->resyncing = 0;
 
-    controller_send_hdr(state, &hello_msg, sizeof(hello_msg));
+    if (state->controller_bev == NULL) {
+        return;
+    }
+    bufferevent_write(state->controller_bev, &msg, sizeof(msg));
 }
 
 void controller_send_echo_request(struct fox_state *state)
@@ -484,6 +1368,80 @@ void controller_send_features_request(struct fox_state *state)
     controller_send_hdr(state, &feature_req, sizeof(feature_req));
 }
 
+int controller_send_flow_stats_request(struct fox_state *state,
+                                       const struct ofp_match *match,
+                                       uint32_t xid)
+{
+    struct {
+        struct ofp_stats_request        hdr;
+        struct ofp_flow_stats_request   body;
+    } __attribute__((__packed__)) req;
+
+    if (state->version == OFP13_VERSION) {
+        return of13_send_flow_stats_request(state, match, xid);
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.hdr.header.type = OFPT_STATS_REQUEST;
+    req.hdr.header.xid = htonl(xid);
+    req.hdr.type = htons(OFPST_FLOW);
+    req.body.match = *match;
+    req.body.table_id = 0xff;
+    req.body.out_port = htons(OFPP_NONE);
+
+    return controller_send_raw(state, &req, sizeof(req));
+}
+
+/*
+* Send a packet out of a single (possibly virtual, e.g. OFPP_FLOOD) port.
+* If buffer_id is UINT32_MAX, data must hold the whole frame; otherwise the
+* switch's buffered copy is used and data may be NULL.
+*/
+void controller_send_packet_out(struct fox_state *state, uint32_t buffer_id,
+                                uint16_t in_port, uint16_t out_port,
+                                void *data, size_t data_len)
+{
+    struct ofp_packet_out *pkt_out;
+    struct ofp_action_output *action;
+    size_t len;
+
+    if (state->version == OFP13_VERSION) {
+        of13_send_packet_out(state, buffer_id, in_port, out_port,
+                             data, data_len);
+        return;
+    }
+
+    if (buffer_id != UINT32_MAX) {
+        data_len = 0;
+    }
+    len = sizeof(*pkt_out) + sizeof(*action) + data_len;
+
+    pkt_out = malloc(len);
+    if (pkt_out == NULL) {
+        LogError(state->name, "Could not malloc %d byte packet out", len);
+        return;
+    }
+    memset(pkt_out, 0, sizeof(*pkt_out) + sizeof(*action));
+
+    pkt_out->header.type = OFPT_PACKET_OUT;
+    pkt_out->buffer_id = htonl(buffer_id);
+    pkt_out->in_port = htons(in_port);
+    pkt_out->actions_len = htons(sizeof(*action));
+
+    action = (struct ofp_action_output *)&pkt_out->actions[0];
+    action->type = htons(OFPAT_OUTPUT);
+    action->len = htons(sizeof(*action));
+    action->port = htons(out_port);
+
+    if (data_len > 0) {
+        memcpy(&action[1], data, data_len);
+    }
+
+    controller_send_hdr(state, pkt_out, len);
+
+    free(pkt_out);
+}
+
 /* TODO: check xid */
 void controller_handle_echo_reply(struct fox_state *state)
 {
@@ -494,6 +1452,10 @@ void controller_handle_echo_reply(struct fox_state *state)
     }
 
     LogDebug(state->name, "Got echo reply, ms: %d", state->echo_period_ms);
+    if (state->echo_late) {
+        LogInfo(state->name, "Answering echoes again");
+        state->echo_late = 0;
+    }
 
     tv.tv_sec = state->echo_period_ms / 1000;
     tv.tv_usec = (state->echo_period_ms % 1000) * 1000;
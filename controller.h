@@ -4,13 +4,27 @@
 #include <event2/event.h>
 #include <event2/bufferevent.h>
 #include "fox.h"
+#include "openflow13.h"
+
+/* OpenFlow versions we offer in HELLO, as a version bitmap */
+#define CONTROLLER_VERSIONS     ((1 << OFP_VERSION) | (1 << OFP13_VERSION))
+
+/* Queued messages are moved into the bufferevent until it holds this
+ * much, and again once it drains below the low water mark */
+#define CONTROLLER_SEND_HIGH_WATER  (64 * 1024)
+#define CONTROLLER_SEND_LOW_WATER   (16 * 1024)
 
 struct fox_state *controller_new(struct event_base *base, char *ip,
                                  uint16_t port, uint32_t echo_period_ms,
                                  int connect);
 
+void controller_free(struct fox_state *state);
+
 void controller_init_echo(struct fox_state *state);
 
+/* Connected, past the HELLO exchange and answering echoes */
+int controller_healthy(struct fox_state *state);
+
 int controller_listen(struct fox_state *state, char *listen_ip,
                       uint16_t listen_port);
 
@@ -22,6 +36,8 @@ void controller_connect_cb(struct bufferevent *bev, short events,
 
 void controller_read_cb(struct bufferevent *bev, void *user_data);
 
+void controller_send_cb(evutil_socket_t fd, short what, void *arg);
+
 void controller_handle_msg(struct fox_state *state, struct ofp_header *ofhdr,
                            void *payload);
 
@@ -35,6 +51,24 @@ void controller_register_handler(struct fox_state *state, uint8_t type,
                                 void (*func)(struct fox_state *state, 
                                              void *payload));
 
+void controller_unregister_handler(struct fox_state *state, uint8_t type,
+                                   void (*func)(struct fox_state *state,
+                                                void *payload));
+
+/* func gets the messages of type that arrive back to back in one read, up
+ * to CONTROLLER_BATCH_MAX at a time, after any per-message handlers have
+ * seen each. The payloads are only good until it returns. */
+void controller_register_batch_handler(struct fox_state *state, uint8_t type,
+                                      void (*func)(struct fox_state *state,
+                                                   void **payloads,
+                                                   size_t n));
+
+void controller_unregister_batch_handler(struct fox_state *state,
+                                        uint8_t type,
+                                        void (*func)(struct fox_state *state,
+                                                     void **payloads,
+                                                     size_t n));
+
 void controller_send_hello(struct fox_state *state);
 
 void controller_send_echo_request(struct fox_state *state);
@@ -43,6 +77,44 @@ void controller_send_echo_reply(struct fox_state *state, uint32_t xid);
 
 void controller_send_features_request(struct fox_state *state);
 
+int controller_send_hdr(struct fox_state *state, void *payload, size_t len);
+
+/* Sends in the class of the message's type; flow mods keep their order */
+int controller_send_raw(struct fox_state *state, void *payload, size_t len);
+
+/*
+* Send a message laid out for the negotiated version in class cls
+* (CONTROLLER_CLASS_*, fox.h). Control messages are written straight into
+* the bufferevent, so an echo never waits behind a flood of flow mods;
+* the rest wait in their class's queue and are moved across, highest
+* class first, while the bufferevent holds less than
+* CONTROLLER_SEND_HIGH_WATER. Within a class order is kept. A barrier
+* waits for every message queued before it, whatever its class, so its
+* reply still covers them. A caller that knows a delete may overtake the
+* adds before it sends it as CONTROLLER_CLASS_UNBLOCK.
+*/
+int controller_send_class(struct fox_state *state, int cls, void *payload,
+                          size_t len);
+
+/* Bytes on their way to the switch, queued or in the bufferevent */
+size_t controller_pending(struct fox_state *state);
+
+/* Let at most rate flow mods a second out, in bursts of up to burst; a
+ * rate of 0 lifts the limit */
+void controller_set_flow_mod_rate(struct fox_state *state, uint32_t rate,
+                                  uint32_t burst);
+
+/* Ask for every flow in every table that match covers (non-strictly).
+ * Replies come as OFPST_FLOW stats replies in 1.0 form either way; on
+ * 1.3 they carry no actions. */
+int controller_send_flow_stats_request(struct fox_state *state,
+                                       const struct ofp_match *match,
+                                       uint32_t xid);
+
+void controller_send_packet_out(struct fox_state *state, uint32_t buffer_id,
+                                uint16_t in_port, uint16_t out_port,
+                                void *data, size_t data_len);
+
 void controller_handle_echo_reply(struct fox_state *state);
 
 #endif
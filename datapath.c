@@ -0,0 +1,176 @@
+#include <event2/event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "fox.h"
+#include "controller.h"
+#include "datapath.h"
+#include "logger.h"
+
+static struct fox_datapath *datapaths;
+
+static uint64_t datapath_now_ms(struct fox_state *state)
+{
+    struct timeval tv;
+
+    event_base_gettimeofday_cached(state->base, &tv);
+
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void datapath_attach(struct fox_state *state)
+{
+    struct fox_datapath *dp;
+
+    if (state->datapath != NULL) {
+        if (state->datapath->datapath_id == state->datapath_id) {
+            return;
+        }
+        datapath_detach(state);
+    }
+
+    for (dp = datapaths; dp != NULL; dp = dp->next) {
+        if (dp->datapath_id == state->datapath_id) {
+            break;
+        }
+    }
+
+    if (dp == NULL) {
+        dp = malloc(sizeof(*dp));
+        if (dp == NULL) {
+            LogError(state->name, "Could not malloc datapath");
+            return;
+        }
+        memset(dp, 0, sizeof(*dp));
+        dp->datapath_id = state->datapath_id;
+        dp->next = datapaths;
+        datapaths = dp;
+    } else if (dp->n_channels == DATAPATH_MAX_CHANNELS) {
+        LogWarn(state->name, "Too many channels to datapath %016llx",
+                (unsigned long long)dp->datapath_id);
+        return;
+    } else {
+        LogInfo(state->name, "Same switch as %s (datapath %016llx)",
+                dp->channels[0]->name, (unsigned long long)dp->datapath_id);
+    }
+
+    dp->channels[dp->n_channels++] = state;
+    state->datapath = dp;
+}
+
+void datapath_detach(struct fox_state *state)
+{
+    struct fox_datapath *dp = state->datapath;
+    struct fox_datapath **prev;
+    uint32_t i;
+
+    if (dp == NULL) {
+        return;
+    }
+    state->datapath = NULL;
+
+    for (i=0; i<dp->n_channels; i++) {
+        if (dp->channels[i] == state) {
+            dp->channels[i] = dp->channels[--dp->n_channels];
+            break;
+        }
+    }
+    for (i=0; i<DATAPATH_DEDUP_SLOTS; i++) {
+        if (dp->seen[i].channel == state) {
+            dp->seen[i].channel = NULL;
+        }
+    }
+    if (dp->n_channels > 0) {
+        return;
+    }
+
+    for (prev = &datapaths; *prev != dp; prev = &(*prev)->next);
+    *prev = dp->next;
+    free(dp);
+}
+
+struct fox_state *datapath_channel(struct fox_state *state)
+{
+    struct fox_datapath *dp = state->datapath;
+    struct fox_state *healthy = NULL;
+    uint32_t i;
+
+    if (dp == NULL || (state->active && controller_healthy(state))) {
+        return state;
+    }
+
+    for (i=0; i<dp->n_channels; i++) {
+        struct fox_state *channel = dp->channels[i];
+
+        if (!controller_healthy(channel)) {
+            continue;
+        }
+        if (channel->active) {
+            return channel;
+        }
+        if (healthy == NULL || channel == state) {
+            healthy = channel;
+        }
+    }
+
+    return healthy != NULL ? healthy : state;
+}
+
+/* FNV-1a over the body; the xid is the channel's, not the event's */
+static uint32_t datapath_hash(void *payload)
+{
+    struct ofp_header *hdr = payload;
+    const uint8_t *p = payload;
+    size_t i, len = ntohs(hdr->length);
+    uint32_t hash = 2166136261u;
+
+    hash = (hash ^ hdr->type) * 16777619u;
+    for (i=sizeof(*hdr); i<len; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+int datapath_duplicate(struct fox_state *state, void *payload)
+{
+    struct fox_datapath *dp = state->datapath;
+    struct ofp_header *hdr = payload;
+    struct datapath_seen *seen;
+    uint64_t now;
+    uint32_t hash, i;
+
+    if (dp == NULL || dp->n_channels < 2) {
+        return 0;
+    }
+    switch (hdr->type) {
+    case OFPT_FLOW_REMOVED:
+    case OFPT_PACKET_IN:
+    case OFPT_PORT_STATUS:
+        break;
+    default:
+        return 0;
+    }
+
+    now = datapath_now_ms(state);
+    hash = datapath_hash(payload);
+
+    /* The same event twice on one channel is two events */
+    for (i=0; i<DATAPATH_DEDUP_SLOTS; i++) {
+        seen = &dp->seen[i];
+        if (seen->hash == hash && seen->channel != NULL &&
+            seen->channel != state &&
+            now - seen->seen_ms <= DATAPATH_DEDUP_MS) {
+            seen->channel = NULL;
+            dp->n_duplicates++;
+            return 1;
+        }
+    }
+
+    seen = &dp->seen[dp->seen_next];
+    dp->seen_next = (dp->seen_next + 1) % DATAPATH_DEDUP_SLOTS;
+    seen->hash = hash;
+    seen->channel = state;
+    seen->seen_ms = now;
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef DATAPATH_H
+#define DATAPATH_H
+
+#include <stdint.h>
+#include "fox.h"
+
+#define DATAPATH_MAX_CHANNELS   4
+
+/* Asynchronous messages seen on one channel and repeated on another
+ * within DATAPATH_DEDUP_MS are passed on once */
+#define DATAPATH_DEDUP_SLOTS    64
+#define DATAPATH_DEDUP_MS       1000
+
+struct datapath_seen {
+    uint32_t            hash;
+    struct fox_state    *channel;
+    uint64_t            seen_ms;
+};
+
+/*
+* A switch, as opposed to a connection to it. Some switches (see BUGS) are
+* reached through an active connection we make plus a passive one they
+* make back to us, each with its own fox_state. Channels whose features
+* reply carried the same datapath id are merged into one datapath:
+* requests go over whichever of them is healthy, preferring ones we
+* connected to, and asynchronous messages (flow removed, packet in, port
+* status) the switch sends on more than one are handed to apps once.
+*/
+struct fox_datapath {
+    struct fox_datapath     *next;
+    uint64_t                datapath_id;
+
+    uint32_t                n_channels;
+    struct fox_state        *channels[DATAPATH_MAX_CHANNELS];
+
+    struct datapath_seen    seen[DATAPATH_DEDUP_SLOTS];
+    uint32_t                seen_next;
+
+    uint64_t                n_duplicates;
+};
+
+/* Join the datapath of state->datapath_id, creating it if this is its
+ * first channel. Called once the features reply is in. */
+void datapath_attach(struct fox_state *state);
+
+/* Leave it; the datapath goes with its last channel */
+void datapath_detach(struct fox_state *state);
+
+/* The channel to send state's switch requests over: a healthy one we
+ * connected to, else any healthy one, else state itself */
+struct fox_state *datapath_channel(struct fox_state *state);
+
+/* Whether an asynchronous message on state was already passed on from
+ * another channel to the same switch */
+int datapath_duplicate(struct fox_state *state, void *payload);
+
+#endif
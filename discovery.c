@@ -0,0 +1,517 @@
+#include <event2/event.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "fox.h"
+#include "controller.h"
+#include "flowmod.h"
+#include "discovery.h"
+#include "logger.h"
+
+/* TLV types and subtypes used in our probes */
+#define LLDP_TLV_END            0
+#define LLDP_TLV_CHASSIS_ID     1
+#define LLDP_TLV_PORT_ID        2
+#define LLDP_TLV_TTL            3
+#define LLDP_CHASSIS_LOCAL      7
+#define LLDP_PORT_COMPONENT     2
+
+#define LLDP_TLV_HDR(type, len) htons(((type) << 9) | (len))
+
+/* Ethernet minimum frame size, without the FCS */
+#define LLDP_FRAME_LEN          60
+
+struct lldp_probe {
+    uint8_t     dl_dst[OFP_ETH_ALEN];
+    uint8_t     dl_src[OFP_ETH_ALEN];
+    uint16_t    dl_type;
+
+    uint16_t    chassis_tlv;
+    uint8_t     chassis_subtype;
+    uint64_t    chassis_dpid;
+
+    uint16_t    port_tlv;
+    uint8_t     port_subtype;
+    uint16_t    port_no;
+
+    uint16_t    ttl_tlv;
+    uint16_t    ttl;
+
+    uint16_t    end_tlv;
+} __attribute__((__packed__));
+
+static const uint8_t lldp_multicast[OFP_ETH_ALEN] =
+    { 0x01, 0x80, 0xc2, 0x00, 0x00, 0x0e };
+
+/* There is one discovery engine per process; the message handlers only
+ * get the fox_state of the switch, so they find the engine through here. */
+static struct discovery_state *discovery;
+
+static uint64_t discovery_now_ms(struct discovery_state *disc)
+{
+    struct timeval tv;
+
+    event_base_gettimeofday_cached(disc->base, &tv);
+
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int discovery_find_sw(struct discovery_state *disc,
+                             struct fox_state *sw)
+{
+    int i;
+
+    for (i=0; i<disc->n_nodes; i++) {
+        if (disc->nodes[i].sw == sw) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int discovery_find_dpid(struct discovery_state *disc, uint64_t dpid)
+{
+    int i;
+
+    for (i=0; i<disc->n_nodes; i++) {
+        if (disc->nodes[i].sw != NULL && disc->nodes[i].features &&
+            disc->nodes[i].dpid == dpid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Recompute shortest paths from a single source by BFS over the
+ * adjacency matrix. */
+static void discovery_bfs(struct discovery_state *disc, int src)
+{
+    int queue[DISCOVERY_MAX_SWITCHES];
+    int head = 0, tail = 0;
+    int i;
+
+    memset(disc->dist[src], DISCOVERY_NO_PATH, sizeof(disc->dist[src]));
+    memset(disc->first_hop[src], DISCOVERY_NO_PATH,
+           sizeof(disc->first_hop[src]));
+
+    disc->dist[src][src] = 0;
+    disc->first_hop[src][src] = src;
+    queue[tail++] = src;
+
+    while (head < tail) {
+        int u = queue[head++];
+
+        for (i=0; i<disc->n_nodes; i++) {
+            if (disc->links[u][i].src_port == 0 ||
+                disc->dist[src][i] != DISCOVERY_NO_PATH) {
+                continue;
+            }
+            disc->dist[src][i] = disc->dist[src][u] + 1;
+            disc->first_hop[src][i] = (u == src) ?
+                                      i : disc->first_hop[src][u];
+            queue[tail++] = i;
+        }
+    }
+}
+
+/* A new link u -> v can only shorten paths, and any path it shortens is
+ * s ~> u -> v ~> t, so relaxing every (s, t) pair through it is enough;
+ * no full recomputation needed. */
+static void discovery_path_link_up(struct discovery_state *disc, int u, int v)
+{
+    int s, t;
+
+    for (s=0; s<disc->n_nodes; s++) {
+        if (disc->dist[s][u] == DISCOVERY_NO_PATH) {
+            continue;
+        }
+        for (t=0; t<disc->n_nodes; t++) {
+            int d;
+
+            if (disc->dist[v][t] == DISCOVERY_NO_PATH) {
+                continue;
+            }
+            d = disc->dist[s][u] + 1 + disc->dist[v][t];
+            if (d < disc->dist[s][t]) {
+                disc->dist[s][t] = d;
+                disc->first_hop[s][t] = (s == u) ? v : disc->first_hop[s][u];
+            }
+        }
+    }
+}
+
+/* Removing u -> v can only lengthen paths of sources whose shortest path
+ * tree might use it, i.e. those reaching v in exactly one hop past u.
+ * Only those sources get a fresh BFS. */
+static void discovery_path_link_down(struct discovery_state *disc,
+                                     int u, int v)
+{
+    int s;
+
+    for (s=0; s<disc->n_nodes; s++) {
+        if (disc->dist[s][u] == DISCOVERY_NO_PATH) {
+            continue;
+        }
+        if (disc->dist[s][v] == disc->dist[s][u] + 1) {
+            discovery_bfs(disc, s);
+        }
+    }
+}
+
+static void discovery_link_down(struct discovery_state *disc, int u, int v)
+{
+    struct discovery_link *link = &disc->links[u][v];
+
+    LogInfo(disc->name, "Link down: %016llx:%d -> %016llx:%d",
+            (unsigned long long)disc->nodes[u].dpid, link->src_port,
+            (unsigned long long)disc->nodes[v].dpid, link->dst_port);
+
+    memset(link, 0, sizeof(*link));
+    discovery_path_link_down(disc, u, v);
+}
+
+static void discovery_link_seen(struct discovery_state *disc, int u,
+                                uint16_t src_port, int v, uint16_t dst_port)
+{
+    struct discovery_link *link = &disc->links[u][v];
+    int is_new = (link->src_port == 0);
+
+    if (!is_new && (link->src_port != src_port ||
+                    link->dst_port != dst_port)) {
+        /* Recabled (or a parallel link); treat it as a new link */
+        discovery_link_down(disc, u, v);
+        is_new = 1;
+    }
+
+    link->src_port = src_port;
+    link->dst_port = dst_port;
+    link->last_seen_ms = discovery_now_ms(disc);
+
+    if (is_new) {
+        LogInfo(disc->name, "Link up: %016llx:%d -> %016llx:%d",
+                (unsigned long long)disc->nodes[u].dpid, src_port,
+                (unsigned long long)disc->nodes[v].dpid, dst_port);
+        discovery_path_link_up(disc, u, v);
+    }
+}
+
+static void discovery_age_links(struct discovery_state *disc)
+{
+    uint64_t now = discovery_now_ms(disc);
+    int u, v;
+
+    for (u=0; u<disc->n_nodes; u++) {
+        for (v=0; v<disc->n_nodes; v++) {
+            struct discovery_link *link = &disc->links[u][v];
+
+            if (link->src_port != 0 &&
+                now - link->last_seen_ms > disc->link_timeout_ms) {
+                discovery_link_down(disc, u, v);
+            }
+        }
+    }
+}
+
+static int discovery_port_usable(struct ofp_phy_port *port)
+{
+    return ntohs(port->port_no) < OFPP_MAX &&
+           !(ntohl(port->config) & OFPPC_PORT_DOWN) &&
+           !(ntohl(port->state) & OFPPS_LINK_DOWN);
+}
+
+static void discovery_send_probe(struct discovery_state *disc,
+                                 struct discovery_node *node,
+                                 struct ofp_phy_port *port)
+{
+    uint8_t frame[LLDP_FRAME_LEN];
+    struct lldp_probe *probe = (struct lldp_probe *)frame;
+
+    memset(frame, 0, sizeof(frame));
+
+    memcpy(probe->dl_dst, lldp_multicast, OFP_ETH_ALEN);
+    memcpy(probe->dl_src, port->hw_addr, OFP_ETH_ALEN);
+    probe->dl_type = htons(LLDP_ETHERTYPE);
+
+    probe->chassis_tlv = LLDP_TLV_HDR(LLDP_TLV_CHASSIS_ID,
+                                      1 + sizeof(probe->chassis_dpid));
+    probe->chassis_subtype = LLDP_CHASSIS_LOCAL;
+    probe->chassis_dpid = htobe64(node->dpid);
+
+    probe->port_tlv = LLDP_TLV_HDR(LLDP_TLV_PORT_ID,
+                                   1 + sizeof(probe->port_no));
+    probe->port_subtype = LLDP_PORT_COMPONENT;
+    probe->port_no = port->port_no;
+
+    probe->ttl_tlv = LLDP_TLV_HDR(LLDP_TLV_TTL, sizeof(probe->ttl));
+    probe->ttl = htons(LLDP_TTL_SECS);
+
+    probe->end_tlv = LLDP_TLV_HDR(LLDP_TLV_END, 0);
+
+    controller_send_packet_out(node->sw, UINT32_MAX, OFPP_NONE,
+                               ntohs(port->port_no), frame, sizeof(frame));
+    disc->probes_sent++;
+}
+
+/* Advance the probe cursor by up to probes_per_tick ports. Each full sweep
+ * over every switch also ages out links we have not heard from. */
+void discovery_probe_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct discovery_state *disc = arg;
+    struct timeval tv;
+    uint32_t sent = 0;
+    int visited = 0;
+
+    while (sent < disc->probes_per_tick && visited <= disc->n_nodes) {
+        struct discovery_node *node;
+
+        if (disc->probe_node >= disc->n_nodes) {
+            disc->probe_node = 0;
+            disc->probe_port = 0;
+            discovery_age_links(disc);
+            if (disc->n_nodes == 0) {
+                break;
+            }
+        }
+
+        node = &disc->nodes[disc->probe_node];
+        if (node->sw == NULL || !node->features ||
+            node->sw->controller_bev == NULL ||
+            disc->probe_port >= node->sw->n_ports) {
+            disc->probe_node++;
+            disc->probe_port = 0;
+            visited++;
+            continue;
+        }
+
+        if (discovery_port_usable(&node->sw->ports[disc->probe_port])) {
+            discovery_send_probe(disc, node,
+                                 &node->sw->ports[disc->probe_port]);
+            sent++;
+        }
+        disc->probe_port++;
+    }
+
+    tv.tv_sec = disc->tick_ms / 1000;
+    tv.tv_usec = (disc->tick_ms % 1000) * 1000;
+    evtimer_add(disc->probe_timer, &tv);
+}
+
+/* Make sure LLDP frames come back to us even if the switch has other
+ * flows installed. */
+static void discovery_install_trap(struct fox_state *sw)
+{
+    struct flow_mod mod;
+
+    flow_mod_init(&mod, OFPFC_ADD);
+    mod.match.wildcards = htonl(OFPFW_ALL & ~OFPFW_DL_TYPE);
+    mod.match.dl_type = htons(LLDP_ETHERTYPE);
+    mod.priority = OFP_DEFAULT_PRIORITY + 200;
+    flow_mod_add_output(&mod, OFPP_CONTROLLER, sizeof(struct lldp_probe));
+
+    flow_mod_send(sw, &mod);
+}
+
+void discovery_features_cb(struct fox_state *sw, void *payload)
+{
+    struct discovery_state *disc = discovery;
+    int idx = discovery_find_sw(disc, sw);
+    int other;
+
+    if (idx < 0) {
+        return;
+    }
+
+    /* Another connection already claims this dpid; keep the first one */
+    other = discovery_find_dpid(disc, sw->datapath_id);
+    if (other >= 0 && other != idx) {
+        LogWarn(disc->name, "%016llx already known via %s, ignoring %s",
+                (unsigned long long)sw->datapath_id,
+                disc->nodes[other].sw->name, sw->name);
+        return;
+    }
+
+    disc->nodes[idx].dpid = sw->datapath_id;
+    disc->nodes[idx].features = 1;
+
+    LogDebug(disc->name, "%s is %016llx with %d ports", sw->name,
+             (unsigned long long)sw->datapath_id, sw->n_ports);
+
+    discovery_install_trap(sw);
+}
+
+void discovery_packet_in_cb(struct fox_state *sw, void *payload)
+{
+    struct discovery_state *disc = discovery;
+    struct ofp_packet_in *pkt_in = payload;
+    struct lldp_probe *probe = (struct lldp_probe *)pkt_in->data;
+    size_t msg_len = ntohs(pkt_in->header.length);
+    int u, v;
+
+    if (msg_len < offsetof(struct ofp_packet_in, data) + sizeof(*probe) ||
+        probe->dl_type != htons(LLDP_ETHERTYPE)) {
+        return;
+    }
+
+    /* Only our own probes are parsed; anything else is some other
+     * speaker's LLDP and is ignored. */
+    if (probe->chassis_tlv != LLDP_TLV_HDR(LLDP_TLV_CHASSIS_ID,
+                                   1 + sizeof(probe->chassis_dpid)) ||
+        probe->chassis_subtype != LLDP_CHASSIS_LOCAL ||
+        probe->port_tlv != LLDP_TLV_HDR(LLDP_TLV_PORT_ID,
+                                        1 + sizeof(probe->port_no)) ||
+        probe->port_subtype != LLDP_PORT_COMPONENT) {
+        return;
+    }
+
+    disc->probes_received++;
+
+    v = discovery_find_sw(disc, sw);
+    u = discovery_find_dpid(disc, be64toh(probe->chassis_dpid));
+    if (u < 0 || v < 0 || !disc->nodes[v].features || u == v) {
+        return;
+    }
+
+    discovery_link_seen(disc, u, ntohs(probe->port_no),
+                        v, ntohs(pkt_in->in_port));
+}
+
+struct discovery_state *discovery_init(struct event_base *base,
+                                       uint32_t tick_ms,
+                                       uint32_t probes_per_tick,
+                                       uint32_t link_timeout_ms)
+{
+    struct discovery_state *disc;
+    struct timeval tv;
+    int i;
+
+    if (discovery != NULL) {
+        return discovery;
+    }
+
+    disc = malloc(sizeof(*disc));
+    if (disc == NULL) {
+        LogError("discovery", "Unable to malloc %d bytes", sizeof(*disc));
+        return NULL;
+    }
+    memset(disc, 0, sizeof(*disc));
+
+    disc->name = "Discovery";
+    disc->base = base;
+    disc->tick_ms = tick_ms;
+    disc->probes_per_tick = probes_per_tick;
+    disc->link_timeout_ms = link_timeout_ms;
+
+    memset(disc->dist, DISCOVERY_NO_PATH, sizeof(disc->dist));
+    memset(disc->first_hop, DISCOVERY_NO_PATH, sizeof(disc->first_hop));
+    for (i=0; i<DISCOVERY_MAX_SWITCHES; i++) {
+        disc->dist[i][i] = 0;
+        disc->first_hop[i][i] = i;
+    }
+
+    disc->probe_timer = evtimer_new(base, discovery_probe_cb, disc);
+    if (disc->probe_timer == NULL) {
+        LogError(disc->name, "Could not create probe timer");
+        free(disc);
+        return NULL;
+    }
+
+    tv.tv_sec = tick_ms / 1000;
+    tv.tv_usec = (tick_ms % 1000) * 1000;
+    evtimer_add(disc->probe_timer, &tv);
+
+    discovery = disc;
+
+    return disc;
+}
+
+int discovery_add_switch(struct fox_state *sw)
+{
+    struct discovery_state *disc = discovery;
+    int i;
+
+    if (disc == NULL) {
+        LogError("discovery", "discovery_init has not been called");
+        return -1;
+    }
+
+    for (i=0; i<DISCOVERY_MAX_SWITCHES; i++) {
+        if (disc->nodes[i].sw == NULL) {
+            break;
+        }
+    }
+    if (i == DISCOVERY_MAX_SWITCHES) {
+        LogError(disc->name, "Too many switches, not adding %s", sw->name);
+        return -1;
+    }
+
+    memset(&disc->nodes[i], 0, sizeof(disc->nodes[i]));
+    disc->nodes[i].sw = sw;
+    if (i >= disc->n_nodes) {
+        disc->n_nodes = i + 1;
+    }
+
+    controller_register_handler(sw, OFPT_FEATURES_REPLY,
+                                discovery_features_cb);
+    controller_register_handler(sw, OFPT_PACKET_IN, discovery_packet_in_cb);
+
+    /* Features may already be in; pick them up now rather than waiting */
+    if (sw->n_ports > 0) {
+        discovery_features_cb(sw, NULL);
+    }
+
+    return 0;
+}
+
+void discovery_remove_switch(struct fox_state *sw)
+{
+    struct discovery_state *disc = discovery;
+    int idx, i;
+
+    if (disc == NULL || (idx = discovery_find_sw(disc, sw)) < 0) {
+        return;
+    }
+
+    controller_unregister_handler(sw, OFPT_FEATURES_REPLY,
+                                  discovery_features_cb);
+    controller_unregister_handler(sw, OFPT_PACKET_IN, discovery_packet_in_cb);
+
+    for (i=0; i<disc->n_nodes; i++) {
+        if (disc->links[idx][i].src_port != 0) {
+            discovery_link_down(disc, idx, i);
+        }
+        if (disc->links[i][idx].src_port != 0) {
+            discovery_link_down(disc, i, idx);
+        }
+    }
+
+    memset(&disc->nodes[idx], 0, sizeof(disc->nodes[idx]));
+    while (disc->n_nodes > 0 && disc->nodes[disc->n_nodes - 1].sw == NULL) {
+        disc->n_nodes--;
+    }
+}
+
+int discovery_next_hop(uint64_t src_dpid, uint64_t dst_dpid,
+                       uint16_t *out_port)
+{
+    struct discovery_state *disc = discovery;
+    int s, t, hop;
+
+    if (disc == NULL) {
+        return -1;
+    }
+
+    s = discovery_find_dpid(disc, src_dpid);
+    t = discovery_find_dpid(disc, dst_dpid);
+    if (s < 0 || t < 0 || disc->dist[s][t] == DISCOVERY_NO_PATH) {
+        return -1;
+    }
+
+    hop = disc->first_hop[s][t];
+    if (out_port != NULL) {
+        *out_port = (s == t) ? OFPP_NONE : disc->links[s][hop].src_port;
+    }
+
+    return disc->dist[s][t];
+}
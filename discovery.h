@@ -0,0 +1,75 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <event2/event.h>
+#include "fox.h"
+
+#define DISCOVERY_MAX_SWITCHES  64
+#define DISCOVERY_NO_PATH       0xff
+
+#define LLDP_ETHERTYPE          0x88cc
+#define LLDP_TTL_SECS           120
+
+/* A directed link src -> dst, learned from an LLDP probe sent out of
+ * src_port that came back as a packet-in on dst's dst_port.
+ * src_port == 0 means there is no link (physical ports start at 1). */
+struct discovery_link {
+    uint16_t    src_port;
+    uint16_t    dst_port;
+    uint64_t    last_seen_ms;
+};
+
+struct discovery_node {
+    struct fox_state    *sw;        /* NULL if this slot is free */
+    uint64_t            dpid;
+    int                 features;   /* dpid and ports are valid */
+};
+
+struct discovery_state {
+    char                    *name;
+    struct event_base       *base;
+    struct event            *probe_timer;
+
+    uint32_t                tick_ms;
+    uint32_t                probes_per_tick;
+    uint32_t                link_timeout_ms;
+
+    int                     n_nodes;    /* highest used slot + 1 */
+    struct discovery_node   nodes[DISCOVERY_MAX_SWITCHES];
+
+    /* Probe cursor: the next (node, port index) to send a probe out of */
+    int                     probe_node;
+    int                     probe_port;
+
+    struct discovery_link   links[DISCOVERY_MAX_SWITCHES]
+                                 [DISCOVERY_MAX_SWITCHES];
+
+    /* All-pairs shortest paths in hops, and the first hop node on that
+     * path. Kept up to date incrementally as links come and go. */
+    uint8_t                 dist[DISCOVERY_MAX_SWITCHES]
+                                [DISCOVERY_MAX_SWITCHES];
+    uint8_t                 first_hop[DISCOVERY_MAX_SWITCHES]
+                                     [DISCOVERY_MAX_SWITCHES];
+
+    uint64_t                probes_sent;
+    uint64_t                probes_received;
+};
+
+/* Probes go out at most probes_per_tick every tick_ms, round robin over
+ * every port of every switch, so a large fabric is swept over several
+ * ticks instead of all at once. */
+struct discovery_state *discovery_init(struct event_base *base,
+                                       uint32_t tick_ms,
+                                       uint32_t probes_per_tick,
+                                       uint32_t link_timeout_ms);
+
+int discovery_add_switch(struct fox_state *sw);
+
+void discovery_remove_switch(struct fox_state *sw);
+
+/* Returns the number of hops from src to dst and the port on src to reach
+ * it through, or -1 if there is no known path. */
+int discovery_next_hop(uint64_t src_dpid, uint64_t dst_dpid,
+                       uint16_t *out_port);
+
+#endif
@@ -0,0 +1,146 @@
+#include <arpa/inet.h>
+#include <endian.h>
+#include <string.h>
+#include "flowmod.h"
+#include "controller.h"
+#include "logger.h"
+#include "openflow13.h"
+#include "of13.h"
+
+void flow_mod_init(struct flow_mod *mod, uint16_t command)
+{
+    memset(mod, 0, sizeof(*mod));
+
+    mod->match.wildcards = htonl(OFPFW_ALL);
+    mod->command = command;
+    mod->idle_timeout = OFP_FLOW_PERMANENT;
+    mod->hard_timeout = OFP_FLOW_PERMANENT;
+    mod->priority = OFP_DEFAULT_PRIORITY;
+    mod->out_port = OFPP_NONE;
+    mod->buffer_id = UINT32_MAX;
+}
+
+int flow_mod_add_output(struct flow_mod *mod, uint16_t port,
+                        uint16_t max_len)
+{
+    struct flow_action *action;
+
+    if (mod->n_actions >= FLOW_MOD_MAX_ACTIONS) {
+        return -1;
+    }
+    action = &mod->actions[mod->n_actions++];
+    action->type = OFPAT_OUTPUT;
+    action->port = port;
+    action->max_len = max_len;
+    action->queue_id = 0;
+
+    return 0;
+}
+
+int flow_mod_add_enqueue(struct flow_mod *mod, uint16_t port,
+                         uint32_t queue_id)
+{
+    struct flow_action *action;
+
+    if (mod->n_actions >= FLOW_MOD_MAX_ACTIONS) {
+        return -1;
+    }
+    action = &mod->actions[mod->n_actions++];
+    action->type = OFPAT_ENQUEUE;
+    action->port = port;
+    action->max_len = 0;
+    action->queue_id = queue_id;
+
+    return 0;
+}
+
+static size_t flow_mod_encode10(const struct flow_mod *mod, void *buf,
+                                size_t len)
+{
+    struct ofp_flow_mod *ofmod = buf;
+    uint8_t *p;
+    size_t mod_len;
+    int i;
+
+    /* No meters in 1.0; leaving it off would quietly unthrottle */
+    if (mod->meter_id != 0) {
+        return 0;
+    }
+
+    mod_len = sizeof(*ofmod);
+    for (i=0; i<mod->n_actions; i++) {
+        mod_len += mod->actions[i].type == OFPAT_ENQUEUE ?
+                   sizeof(struct ofp_action_enqueue) :
+                   sizeof(struct ofp_action_output);
+    }
+    if (mod_len > len) {
+        return 0;
+    }
+    memset(ofmod, 0, mod_len);
+
+    ofmod->header.version = OFP_VERSION;
+    ofmod->header.type = OFPT_FLOW_MOD;
+    ofmod->header.length = htons(mod_len);
+    ofmod->header.xid = htonl(mod->xid);
+    ofmod->match = mod->match;
+    ofmod->cookie = htobe64(mod->cookie);
+    ofmod->command = htons(mod->command);
+    ofmod->idle_timeout = htons(mod->idle_timeout);
+    ofmod->hard_timeout = htons(mod->hard_timeout);
+    ofmod->priority = htons(mod->priority);
+    ofmod->buffer_id = htonl(mod->buffer_id);
+    ofmod->out_port = htons(mod->out_port);
+    ofmod->flags = htons(mod->flags);
+
+    p = (uint8_t *)&ofmod->actions[0];
+    for (i=0; i<mod->n_actions; i++) {
+        const struct flow_action *fa = &mod->actions[i];
+
+        if (fa->type == OFPAT_ENQUEUE) {
+            struct ofp_action_enqueue *action = (void *)p;
+            action->type = htons(OFPAT_ENQUEUE);
+            action->len = htons(sizeof(*action));
+            action->port = htons(fa->port);
+            action->queue_id = htonl(fa->queue_id);
+            p += sizeof(*action);
+        } else {
+            struct ofp_action_output *action = (void *)p;
+            action->type = htons(OFPAT_OUTPUT);
+            action->len = htons(sizeof(*action));
+            action->port = htons(fa->port);
+            action->max_len = htons(fa->max_len);
+            p += sizeof(*action);
+        }
+    }
+
+    return mod_len;
+}
+
+size_t flow_mod_encode(uint8_t version, const struct flow_mod *mod,
+                       void *buf, size_t len)
+{
+    switch (version) {
+    case 0:
+    case OFP_VERSION:
+        return flow_mod_encode10(mod, buf, len);
+    case OFP13_VERSION:
+        return of13_encode_flow_mod(mod, buf, len);
+    default:
+        return 0;
+    }
+}
+
+int flow_mod_send(struct fox_state *state, const struct flow_mod *mod)
+{
+    uint8_t buf[FLOW_MOD_MAX_LEN];
+    size_t len;
+
+    len = flow_mod_encode(state->version, mod, buf, sizeof(buf));
+    if (len == 0) {
+        LogError(state->name, "Could not encode flow mod for version %d",
+                 state->version);
+        return -1;
+    }
+
+    return controller_send_raw(state, buf, len);
+}
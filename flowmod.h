@@ -0,0 +1,65 @@
+#ifndef FLOWMOD_H
+#define FLOWMOD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "fox.h"
+
+#define FLOW_MOD_MAX_ACTIONS    4
+#define FLOW_MOD_MAX_LEN        256     /* encoded, any version */
+
+/* Output (port, max_len) or enqueue (port, queue_id) */
+struct flow_action {
+    uint16_t    type;           /* OFPAT_OUTPUT or OFPAT_ENQUEUE */
+    uint16_t    port;           /* OFPP_* (1.0 numbering) */
+    uint16_t    max_len;
+    uint32_t    queue_id;
+};
+
+/*
+* A flow mod that does not care which OpenFlow version the switch speaks.
+* It is described in 1.0 terms: the match is an ofp_match (network byte
+* order, OFPFW_* wildcards) and ports use 1.0 numbering. Everything else
+* is host order. flow_mod_send() encodes it for the connection's
+* negotiated version; see of13.c for how 1.0 terms map onto 1.3.
+*/
+struct flow_mod {
+    uint32_t            xid;            /* echoed in any error about it */
+    struct ofp_match    match;
+    uint64_t            cookie;
+    uint16_t            command;        /* OFPFC_* */
+    uint16_t            idle_timeout;
+    uint16_t            hard_timeout;
+    uint16_t            priority;
+    uint16_t            flags;          /* OFPFF_SEND_FLOW_REM and
+                                           OFPFF_CHECK_OVERLAP */
+    uint16_t            out_port;       /* deletes only; OFPP_NONE is any */
+    uint32_t            buffer_id;
+    uint8_t             table_id;       /* ignored by 1.0 */
+    uint32_t            meter_id;       /* 1.3 only; 0 for none */
+
+    uint8_t             n_actions;
+    struct flow_action  actions[FLOW_MOD_MAX_ACTIONS];
+};
+
+/* Wildcard everything, no actions, permanent, default priority, no
+ * buffer, any out_port, table 0. */
+void flow_mod_init(struct flow_mod *mod, uint16_t command);
+
+/* Returns -1 if the action list is full */
+int flow_mod_add_output(struct flow_mod *mod, uint16_t port,
+                        uint16_t max_len);
+
+/* Out of port through one of its queues (set up on the switch) */
+int flow_mod_add_enqueue(struct flow_mod *mod, uint16_t port,
+                         uint32_t queue_id);
+
+/* Encode for an OpenFlow version (0 is taken as 1.0). Returns the length,
+* or 0 if the version is unknown, cannot express the mod (a meter over
+* 1.0) or it does not fit in len bytes. */
+size_t flow_mod_encode(uint8_t version, const struct flow_mod *mod,
+                       void *buf, size_t len);
+
+int flow_mod_send(struct fox_state *state, const struct flow_mod *mod);
+
+#endif
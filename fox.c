@@ -1,34 +1,44 @@
 #include <event2/event.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include "fox.h"
 #include "controller.h"
+#include "telex.h"
 #include "logger.h"
 
 
-void cleanup_state(struct fox_state *state)
-{
-    if (state->controller_bev) {
-        bufferevent_free(state->controller_bev);
-    }
-}
-
 void echo_cb(struct fox_state *state, void *payload)
 {
     LogInfo(state->name, "main got an echo callback!");
 }
 
-int main(char *argv[], int argc)
+int main(int argc, char *argv[])
 {
     struct event_base *base;
     struct fox_state *state;
+    char *config_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+        case 'c':
+            config_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c config]\n", argv[0]);
+            return 1;
+        }
+    }
 
     LogOutputStream(stdout);
     LogOutputLevel(LOG_DEBUG);
 
     base = event_base_new();
 
-    telex_init(base);
+    if (telex_init(base, config_path)) {
+        return 1;
+    }
    
     event_base_dispatch(base);
     
@@ -8,6 +8,22 @@
 #include "openflow.h"
 
 struct fox_state;
+struct fox_datapath;
+struct admit;
+struct evconnlistener;
+
+/* Classes of outgoing messages, highest priority first (see
+ * controller_send_class) */
+#define CONTROLLER_CLASS_CONTROL    0   /* echo, features, role, errors */
+#define CONTROLLER_CLASS_BARRIER    1
+#define CONTROLLER_CLASS_UNBLOCK    2   /* deletes that may overtake adds */
+#define CONTROLLER_CLASS_BLOCK      3   /* flow adds and modifies */
+#define CONTROLLER_CLASS_BULK       4   /* stats requests, packet outs */
+#define CONTROLLER_CLASSES          5
+
+/* Most messages, and bytes of them, handed to batch handlers at once */
+#define CONTROLLER_BATCH_MAX        256
+#define CONTROLLER_BATCH_BYTES      (256 * 1024)
 
 struct handler_list {
     struct handler_list *next;
@@ -15,17 +31,82 @@ struct handler_list {
                  void *payload);
 };
 
+struct batch_handler_list {
+    struct batch_handler_list *next;
+    void (*func)(struct fox_state *state,
+                 void **payloads, size_t n);
+};
+
 struct fox_state {
     char                *name;
     struct event_base   *base;
     struct bufferevent  *controller_bev;
+    struct evconnlistener *listener;
     struct event        *echo_timer;
     struct event        *echo_timeout;
     uint32_t            echo_period_ms;
+    uint8_t             echo_late;      /* no reply to the last echo yet */
+
+    /* 1 if we connect to the switch (and reconnect to port), 0 if it
+     * connects to us */
+    uint8_t             active;
+    uint16_t            port;
+
+    /* OpenFlow version agreed in the HELLO exchange; 0 until then */
+    uint8_t             version;
+
+    /* Learned from the switch's features reply */
+    uint64_t            datapath_id;
+    struct fox_datapath *datapath;      /* see datapath.h */
+    uint8_t             n_tables;
+    uint16_t            n_ports;
+    struct ofp_phy_port *ports;
+
+    /* OpenFlow 1.3: features reply waiting for its port list */
+    struct ofp_switch_features *pending_features;
+    size_t              pending_features_len;
 
     void (*controller_join_cb)(struct fox_state *state);
 
+    /* Messages waiting for room in the bufferevent, by class, and how
+     * many ever went into and out of each. Without send_ev (a fox_state
+     * not made by controller_new) messages are written straight out. */
+    struct evbuffer     *send_queue[CONTROLLER_CLASSES];
+    uint64_t            send_queued[CONTROLLER_CLASSES];
+    uint64_t            send_sent[CONTROLLER_CLASSES];
+    struct event        *send_ev;
+
+    /* The last barrier written out on this connection, if any */
+    uint32_t            barrier_xid;
+    uint8_t             barrier_sent;
+
+    /* Token bucket on flow mods; flow_mod_rate 0 is no limit */
+    uint32_t            flow_mod_rate;      /* per second */
+    uint32_t            flow_mod_burst;
+    double              flow_mod_tokens;
+    uint64_t            flow_mod_refill_us;
+
     struct handler_list *msg_handler[256];
+    struct batch_handler_list *batch_handler[256];
+
+    /* Messages of batch_type held for its batch handlers, back to back in
+     * batch_buf, each starting at its batch_off */
+    uint8_t             batch_type;
+    uint32_t            batch_count;
+    uint32_t            batch_off[CONTROLLER_BATCH_MAX];
+    char                *batch_buf;
+    size_t              batch_len;
+    size_t              batch_size;
+
+    /* Packet-ins are admitted by this before they are read, if set
+     * (see admit.h) */
+    struct admit        *admit;
+
+    /* Messages that failed validation, and bytes skipped looking for the
+     * next good header after one that could not be framed */
+    uint64_t            bad_msgs;
+    uint64_t            resync_bytes;
+    int                 resyncing;
 
     void                *user_ptr;
 };
@@ -0,0 +1,466 @@
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include "ha.h"
+#include "logger.h"
+
+static uint64_t ha_now_ms(struct ha_state *ha)
+{
+    struct timeval tv;
+
+    event_base_gettimeofday_cached(ha->base, &tv);
+
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void ha_send(struct ha_state *ha, uint8_t type,
+                    const struct block_key *key, uint8_t action,
+                    uint8_t flags, uint64_t value)
+{
+    struct ha_record rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.action = action;
+    rec.flags = flags;
+    if (key != NULL) {
+        rec.key = *key;
+    }
+    rec.value = htobe64(value);
+
+    bufferevent_write(ha->bev, &rec, sizeof(rec));
+    ha->n_sent++;
+}
+
+/* Forget the link; the timer makes a new one */
+static void ha_drop(struct ha_state *ha)
+{
+    if (ha->bev != NULL) {
+        bufferevent_free(ha->bev);
+        ha->bev = NULL;
+    }
+    ha->outgoing = 0;
+    ha->peer_known = 0;
+    ha->streaming = 0;
+}
+
+static void ha_send_hello(struct ha_state *ha)
+{
+    ha_send(ha, HA_REC_HELLO, NULL, ha->role, ha->preferred,
+            ha_primary(ha) ? ha->generation : 0);
+}
+
+void ha_log(struct ha_state *ha, uint8_t type, const struct block_key *key,
+            uint8_t action, uint8_t flags, uint64_t value)
+{
+    if (!ha_primary(ha) || ha->bev == NULL || !ha->streaming) {
+        return;
+    }
+    ha_send(ha, type, key, action, flags, value);
+
+    if (evbuffer_get_length(bufferevent_get_output(ha->bev)) >
+        HA_MAX_BUFFERED) {
+        LogWarn(ha->name, "Standby is not keeping up, dropping it");
+        ha_drop(ha);
+    }
+}
+
+static void ha_send_snapshot(struct ha_state *ha)
+{
+    ha->streaming = 1;
+    ha->snapshot_ms = ha_now_ms(ha);
+    ha->snapshot_from = ha->n_sent;
+
+    ha_log(ha, HA_REC_SNAPSHOT, NULL, 0, 0, 0);
+    ha->snapshot_cb(ha->arg);
+
+    LogInfo(ha->name, "Sent standby a snapshot (%llu records)",
+            (unsigned long long)(ha->n_sent - ha->snapshot_from));
+}
+
+/* Start the standby off once it has said it is one */
+static void ha_check_stream(struct ha_state *ha)
+{
+    if (ha_primary(ha) && ha->bev != NULL && ha->peer_known &&
+        ha->peer_role == HA_ROLE_STANDBY && !ha->streaming) {
+        ha_send_snapshot(ha);
+    }
+}
+
+static void ha_tail_clear(struct ha_state *ha)
+{
+    ha->n_tail = 0;
+}
+
+static void ha_become(struct ha_state *ha, uint8_t role)
+{
+    uint64_t now = ha_now_ms(ha);
+
+    if (role == HA_ROLE_PRIMARY) {
+        ha->generation = now;
+        if (ha->generation <= ha->peer_generation) {
+            ha->generation = ha->peer_generation + 1;
+        }
+        ha->n_takeovers++;
+        LogWarn(ha->name, "Taking over as primary (generation %llu, %s)",
+                (unsigned long long)ha->generation,
+                !ha->synced ? "no copy of the blocks" :
+                !ha->settled ? "resending every block" :
+                               "resending unconfirmed changes");
+    } else {
+        LogWarn(ha->name, "Stepping down to standby");
+        ha->heard_ms = now;
+    }
+
+    ha->role = role;
+    ha->streaming = 0;
+    ha->role_cb(ha->arg, role);
+
+    ha->synced = 0;
+    ha->settled = 0;
+    ha_tail_clear(ha);
+
+    if (ha->bev != NULL) {
+        ha_send_hello(ha);
+        ha_check_stream(ha);
+    }
+}
+
+/* Configured preference, then addresses, which differ and are seen the
+ * same way from both ends */
+static int ha_prefers_self(struct ha_state *ha)
+{
+    uint64_t mine, theirs;
+
+    if (ha->preferred != ha->peer_preferred) {
+        return ha->preferred;
+    }
+    mine = (uint64_t)ntohl(inet_addr(ha->listen_ip)) << 16 | ha->listen_port;
+    theirs = (uint64_t)ntohl(inet_addr(ha->peer_ip)) << 16 | ha->peer_port;
+    return mine < theirs;
+}
+
+/* Order between two instances that both claim, or both want, the primary
+ * role */
+static int ha_outranks_peer(struct ha_state *ha)
+{
+    if (ha_primary(ha) && ha->generation != ha->peer_generation) {
+        return ha->generation > ha->peer_generation;
+    }
+    return ha_prefers_self(ha);
+}
+
+static void ha_handle_hello(struct ha_state *ha, const struct ha_record *rec)
+{
+    ha->peer_known = 1;
+    ha->peer_role = rec->action;
+    ha->peer_preferred = rec->flags & 1;
+    ha->peer_generation = be64toh(rec->value);
+
+    if (ha->peer_role == HA_ROLE_PRIMARY) {
+        if (!ha_primary(ha)) {
+            LogInfo(ha->name, "Following primary (generation %llu)",
+                    (unsigned long long)ha->peer_generation);
+            ha->heard_ms = ha_now_ms(ha);
+        } else if (!ha_outranks_peer(ha)) {
+            ha_become(ha, HA_ROLE_STANDBY);
+        }
+        return;
+    }
+
+    if (!ha_primary(ha) && ha_outranks_peer(ha)) {
+        ha_become(ha, HA_ROLE_PRIMARY);
+    }
+    ha_check_stream(ha);
+}
+
+/* Until the next pass every switch confirms, the tail says too little */
+static void ha_tail_lost(struct ha_state *ha)
+{
+    ha_tail_clear(ha);
+    ha->settled = 0;
+    ha->settle_next = 1;
+}
+
+static void ha_tail_add(struct ha_state *ha, const struct ha_record *rec)
+{
+    if (ha->n_tail == HA_TAIL_MAX) {
+        LogWarn(ha->name, "Too many unconfirmed changes to keep; would "
+                "resend every block on taking over");
+        ha_tail_lost(ha);
+    }
+    if (ha->n_tail == ha->tail_size) {
+        uint32_t size = ha->tail_size ? ha->tail_size * 2 : 1024;
+        struct ha_record *tail;
+
+        tail = realloc(ha->tail, size * sizeof(*tail));
+        if (tail == NULL) {
+            LogError(ha->name, "Unable to grow the tail to %u records",
+                     size);
+            ha_tail_lost(ha);
+            return;
+        }
+        ha->tail = tail;
+        ha->tail_size = size;
+    }
+    ha->tail[ha->n_tail++] = *rec;
+}
+
+/* Every switch has pass xid, and so everything logged before it */
+static void ha_confirm(struct ha_state *ha, uint32_t xid)
+{
+    uint32_t k;
+
+    for (k=0; k<ha->n_tail; k++) {
+        if (ha->tail[k].type == HA_REC_PASS &&
+            (uint32_t)be64toh(ha->tail[k].value) == xid) {
+            ha->n_tail -= k + 1;
+            memmove(ha->tail, ha->tail + k + 1,
+                    ha->n_tail * sizeof(*ha->tail));
+            break;
+        }
+    }
+
+    if (ha->synced && !ha->settled && !ha->settle_next &&
+        (int32_t)(xid - ha->settle_xid) >= 0) {
+        ha->settled = 1;
+    }
+}
+
+/* A record from the primary we follow */
+static void ha_apply(struct ha_state *ha, const struct ha_record *rec)
+{
+    ha->heard_ms = ha_now_ms(ha);
+    ha->n_applied++;
+
+    switch (rec->type) {
+    case HA_REC_HEARTBEAT:
+        break;
+    case HA_REC_SNAPSHOT:
+        ha->synced = 0;
+        ha->apply_cb(ha->arg, rec);
+        break;
+    case HA_REC_ENTRY:
+    case HA_REC_GROUP:
+        ha->apply_cb(ha->arg, rec);
+        break;
+    case HA_REC_SNAPSHOT_END:
+        ha->apply_cb(ha->arg, rec);
+        ha_tail_clear(ha);
+        ha->synced = 1;
+        ha->settled = !(rec->flags & 1);
+        ha->settle_xid = be64toh(rec->value);
+        ha->settle_next = 0;
+        LogInfo(ha->name, "Have a snapshot from the primary");
+        break;
+    case HA_REC_BLOCK:
+    case HA_REC_FORGET:
+        ha->apply_cb(ha->arg, rec);
+        ha_tail_add(ha, rec);
+        break;
+    case HA_REC_PASS:
+        if (ha->settle_next) {
+            ha->settle_xid = be64toh(rec->value);
+            ha->settle_next = 0;
+        }
+        ha_tail_add(ha, rec);
+        break;
+    case HA_REC_CONFIRMED:
+        ha_confirm(ha, be64toh(rec->value));
+        break;
+    default:
+        LogWarn(ha->name, "Unknown record type %d", rec->type);
+        break;
+    }
+}
+
+void ha_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct ha_state *ha = ctx;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    struct ha_record rec;
+
+    while (ha->bev == bev &&
+           evbuffer_remove(input, &rec, sizeof(rec)) == sizeof(rec)) {
+        if (rec.type == HA_REC_HELLO) {
+            ha_handle_hello(ha, &rec);
+        } else if (!ha->peer_known) {
+            LogError(ha->name, "Peer did not start with a hello");
+            ha_drop(ha);
+        } else if (!ha_primary(ha) && ha->peer_role == HA_ROLE_PRIMARY) {
+            ha_apply(ha, &rec);
+        }
+    }
+}
+
+void ha_event_cb(struct bufferevent *bev, short events, void *ctx)
+{
+    struct ha_state *ha = ctx;
+
+    if (events & BEV_EVENT_CONNECTED) {
+        LogInfo(ha->name, "Connected to peer %s:%d", ha->peer_ip,
+                ha->peer_port);
+        ha_send_hello(ha);
+        return;
+    }
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        if (ha->peer_known) {
+            LogWarn(ha->name, "Lost the link to the peer");
+        }
+        ha_drop(ha);
+    }
+}
+
+static void ha_connect(struct ha_state *ha)
+{
+    struct sockaddr_in sin;
+
+    ha->bev = bufferevent_socket_new(ha->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (ha->bev == NULL) {
+        LogError(ha->name, "Could not create peer bufferevent");
+        return;
+    }
+    ha->outgoing = 1;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr(ha->peer_ip);
+    sin.sin_port = htons(ha->peer_port);
+
+    bufferevent_setcb(ha->bev, ha_read_cb, NULL, ha_event_cb, ha);
+    bufferevent_enable(ha->bev, EV_READ);
+    if (bufferevent_socket_connect(ha->bev, (struct sockaddr *)&sin,
+                                   sizeof(sin)) < 0) {
+        ha_drop(ha);
+    }
+}
+
+/* When both ends connect at once, the one ha_prefers_self picks keeps its
+ * own connection and the other takes it, so exactly one survives */
+void ha_accept_cb(struct evconnlistener *listener, evutil_socket_t fd,
+                  struct sockaddr *address, int socklen, void *ctx)
+{
+    struct ha_state *ha = ctx;
+
+    if (ha->bev != NULL && ha->outgoing && ha_prefers_self(ha)) {
+        evutil_closesocket(fd);
+        return;
+    }
+    ha_drop(ha);
+
+    ha->bev = bufferevent_socket_new(ha->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (ha->bev == NULL) {
+        LogError(ha->name, "Could not create peer bufferevent");
+        evutil_closesocket(fd);
+        return;
+    }
+    LogInfo(ha->name, "Peer connected");
+
+    bufferevent_setcb(ha->bev, ha_read_cb, NULL, ha_event_cb, ha);
+    bufferevent_enable(ha->bev, EV_READ);
+    ha_send_hello(ha);
+}
+
+void ha_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct ha_state *ha = arg;
+    uint64_t now = ha_now_ms(ha);
+
+    if (ha->bev == NULL) {
+        ha_connect(ha);
+    }
+
+    if (!ha_primary(ha)) {
+        if (now - ha->heard_ms > ha->timeout_ms) {
+            LogWarn(ha->name, "No word from a primary for %u ms",
+                    ha->timeout_ms);
+            ha_become(ha, HA_ROLE_PRIMARY);
+        }
+        return;
+    }
+
+    if (ha->streaming && ha->snapshot_s != 0 &&
+        now - ha->snapshot_ms >= (uint64_t)ha->snapshot_s * 1000) {
+        ha_send_snapshot(ha);
+    } else if (ha->streaming) {
+        ha_log(ha, HA_REC_HEARTBEAT, NULL, 0, 0, 0);
+    }
+}
+
+struct ha_state *ha_init(struct event_base *base,
+                         const struct fox_config *cfg,
+                         void (*role_cb)(void *arg, uint8_t role),
+                         void (*apply_cb)(void *arg,
+                                          const struct ha_record *rec),
+                         void (*snapshot_cb)(void *arg), void *arg)
+{
+    struct ha_state *ha;
+    struct sockaddr_in sin;
+    struct timeval tv;
+
+    ha = malloc(sizeof(*ha));
+    if (ha == NULL) {
+        LogError("HA", "Unable to malloc %d bytes", sizeof(*ha));
+        return NULL;
+    }
+    memset(ha, 0, sizeof(*ha));
+
+    ha->name = "HA";
+    ha->base = base;
+    strcpy(ha->listen_ip, cfg->ha.listen_ip);
+    ha->listen_port = cfg->ha.listen_port;
+    strcpy(ha->peer_ip, cfg->ha.peer_ip);
+    ha->peer_port = cfg->ha.peer_port;
+    ha->preferred = cfg->ha.role == CONFIG_HA_PRIMARY;
+    /* Until its first hello the peer is taken to be configured the same,
+     * which both ends then agree falls back to the addresses */
+    ha->peer_preferred = ha->preferred;
+    ha->heartbeat_ms = cfg->ha.heartbeat_ms;
+    ha->timeout_ms = cfg->ha.timeout_ms;
+    ha->snapshot_s = cfg->ha.snapshot_s;
+    ha->role = HA_ROLE_STANDBY;
+    ha->role_cb = role_cb;
+    ha->apply_cb = apply_cb;
+    ha->snapshot_cb = snapshot_cb;
+    ha->arg = arg;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr(ha->listen_ip);
+    sin.sin_port = htons(ha->listen_port);
+
+    ha->listener = evconnlistener_new_bind(base, ha_accept_cb, ha,
+                            LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
+                            (struct sockaddr *)&sin, sizeof(sin));
+    if (ha->listener == NULL) {
+        LogError(ha->name, "Error binding %s:%d", ha->listen_ip,
+                 ha->listen_port);
+        free(ha);
+        return NULL;
+    }
+
+    ha->timer = event_new(base, -1, EV_PERSIST, ha_timer_cb, ha);
+    if (ha->timer == NULL) {
+        LogError(ha->name, "Could not create timer");
+        evconnlistener_free(ha->listener);
+        free(ha);
+        return NULL;
+    }
+    tv.tv_sec = ha->heartbeat_ms / 1000;
+    tv.tv_usec = (ha->heartbeat_ms % 1000) * 1000;
+    evtimer_add(ha->timer, &tv);
+
+    ha->started_ms = ha_now_ms(ha);
+    ha->heard_ms = ha->started_ms;
+
+    LogInfo(ha->name, "Standing by for peer %s:%d (%s)", ha->peer_ip,
+            ha->peer_port, ha->preferred ? "preferred primary" : "standby");
+    ha_connect(ha);
+
+    return ha;
+}
@@ -0,0 +1,148 @@
+#ifndef HA_H
+#define HA_H
+
+#include <stdint.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/bufferevent.h>
+#include "blocktable.h"
+#include "config.h"
+
+/* Built-in defaults for the ha_* settings in struct fox_config */
+#define HA_HEARTBEAT_MS         500
+#define HA_TIMEOUT_MS           3000
+#define HA_SNAPSHOT_S           600
+
+/* More than this waiting to go to the standby and it is cut off; it gets
+ * a fresh snapshot when it reconnects */
+#define HA_MAX_BUFFERED         (64 * 1024 * 1024)
+
+/* Deltas the standby holds on to while passes go unconfirmed. Past this
+ * it gives up on them and would resend every block on taking over. */
+#define HA_TAIL_MAX             (1 << 20)
+
+#define HA_ROLE_STANDBY         0
+#define HA_ROLE_PRIMARY         1
+
+/*
+* The replication stream is a sequence of fixed-size ha_records. Each side
+* opens with a HELLO. The primary then sends its standby a SNAPSHOT of
+* the shadow block table (ENTRY and GROUP records closed by SNAPSHOT_END),
+* and after that a BLOCK or FORGET for every change to it, a PASS as each
+* scheduling pass closes and a CONFIRMED once every switch has answered
+* its barrier. Snapshots are repeated every ha_snapshot_s to undo any
+* drift between the two tables.
+*/
+#define HA_REC_HELLO            1   /* action: role, flags: preferred,
+                                       value: generation */
+#define HA_REC_HEARTBEAT        2
+#define HA_REC_BLOCK            3   /* key, action, value: installed_ms */
+#define HA_REC_FORGET           4   /* key */
+#define HA_REC_PASS             5   /* value: pass xid */
+#define HA_REC_CONFIRMED        6   /* value: pass xid */
+#define HA_REC_SNAPSHOT         7
+#define HA_REC_ENTRY            8   /* key, action, flags,
+                                       value: installed_ms */
+#define HA_REC_GROUP            9   /* key: group's, action: kind, flags */
+#define HA_REC_SNAPSHOT_END     10  /* flags: 1 if passes were unconfirmed,
+                                       value: the newest of them */
+
+/* key is in network byte order as in block_key, and so is value */
+struct ha_record {
+    uint8_t             type;
+    uint8_t             action;
+    uint8_t             flags;
+    uint8_t             pad;
+    struct block_key    key;
+    uint64_t            value;
+} __attribute__((__packed__));
+
+/*
+* One of two fox instances sharing the switches. Both listen for their
+* peer and connect to it while they have no link; when both links come up
+* at once, the one the preferred (configured primary) instance made is
+* kept, or if neither or both are, the one made by the instance with the
+* lower listen address and port. An instance starts as a standby. It becomes primary when its peer
+* says it is a standby too and it is the preferred one, or once it has
+* heard nothing from a primary for ha_timeout_ms. Two primaries (after a
+* partition) settle it by generation: the older one steps down.
+*
+* A standby keeps the BLOCK and FORGET records since the last pass every
+* switch confirmed (the tail). On taking over only those have to be
+* resent; everything before them is already on the switches.
+*/
+struct ha_state {
+    char                    *name;
+    struct event_base       *base;
+    struct evconnlistener   *listener;
+    struct bufferevent      *bev;       /* link to the peer, if any */
+    int                     outgoing;   /* bev is a connection we made */
+    struct event            *timer;
+
+    char                    listen_ip[INET_ADDRSTRLEN];
+    uint16_t                listen_port;
+    char                    peer_ip[INET_ADDRSTRLEN];
+    uint16_t                peer_port;
+    int                     preferred;
+    uint32_t                heartbeat_ms;
+    uint32_t                timeout_ms;
+    uint32_t                snapshot_s;
+
+    uint8_t                 role;       /* HA_ROLE_* */
+    uint64_t                generation; /* while primary */
+    uint64_t                started_ms;
+    uint64_t                heard_ms;   /* last record from a primary */
+
+    /* What the peer said in its HELLO on this link */
+    int                     peer_known;
+    uint8_t                 peer_role;
+    int                     peer_preferred;
+    uint64_t                peer_generation;
+
+    /* Primary: the standby has had a snapshot, when, and n_sent before it */
+    int                     streaming;
+    uint64_t                snapshot_ms;
+    uint64_t                snapshot_from;
+
+    /* Standby: a whole snapshot came in; settled once every pass that was
+     * unconfirmed when it was taken has been confirmed */
+    int                     synced;
+    int                     settled;
+    uint32_t                settle_xid;
+    int                     settle_next;    /* on the next PASS's xid */
+    struct ha_record        *tail;
+    uint32_t                n_tail;
+    uint32_t                tail_size;
+
+    /* Owner's side: role changes (the tail is cleared once role_cb
+     * returns), records to apply (standby), and writing a snapshot with
+     * ha_log (primary) */
+    void                    (*role_cb)(void *arg, uint8_t role);
+    void                    (*apply_cb)(void *arg,
+                                        const struct ha_record *rec);
+    void                    (*snapshot_cb)(void *arg);
+    void                    *arg;
+
+    uint64_t                n_sent;
+    uint64_t                n_applied;
+    uint64_t                n_takeovers;
+};
+
+struct ha_state *ha_init(struct event_base *base,
+                         const struct fox_config *cfg,
+                         void (*role_cb)(void *arg, uint8_t role),
+                         void (*apply_cb)(void *arg,
+                                          const struct ha_record *rec),
+                         void (*snapshot_cb)(void *arg), void *arg);
+
+static inline int ha_primary(struct ha_state *ha)
+{
+    return ha->role == HA_ROLE_PRIMARY;
+}
+
+/* Send a record to the standby. Does nothing unless we are primary and
+ * the standby is being kept up to date (or for the snapshot_cb). */
+void ha_log(struct ha_state *ha, uint8_t type, const struct block_key *key,
+            uint8_t action, uint8_t flags, uint64_t value);
+
+#endif
@@ -0,0 +1,342 @@
+#include <event2/event.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include "journal.h"
+#include "logger.h"
+
+static size_t journal_map_len(uint32_t size)
+{
+    return sizeof(struct journal_header) + (size_t)size *
+           sizeof(struct ha_record);
+}
+
+/* Map fd with room for size records */
+static int journal_map(struct journal *j, int fd, uint32_t size)
+{
+    size_t len = journal_map_len(size);
+    void *map;
+
+    if (ftruncate(fd, len) != 0) {
+        LogError(j->name, "ftruncate %s: %s", j->path, strerror(errno));
+        return -1;
+    }
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        LogError(j->name, "mmap %s: %s", j->path, strerror(errno));
+        return -1;
+    }
+
+    j->fd = fd;
+    j->hdr = map;
+    j->records = (struct ha_record *)(j->hdr + 1);
+    j->map_len = len;
+    j->size = size;
+    return 0;
+}
+
+static void journal_unmap(struct journal *j)
+{
+    if (j->hdr != NULL) {
+        munmap(j->hdr, j->map_len);
+    }
+    close(j->fd);
+}
+
+static int journal_grow(struct journal *j)
+{
+    uint32_t size = j->size > j->n_records ? j->size : j->n_records;
+    int fd = j->fd;
+
+    munmap(j->hdr, j->map_len);
+    if (journal_map(j, fd, size + JOURNAL_GROW) == 0) {
+        return 0;
+    }
+    /* Keep what we had; the file is never cut below the records in it */
+    if (journal_map(j, fd, size) != 0) {
+        j->hdr = NULL;
+        j->records = NULL;
+    }
+    return -1;
+}
+
+void journal_log(struct journal *j, uint8_t type, const struct block_key *key,
+                 uint8_t action, uint8_t flags, uint64_t value)
+{
+    struct ha_record *rec;
+
+    /* Until the file being replaced is, it gets every record too */
+    if (j->prev != NULL) {
+        journal_log(j->prev, type, key, action, flags, value);
+    }
+
+    /* Once a record is missing the file stays as it is until the
+     * compaction on the timer replaces it */
+    if (j->lost || j->hdr == NULL) {
+        return;
+    }
+    if (j->n_records >= j->size && journal_grow(j) != 0) {
+        if (!j->lost) {
+            LogError(j->name, "Unable to grow %s, it is out of date until "
+                     "compacted", j->path);
+        }
+        j->lost = 1;
+        return;
+    }
+
+    rec = &j->records[j->n_records++];
+    rec->action = action;
+    rec->flags = flags;
+    if (key != NULL) {
+        rec->key = *key;
+    }
+    rec->value = htobe64(value);
+    __atomic_store_n(&rec->type, type, __ATOMIC_RELEASE);
+
+    j->n_logged++;
+}
+
+static void journal_tmp_path(struct journal *j, char *tmp, size_t len)
+{
+    snprintf(tmp, len, "%s.new", j->path);
+}
+
+/* msync what was written since the last call */
+static int journal_sync(struct journal *j)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t start, end;
+
+    if (j->hdr == NULL || j->synced == j->n_records) {
+        return 0;
+    }
+    start = journal_map_len(j->synced) & ~(size_t)(page - 1);
+    end = journal_map_len(j->n_records);
+    if (msync((char *)j->hdr + start, end - start, MS_SYNC) != 0) {
+        LogWarn(j->name, "msync %s: %s", j->path, strerror(errno));
+        return -1;
+    }
+    j->synced = j->n_records;
+    return 0;
+}
+
+/* Write the new file out off the event loop. Its mapping may be grown
+ * meanwhile, but the descriptor stays, and the zero-filled room past the
+ * records has nothing to write. */
+static void *journal_sync_thread(void *arg)
+{
+    struct journal *j = arg;
+    int err = fdatasync(j->sync_fd) != 0 ? errno : 0;
+
+    __atomic_store_n(&j->sync_err, err, __ATOMIC_RELAXED);
+    __atomic_store_n(&j->sync_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Go back to the file the compaction was replacing */
+static void journal_compact_abandon(struct journal *j)
+{
+    struct journal *prev = j->prev;
+    char tmp[CONFIG_PATH_LEN + 8];
+
+    journal_tmp_path(j, tmp, sizeof(tmp));
+    journal_unmap(j);
+    unlink(tmp);
+    *j = *prev;
+    free(prev);
+}
+
+int journal_compact(struct journal *j)
+{
+    struct journal *prev;
+    char tmp[CONFIG_PATH_LEN + 8];
+    int fd;
+
+    /* The snapshot being written out is already out of date */
+    if (j->prev != NULL) {
+        j->lost = 1;
+        j->prev->lost = 1;
+        return 0;
+    }
+
+    prev = malloc(sizeof(*prev));
+    if (prev == NULL) {
+        LogError(j->name, "Unable to malloc %d bytes", sizeof(*prev));
+        return -1;
+    }
+    *prev = *j;
+
+    journal_tmp_path(j, tmp, sizeof(tmp));
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LogError(j->name, "open %s: %s", tmp, strerror(errno));
+        free(prev);
+        return -1;
+    }
+    if (journal_map(j, fd, prev->n_records + JOURNAL_GROW) != 0) {
+        close(fd);
+        unlink(tmp);
+        free(prev);
+        return -1;
+    }
+    j->hdr->magic = JOURNAL_MAGIC;
+    j->hdr->version = JOURNAL_VERSION;
+    j->hdr->record_size = sizeof(struct ha_record);
+    j->n_records = 0;
+    j->lost = 0;
+
+    /* A memory copy into the new mapping */
+    j->snapshot_cb(j->arg);
+
+    j->prev = prev;
+    j->synced = j->n_records;
+    j->sync_fd = fd;
+    j->sync_done = 0;
+    if (j->lost ||
+        pthread_create(&j->sync_thread, NULL, journal_sync_thread, j) != 0) {
+        LogError(j->name, "Unable to compact %s", j->path);
+        journal_compact_abandon(j);
+        return -1;
+    }
+    return 0;
+}
+
+/* The snapshot is on disk: sync what was logged since, and only then put
+ * the new file in the old one's place */
+static void journal_compact_finish(struct journal *j)
+{
+    char tmp[CONFIG_PATH_LEN + 8];
+
+    pthread_join(j->sync_thread, NULL);
+    journal_tmp_path(j, tmp, sizeof(tmp));
+
+    /* lost: a record did not make it, or the snapshot went stale */
+    if (j->lost) {
+        journal_compact_abandon(j);
+        return;
+    }
+    if (j->sync_err != 0 || journal_sync(j) != 0 ||
+        rename(tmp, j->path) != 0) {
+        LogError(j->name, "Unable to compact %s: %s", j->path,
+                 strerror(j->sync_err != 0 ? j->sync_err : errno));
+        journal_compact_abandon(j);
+        return;
+    }
+    LogDebug(j->name, "Compacted %s from %u to %u records", j->path,
+             j->prev->n_records, j->n_records);
+    journal_unmap(j->prev);
+    free(j->prev);
+    j->prev = NULL;
+
+    j->compact_at = j->n_records * 2 + JOURNAL_COMPACT_MIN;
+    j->n_compactions++;
+}
+
+/* Flush what was written since the last tick, and compact if due */
+void journal_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct journal *j = arg;
+
+    if (j->prev != NULL) {
+        journal_sync(j->prev);
+        if (__atomic_load_n(&j->sync_done, __ATOMIC_ACQUIRE)) {
+            journal_compact_finish(j);
+        }
+        return;
+    }
+    if (j->lost || j->n_records >= j->compact_at) {
+        journal_compact(j);
+        return;
+    }
+    journal_sync(j);
+}
+
+struct journal *journal_open(struct event_base *base,
+                             const struct fox_config *cfg,
+                             void (*apply_cb)(void *arg,
+                                              const struct ha_record *rec),
+                             void (*snapshot_cb)(void *arg), void *arg)
+{
+    struct journal *j;
+    struct stat st;
+    struct timeval tv;
+    uint32_t size = JOURNAL_GROW;
+    int fd, fresh;
+
+    j = malloc(sizeof(*j));
+    if (j == NULL) {
+        LogError("Journal", "Unable to malloc %d bytes", sizeof(*j));
+        return NULL;
+    }
+    memset(j, 0, sizeof(*j));
+    j->name = "Journal";
+    strcpy(j->path, cfg->journal_path);
+    j->sync_ms = cfg->journal_sync_ms;
+    j->snapshot_cb = snapshot_cb;
+    j->arg = arg;
+
+    fd = open(j->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        LogError(j->name, "open %s: %s", j->path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(j);
+        return NULL;
+    }
+
+    /* A torn tail is left as it is; the zero type after it ends the
+     * records */
+    fresh = st.st_size < (off_t)sizeof(struct journal_header);
+    if (!fresh) {
+        size = (st.st_size - sizeof(struct journal_header)) /
+               sizeof(struct ha_record);
+    }
+    if (journal_map(j, fd, size) != 0) {
+        close(fd);
+        free(j);
+        return NULL;
+    }
+
+    if (fresh) {
+        j->hdr->magic = JOURNAL_MAGIC;
+        j->hdr->version = JOURNAL_VERSION;
+        j->hdr->record_size = sizeof(struct ha_record);
+    } else if (j->hdr->magic != JOURNAL_MAGIC ||
+               j->hdr->version != JOURNAL_VERSION ||
+               j->hdr->record_size != sizeof(struct ha_record)) {
+        LogError(j->name, "%s is not a version %d journal", j->path,
+                 JOURNAL_VERSION);
+        journal_unmap(j);
+        free(j);
+        return NULL;
+    }
+
+    while (j->n_records < j->size && j->records[j->n_records].type != 0) {
+        apply_cb(arg, &j->records[j->n_records++]);
+    }
+    j->synced = j->n_records;
+    j->compact_at = j->n_records + JOURNAL_COMPACT_MIN;
+
+    LogInfo(j->name, "Recovered %u records from %s", j->n_records, j->path);
+
+    j->timer = event_new(base, -1, EV_PERSIST, journal_timer_cb, j);
+    if (j->timer == NULL) {
+        LogError(j->name, "Could not create timer");
+        journal_unmap(j);
+        free(j);
+        return NULL;
+    }
+    tv.tv_sec = j->sync_ms / 1000;
+    tv.tv_usec = (j->sync_ms % 1000) * 1000;
+    evtimer_add(j->timer, &tv);
+
+    return j;
+}
@@ -0,0 +1,93 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <event2/event.h>
+#include "config.h"
+#include "ha.h"
+
+#define JOURNAL_MAGIC           0x666f786a      /* "foxj" */
+#define JOURNAL_VERSION         1
+
+/* Built-in default for journal_sync_ms in struct fox_config */
+#define JOURNAL_SYNC_MS         1000
+
+/* The file grows by this many records at a time */
+#define JOURNAL_GROW            (1 << 16)
+
+/* Compacted once it holds twice what the last compaction wrote, and this
+ * many records more */
+#define JOURNAL_COMPACT_MIN     (1 << 16)
+
+/*
+* The block table on disk, as a file of the same fixed-size records the
+* HA stream uses (ha.h): the ENTRY and GROUP records of the last
+* compaction, then a BLOCK or FORGET for every change since. The file is
+* mapped and records are written straight into it, so a crash of fox
+* loses nothing the kernel has; journal_sync_ms bounds what a crash of the
+* host can lose. Recovery walks the mapping, with nothing to parse.
+*
+* The file is grown zero-filled ahead of the records, and a record's type
+* is written last, so the first zero type is where the journal ends.
+*/
+struct journal_header {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    record_size;
+    uint32_t    pad;
+};
+
+struct journal {
+    char                    *name;
+    char                    path[CONFIG_PATH_LEN];
+    struct event            *timer;
+    uint32_t                sync_ms;
+
+    int                     fd;
+    struct journal_header   *hdr;
+    struct ha_record        *records;
+    size_t                  map_len;
+    uint32_t                n_records;
+    uint32_t                size;       /* records the mapping has room for */
+    uint32_t                synced;     /* records msync()ed so far */
+    uint32_t                compact_at;
+    int                     lost;       /* a record could not be written */
+
+    /* A compaction being written out by sync_thread. Until it is on disk
+     * and renamed over path, prev is the journal there, and is kept up
+     * to date too. */
+    struct journal          *prev;
+    pthread_t               sync_thread;
+    int                     sync_fd;
+    int                     sync_done;
+    int                     sync_err;
+
+    /* Writes every live entry and group with journal_log */
+    void                    (*snapshot_cb)(void *arg);
+    void                    *arg;
+
+    uint64_t                n_logged;
+    uint64_t                n_compactions;
+};
+
+/* Map path, creating it if need be, and hand every record in it to
+ * apply_cb. Call journal_compact once the owner can take snapshot_cb. */
+struct journal *journal_open(struct event_base *base,
+                             const struct fox_config *cfg,
+                             void (*apply_cb)(void *arg,
+                                              const struct ha_record *rec),
+                             void (*snapshot_cb)(void *arg), void *arg);
+
+void journal_log(struct journal *j, uint8_t type, const struct block_key *key,
+                 uint8_t action, uint8_t flags, uint64_t value);
+
+/* Start replacing the file with a snapshot. The snapshot is a copy into a
+ * new mapping; it is written out by a thread, and renamed into place on
+ * the first timer tick after that. Returns 0, or -1 with the old file
+ * still the only one in use. While one is under way another only marks
+ * it stale, so the tick that finds it done starts over. */
+int journal_compact(struct journal *j);
+
+#endif
@@ -0,0 +1,343 @@
+#include <event2/event.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <linux/if_ether.h>
+#include "fox.h"
+#include "controller.h"
+#include "flowmod.h"
+#include "l2switch.h"
+#include "logger.h"
+
+#define L2_SLOT_MAC(slot)       ((slot) & 0xffffffffffffULL)
+#define L2_SLOT_PORT(slot)      ((uint16_t)((slot) >> 48))
+#define L2_SLOT(mac, port)      ((mac) | ((uint64_t)(port) << 48))
+
+static inline uint64_t mac_to_u64(const uint8_t *mac)
+{
+    return ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) |
+           ((uint64_t)mac[2] << 24) | ((uint64_t)mac[3] << 16) |
+           ((uint64_t)mac[4] << 8)  | (uint64_t)mac[5];
+}
+
+static inline uint32_t l2_hash(uint64_t mac)
+{
+    /* Fibonacci hashing; the high bits are the well mixed ones */
+    return (uint32_t)((mac * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static int l2_table_alloc(struct l2_table *table, uint32_t n_slots)
+{
+    table->slots = calloc(n_slots, sizeof(uint64_t));
+    if (table->slots == NULL) {
+        return -1;
+    }
+    table->mask = n_slots - 1;
+    table->count = 0;
+    return 0;
+}
+
+static void l2_table_insert_slot(struct l2_table *table, uint64_t slot)
+{
+    uint32_t i = l2_hash(L2_SLOT_MAC(slot)) & table->mask;
+
+    while (table->slots[i] != 0) {
+        i = (i + 1) & table->mask;
+    }
+    table->slots[i] = slot;
+    table->count++;
+}
+
+/* Rebuild into a table of n_slots, keeping only entries not on drop_port
+ * (0 keeps everything). */
+static int l2_table_rebuild(struct l2_table *table, uint32_t n_slots,
+                            uint16_t drop_port)
+{
+    struct l2_table old = *table;
+    uint32_t i;
+
+    if (l2_table_alloc(table, n_slots)) {
+        *table = old;
+        return -1;
+    }
+
+    for (i=0; i<=old.mask; i++) {
+        uint64_t slot = old.slots[i];
+        if (slot != 0 && (drop_port == 0 || L2_SLOT_PORT(slot) != drop_port)) {
+            l2_table_insert_slot(table, slot);
+        }
+    }
+    free(old.slots);
+
+    return 0;
+}
+
+int l2_table_lookup(struct l2_table *table, uint64_t mac, uint16_t *port)
+{
+    uint32_t i = l2_hash(mac) & table->mask;
+
+    while (table->slots[i] != 0) {
+        if (L2_SLOT_MAC(table->slots[i]) == mac) {
+            *port = L2_SLOT_PORT(table->slots[i]);
+            return 1;
+        }
+        i = (i + 1) & table->mask;
+    }
+    return 0;
+}
+
+/* Returns 1 if the mac is new, 2 if it moved ports, 0 if unchanged, -1
+ * on error. */
+int l2_table_learn(struct l2_table *table, uint64_t mac, uint16_t port)
+{
+    uint32_t i;
+
+    /* Keep the load factor under 0.7 so probe sequences stay short */
+    if ((table->count + 1) * 10 >= (table->mask + 1) * 7) {
+        if (l2_table_rebuild(table, (table->mask + 1) * 2, 0)) {
+            return -1;
+        }
+    }
+
+    i = l2_hash(mac) & table->mask;
+    while (table->slots[i] != 0) {
+        if (L2_SLOT_MAC(table->slots[i]) == mac) {
+            if (L2_SLOT_PORT(table->slots[i]) == port) {
+                return 0;
+            }
+            table->slots[i] = L2_SLOT(mac, port);
+            return 2;
+        }
+        i = (i + 1) & table->mask;
+    }
+
+    table->slots[i] = L2_SLOT(mac, port);
+    table->count++;
+    return 1;
+}
+
+/* Backward shift deletion: no tombstones, so lookups never get slower as
+ * entries churn. */
+void l2_table_remove(struct l2_table *table, uint64_t mac)
+{
+    uint32_t i = l2_hash(mac) & table->mask;
+    uint32_t j;
+
+    while (L2_SLOT_MAC(table->slots[i]) != mac) {
+        if (table->slots[i] == 0) {
+            return;
+        }
+        i = (i + 1) & table->mask;
+    }
+
+    j = i;
+    while (1) {
+        uint32_t home;
+
+        j = (j + 1) & table->mask;
+        if (table->slots[j] == 0) {
+            break;
+        }
+        home = l2_hash(L2_SLOT_MAC(table->slots[j])) & table->mask;
+
+        /* The entry at j may fill the hole at i only if its home slot is
+         * not cyclically within (i, j] */
+        if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+    table->slots[i] = 0;
+    table->count--;
+}
+
+static void l2switch_send_flow_mod(struct l2switch_state *l2,
+                                   const uint8_t *dl_dst, uint16_t command,
+                                   uint16_t out_port, uint32_t buffer_id)
+{
+    struct flow_mod mod;
+
+    flow_mod_init(&mod, command);
+    mod.buffer_id = buffer_id;
+    mod.priority = L2SWITCH_PRIORITY;
+
+    if (dl_dst != NULL) {
+        mod.match.wildcards = htonl(OFPFW_ALL & ~OFPFW_DL_DST);
+        memcpy(mod.match.dl_dst, dl_dst, OFP_ETH_ALEN);
+    }
+
+    if (command == OFPFC_ADD) {
+        /* The output port rides along in the cookie, so a flow removed
+         * for a host that has since moved does not evict its new entry */
+        mod.cookie = L2SWITCH_COOKIE | out_port;
+        mod.idle_timeout = L2SWITCH_IDLE_TIMEOUT;
+        mod.flags = OFPFF_SEND_FLOW_REM;
+        flow_mod_add_output(&mod, out_port, 0);
+
+        l2->flows_installed++;
+    } else {
+        mod.out_port = out_port;
+    }
+
+    flow_mod_send(l2->sw, &mod);
+}
+
+void l2switch_packet_in_cb(struct fox_state *sw, void *payload)
+{
+    struct l2switch_state *l2 = sw->user_ptr;
+    struct ofp_packet_in *pkt_in = payload;
+    size_t msg_len = ntohs(pkt_in->header.length);
+    size_t data_len = msg_len - offsetof(struct ofp_packet_in, data);
+    uint8_t *eth = pkt_in->data;
+    uint16_t in_port = ntohs(pkt_in->in_port);
+    uint32_t buffer_id = ntohl(pkt_in->buffer_id);
+    uint64_t src, dst;
+    uint16_t out_port;
+
+    if (msg_len < offsetof(struct ofp_packet_in, data) + ETH_HLEN) {
+        return;
+    }
+    l2->packet_ins++;
+
+    dst = mac_to_u64(eth);
+    src = mac_to_u64(eth + OFP_ETH_ALEN);
+
+    if (!(eth[OFP_ETH_ALEN] & 1) && src != 0) {
+        if (l2_table_learn(&l2->table, src, in_port) == 2) {
+            /* Host moved; drop any flow still pointing at its old port */
+            l2switch_send_flow_mod(l2, eth + OFP_ETH_ALEN, OFPFC_DELETE,
+                                   OFPP_NONE, UINT32_MAX);
+        }
+    }
+
+    if ((eth[0] & 1) || !l2_table_lookup(&l2->table, dst, &out_port)) {
+        l2->floods++;
+        controller_send_packet_out(sw, buffer_id, in_port, OFPP_FLOOD,
+                                   eth, data_len);
+        return;
+    }
+
+    if (out_port == in_port) {
+        return;
+    }
+
+    l2switch_send_flow_mod(l2, eth, OFPFC_ADD, out_port, buffer_id);
+    if (buffer_id == UINT32_MAX) {
+        controller_send_packet_out(sw, buffer_id, in_port, out_port,
+                                   eth, data_len);
+    }
+}
+
+/* Start the table probes for a whole read's worth of packet-ins before
+ * any of them waits on one */
+void l2switch_packet_in_batch_cb(struct fox_state *sw, void **payloads,
+                                 size_t n)
+{
+    struct l2switch_state *l2 = sw->user_ptr;
+    struct l2_table *table = &l2->table;
+    struct ofp_packet_in *pkt_in;
+    size_t i;
+
+    for (i=0; i<n; i++) {
+        pkt_in = payloads[i];
+        if (ntohs(pkt_in->header.length) <
+            offsetof(struct ofp_packet_in, data) + ETH_HLEN) {
+            continue;
+        }
+        __builtin_prefetch(&table->slots[l2_hash(mac_to_u64(pkt_in->data)) &
+                                         table->mask]);
+        __builtin_prefetch(&table->slots[l2_hash(mac_to_u64(pkt_in->data +
+                                                 OFP_ETH_ALEN)) &
+                                         table->mask]);
+    }
+    for (i=0; i<n; i++) {
+        l2switch_packet_in_cb(sw, payloads[i]);
+    }
+}
+
+void l2switch_flow_removed_cb(struct fox_state *sw, void *payload)
+{
+    struct l2switch_state *l2 = sw->user_ptr;
+    struct ofp_flow_removed *removed = payload;
+    uint64_t cookie = be64toh(removed->cookie);
+    uint64_t mac;
+    uint16_t port;
+
+    if ((cookie & ~0xffffULL) != L2SWITCH_COOKIE) {
+        return;
+    }
+    l2->flows_removed++;
+
+    mac = mac_to_u64(removed->match.dl_dst);
+    if (l2_table_lookup(&l2->table, mac, &port) &&
+        port == (uint16_t)cookie) {
+        l2_table_remove(&l2->table, mac);
+    }
+}
+
+void l2switch_port_status_cb(struct fox_state *sw, void *payload)
+{
+    struct l2switch_state *l2 = sw->user_ptr;
+    struct ofp_port_status *status = payload;
+    uint16_t port = ntohs(status->desc.port_no);
+
+    if (status->reason != OFPPR_DELETE &&
+        !(ntohl(status->desc.state) & OFPPS_LINK_DOWN)) {
+        return;
+    }
+
+    LogDebug(l2->name, "Port %d gone, flushing its hosts", port);
+
+    l2_table_rebuild(&l2->table, l2->table.mask + 1, port);
+    l2switch_send_flow_mod(l2, NULL, OFPFC_DELETE, port, UINT32_MAX);
+}
+
+struct l2switch_state *l2switch_attach(struct fox_state *sw)
+{
+    struct l2switch_state *l2;
+
+    l2 = malloc(sizeof(*l2));
+    if (l2 == NULL) {
+        LogError(sw->name, "Unable to malloc %d bytes", sizeof(*l2));
+        return NULL;
+    }
+    memset(l2, 0, sizeof(*l2));
+
+    if (l2_table_alloc(&l2->table, L2SWITCH_TABLE_MIN)) {
+        LogError(sw->name, "Unable to malloc MAC table");
+        free(l2);
+        return NULL;
+    }
+
+    l2->name = sw->name;
+    l2->sw = sw;
+    sw->user_ptr = l2;
+
+    controller_register_batch_handler(sw, OFPT_PACKET_IN,
+                                      l2switch_packet_in_batch_cb);
+    controller_register_handler(sw, OFPT_FLOW_REMOVED,
+                                l2switch_flow_removed_cb);
+    controller_register_handler(sw, OFPT_PORT_STATUS,
+                                l2switch_port_status_cb);
+
+    return l2;
+}
+
+int l2switch_init(struct event_base *base, char *ip, uint16_t port,
+                  int connect)
+{
+    struct fox_state *sw;
+
+    sw = controller_new(base, ip, port, 90*1000, connect);
+    if (sw == NULL) {
+        return -1;
+    }
+
+    if (l2switch_attach(sw) == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
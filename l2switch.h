@@ -0,0 +1,51 @@
+#ifndef L2SWITCH_H
+#define L2SWITCH_H
+
+#include <event2/event.h>
+#include "fox.h"
+
+#define L2SWITCH_TABLE_MIN      1024    /* slots; must be a power of two */
+#define L2SWITCH_IDLE_TIMEOUT   60
+#define L2SWITCH_PRIORITY       OFP_DEFAULT_PRIORITY
+#define L2SWITCH_COOKIE         0x6c32737700000000ULL   /* "l2sw" */
+
+/* MAC -> port table, open addressing with linear probing. Each slot is a
+ * single uint64_t: the MAC in the low 48 bits and the port in the high 16,
+ * so a lookup touches one cache line in the common case. A zero slot is
+ * empty (00:00:00:00:00:00 is never learned). */
+struct l2_table {
+    uint64_t    *slots;
+    uint32_t    mask;
+    uint32_t    count;
+};
+
+struct l2switch_state {
+    char                *name;
+    struct fox_state    *sw;
+    struct l2_table     table;
+
+    uint64_t            packet_ins;
+    uint64_t            floods;
+    uint64_t            flows_installed;
+    uint64_t            flows_removed;
+};
+
+int l2switch_init(struct event_base *base, char *ip, uint16_t port,
+                  int connect);
+
+/* Run the learning switch on an existing connection. Takes over
+ * sw->user_ptr. */
+struct l2switch_state *l2switch_attach(struct fox_state *sw);
+
+int l2_table_lookup(struct l2_table *table, uint64_t mac, uint16_t *port);
+
+int l2_table_learn(struct l2_table *table, uint64_t mac, uint16_t port);
+
+void l2_table_remove(struct l2_table *table, uint64_t mac);
+
+/* l2switch_attach registers the batch one for packet-ins */
+void l2switch_packet_in_cb(struct fox_state *sw, void *payload);
+void l2switch_packet_in_batch_cb(struct fox_state *sw, void **payloads,
+                                 size_t n);
+
+#endif
@@ -0,0 +1,67 @@
+#include <arpa/inet.h>
+#include <string.h>
+#include "matchkey.h"
+
+/* A prefix of the address; 32 or more wildcarded bits leave nothing */
+static uint32_t match_key_prefix(uint32_t addr, uint32_t wild_bits)
+{
+    if (wild_bits >= 32) {
+        return 0;
+    }
+    return addr & htonl(~0u << wild_bits);
+}
+
+/* Field by field: a program has only a handful of wildcard patterns, so
+ * the branches predict well, and beat masking all five words per bit */
+void match_key_init(union match_key *key, const struct ofp_match *match)
+{
+    struct ofp_match *m = &key->match;
+    uint32_t wc = ntohl(match->wildcards) & OFPFW_ALL;
+    uint32_t src_bits = (wc & OFPFW_NW_SRC_MASK) >> OFPFW_NW_SRC_SHIFT;
+    uint32_t dst_bits = (wc & OFPFW_NW_DST_MASK) >> OFPFW_NW_DST_SHIFT;
+
+    memset(key, 0, sizeof(*key));
+
+    if (src_bits > 32) {
+        src_bits = 32;
+    }
+    if (dst_bits > 32) {
+        dst_bits = 32;
+    }
+    wc &= ~(OFPFW_NW_SRC_MASK | OFPFW_NW_DST_MASK);
+    wc |= src_bits << OFPFW_NW_SRC_SHIFT | dst_bits << OFPFW_NW_DST_SHIFT;
+    m->wildcards = htonl(wc);
+
+    if (!(wc & OFPFW_IN_PORT)) {
+        m->in_port = match->in_port;
+    }
+    if (!(wc & OFPFW_DL_SRC)) {
+        memcpy(m->dl_src, match->dl_src, OFP_ETH_ALEN);
+    }
+    if (!(wc & OFPFW_DL_DST)) {
+        memcpy(m->dl_dst, match->dl_dst, OFP_ETH_ALEN);
+    }
+    if (!(wc & OFPFW_DL_VLAN)) {
+        m->dl_vlan = match->dl_vlan;
+    }
+    if (!(wc & OFPFW_DL_VLAN_PCP)) {
+        m->dl_vlan_pcp = match->dl_vlan_pcp;
+    }
+    if (!(wc & OFPFW_DL_TYPE)) {
+        m->dl_type = match->dl_type;
+    }
+    if (!(wc & OFPFW_NW_TOS)) {
+        m->nw_tos = match->nw_tos;
+    }
+    if (!(wc & OFPFW_NW_PROTO)) {
+        m->nw_proto = match->nw_proto;
+    }
+    m->nw_src = match_key_prefix(match->nw_src, src_bits);
+    m->nw_dst = match_key_prefix(match->nw_dst, dst_bits);
+    if (!(wc & OFPFW_TP_SRC)) {
+        m->tp_src = match->tp_src;
+    }
+    if (!(wc & OFPFW_TP_DST)) {
+        m->tp_dst = match->tp_dst;
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef MATCHKEY_H
+#define MATCHKEY_H
+
+#include <stdint.h>
+#include "openflow.h"
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+#define MATCH_KEY_WORDS     (sizeof(struct ofp_match) / sizeof(uint64_t))
+
+/*
+* An ofp_match put in a canonical form, so that two matches a switch treats
+* the same hash and compare the same as five whole words: every field the
+* wildcards leave out is zero, as are the pads, the nw_src/nw_dst prefixes
+* are masked to their length (anything from 32 up is 32), and wildcard bits
+* OpenFlow 1.0 does not define are cleared. Still in network byte order,
+* so the match can go straight into a flow mod.
+*
+* Built with SSE4.2 (e.g. -march=native), the hash is CRC32 based, and
+* with AVX2 or SSE4.2 the compare is too; otherwise both are plain word
+* operations. Hashes are only good within one build, and must not be
+* stored or sent anywhere.
+*/
+union match_key {
+    struct ofp_match    match;
+    uint64_t            w[MATCH_KEY_WORDS];
+};
+
+void match_key_init(union match_key *key, const struct ofp_match *match);
+
+static inline uint32_t match_key_hash(const union match_key *key)
+{
+#if defined(__SSE4_2__)
+    /* Two chains, so one CRC's latency overlaps the other's */
+    uint64_t a = _mm_crc32_u64(0, key->w[0]);
+    uint64_t b = _mm_crc32_u64(0xffffffff, key->w[1]);
+
+    a = _mm_crc32_u64(a, key->w[2]);
+    b = _mm_crc32_u64(b, key->w[3]);
+    a = _mm_crc32_u64(a, key->w[4]);
+
+    return (uint32_t)(a ^ (b * 0x9e3779b1));
+#else
+    uint64_t h = key->w[0];
+    uint32_t i;
+
+    for (i=1; i<MATCH_KEY_WORDS; i++) {
+        h = ((h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ULL) ^ key->w[i];
+    }
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+
+    return (uint32_t)h;
+#endif
+}
+
+static inline int match_key_equal(const union match_key *a,
+                                  const union match_key *b)
+{
+#if defined(__AVX2__)
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)a->w),
+                                 _mm256_loadu_si256((const __m256i *)b->w));
+
+    return _mm256_testz_si256(x, x) && a->w[4] == b->w[4];
+#elif defined(__SSE4_2__)
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)a->w),
+                              _mm_loadu_si128((const __m128i *)b->w));
+    __m128i y = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&a->w[2]),
+                              _mm_loadu_si128((const __m128i *)&b->w[2]));
+
+    x = _mm_or_si128(x, y);
+    return _mm_testz_si128(x, x) && a->w[4] == b->w[4];
+#else
+    return ((a->w[0] ^ b->w[0]) | (a->w[1] ^ b->w[1]) |
+            (a->w[2] ^ b->w[2]) | (a->w[3] ^ b->w[3]) |
+            (a->w[4] ^ b->w[4])) == 0;
+#endif
+}
+
+#endif
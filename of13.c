@@ -0,0 +1,871 @@
+#include <arpa/inet.h>
+#include <endian.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+#include "fox.h"
+#include "controller.h"
+#include "logger.h"
+#include "of13.h"
+
+/* Longest match we encode: every field of an ofp_match, both IPs masked */
+#define OF13_MAX_MATCH      96
+
+/* 1.3 reserved ports are the 1.0 ones with the top 16 bits set */
+static uint32_t of13_port(uint16_t port)
+{
+    return port >= OFPP_MAX ? 0xffff0000 | port : port;
+}
+
+static uint16_t of10_port(uint32_t port)
+{
+    if (port >= OFPP13_MAX) {
+        return (uint16_t)port;
+    }
+    return port < OFPP_MAX ? port : OFPP_NONE;
+}
+
+int of13_msg_type(uint8_t type)
+{
+    switch (type) {
+    case OFPT_HELLO:
+    case OFPT_ERROR:
+    case OFPT_ECHO_REQUEST:
+    case OFPT_ECHO_REPLY:
+    case OFPT_FEATURES_REQUEST:
+    case OFPT_GET_CONFIG_REQUEST:
+    case OFPT_SET_CONFIG:
+        return type;
+    case OFPT_BARRIER_REQUEST:
+        return OFPT13_BARRIER_REQUEST;
+    default:
+        return -1;
+    }
+}
+
+/*
+* Matches
+*/
+static uint8_t *oxm_put(uint8_t *p, uint32_t header, const void *value,
+                        size_t len)
+{
+    uint32_t h = htonl(header);
+
+    memcpy(p, &h, sizeof(h));
+    memcpy(p + sizeof(h), value, len);
+
+    return p + sizeof(h) + len;
+}
+
+static uint8_t *oxm_put_ipv4(uint8_t *p, uint32_t exact, uint32_t masked,
+                             uint32_t addr, uint32_t wild_bits)
+{
+    uint32_t mask[2];
+
+    if (wild_bits >= 32) {
+        return p;
+    }
+    if (wild_bits == 0) {
+        return oxm_put(p, exact, &addr, sizeof(addr));
+    }
+    mask[0] = addr;
+    mask[1] = htonl(~0U << wild_bits);
+    return oxm_put(p, masked, mask, sizeof(mask));
+}
+
+/*
+* Encode a 1.0 match as OXM, padded to 8 bytes; returns the padded length.
+* 1.3 insists on prerequisites (IP fields need an IPv4 ethertype, ports
+* need TCP or UDP), so fields 1.0 would have accepted without them are
+* left out, which only widens the match.
+*/
+static size_t of13_encode_match(const struct ofp_match *m, uint8_t *buf)
+{
+    struct ofp13_match *match = (struct ofp13_match *)buf;
+    uint32_t wc = ntohl(m->wildcards);
+    uint8_t *p = match->oxm_fields;
+    size_t len;
+    int is_ip;
+
+    if (!(wc & OFPFW_IN_PORT)) {
+        uint32_t port = htonl(of13_port(ntohs(m->in_port)));
+        p = oxm_put(p, OXM_OF_IN_PORT, &port, sizeof(port));
+    }
+    if (!(wc & OFPFW_DL_DST)) {
+        p = oxm_put(p, OXM_OF_ETH_DST, m->dl_dst, OFP_ETH_ALEN);
+    }
+    if (!(wc & OFPFW_DL_SRC)) {
+        p = oxm_put(p, OXM_OF_ETH_SRC, m->dl_src, OFP_ETH_ALEN);
+    }
+    if (!(wc & OFPFW_DL_TYPE)) {
+        p = oxm_put(p, OXM_OF_ETH_TYPE, &m->dl_type, sizeof(m->dl_type));
+    }
+    if (!(wc & OFPFW_DL_VLAN)) {
+        uint16_t vid = ntohs(m->dl_vlan);
+
+        vid = vid == OFP_VLAN_NONE ? OFPVID_NONE :
+                                     (vid & 0xfff) | OFPVID_PRESENT;
+        vid = htons(vid);
+        p = oxm_put(p, OXM_OF_VLAN_VID, &vid, sizeof(vid));
+
+        if (!(wc & OFPFW_DL_VLAN_PCP) && vid != htons(OFPVID_NONE)) {
+            p = oxm_put(p, OXM_OF_VLAN_PCP, &m->dl_vlan_pcp, 1);
+        }
+    }
+
+    is_ip = !(wc & OFPFW_DL_TYPE) && m->dl_type == htons(ETH_P_IP);
+    if (is_ip) {
+        if (!(wc & OFPFW_NW_TOS)) {
+            uint8_t dscp = m->nw_tos >> 2;
+            p = oxm_put(p, OXM_OF_IP_DSCP, &dscp, 1);
+        }
+        if (!(wc & OFPFW_NW_PROTO)) {
+            p = oxm_put(p, OXM_OF_IP_PROTO, &m->nw_proto, 1);
+        }
+        p = oxm_put_ipv4(p, OXM_OF_IPV4_SRC, OXM_OF_IPV4_SRC_W, m->nw_src,
+                         (wc & OFPFW_NW_SRC_MASK) >> OFPFW_NW_SRC_SHIFT);
+        p = oxm_put_ipv4(p, OXM_OF_IPV4_DST, OXM_OF_IPV4_DST_W, m->nw_dst,
+                         (wc & OFPFW_NW_DST_MASK) >> OFPFW_NW_DST_SHIFT);
+    }
+    if (is_ip && !(wc & OFPFW_NW_PROTO) &&
+        (m->nw_proto == IPPROTO_TCP || m->nw_proto == IPPROTO_UDP)) {
+        int tcp = m->nw_proto == IPPROTO_TCP;
+
+        if (!(wc & OFPFW_TP_SRC)) {
+            p = oxm_put(p, tcp ? OXM_OF_TCP_SRC : OXM_OF_UDP_SRC,
+                        &m->tp_src, sizeof(m->tp_src));
+        }
+        if (!(wc & OFPFW_TP_DST)) {
+            p = oxm_put(p, tcp ? OXM_OF_TCP_DST : OXM_OF_UDP_DST,
+                        &m->tp_dst, sizeof(m->tp_dst));
+        }
+    }
+
+    len = p - buf;
+    match->type = htons(OFPMT_OXM);
+    match->length = htons(len);
+    memset(p, 0, OFP13_MATCH_LEN(len) - len);
+
+    return OFP13_MATCH_LEN(len);
+}
+
+/* Count of set bits in a contiguous netmask, as 1.0 wildcard bits */
+static uint32_t of13_mask_wild_bits(uint32_t mask)
+{
+    return 32 - __builtin_popcount(mask);
+}
+
+/*
+* Turn an OXM match of at most avail bytes back into a 1.0 match. Fields
+* 1.0 has no room for are ignored. Returns -1 if the TLVs are malformed.
+*/
+static int of13_decode_match(const struct ofp13_match *match, size_t avail,
+                             struct ofp_match *m)
+{
+    const uint8_t *p = (const uint8_t *)match;
+    uint32_t wc = OFPFW_ALL;
+    size_t len, off;
+
+    memset(m, 0, sizeof(*m));
+
+    if (avail < sizeof(*match)) {
+        return -1;
+    }
+    len = ntohs(match->length);
+    if (ntohs(match->type) != OFPMT_OXM || len < 4 ||
+        OFP13_MATCH_LEN(len) > avail) {
+        return -1;
+    }
+
+    for (off = 4; off + 4 <= len; ) {
+        const uint8_t *value = p + off + 4;
+        uint32_t header, field_len;
+        uint32_t u32;
+        uint16_t u16;
+
+        memcpy(&header, p + off, sizeof(header));
+        header = ntohl(header);
+        field_len = OXM_LENGTH(header);
+        if (off + 4 + field_len > len) {
+            return -1;
+        }
+        off += 4 + field_len;
+
+        if (OXM_CLASS(header) != OFPXMC_OPENFLOW_BASIC) {
+            continue;
+        }
+
+        switch (header) {
+        case OXM_OF_IN_PORT:
+            memcpy(&u32, value, sizeof(u32));
+            m->in_port = htons(of10_port(ntohl(u32)));
+            wc &= ~OFPFW_IN_PORT;
+            break;
+        case OXM_OF_ETH_DST:
+            memcpy(m->dl_dst, value, OFP_ETH_ALEN);
+            wc &= ~OFPFW_DL_DST;
+            break;
+        case OXM_OF_ETH_SRC:
+            memcpy(m->dl_src, value, OFP_ETH_ALEN);
+            wc &= ~OFPFW_DL_SRC;
+            break;
+        case OXM_OF_ETH_TYPE:
+            memcpy(&m->dl_type, value, sizeof(m->dl_type));
+            wc &= ~OFPFW_DL_TYPE;
+            break;
+        case OXM_OF_VLAN_VID:
+            memcpy(&u16, value, sizeof(u16));
+            u16 = ntohs(u16);
+            m->dl_vlan = htons(u16 & OFPVID_PRESENT ? u16 & 0xfff :
+                                                      OFP_VLAN_NONE);
+            wc &= ~OFPFW_DL_VLAN;
+            break;
+        case OXM_OF_VLAN_PCP:
+            m->dl_vlan_pcp = value[0];
+            wc &= ~OFPFW_DL_VLAN_PCP;
+            break;
+        case OXM_OF_IP_DSCP:
+            m->nw_tos = value[0] << 2;
+            wc &= ~OFPFW_NW_TOS;
+            break;
+        case OXM_OF_IP_PROTO:
+            m->nw_proto = value[0];
+            wc &= ~OFPFW_NW_PROTO;
+            break;
+        case OXM_OF_IPV4_SRC:
+        case OXM_OF_IPV4_SRC_W:
+            memcpy(&m->nw_src, value, sizeof(m->nw_src));
+            u32 = 0;
+            if (OXM_HASMASK(header)) {
+                memcpy(&u32, value + 4, sizeof(u32));
+                u32 = of13_mask_wild_bits(u32);
+            }
+            wc = (wc & ~OFPFW_NW_SRC_MASK) | (u32 << OFPFW_NW_SRC_SHIFT);
+            break;
+        case OXM_OF_IPV4_DST:
+        case OXM_OF_IPV4_DST_W:
+            memcpy(&m->nw_dst, value, sizeof(m->nw_dst));
+            u32 = 0;
+            if (OXM_HASMASK(header)) {
+                memcpy(&u32, value + 4, sizeof(u32));
+                u32 = of13_mask_wild_bits(u32);
+            }
+            wc = (wc & ~OFPFW_NW_DST_MASK) | (u32 << OFPFW_NW_DST_SHIFT);
+            break;
+        case OXM_OF_TCP_SRC:
+        case OXM_OF_UDP_SRC:
+            memcpy(&m->tp_src, value, sizeof(m->tp_src));
+            wc &= ~OFPFW_TP_SRC;
+            break;
+        case OXM_OF_TCP_DST:
+        case OXM_OF_UDP_DST:
+            memcpy(&m->tp_dst, value, sizeof(m->tp_dst));
+            wc &= ~OFPFW_TP_DST;
+            break;
+        default:
+            break;
+        }
+    }
+
+    m->wildcards = htonl(wc);
+    return 0;
+}
+
+static void of13_decode_port(const struct ofp13_port *in,
+                             struct ofp_phy_port *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    out->port_no = htons(of10_port(ntohl(in->port_no)));
+    memcpy(out->hw_addr, in->hw_addr, OFP_ETH_ALEN);
+    memcpy(out->name, in->name, OFP_MAX_PORT_NAME_LEN);
+    out->name[OFP_MAX_PORT_NAME_LEN - 1] = '\0';
+
+    /* The config bits 1.3 kept are where 1.0 had them; of the state bits
+     * only LINK_DOWN means the same thing */
+    out->config = in->config;
+    out->state = in->state & htonl(OFPPS13_LINK_DOWN);
+
+    /* Rates up to 10G line up; the rest moved up by four bits */
+#define OF13_PORT_FEATURES(f) \
+    htonl((ntohl(f) & 0x7f) | ((ntohl(f) >> 4) & 0xf80))
+    out->curr = OF13_PORT_FEATURES(in->curr);
+    out->advertised = OF13_PORT_FEATURES(in->advertised);
+    out->supported = OF13_PORT_FEATURES(in->supported);
+    out->peer = OF13_PORT_FEATURES(in->peer);
+#undef OF13_PORT_FEATURES
+}
+
+/*
+* Outgoing
+*/
+size_t of13_encode_flow_mod(const struct flow_mod *mod, void *buf,
+                            size_t len)
+{
+    struct ofp13_flow_mod *ofmod = buf;
+    struct ofp_instruction_actions *inst;
+    uint8_t match[OF13_MAX_MATCH];
+    size_t match_len, mod_len, actions_len = 0;
+    uint8_t *p;
+    int i;
+
+    for (i=0; i<mod->n_actions; i++) {
+        actions_len += sizeof(struct ofp13_action_output);
+        if (mod->actions[i].type == OFPAT_ENQUEUE) {
+            actions_len += sizeof(struct ofp13_action_set_queue);
+        }
+    }
+
+    match_len = of13_encode_match(&mod->match, match);
+    mod_len = offsetof(struct ofp13_flow_mod, match) + match_len;
+    if (mod->meter_id != 0) {
+        mod_len += sizeof(struct ofp_instruction_meter);
+    }
+    if (mod->n_actions > 0) {
+        mod_len += sizeof(*inst) + actions_len;
+    }
+    if (mod_len > len) {
+        return 0;
+    }
+    memset(ofmod, 0, mod_len);
+
+    ofmod->header.version = OFP13_VERSION;
+    ofmod->header.type = OFPT13_FLOW_MOD;
+    ofmod->header.length = htons(mod_len);
+    ofmod->header.xid = htonl(mod->xid);
+    ofmod->cookie = htobe64(mod->cookie);
+    ofmod->table_id = mod->table_id;
+    ofmod->command = mod->command;
+    ofmod->idle_timeout = htons(mod->idle_timeout);
+    ofmod->hard_timeout = htons(mod->hard_timeout);
+    ofmod->priority = htons(mod->priority);
+    ofmod->buffer_id = htonl(mod->buffer_id);
+    ofmod->out_port = htonl(of13_port(mod->out_port));
+    ofmod->out_group = htonl(OFPG_ANY);
+    ofmod->flags = htons(mod->flags &
+                         (OFPFF_SEND_FLOW_REM | OFPFF_CHECK_OVERLAP));
+    memcpy(&ofmod->match, match, match_len);
+    p = (uint8_t *)&ofmod->match + match_len;
+
+    /* Instructions go in the order the switch runs them: meter first */
+    if (mod->meter_id != 0) {
+        struct ofp_instruction_meter *meter = (void *)p;
+        meter->type = htons(OFPIT_METER);
+        meter->len = htons(sizeof(*meter));
+        meter->meter_id = htonl(mod->meter_id);
+        p += sizeof(*meter);
+    }
+    if (mod->n_actions == 0) {
+        return mod_len;
+    }
+
+    /* 1.0 actions are applied right away, so they go in APPLY_ACTIONS */
+    inst = (struct ofp_instruction_actions *)p;
+    inst->type = htons(OFPIT_APPLY_ACTIONS);
+    inst->len = htons(sizeof(*inst) + actions_len);
+    p += sizeof(*inst);
+
+    for (i=0; i<mod->n_actions; i++) {
+        const struct flow_action *fa = &mod->actions[i];
+        struct ofp13_action_output *output;
+
+        /* 1.0's enqueue is 1.3's set-queue then output */
+        if (fa->type == OFPAT_ENQUEUE) {
+            struct ofp13_action_set_queue *queue = (void *)p;
+            queue->type = htons(OFPAT13_SET_QUEUE);
+            queue->len = htons(sizeof(*queue));
+            queue->queue_id = htonl(fa->queue_id);
+            p += sizeof(*queue);
+        }
+
+        output = (struct ofp13_action_output *)p;
+        output->type = htons(OFPAT13_OUTPUT);
+        output->len = htons(sizeof(*output));
+        output->port = htonl(of13_port(fa->port));
+        output->max_len = htons(fa->max_len);
+        p += sizeof(*output);
+    }
+
+    return mod_len;
+}
+
+/* A meter with a single drop band; unit is OFPMF_KBPS or OFPMF_PKTPS and
+ * a burst of 0 leaves the burst to the switch */
+int of13_send_meter_mod(struct fox_state *state, uint16_t command,
+                        uint32_t meter_id, uint16_t unit, uint32_t rate,
+                        uint32_t burst)
+{
+    struct {
+        struct ofp_meter_mod        mod;
+        struct ofp_meter_band_drop  band;
+    } __attribute__((__packed__)) msg;
+    size_t len = sizeof(msg);
+
+    if (state->version != OFP13_VERSION) {
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.mod.header.type = OFPT13_METER_MOD;
+    msg.mod.command = htons(command);
+    msg.mod.flags = htons(unit | (burst ? OFPMF_BURST : 0));
+    msg.mod.meter_id = htonl(meter_id);
+
+    if (command == OFPMC_DELETE) {
+        len = sizeof(msg.mod);
+    } else {
+        msg.band.type = htons(OFPMBT_DROP);
+        msg.band.len = htons(sizeof(msg.band));
+        msg.band.rate = htonl(rate);
+        msg.band.burst_size = htonl(burst);
+    }
+
+    return controller_send_raw(state, &msg, len);
+}
+
+int of13_send_role_request(struct fox_state *state, uint32_t role,
+                           uint64_t generation_id)
+{
+    struct ofp13_role_request req;
+
+    if (state->version != OFP13_VERSION) {
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.header.type = OFPT13_ROLE_REQUEST;
+    req.role = htonl(role);
+    req.generation_id = htobe64(generation_id);
+
+    return controller_send_raw(state, &req, sizeof(req));
+}
+
+int of13_send_flow_stats_request(struct fox_state *state,
+                                 const struct ofp_match *match, uint32_t xid)
+{
+    uint8_t buf[sizeof(struct ofp13_multipart_request) +
+                sizeof(struct ofp13_flow_stats_request) + 128];
+    struct ofp13_multipart_request *req = (void *)buf;
+    struct ofp13_flow_stats_request *body = (void *)req->body;
+    size_t len;
+
+    if (state->version != OFP13_VERSION) {
+        return -1;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    req->header.type = OFPT13_MULTIPART_REQUEST;
+    req->header.xid = htonl(xid);
+    req->type = htons(OFPMP_FLOW);
+    body->table_id = OFPTT_ALL;
+    body->out_port = htonl(OFPP13_ANY);
+    body->out_group = htonl(OFPG_ANY);
+    len = sizeof(*req) + offsetof(struct ofp13_flow_stats_request, match) +
+          of13_encode_match(match, (uint8_t *)&body->match);
+
+    return controller_send_raw(state, req, len);
+}
+
+void of13_send_packet_out(struct fox_state *state, uint32_t buffer_id,
+                          uint16_t in_port, uint16_t out_port,
+                          void *data, size_t data_len)
+{
+    struct ofp13_packet_out *pkt_out;
+    struct ofp13_action_output *action;
+    size_t len;
+
+    if (buffer_id != UINT32_MAX) {
+        data_len = 0;
+    }
+    len = sizeof(*pkt_out) + sizeof(*action) + data_len;
+
+    pkt_out = malloc(len);
+    if (pkt_out == NULL) {
+        LogError(state->name, "Could not malloc %d byte packet out", len);
+        return;
+    }
+    memset(pkt_out, 0, sizeof(*pkt_out) + sizeof(*action));
+
+    pkt_out->header.type = OFPT13_PACKET_OUT;
+    pkt_out->buffer_id = htonl(buffer_id);
+    /* 1.3 wants a real port or CONTROLLER here, not "none" */
+    pkt_out->in_port = htonl(in_port == OFPP_NONE ? OFPP13_CONTROLLER :
+                                                    of13_port(in_port));
+    pkt_out->actions_len = htons(sizeof(*action));
+
+    action = (struct ofp13_action_output *)&pkt_out->actions[0];
+    action->type = htons(OFPAT13_OUTPUT);
+    action->len = htons(sizeof(*action));
+    action->port = htonl(of13_port(out_port));
+
+    if (data_len > 0) {
+        memcpy(&action[1], data, data_len);
+    }
+
+    controller_send_raw(state, pkt_out, len);
+
+    free(pkt_out);
+}
+
+static void of13_send_port_desc_request(struct fox_state *state)
+{
+    struct ofp13_multipart_request req;
+
+    memset(&req, 0, sizeof(req));
+    req.header.type = OFPT13_MULTIPART_REQUEST;
+    req.type = htons(OFPMP_PORT_DESC);
+
+    controller_send_raw(state, &req, sizeof(req));
+}
+
+/*
+* Incoming
+*/
+static void of13_bad_msg(struct fox_state *state, struct ofp_header *ofhdr)
+{
+    state->bad_msgs++;
+    LogWarn(state->name, "Malformed OpenFlow 1.3 message type %d length %d",
+            ofhdr->type, ntohs(ofhdr->length));
+}
+
+/* Dispatch a rewritten message; it must start with its ofp_header */
+static void of13_dispatch(struct fox_state *state, void *msg, uint8_t type,
+                          size_t len)
+{
+    struct ofp_header *hdr = msg;
+
+    hdr->version = OFP13_VERSION;
+    hdr->type = type;
+    hdr->length = htons(len);
+
+    controller_handle_msg(state, hdr, msg);
+}
+
+/* Flow mod failures are renumbered so apps can act on them the same way
+ * on either version; other errors only get logged and are left as they
+ * are. The data is still the 1.3 request. */
+static void of13_handle_error(struct fox_state *state,
+                              struct ofp_error_msg *err)
+{
+    static const uint16_t flow_mod_codes[] = {
+        [OFPFMFC13_UNKNOWN]         = OFPFMFC_UNSUPPORTED,
+        [OFPFMFC13_TABLE_FULL]      = OFPFMFC_ALL_TABLES_FULL,
+        [OFPFMFC13_BAD_TABLE_ID]    = OFPFMFC_UNSUPPORTED,
+        [OFPFMFC13_OVERLAP]         = OFPFMFC_OVERLAP,
+        [OFPFMFC13_EPERM]           = OFPFMFC_EPERM,
+        [OFPFMFC13_BAD_TIMEOUT]     = OFPFMFC_BAD_EMERG_TIMEOUT,
+        [OFPFMFC13_BAD_COMMAND]     = OFPFMFC_BAD_COMMAND,
+        [OFPFMFC13_BAD_FLAGS]       = OFPFMFC_UNSUPPORTED,
+    };
+    uint16_t code = ntohs(err->code);
+
+    if (ntohs(err->type) == OFPET13_FLOW_MOD_FAILED) {
+        err->type = htons(OFPET_FLOW_MOD_FAILED);
+        err->code = htons(code <= OFPFMFC13_BAD_FLAGS ? flow_mod_codes[code] :
+                                                        OFPFMFC_UNSUPPORTED);
+    }
+
+    controller_handle_msg(state, &err->header, err);
+}
+
+/* The port list comes separately in 1.3, so hold on to the features
+ * until the PORT_DESC reply arrives and hand both up as one 1.0 reply */
+static void of13_handle_features(struct fox_state *state,
+                                 struct ofp13_switch_features *features)
+{
+    struct ofp_switch_features *pending;
+
+    pending = malloc(sizeof(*pending));
+    if (pending == NULL) {
+        LogError(state->name, "Could not malloc features reply");
+        return;
+    }
+    memset(pending, 0, sizeof(*pending));
+    pending->header.xid = features->header.xid;
+    pending->datapath_id = features->datapath_id;
+    pending->n_buffers = features->n_buffers;
+    pending->n_tables = features->n_tables;
+    pending->capabilities = features->capabilities;
+
+    free(state->pending_features);
+    state->pending_features = pending;
+    state->pending_features_len = sizeof(*pending);
+
+    of13_send_port_desc_request(state);
+}
+
+static void of13_handle_port_desc(struct fox_state *state,
+                                  struct ofp13_multipart_reply *reply)
+{
+    size_t len = ntohs(reply->header.length) - sizeof(*reply);
+    size_t n_ports = len / sizeof(struct ofp13_port);
+    struct ofp13_port *ports = (struct ofp13_port *)reply->body;
+    struct ofp_switch_features *features;
+    size_t i;
+
+    if (state->pending_features == NULL) {
+        LogWarn(state->name, "Port description without a features reply");
+        return;
+    }
+    if (len % sizeof(struct ofp13_port) != 0 ||
+        state->pending_features_len + n_ports * sizeof(struct ofp_phy_port) >
+        UINT16_MAX) {
+        of13_bad_msg(state, &reply->header);
+        free(state->pending_features);
+        state->pending_features = NULL;
+        return;
+    }
+
+    features = realloc(state->pending_features,
+                       state->pending_features_len +
+                       n_ports * sizeof(struct ofp_phy_port));
+    if (features == NULL) {
+        LogError(state->name, "Could not malloc %d ports", n_ports);
+        return;
+    }
+    state->pending_features = features;
+
+    for (i=0; i<n_ports; i++) {
+        size_t at = (state->pending_features_len - sizeof(*features)) /
+                    sizeof(struct ofp_phy_port);
+        of13_decode_port(&ports[i], &features->ports[at]);
+        state->pending_features_len += sizeof(struct ofp_phy_port);
+    }
+
+    if (ntohs(reply->flags) & OFPMPF_REPLY_MORE) {
+        return;
+    }
+
+    state->pending_features = NULL;
+    of13_dispatch(state, features, OFPT_FEATURES_REPLY,
+                  state->pending_features_len);
+    free(features);
+}
+
+/* 1.0 flow stats entries that fit in one message */
+#define OF13_FLOW_STATS_MAX     ((UINT16_MAX - sizeof(struct ofp_stats_reply)) \
+                                 / sizeof(struct ofp_flow_stats))
+
+/*
+* Flow stats become a 1.0 OFPST_FLOW reply, without the instructions.
+* 1.0 entries are bigger, so one 1.3 reply may come out as several, all
+* but the last flagged OFPSF_REPLY_MORE like any other partial reply.
+*/
+static void of13_handle_flow_stats(struct fox_state *state,
+                                   struct ofp13_multipart_reply *reply)
+{
+    size_t len = ntohs(reply->header.length);
+    size_t off = sizeof(*reply), n = 0;
+    struct ofp_stats_reply *out;
+
+    out = malloc(sizeof(*out) + OF13_FLOW_STATS_MAX *
+                 sizeof(struct ofp_flow_stats));
+    if (out == NULL) {
+        LogError(state->name, "Could not malloc flow stats reply");
+        return;
+    }
+    memset(out, 0, sizeof(*out));
+    out->header.xid = reply->header.xid;
+    out->type = htons(OFPST_FLOW);
+
+    while (off < len) {
+        struct ofp13_flow_stats *fs = (void *)((uint8_t *)reply + off);
+        struct ofp_flow_stats entry;
+        size_t entry_len;
+
+        if (len - off < sizeof(*fs) ||
+            (entry_len = ntohs(fs->length)) < sizeof(*fs) ||
+            entry_len > len - off) {
+            of13_bad_msg(state, &reply->header);
+            free(out);
+            return;
+        }
+
+        memset(&entry, 0, sizeof(entry));
+        if (of13_decode_match(&fs->match,
+                              entry_len - offsetof(struct ofp13_flow_stats,
+                                                   match),
+                              &entry.match)) {
+            of13_bad_msg(state, &reply->header);
+            free(out);
+            return;
+        }
+        entry.length = htons(sizeof(entry));
+        entry.table_id = fs->table_id;
+        entry.duration_sec = fs->duration_sec;
+        entry.duration_nsec = fs->duration_nsec;
+        entry.priority = fs->priority;
+        entry.idle_timeout = fs->idle_timeout;
+        entry.hard_timeout = fs->hard_timeout;
+        entry.cookie = fs->cookie;
+        entry.packet_count = fs->packet_count;
+        entry.byte_count = fs->byte_count;
+
+        if (n == OF13_FLOW_STATS_MAX) {
+            out->flags = htons(OFPSF_REPLY_MORE);
+            of13_dispatch(state, out, OFPT_STATS_REPLY,
+                          sizeof(*out) + n * sizeof(entry));
+            n = 0;
+        }
+        /* The body is only 4-byte aligned */
+        memcpy(out->body + n++ * sizeof(entry), &entry, sizeof(entry));
+        off += entry_len;
+    }
+
+    out->flags = htons(ntohs(reply->flags) & OFPMPF_REPLY_MORE ?
+                       OFPSF_REPLY_MORE : 0);
+    of13_dispatch(state, out, OFPT_STATS_REPLY,
+                  sizeof(*out) + n * sizeof(struct ofp_flow_stats));
+    free(out);
+}
+
+static void of13_handle_multipart(struct fox_state *state,
+                                  struct ofp13_multipart_reply *reply)
+{
+    switch (ntohs(reply->type)) {
+    case OFPMP_PORT_DESC:
+        of13_handle_port_desc(state, reply);
+        break;
+    case OFPMP_FLOW:
+        of13_handle_flow_stats(state, reply);
+        break;
+    default:
+        LogWarn(state->name, "Unimplemented multipart reply type %d",
+                ntohs(reply->type));
+        break;
+    }
+}
+
+static void of13_handle_packet_in(struct fox_state *state,
+                                  struct ofp13_packet_in *pkt_in)
+{
+    size_t msg_len = ntohs(pkt_in->header.length);
+    size_t match_off = offsetof(struct ofp13_packet_in, match);
+    size_t data_off, data_len, len;
+    struct ofp_packet_in *out;
+    struct ofp_match match;
+
+    if (of13_decode_match(&pkt_in->match, msg_len - match_off, &match)) {
+        of13_bad_msg(state, &pkt_in->header);
+        return;
+    }
+    /* Frame starts after the padded match and 2 more bytes of pad */
+    data_off = match_off + OFP13_MATCH_LEN(ntohs(pkt_in->match.length)) + 2;
+    if (data_off > msg_len) {
+        of13_bad_msg(state, &pkt_in->header);
+        return;
+    }
+    data_len = msg_len - data_off;
+    len = offsetof(struct ofp_packet_in, data) + data_len;
+
+    out = malloc(len);
+    if (out == NULL) {
+        LogError(state->name, "Error: could not malloc %d bytes", len);
+        return;
+    }
+    memset(out, 0, offsetof(struct ofp_packet_in, data));
+    out->header.xid = pkt_in->header.xid;
+    out->buffer_id = pkt_in->buffer_id;
+    out->total_len = pkt_in->total_len;
+    out->in_port = (ntohl(match.wildcards) & OFPFW_IN_PORT) ?
+                   htons(OFPP_NONE) : match.in_port;
+    out->reason = pkt_in->reason;
+    memcpy(out->data, (uint8_t *)pkt_in + data_off, data_len);
+
+    of13_dispatch(state, out, OFPT_PACKET_IN, len);
+    free(out);
+}
+
+static void of13_handle_flow_removed(struct fox_state *state,
+                                     struct ofp13_flow_removed *removed)
+{
+    size_t msg_len = ntohs(removed->header.length);
+    struct ofp_flow_removed out;
+
+    memset(&out, 0, sizeof(out));
+    if (of13_decode_match(&removed->match,
+                          msg_len - offsetof(struct ofp13_flow_removed, match),
+                          &out.match)) {
+        of13_bad_msg(state, &removed->header);
+        return;
+    }
+    out.header.xid = removed->header.xid;
+    out.cookie = removed->cookie;
+    out.priority = removed->priority;
+    out.reason = removed->reason;
+    out.duration_sec = removed->duration_sec;
+    out.duration_nsec = removed->duration_nsec;
+    out.idle_timeout = removed->idle_timeout;
+    out.packet_count = removed->packet_count;
+    out.byte_count = removed->byte_count;
+
+    of13_dispatch(state, &out, OFPT_FLOW_REMOVED, sizeof(out));
+}
+
+static void of13_handle_port_status(struct fox_state *state,
+                                    struct ofp13_port_status *status)
+{
+    struct ofp_port_status out;
+
+    memset(&out, 0, sizeof(out));
+    out.header.xid = status->header.xid;
+    out.reason = status->reason;
+    of13_decode_port(&status->desc, &out.desc);
+
+    of13_dispatch(state, &out, OFPT_PORT_STATUS, sizeof(out));
+}
+
+/* Nothing hangs on it; a refused request comes back as an error */
+static void of13_handle_role_reply(struct fox_state *state,
+                                   struct ofp13_role_request *reply)
+{
+    LogInfo(state->name, "Role %u, generation %llu", ntohl(reply->role),
+            (unsigned long long)be64toh(reply->generation_id));
+}
+
+void of13_handle_msg(struct fox_state *state, struct ofp_header *ofhdr,
+                     void *payload)
+{
+    switch (ofhdr->type) {
+    /* Same number and body as 1.0 */
+    case OFPT13_HELLO:
+    case OFPT13_ECHO_REQUEST:
+    case OFPT13_ECHO_REPLY:
+    case OFPT13_EXPERIMENTER:
+    case OFPT13_GET_CONFIG_REPLY:
+        controller_handle_msg(state, ofhdr, payload);
+        break;
+    case OFPT13_ERROR:
+        of13_handle_error(state, payload);
+        break;
+    case OFPT13_BARRIER_REPLY:
+        of13_dispatch(state, payload, OFPT_BARRIER_REPLY,
+                      ntohs(ofhdr->length));
+        break;
+
+    case OFPT13_FEATURES_REPLY:
+        of13_handle_features(state, payload);
+        break;
+    case OFPT13_MULTIPART_REPLY:
+        of13_handle_multipart(state, payload);
+        break;
+    case OFPT13_PACKET_IN:
+        of13_handle_packet_in(state, payload);
+        break;
+    case OFPT13_FLOW_REMOVED:
+        of13_handle_flow_removed(state, payload);
+        break;
+    case OFPT13_PORT_STATUS:
+        of13_handle_port_status(state, payload);
+        break;
+    case OFPT13_ROLE_REPLY:
+        of13_handle_role_reply(state, payload);
+        break;
+    default:
+        LogWarn(state->name, "Unknown/unimplemented OpenFlow 1.3 type %d",
+                ofhdr->type);
+        break;
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef OF13_H
+#define OF13_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "fox.h"
+#include "flowmod.h"
+#include "openflow13.h"
+
+/*
+* OpenFlow 1.3 codec. fox's handlers and apps speak 1.0: on a connection
+* that negotiated 1.3, incoming messages are rewritten into their 1.0
+* form before dispatch (OXM matches become ofp_match, ports are folded
+* into 16 bits, the port list arrives with FEATURES_REPLY as usual), and
+* outgoing ones are encoded from the version-neutral builders. Messages
+* with no 1.0 equivalent are logged and dropped.
+*/
+
+/* The 1.3 wire type for a 1.0 message whose body is the same in both,
+ * or -1 if it has to be re-encoded (flow mods, packet outs, stats...) */
+int of13_msg_type(uint8_t type);
+
+void of13_handle_msg(struct fox_state *state, struct ofp_header *ofhdr,
+                     void *payload);
+
+size_t of13_encode_flow_mod(const struct flow_mod *mod, void *buf,
+                            size_t len);
+
+/* Meters are 1.3 only; returns -1 on a connection that is not 1.3 */
+int of13_send_meter_mod(struct fox_state *state, uint16_t command,
+                        uint32_t meter_id, uint16_t unit, uint32_t rate,
+                        uint32_t burst);
+
+/* Ask to be master (or slave...) of a 1.3 switch. The switch refuses
+ * generations older than the newest it has seen, so a controller that was
+ * taken over from cannot take the switch back. Returns -1 if not 1.3. */
+int of13_send_role_request(struct fox_state *state, uint32_t role,
+                           uint64_t generation_id);
+
+/* See controller_send_flow_stats_request */
+int of13_send_flow_stats_request(struct fox_state *state,
+                                 const struct ofp_match *match, uint32_t xid);
+
+void of13_send_packet_out(struct fox_state *state, uint32_t buffer_id,
+                          uint16_t in_port, uint16_t out_port,
+                          void *data, size_t data_len);
+
+#endif
@@ -0,0 +1,565 @@
+/* OpenFlow 1.3 (wire version 0x04): the subset fox speaks.
+ *
+ * Names are those of the 1.3.x spec with an ofp13_/OFP13/OFPT13_ prefix
+ * wherever they would collide with the 1.0 definitions in openflow.h,
+ * which this header is meant to be included alongside. All multi-byte
+ * fields are in network byte order.
+ */
+
+#ifndef OPENFLOW_OPENFLOW13_H
+#define OPENFLOW_OPENFLOW13_H 1
+
+#include "openflow.h"
+
+#define OFP13_VERSION   0x04
+
+enum ofp13_type {
+    /* Immutable messages, same as 1.0 */
+    OFPT13_HELLO                    = 0,
+    OFPT13_ERROR                    = 1,
+    OFPT13_ECHO_REQUEST             = 2,
+    OFPT13_ECHO_REPLY               = 3,
+    OFPT13_EXPERIMENTER             = 4,
+
+    /* Switch configuration messages */
+    OFPT13_FEATURES_REQUEST         = 5,
+    OFPT13_FEATURES_REPLY           = 6,
+    OFPT13_GET_CONFIG_REQUEST       = 7,
+    OFPT13_GET_CONFIG_REPLY         = 8,
+    OFPT13_SET_CONFIG               = 9,
+
+    /* Asynchronous messages */
+    OFPT13_PACKET_IN                = 10,
+    OFPT13_FLOW_REMOVED             = 11,
+    OFPT13_PORT_STATUS              = 12,
+
+    /* Controller command messages */
+    OFPT13_PACKET_OUT               = 13,
+    OFPT13_FLOW_MOD                 = 14,
+    OFPT13_GROUP_MOD                = 15,
+    OFPT13_PORT_MOD                 = 16,
+    OFPT13_TABLE_MOD                = 17,
+
+    /* Multipart messages */
+    OFPT13_MULTIPART_REQUEST        = 18,
+    OFPT13_MULTIPART_REPLY          = 19,
+
+    /* Barrier messages */
+    OFPT13_BARRIER_REQUEST          = 20,
+    OFPT13_BARRIER_REPLY            = 21,
+
+    /* Queue configuration messages */
+    OFPT13_QUEUE_GET_CONFIG_REQUEST = 22,
+    OFPT13_QUEUE_GET_CONFIG_REPLY   = 23,
+
+    /* Controller role change request messages */
+    OFPT13_ROLE_REQUEST             = 24,
+    OFPT13_ROLE_REPLY               = 25,
+
+    /* Asynchronous message configuration */
+    OFPT13_GET_ASYNC_REQUEST        = 26,
+    OFPT13_GET_ASYNC_REPLY          = 27,
+    OFPT13_SET_ASYNC                = 28,
+
+    /* Meters and rate limiters configuration messages */
+    OFPT13_METER_MOD                = 29
+};
+
+/* Experimenter extension (the 1.3 name for vendor). */
+struct ofp13_experimenter_header {
+    struct ofp_header header;   /* Type OFPT13_EXPERIMENTER. */
+    uint32_t experimenter;
+    uint32_t exp_type;
+};
+OFP_ASSERT(sizeof(struct ofp13_experimenter_header) == 16);
+
+/* Port numbering. Ports are numbered starting from 1. */
+enum ofp13_port_no {
+    OFPP13_MAX          = 0xffffff00,
+    OFPP13_IN_PORT      = 0xfffffff8,
+    OFPP13_TABLE        = 0xfffffff9,
+    OFPP13_NORMAL       = 0xfffffffa,
+    OFPP13_FLOOD        = 0xfffffffb,
+    OFPP13_ALL          = 0xfffffffc,
+    OFPP13_CONTROLLER   = 0xfffffffd,
+    OFPP13_LOCAL        = 0xfffffffe,
+    OFPP13_ANY          = 0xffffffff
+};
+
+/* Hello elements */
+enum ofp_hello_elem_type {
+    OFPHET_VERSIONBITMAP = 1
+};
+
+struct ofp_hello_elem_header {
+    uint16_t type;              /* One of OFPHET_*. */
+    uint16_t length;            /* Length in bytes of this element,
+                                   excluding padding to 8 bytes. */
+};
+OFP_ASSERT(sizeof(struct ofp_hello_elem_header) == 4);
+
+/* Bit n of bitmaps[0] set means version n is supported; bitmaps[1]
+ * covers 32..63 and so on. */
+struct ofp_hello_elem_versionbitmap {
+    uint16_t type;              /* OFPHET_VERSIONBITMAP. */
+    uint16_t length;
+    uint32_t bitmaps[0];
+};
+OFP_ASSERT(sizeof(struct ofp_hello_elem_versionbitmap) == 4);
+
+/* Description of a port */
+struct ofp13_port {
+    uint32_t port_no;
+    uint8_t pad[4];
+    uint8_t hw_addr[OFP_ETH_ALEN];
+    uint8_t pad2[2];
+    char name[OFP_MAX_PORT_NAME_LEN]; /* Null-terminated */
+
+    uint32_t config;            /* Bitmap of OFPPC_* flags. */
+    uint32_t state;             /* Bitmap of OFPPS13_* flags. */
+
+    /* Bitmaps of OFPPF13_* that describe features. */
+    uint32_t curr;
+    uint32_t advertised;
+    uint32_t supported;
+    uint32_t peer;
+
+    uint32_t curr_speed;        /* Current port bitrate in kbps. */
+    uint32_t max_speed;         /* Max port bitrate in kbps */
+};
+OFP_ASSERT(sizeof(struct ofp13_port) == 64);
+
+enum ofp13_port_state {
+    OFPPS13_LINK_DOWN   = 1 << 0,
+    OFPPS13_BLOCKED     = 1 << 1,
+    OFPPS13_LIVE        = 1 << 2
+};
+
+/* Rates 10MB_HD..10GB_FD are the same bits as 1.0; 1.3 adds four more
+ * above them, which pushes the medium and pause bits up by four. */
+enum ofp13_port_features {
+    OFPPF13_40GB_FD     = 1 << 7,
+    OFPPF13_100GB_FD    = 1 << 8,
+    OFPPF13_1TB_FD      = 1 << 9,
+    OFPPF13_OTHER       = 1 << 10,
+    OFPPF13_COPPER      = 1 << 11,
+    OFPPF13_FIBER       = 1 << 12,
+    OFPPF13_AUTONEG     = 1 << 13,
+    OFPPF13_PAUSE       = 1 << 14,
+    OFPPF13_PAUSE_ASYM  = 1 << 15
+};
+
+/* Switch features. Ports are not listed; ask with OFPMP_PORT_DESC. */
+struct ofp13_switch_features {
+    struct ofp_header header;
+    uint64_t datapath_id;
+    uint32_t n_buffers;
+    uint8_t n_tables;
+    uint8_t auxiliary_id;       /* Identify auxiliary connections */
+    uint8_t pad[2];
+    uint32_t capabilities;
+    uint32_t reserved;
+};
+OFP_ASSERT(sizeof(struct ofp13_switch_features) == 32);
+
+/* A physical port has changed in the datapath */
+struct ofp13_port_status {
+    struct ofp_header header;
+    uint8_t reason;             /* One of OFPPR_*. */
+    uint8_t pad[7];
+    struct ofp13_port desc;
+};
+OFP_ASSERT(sizeof(struct ofp13_port_status) == 80);
+
+/* Match: a TLV list of OXM fields, padded out to a multiple of 8. The
+ * 4 bytes of oxm_fields here only make the fixed part 8 bytes long. */
+enum ofp13_match_type {
+    OFPMT_STANDARD = 0,         /* Deprecated. */
+    OFPMT_OXM      = 1
+};
+
+struct ofp13_match {
+    uint16_t type;              /* One of OFPMT_* */
+    uint16_t length;            /* Length of ofp13_match (excluding
+                                   padding) */
+    uint8_t oxm_fields[4];
+};
+OFP_ASSERT(sizeof(struct ofp13_match) == 8);
+
+#define OFP13_MATCH_LEN(len)    (((len) + 7) / 8 * 8)
+
+/* OXM header: class(16) field(7) hasmask(1) length(8) */
+#define OXM_HEADER__(CLASS, FIELD, HASMASK, LENGTH) \
+    (((uint32_t)(CLASS) << 16) | ((FIELD) << 9) | ((HASMASK) << 8) | (LENGTH))
+#define OXM_HEADER(CLASS, FIELD, LENGTH) \
+    OXM_HEADER__(CLASS, FIELD, 0, LENGTH)
+#define OXM_HEADER_W(CLASS, FIELD, LENGTH) \
+    OXM_HEADER__(CLASS, FIELD, 1, (LENGTH) * 2)
+#define OXM_CLASS(HEADER)       ((HEADER) >> 16)
+#define OXM_FIELD(HEADER)       (((HEADER) >> 9) & 0x7f)
+#define OXM_HASMASK(HEADER)     (((HEADER) >> 8) & 1)
+#define OXM_LENGTH(HEADER)      ((HEADER) & 0xff)
+
+enum ofp_oxm_class {
+    OFPXMC_OPENFLOW_BASIC = 0x8000
+};
+
+enum oxm_ofb_match_fields {
+    OFPXMT_OFB_IN_PORT      = 0,
+    OFPXMT_OFB_IN_PHY_PORT  = 1,
+    OFPXMT_OFB_METADATA     = 2,
+    OFPXMT_OFB_ETH_DST      = 3,
+    OFPXMT_OFB_ETH_SRC      = 4,
+    OFPXMT_OFB_ETH_TYPE     = 5,
+    OFPXMT_OFB_VLAN_VID     = 6,
+    OFPXMT_OFB_VLAN_PCP     = 7,
+    OFPXMT_OFB_IP_DSCP      = 8,
+    OFPXMT_OFB_IP_ECN       = 9,
+    OFPXMT_OFB_IP_PROTO     = 10,
+    OFPXMT_OFB_IPV4_SRC     = 11,
+    OFPXMT_OFB_IPV4_DST     = 12,
+    OFPXMT_OFB_TCP_SRC      = 13,
+    OFPXMT_OFB_TCP_DST      = 14,
+    OFPXMT_OFB_UDP_SRC      = 15,
+    OFPXMT_OFB_UDP_DST      = 16
+};
+
+#define OXM_OF_IN_PORT      OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_IN_PORT, 4)
+#define OXM_OF_ETH_DST      OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_ETH_DST, 6)
+#define OXM_OF_ETH_SRC      OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_ETH_SRC, 6)
+#define OXM_OF_ETH_TYPE     OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_ETH_TYPE, 2)
+#define OXM_OF_VLAN_VID     OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_VLAN_VID, 2)
+#define OXM_OF_VLAN_PCP     OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_VLAN_PCP, 1)
+#define OXM_OF_IP_DSCP      OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_IP_DSCP, 1)
+#define OXM_OF_IP_PROTO     OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_IP_PROTO, 1)
+#define OXM_OF_IPV4_SRC     OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_IPV4_SRC, 4)
+#define OXM_OF_IPV4_SRC_W   OXM_HEADER_W(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_IPV4_SRC, 4)
+#define OXM_OF_IPV4_DST     OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_IPV4_DST, 4)
+#define OXM_OF_IPV4_DST_W   OXM_HEADER_W(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_IPV4_DST, 4)
+#define OXM_OF_TCP_SRC      OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_TCP_SRC, 2)
+#define OXM_OF_TCP_DST      OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_TCP_DST, 2)
+#define OXM_OF_UDP_SRC      OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_UDP_SRC, 2)
+#define OXM_OF_UDP_DST      OXM_HEADER(OFPXMC_OPENFLOW_BASIC, OFPXMT_OFB_UDP_DST, 2)
+
+/* VLAN id values; the VID itself goes in the low 12 bits */
+enum ofp_vlan_id {
+    OFPVID_PRESENT = 0x1000,
+    OFPVID_NONE    = 0x0000
+};
+
+/* Actions. Same OFPAT13_OUTPUT number as 1.0, but a 32-bit port. */
+enum ofp13_action_type {
+    OFPAT13_OUTPUT      = 0,
+    OFPAT13_SET_QUEUE   = 21
+};
+
+struct ofp13_action_output {
+    uint16_t type;              /* OFPAT13_OUTPUT. */
+    uint16_t len;               /* Length is 16. */
+    uint32_t port;              /* Output port. */
+    uint16_t max_len;           /* Max length to send to controller. */
+    uint8_t pad[6];
+};
+OFP_ASSERT(sizeof(struct ofp13_action_output) == 16);
+
+struct ofp13_action_set_queue {
+    uint16_t type;              /* OFPAT13_SET_QUEUE. */
+    uint16_t len;               /* Len is 8. */
+    uint32_t queue_id;
+};
+OFP_ASSERT(sizeof(struct ofp13_action_set_queue) == 8);
+
+/* Send the whole packet to the controller, unbuffered */
+#define OFPCML_NO_BUFFER    0xffff
+
+/* Instructions */
+enum ofp_instruction_type {
+    OFPIT_GOTO_TABLE        = 1,
+    OFPIT_WRITE_METADATA    = 2,
+    OFPIT_WRITE_ACTIONS     = 3,
+    OFPIT_APPLY_ACTIONS     = 4,
+    OFPIT_CLEAR_ACTIONS     = 5,
+    OFPIT_METER             = 6
+};
+
+struct ofp_instruction_goto_table {
+    uint16_t type;              /* OFPIT_GOTO_TABLE */
+    uint16_t len;               /* Length is 8. */
+    uint8_t table_id;
+    uint8_t pad[3];
+};
+OFP_ASSERT(sizeof(struct ofp_instruction_goto_table) == 8);
+
+struct ofp_instruction_actions {
+    uint16_t type;              /* One of OFPIT_*_ACTIONS */
+    uint16_t len;               /* Length including the actions */
+    uint8_t pad[4];
+    struct ofp_action_header actions[0];
+};
+OFP_ASSERT(sizeof(struct ofp_instruction_actions) == 8);
+
+struct ofp_instruction_meter {
+    uint16_t type;              /* OFPIT_METER */
+    uint16_t len;               /* Length is 8. */
+    uint32_t meter_id;
+};
+OFP_ASSERT(sizeof(struct ofp_instruction_meter) == 8);
+
+/* Table numbering */
+enum ofp_table {
+    OFPTT_MAX = 0xfe,
+    OFPTT_ALL = 0xff
+};
+
+#define OFPG_ANY            0xffffffff
+
+enum ofp13_flow_mod_flags {
+    OFPFF13_SEND_FLOW_REM   = 1 << 0,
+    OFPFF13_CHECK_OVERLAP   = 1 << 1,
+    OFPFF13_RESET_COUNTS    = 1 << 2,
+    OFPFF13_NO_PKT_COUNTS   = 1 << 3,
+    OFPFF13_NO_BYT_COUNTS   = 1 << 4
+};
+
+/* Error types that moved since 1.0 (the first three kept their numbers) */
+enum ofp13_error_type {
+    OFPET13_BAD_INSTRUCTION     = 3,
+    OFPET13_BAD_MATCH           = 4,
+    OFPET13_FLOW_MOD_FAILED     = 5,
+    OFPET13_GROUP_MOD_FAILED    = 6,
+    OFPET13_PORT_MOD_FAILED     = 7,
+    OFPET13_TABLE_MOD_FAILED    = 8,
+    OFPET13_QUEUE_OP_FAILED     = 9,
+    OFPET13_SWITCH_CONFIG_FAILED = 10,
+    OFPET13_ROLE_REQUEST_FAILED = 11,
+    OFPET13_METER_MOD_FAILED    = 12,
+    OFPET13_TABLE_FEATURES_FAILED = 13,
+    OFPET13_EXPERIMENTER        = 0xffff
+};
+
+enum ofp13_flow_mod_failed_code {
+    OFPFMFC13_UNKNOWN           = 0,
+    OFPFMFC13_TABLE_FULL        = 1,
+    OFPFMFC13_BAD_TABLE_ID      = 2,
+    OFPFMFC13_OVERLAP           = 3,
+    OFPFMFC13_EPERM             = 4,
+    OFPFMFC13_BAD_TIMEOUT       = 5,
+    OFPFMFC13_BAD_COMMAND       = 6,
+    OFPFMFC13_BAD_FLAGS         = 7
+};
+
+/* Flow setup and teardown (controller -> datapath). The match is
+ * variable length; instructions follow it once padded to 8 bytes. */
+struct ofp13_flow_mod {
+    struct ofp_header header;
+    uint64_t cookie;
+    uint64_t cookie_mask;
+    uint8_t table_id;
+    uint8_t command;            /* One of OFPFC_*. */
+    uint16_t idle_timeout;
+    uint16_t hard_timeout;
+    uint16_t priority;
+    uint32_t buffer_id;
+    uint32_t out_port;          /* For OFPFC_DELETE*, OFPP13_ANY for any */
+    uint32_t out_group;         /* For OFPFC_DELETE*, OFPG_ANY for any */
+    uint16_t flags;             /* One of OFPFF13_*. */
+    uint8_t pad[2];
+    struct ofp13_match match;
+};
+OFP_ASSERT(sizeof(struct ofp13_flow_mod) == 56);
+
+/* Send packet (controller -> datapath). */
+struct ofp13_packet_out {
+    struct ofp_header header;
+    uint32_t buffer_id;
+    uint32_t in_port;           /* OFPP13_CONTROLLER if none */
+    uint16_t actions_len;
+    uint8_t pad[6];
+    struct ofp_action_header actions[0];
+};
+OFP_ASSERT(sizeof(struct ofp13_packet_out) == 24);
+
+/* Packet received on port (datapath -> controller). The match is
+ * variable length and is followed by 2 bytes of pad, then the frame. */
+struct ofp13_packet_in {
+    struct ofp_header header;
+    uint32_t buffer_id;
+    uint16_t total_len;
+    uint8_t reason;             /* One of OFPR_*. */
+    uint8_t table_id;
+    uint64_t cookie;
+    struct ofp13_match match;
+};
+OFP_ASSERT(sizeof(struct ofp13_packet_in) == 32);
+
+/* Flow removed (datapath -> controller). Variable-length match last. */
+struct ofp13_flow_removed {
+    struct ofp_header header;
+    uint64_t cookie;
+    uint16_t priority;
+    uint8_t reason;             /* One of OFPRR_*. */
+    uint8_t table_id;
+    uint32_t duration_sec;
+    uint32_t duration_nsec;
+    uint16_t idle_timeout;
+    uint16_t hard_timeout;
+    uint64_t packet_count;
+    uint64_t byte_count;
+    struct ofp13_match match;
+};
+OFP_ASSERT(sizeof(struct ofp13_flow_removed) == 56);
+
+/* Multipart (the 1.3 name for stats) */
+enum ofp_multipart_type {
+    OFPMP_DESC          = 0,
+    OFPMP_FLOW          = 1,
+    OFPMP_AGGREGATE     = 2,
+    OFPMP_TABLE         = 3,
+    OFPMP_PORT_STATS    = 4,
+    OFPMP_QUEUE         = 5,
+    OFPMP_GROUP         = 6,
+    OFPMP_GROUP_DESC    = 7,
+    OFPMP_GROUP_FEATURES = 8,
+    OFPMP_METER         = 9,
+    OFPMP_METER_CONFIG  = 10,
+    OFPMP_METER_FEATURES = 11,
+    OFPMP_TABLE_FEATURES = 12,
+    OFPMP_PORT_DESC     = 13,
+    OFPMP_EXPERIMENTER  = 0xffff
+};
+
+enum ofp_multipart_reply_flags {
+    OFPMPF_REPLY_MORE   = 1 << 0
+};
+
+struct ofp13_multipart_request {
+    struct ofp_header header;
+    uint16_t type;              /* One of the OFPMP_* constants. */
+    uint16_t flags;
+    uint8_t pad[4];
+    uint8_t body[0];
+};
+OFP_ASSERT(sizeof(struct ofp13_multipart_request) == 16);
+
+struct ofp13_multipart_reply {
+    struct ofp_header header;
+    uint16_t type;              /* One of the OFPMP_* constants. */
+    uint16_t flags;             /* OFPMPF_REPLY_* flags. */
+    uint8_t pad[4];
+    uint8_t body[0];
+};
+OFP_ASSERT(sizeof(struct ofp13_multipart_reply) == 16);
+
+/* Body for ofp13_multipart_request of type OFPMP_FLOW */
+struct ofp13_flow_stats_request {
+    uint8_t table_id;           /* OFPTT_ALL for all tables */
+    uint8_t pad[3];
+    uint32_t out_port;          /* OFPP13_ANY for any */
+    uint32_t out_group;         /* OFPG_ANY for any */
+    uint8_t pad2[4];
+    uint64_t cookie;
+    uint64_t cookie_mask;       /* 0 for any cookie */
+    struct ofp13_match match;
+};
+OFP_ASSERT(sizeof(struct ofp13_flow_stats_request) == 40);
+
+/* Body of reply to OFPMP_FLOW request; instructions follow the match */
+struct ofp13_flow_stats {
+    uint16_t length;            /* Length of this entry */
+    uint8_t table_id;
+    uint8_t pad;
+    uint32_t duration_sec;
+    uint32_t duration_nsec;
+    uint16_t priority;
+    uint16_t idle_timeout;
+    uint16_t hard_timeout;
+    uint16_t flags;             /* OFPFF_* */
+    uint8_t pad2[4];
+    uint64_t cookie;
+    uint64_t packet_count;
+    uint64_t byte_count;
+    struct ofp13_match match;
+};
+OFP_ASSERT(sizeof(struct ofp13_flow_stats) == 56);
+
+/* Meters */
+enum ofp_meter {
+    OFPM_MAX        = 0xffff0000,
+    OFPM_SLOWPATH   = 0xfffffffd,
+    OFPM_CONTROLLER = 0xfffffffe,
+    OFPM_ALL        = 0xffffffff
+};
+
+enum ofp_meter_mod_command {
+    OFPMC_ADD,
+    OFPMC_MODIFY,
+    OFPMC_DELETE
+};
+
+enum ofp_meter_flags {
+    OFPMF_KBPS      = 1 << 0,
+    OFPMF_PKTPS     = 1 << 1,
+    OFPMF_BURST     = 1 << 2,
+    OFPMF_STATS     = 1 << 3
+};
+
+enum ofp_meter_band_type {
+    OFPMBT_DROP         = 1,
+    OFPMBT_DSCP_REMARK  = 2,
+    OFPMBT_EXPERIMENTER = 0xffff
+};
+
+/* Drop packets over the rate */
+struct ofp_meter_band_drop {
+    uint16_t type;              /* OFPMBT_DROP. */
+    uint16_t len;               /* Length is 16. */
+    uint32_t rate;              /* kbps or pktps, per the meter's flags */
+    uint32_t burst_size;        /* Used with OFPMF_BURST */
+    uint8_t pad[4];
+};
+OFP_ASSERT(sizeof(struct ofp_meter_band_drop) == 16);
+
+/* Meter configuration; the bands follow */
+struct ofp_meter_mod {
+    struct ofp_header header;
+    uint16_t command;           /* One of OFPMC_*. */
+    uint16_t flags;             /* Bitmap of OFPMF_* flags. */
+    uint32_t meter_id;
+};
+OFP_ASSERT(sizeof(struct ofp_meter_mod) == 16);
+
+/* Controller roles. */
+enum ofp13_controller_role {
+    OFPCR_ROLE_NOCHANGE = 0,    /* Don't change current role. */
+    OFPCR_ROLE_EQUAL    = 1,    /* Default role, full access. */
+    OFPCR_ROLE_MASTER   = 2,    /* Full access, at most one master. */
+    OFPCR_ROLE_SLAVE    = 3     /* Read-only access. */
+};
+
+/* Role request and reply message. */
+struct ofp13_role_request {
+    struct ofp_header header;
+    uint32_t role;
+    uint8_t pad[4];
+    uint64_t generation_id;
+};
+OFP_ASSERT(sizeof(struct ofp13_role_request) == 24);
+
+/* Asynchronous message configuration. */
+struct ofp13_async_config {
+    struct ofp_header header;
+    uint32_t packet_in_mask[2];
+    uint32_t port_status_mask[2];
+    uint32_t flow_removed_mask[2];
+};
+OFP_ASSERT(sizeof(struct ofp13_async_config) == 32);
+
+/* Queue configuration reply; the queue list follows */
+struct ofp13_queue_get_config_reply {
+    struct ofp_header header;
+    uint32_t port;
+    uint8_t pad[4];
+};
+OFP_ASSERT(sizeof(struct ofp13_queue_get_config_reply) == 16);
+
+#endif /* openflow/openflow13.h */
@@ -0,0 +1,230 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "shmring.h"
+#include "logger.h"
+
+static size_t shm_ring_map_len(uint32_t n_slots, uint32_t slot_size)
+{
+    return sizeof(struct shm_ring) + (size_t)n_slots * slot_size;
+}
+
+struct shm_ring_handle *shm_ring_create(const char *name, uint32_t n_slots,
+                                        uint32_t record_size)
+{
+    struct shm_ring_handle *h;
+    uint32_t slot_size = (record_size + 7) & ~7;
+    int fd;
+
+    if (n_slots == 0 || (n_slots & (n_slots - 1)) != 0) {
+        LogError("shmring", "Ring size %d is not a power of two", n_slots);
+        return NULL;
+    }
+
+    h = malloc(sizeof(*h));
+    if (h == NULL) {
+        LogError("shmring", "Unable to malloc %d bytes", sizeof(*h));
+        return NULL;
+    }
+    memset(h, 0, sizeof(*h));
+    snprintf(h->name, sizeof(h->name), "%s", name);
+    h->map_len = shm_ring_map_len(n_slots, slot_size);
+    h->owner = 1;
+    h->wake_fd = -1;
+
+    /* A stale ring from a previous run may hold records we already acted
+     * on; start clean */
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        LogError("shmring", "shm_open %s: %s", name, strerror(errno));
+        free(h);
+        return NULL;
+    }
+    if (ftruncate(fd, h->map_len) != 0) {
+        LogError("shmring", "ftruncate %s: %s", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        free(h);
+        return NULL;
+    }
+
+    h->ring = mmap(NULL, h->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    close(fd);
+    if (h->ring == MAP_FAILED) {
+        LogError("shmring", "mmap %s: %s", name, strerror(errno));
+        shm_unlink(name);
+        free(h);
+        return NULL;
+    }
+
+    /* Opened read-write so we never see EOF when producers come and go */
+    snprintf(h->ring->wake_path, sizeof(h->ring->wake_path),
+             "/tmp%s%s.wake", name[0] == '/' ? "" : "/", name);
+    unlink(h->ring->wake_path);
+    if (mkfifo(h->ring->wake_path, 0600) != 0 ||
+        (h->wake_fd = open(h->ring->wake_path,
+                           O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        LogWarn("shmring", "No wakeup FIFO %s (%s), ring will only be polled",
+                h->ring->wake_path, strerror(errno));
+        h->ring->wake_path[0] = '\0';
+        h->wake_fd = -1;
+    }
+
+    h->ring->n_slots = n_slots;
+    h->ring->slot_size = slot_size;
+    h->ring->version = SHM_RING_VERSION;
+    __atomic_store_n(&h->ring->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    return h;
+}
+
+struct shm_ring_handle *shm_ring_attach(const char *name)
+{
+    struct shm_ring_handle *h;
+    struct shm_ring hdr;
+    int fd;
+
+    h = malloc(sizeof(*h));
+    if (h == NULL) {
+        LogError("shmring", "Unable to malloc %d bytes", sizeof(*h));
+        return NULL;
+    }
+    memset(h, 0, sizeof(*h));
+    snprintf(h->name, sizeof(h->name), "%s", name);
+    h->wake_fd = -1;
+
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        LogError("shmring", "shm_open %s: %s", name, strerror(errno));
+        free(h);
+        return NULL;
+    }
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        hdr.magic != SHM_RING_MAGIC || hdr.version != SHM_RING_VERSION) {
+        LogError("shmring", "%s is not a version %d ring", name,
+                 SHM_RING_VERSION);
+        close(fd);
+        free(h);
+        return NULL;
+    }
+
+    h->map_len = shm_ring_map_len(hdr.n_slots, hdr.slot_size);
+    h->ring = mmap(NULL, h->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    close(fd);
+    if (h->ring == MAP_FAILED) {
+        LogError("shmring", "mmap %s: %s", name, strerror(errno));
+        free(h);
+        return NULL;
+    }
+
+    if (hdr.wake_path[0] != '\0') {
+        hdr.wake_path[sizeof(hdr.wake_path) - 1] = '\0';
+        h->wake_fd = open(hdr.wake_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (h->wake_fd < 0) {
+            LogWarn("shmring", "Cannot open wakeup FIFO %s (%s), "
+                    "relying on polling", hdr.wake_path, strerror(errno));
+        }
+    }
+
+    return h;
+}
+
+int shm_ring_push(struct shm_ring_handle *h, const void *record, size_t len)
+{
+    struct shm_ring *ring = h->ring;
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint8_t *slot;
+
+    if (head - tail >= ring->n_slots) {
+        return -1;
+    }
+    if (len > ring->slot_size) {
+        len = ring->slot_size;
+    }
+
+    slot = &ring->slots[(head & (ring->n_slots - 1)) * ring->slot_size];
+    memcpy(slot, record, len);
+
+    /* Publishing head and then checking consumer_waiting must not be
+     * reordered, or we could miss a consumer that just went to sleep */
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->consumer_waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST) &&
+        h->wake_fd >= 0) {
+        uint8_t one = 1;
+        if (write(h->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LogWarn("shmring", "wakeup write: %s", strerror(errno));
+        }
+    }
+
+    return 0;
+}
+
+size_t shm_ring_consume(struct shm_ring_handle *h, size_t max,
+                        void (*func)(void *record, void *arg), void *arg)
+{
+    struct shm_ring *ring = h->ring;
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+
+    while (tail != head && n < max) {
+        func(&ring->slots[(tail & (ring->n_slots - 1)) * ring->slot_size],
+             arg);
+        tail++;
+        n++;
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+int shm_ring_arm(struct shm_ring_handle *h)
+{
+    struct shm_ring *ring = h->ring;
+    uint8_t drained[64];
+
+    /* Empty the FIFO before sleeping on it */
+    if (h->wake_fd >= 0) {
+        while (read(h->wake_fd, drained, sizeof(drained)) > 0);
+    }
+
+    __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail) {
+        __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+void shm_ring_close(struct shm_ring_handle *h)
+{
+    if (h == NULL) {
+        return;
+    }
+
+    if (h->wake_fd >= 0) {
+        close(h->wake_fd);
+    }
+    if (h->owner) {
+        if (h->ring->wake_path[0] != '\0') {
+            unlink(h->ring->wake_path);
+        }
+        shm_unlink(h->name);
+    }
+    munmap(h->ring, h->map_len);
+    free(h);
+}
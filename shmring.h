@@ -0,0 +1,65 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHM_RING_MAGIC      0x666f7872      /* "foxr" */
+#define SHM_RING_VERSION    1
+#define SHM_RING_CACHELINE  64
+
+/* Single producer, single consumer ring of fixed-size records in a POSIX
+ * shared memory object. head is only written by the producer and tail only
+ * by the consumer, each on its own cache line; both count records and
+ * never wrap (the slot is count & mask).
+ *
+ * The consumer sleeps on a wakeup FIFO named in the header. Before
+ * sleeping it sets consumer_waiting and re-checks head; a producer that
+ * publishes a record and sees consumer_waiting set clears it and writes a
+ * byte to the FIFO, so a busy ring costs no syscalls at all. (An eventfd
+ * would be cheaper still, but another process has no way to open one.)
+ * If the producer cannot open the FIFO, the consumer should also poll. */
+struct shm_ring {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    n_slots;        /* power of two */
+    uint32_t    slot_size;
+    char        wake_path[64];
+
+    uint64_t    head __attribute__((aligned(SHM_RING_CACHELINE)));
+    uint64_t    tail __attribute__((aligned(SHM_RING_CACHELINE)));
+    uint32_t    consumer_waiting __attribute__((aligned(SHM_RING_CACHELINE)));
+
+    uint8_t     slots[0] __attribute__((aligned(SHM_RING_CACHELINE)));
+};
+
+struct shm_ring_handle {
+    struct shm_ring *ring;
+    size_t          map_len;
+    int             wake_fd;    /* -1 if there is no wakeup FIFO */
+    int             owner;      /* we created it, and unlink on close */
+    char            name[64];
+};
+
+/* Consumer side. record_size is rounded up to a multiple of 8. */
+struct shm_ring_handle *shm_ring_create(const char *name, uint32_t n_slots,
+                                        uint32_t record_size);
+
+/* Calls func for up to max records, returns how many were consumed */
+size_t shm_ring_consume(struct shm_ring_handle *h, size_t max,
+                        void (*func)(void *record, void *arg), void *arg);
+
+/* Ask for a wakeup on the next push. Returns 1 if records are
+ * already waiting (so don't sleep), 0 otherwise. */
+int shm_ring_arm(struct shm_ring_handle *h);
+
+/* Producer side */
+struct shm_ring_handle *shm_ring_attach(const char *name);
+
+/* Returns 0, or -1 if the ring is full */
+int shm_ring_push(struct shm_ring_handle *h, const void *record,
+                  size_t len);
+
+void shm_ring_close(struct shm_ring_handle *h);
+
+#endif
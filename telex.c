@@ -1,221 +1,2665 @@
 #include <event2/event.h>
 #include <event2/listener.h>
 #include <event2/bufferevent.h>
+#include <event2/buffer.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <signal.h>
 #include <linux/if_ether.h>
+#include <endian.h>
 #include "fox.h"
 #include "controller.h"
+#include "flowmod.h"
+#include "of13.h"
+#include "logger.h"
 #include "telex.h"
+#include "shmring.h"
+#include "config.h"
+#include "discovery.h"
+#include "admit.h"
+#include "datapath.h"
+#include "ha.h"
+#include "journal.h"
 
-void telex_generate_mod_flow(struct telex_state *state, uint32_t src_ip,
-                             uint32_t dst_ip, uint16_t src_port,
-                             uint16_t dst_port, int add)
+static void telex_make_room(struct telex_state *state);
+static void telex_reconcile_reply(struct telex_state *state, uint32_t i,
+                                  struct ofp_stats_reply *reply);
+
+static uint64_t telex_now_ms(struct telex_state *state)
+{
+    struct timeval tv;
+
+    event_base_gettimeofday_cached(state->base, &tv);
+
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Where a change to the block table is recorded */
+#define TELEX_TO_HA         0x01    /* the standby, if any (ha.h) */
+#define TELEX_TO_JOURNAL    0x02    /* the journal, if any (journal.h) */
+
+static void telex_record(struct telex_state *state, int to, uint8_t type,
+                         const struct block_key *key, uint8_t action,
+                         uint8_t flags, uint64_t value)
+{
+    if ((to & TELEX_TO_HA) && state->ha != NULL) {
+        ha_log(state->ha, type, key, action, flags, value);
+    }
+    if ((to & TELEX_TO_JOURNAL) && state->journal != NULL) {
+        journal_log(state->journal, type, key, action, flags, value);
+    }
+}
+
+/* The switch (index in controllers) a message on channel sw is about:
+ * sw's own, unless sw is another channel to a datapath we send blocks to
+ * through a different entry. -1 if it is none of ours. */
+static int telex_switch_index(struct telex_state *state, struct fox_state *sw)
+{
+    int i, own = -1;
+
+    for (i=0; i<MAX_SWITCHES; i++) {
+        if (state->controllers[i] == sw) {
+            own = i;
+            if (state->config.switches[i].blocks != CONFIG_BLOCKS_NONE) {
+                return i;
+            }
+        }
+    }
+    if (sw->datapath == NULL) {
+        return own;
+    }
+    for (i=0; i<MAX_SWITCHES; i++) {
+        if (state->controllers[i] != NULL &&
+            state->controllers[i]->datapath == sw->datapath &&
+            state->config.switches[i].blocks != CONFIG_BLOCKS_NONE) {
+            return i;
+        }
+    }
+    return own;
+}
+
+/* Where switch i's flow mods go (see datapath.h), or NULL */
+static struct fox_state *telex_channel(struct telex_state *state, uint32_t i)
+{
+    if (state->controllers[i] == NULL) {
+        return NULL;
+    }
+    return datapath_channel(state->controllers[i]);
+}
+
+/* Network order mask of an address with its low bits wildcarded */
+static uint32_t telex_prefix_mask(uint32_t bits)
+{
+    return bits >= 32 ? 0 : htonl(~0u << bits);
+}
+
+/* Whether a switch's blocks policy takes a flow from src to dst, each
+ * possibly a prefix (already masked): a net must overlap one of them */
+static int telex_switch_wants(const struct config_switch *conf,
+                              uint32_t src, uint32_t src_mask,
+                              uint32_t dst, uint32_t dst_mask)
+{
+    uint32_t i;
+
+    if (conf->blocks != CONFIG_BLOCKS_NETS) {
+        return conf->blocks == CONFIG_BLOCKS_ALL;
+    }
+    for (i=0; i<conf->n_nets; i++) {
+        const struct config_net *net = &conf->nets[i];
+
+        if ((src & src_mask & net->mask) == (net->addr & src_mask) ||
+            (dst & dst_mask & net->mask) == (net->addr & dst_mask)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* The switches (bits of controllers indexes) a flow on key goes to, with
+ * src_bits and dst_bits of its addresses wildcarded */
+static uint32_t telex_switches(struct telex_state *state,
+                               const struct block_key *key,
+                               uint32_t src_bits, uint32_t dst_bits)
+{
+    uint32_t i, switches = 0;
+
+    for (i=0; i<state->config.n_switches; i++) {
+        if (telex_switch_wants(&state->config.switches[i],
+                               key->src_ip, telex_prefix_mask(src_bits),
+                               key->dst_ip, telex_prefix_mask(dst_bits))) {
+            switches |= 1u << i;
+        }
+    }
+    return switches;
+}
+
+static uint32_t telex_block_switches(struct telex_state *state,
+                                     const struct block_key *key)
+{
+    return telex_switches(state, key, 0, 0);
+}
+
+/* Those of the aggregate flow of kind for group key gkey */
+static uint32_t telex_group_switches(struct telex_state *state, int kind,
+                                     const struct block_key *gkey)
+{
+    uint32_t bits = agg_wild_bits(&state->aggs, kind);
+
+    return telex_switches(state, gkey, kind == AGG_BY_SRC ? bits : 0,
+                          kind == AGG_BY_DST ? bits : 0);
+}
+
+static uint32_t telex_aggregate_switches(struct telex_state *state, int kind,
+                                         uint32_t group)
+{
+    return telex_group_switches(state, kind,
+                                &agg_group(&state->aggs, kind, group)->key);
+}
+
+/* A flow was added to (delta 1) or removed from (-1) each of switches */
+static void telex_count(struct telex_state *state, uint32_t switches,
+                        int delta)
+{
+    uint32_t i;
+
+    for (i=0; i<MAX_SWITCHES; i++) {
+        if (switches & 1u << i) {
+            state->capacity.room[i].n_flows += delta;
+        }
+    }
+}
+
+/*
+* Flow mods are queued on the switch's channel in controller class cls
+* (see controller_send_class), which writes out what one trip through the
+* event loop queued in one go, and the barrier ending the scheduling pass
+* (telex_send_barrier) behind them.
+*/
+static void telex_queue_flow_mod(struct telex_state *state, uint32_t i,
+                                 const struct flow_mod *mod, int cls)
+{
+    struct fox_state *sw = telex_channel(state, i);
+    uint8_t buf[FLOW_MOD_MAX_LEN];
+    size_t len;
+
+    len = flow_mod_encode(sw->version, mod, buf, sizeof(buf));
+    if (len == 0) {
+        LogError(sw->name, "Could not encode flow mod for version %d",
+                 sw->version);
+        return;
+    }
+    if (controller_send_class(sw, cls, buf, len) != 0) {
+        state->unsent[i] += len;
+    }
+    state->batch_switches |= 1u << i;
+}
+
+/*
+* A delete may overtake the adds queued for a switch (see controller.h),
+* unless the block's own add could be one of them: it went out in the
+* pass e->pass, and a barrier is only written out after everything queued
+* before it, so the add is out once that pass's barrier is.
+*/
+static int telex_delete_class(struct telex_state *state,
+                              const struct block_key *key,
+                              struct fox_state *sw)
+{
+    struct block_key k = *key;
+    uint32_t entry = block_table_find(&state->blocks, &k);
+
+    if (entry == BLOCK_NONE ||
+        (sw->barrier_sent &&
+         (int32_t)(sw->barrier_xid -
+                   block_table_get(&state->blocks, entry)->pass) >= 0)) {
+        return CONTROLLER_CLASS_UNBLOCK;
+    }
+    return CONTROLLER_CLASS_BLOCK;
+}
+
+static int telex_action_installs(uint8_t action)
+{
+    action &= TELEX_MOD_CMD_MASK;
+    return action == TELEX_MOD_BLOCK ||
+           action == TELEX_MOD_BLOCK_BIDIRECTIONAL ||
+           action == TELEX_MOD_THROTTLE ||
+           action == TELEX_MOD_THROTTLE_BIDIRECTIONAL;
+}
+
+static int telex_action_throttles(uint8_t action)
+{
+    action &= TELEX_MOD_CMD_MASK;
+    return action == TELEX_MOD_THROTTLE ||
+           action == TELEX_MOD_THROTTLE_BIDIRECTIONAL;
+}
+
+/* What a block does with the flow's packets; no actions means drop */
+static void telex_block_actions(struct telex_state *state,
+                                struct fox_state *sw, struct flow_mod *mod,
+                                uint8_t mode)
+{
+    if (mode == TELEX_MOD_BLOCK_DEFAULT) {
+        mode = state->config.block_action;
+    }
+
+    switch (mode) {
+    case TELEX_MOD_BLOCK_DROP:
+        break;
+    case TELEX_MOD_BLOCK_SAMPLE:
+        if (sw->version == OFP13_VERSION) {
+            mod->meter_id = TELEX_SAMPLE_METER_ID;
+        }
+        /* fall through */
+    case TELEX_MOD_BLOCK_PUNT:
+        flow_mod_add_output(mod, OFPP_CONTROLLER, state->config.punt_max_len);
+        break;
+    }
+}
+
+/* Only plain blocks are aggregated: an aggregate has a single action */
+static int telex_action_aggregates(uint8_t action)
+{
+    return (action & TELEX_MOD_BLOCK_MASK) == TELEX_MOD_BLOCK_DEFAULT &&
+           ((action & TELEX_MOD_CMD_MASK) == TELEX_MOD_BLOCK ||
+            (action & TELEX_MOD_CMD_MASK) == TELEX_MOD_BLOCK_BIDIRECTIONAL);
+}
+
+/* The entry an exact block's cookie names, or BLOCK_NONE */
+static uint32_t telex_cookie_entry(uint64_t cookie)
+{
+    if ((cookie & TELEX_COOKIE_TAG_MASK) != TELEX_COOKIE_BLOCK) {
+        return BLOCK_NONE;
+    }
+    return (uint32_t)cookie;
+}
+
+/* Whether a block's cookie was sent for the block now in its entry, rather
+ * than one that had the entry before it */
+static int telex_cookie_current(struct telex_state *state, uint64_t cookie,
+                                uint32_t entry)
+{
+    return telex_cookie_entry(cookie) == entry &&
+           (uint16_t)(cookie >> TELEX_COOKIE_GEN_SHIFT) ==
+           block_table_get(&state->blocks, entry)->gen;
+}
+
+/* Match a block's TCP 4-tuple, with src_bits and dst_bits of the addresses
+ * wildcarded. Anything wider than one flow also leaves the source port
+ * open, and its addresses are already masked. */
+static void telex_match(struct flow_mod *mod, const struct block_key *key,
+                        uint32_t src_bits, uint32_t dst_bits)
+{
+    uint32_t wildcards = OFPFW_ALL &
+                         ~OFPFW_NW_SRC_MASK & ~OFPFW_NW_DST_MASK &
+                         ~OFPFW_TP_SRC & ~OFPFW_TP_DST &
+                         ~OFPFW_NW_PROTO & ~OFPFW_DL_TYPE;
+
+    wildcards |= src_bits << OFPFW_NW_SRC_SHIFT;
+    wildcards |= dst_bits << OFPFW_NW_DST_SHIFT;
+    if (src_bits != 0 || dst_bits != 0) {
+        wildcards |= OFPFW_TP_SRC;
+    }
+
+    mod->match.wildcards = htonl(wildcards);
+    mod->match.dl_type = htons(ETH_P_IP); 
+    mod->match.nw_src = key->src_ip;
+    mod->match.nw_dst = key->dst_ip;
+    mod->match.nw_proto = IPPROTO_TCP;
+    mod->match.tp_src = key->src_port;
+    mod->match.tp_dst = key->dst_port;
+}
+
+/* Add or delete a block's flow on each of switches. The actions depend on
+ * what each switch speaks. An add for an entry (TELEX_XID_BLOCK) gets its
+ * cookie, and remembers the pass it went out in. */
+void telex_generate_mod_flow(struct telex_state *state,
+                             const struct block_key *key, uint8_t action,
+                             uint32_t xid, uint32_t switches)
+{
+    struct flow_mod base;
+    uint32_t i;
+
+    flow_mod_init(&base, telex_action_installs(action) ? OFPFC_ADD :
+                                                         OFPFC_DELETE);
+    telex_match(&base, key, 0, 0);
+
+    base.xid = xid;
+    base.idle_timeout = state->config.idle_timeout;
+    base.priority = TELEX_PRIORITY;
+    base.flags = OFPFF_SEND_FLOW_REM;
+    if ((xid & ~TELEX_XID_INDEX_MASK) == TELEX_XID_BLOCK) {
+        struct block_entry *e = block_table_get(&state->blocks,
+                                                xid & TELEX_XID_INDEX_MASK);
+
+        base.cookie = TELEX_COOKIE_BLOCK |
+                      (uint64_t)e->gen << TELEX_COOKIE_GEN_SHIFT |
+                      (xid & TELEX_XID_INDEX_MASK);
+        e->pass = state->next_pass_xid;
+    }
+
+    if (telex_action_throttles(action) && state->config.throttle_kbps == 0) {
+        LogWarn(state->name, "Throttling is not configured; blocking");
+        action = TELEX_MOD_BLOCK;
+    }
+
+    for (i=0; i<MAX_SWITCHES; i++) {
+        struct fox_state *sw = telex_channel(state, i);
+        struct flow_mod mod = base;
+
+        if (!(switches & 1u << i) || sw == NULL) {
+            continue;
+        }
+
+        if (telex_action_throttles(action)) {
+            if (sw->version == OFP13_VERSION) {
+                mod.meter_id = TELEX_METER_ID;
+                flow_mod_add_output(&mod, state->config.throttle_port, 0);
+            } else {
+                flow_mod_add_enqueue(&mod, state->config.throttle_port,
+                                     state->config.throttle_queue);
+            }
+        } else if (telex_action_installs(action)) {
+            telex_block_actions(state, sw, &mod,
+                                action & TELEX_MOD_BLOCK_MASK);
+        }
+
+        telex_queue_flow_mod(state, i, &mod,
+                             telex_action_installs(action) ?
+                             CONTROLLER_CLASS_BLOCK :
+                             telex_delete_class(state, key, sw));
+    }
+}
+
+/*
+* Flow table capacity. Blocks with a flow of their own sit on an LRU list,
+* coldest (least recently blocked or refreshed) first, and count towards
+* the n_flows of each switch they are on, along with installed aggregates.
+*/
+static void telex_lru_unlink(struct telex_state *state, uint32_t entry)
+{
+    struct telex_capacity *cap = &state->capacity;
+    struct block_entry *e = block_table_get(&state->blocks, entry);
+
+    if (e->lru_prev != BLOCK_NONE) {
+        block_table_get(&state->blocks, e->lru_prev)->lru_next = e->lru_next;
+    } else {
+        cap->lru_head = e->lru_next;
+    }
+    if (e->lru_next != BLOCK_NONE) {
+        block_table_get(&state->blocks, e->lru_next)->lru_prev = e->lru_prev;
+    } else {
+        cap->lru_tail = e->lru_prev;
+    }
+}
+
+/* The block's flow was just (re)sent: it is now the hottest */
+static void telex_flow_added(struct telex_state *state, uint32_t entry)
+{
+    struct telex_capacity *cap = &state->capacity;
+    struct block_entry *e = block_table_get(&state->blocks, entry);
+
+    if (e->flags & BLOCK_HAS_FLOW) {
+        telex_lru_unlink(state, entry);
+    } else {
+        e->flags |= BLOCK_HAS_FLOW;
+        telex_count(state, telex_block_switches(state, &e->key), 1);
+    }
+
+    e->sent = ++cap->n_sent;
+    e->lru_next = BLOCK_NONE;
+    e->lru_prev = cap->lru_tail;
+    if (cap->lru_tail != BLOCK_NONE) {
+        block_table_get(&state->blocks, cap->lru_tail)->lru_next = entry;
+    } else {
+        cap->lru_head = entry;
+    }
+    cap->lru_tail = entry;
+}
+
+static void telex_flow_gone(struct telex_state *state, uint32_t entry)
+{
+    struct block_entry *e = block_table_get(&state->blocks, entry);
+
+    if (e->flags & BLOCK_HAS_FLOW) {
+        telex_lru_unlink(state, entry);
+        e->flags &= ~BLOCK_HAS_FLOW;
+        telex_count(state, telex_block_switches(state, &e->key), -1);
+    }
+}
+
+/* Add or strictly delete the aggregate flow of kind on group key gkey. Its
+ * cookie tells its flow removed apart from the exact flows'. It is only
+ * deleted once exact flows have been sent to replace it, so its delete
+ * stays behind their adds. */
+static void telex_aggregate_mod(struct telex_state *state, int kind,
+                                const struct block_key *gkey, uint32_t xid,
+                                uint16_t command, uint32_t switches)
+{
+    uint32_t bits = agg_wild_bits(&state->aggs, kind);
+    struct flow_mod base;
+    uint32_t i;
+
+    flow_mod_init(&base, command);
+    telex_match(&base, gkey, kind == AGG_BY_SRC ? bits : 0,
+                kind == AGG_BY_DST ? bits : 0);
+
+    base.xid = xid;
+    base.cookie = TELEX_COOKIE_AGGREGATE + kind;
+    base.idle_timeout = state->config.idle_timeout;
+    base.priority = TELEX_PRIORITY_AGGREGATE;
+    base.flags = OFPFF_SEND_FLOW_REM;
+
+    for (i=0; i<MAX_SWITCHES; i++) {
+        struct fox_state *sw = telex_channel(state, i);
+        struct flow_mod mod = base;
+
+        if (!(switches & 1u << i) || sw == NULL) {
+            continue;
+        }
+        if (command == OFPFC_ADD) {
+            telex_block_actions(state, sw, &mod, TELEX_MOD_BLOCK_DEFAULT);
+        }
+        telex_queue_flow_mod(state, i, &mod, CONTROLLER_CLASS_BLOCK);
+    }
+}
+
+static void telex_send_aggregate(struct telex_state *state, int kind,
+                                 uint32_t group, uint16_t command,
+                                 uint32_t switches)
+{
+    telex_aggregate_mod(state, kind,
+                        &agg_group(&state->aggs, kind, group)->key,
+                        TELEX_XID_AGGREGATE | kind << TELEX_XID_KIND_SHIFT |
+                        group, command, switches);
+}
+
+/* Replace a group's exact flows with its aggregate. The aggregate goes in
+ * first so the flows are never left unblocked. fresh is the member that
+ * tipped it over, which has no flow yet. */
+static void telex_aggregate(struct telex_state *state, int kind,
+                            uint32_t group, uint32_t fresh)
+{
+    struct block_entry *g = agg_group(&state->aggs, kind, group);
+    uint32_t m;
+
+    g->flags |= AGG_INSTALLED;
+    telex_count(state, telex_aggregate_switches(state, kind, group), 1);
+    telex_send_aggregate(state, kind, group, OFPFC_ADD,
+                         telex_aggregate_switches(state, kind, group));
+
+    LogInfo(state->name, "Aggregating %u blocks (%s prefix)", g->members,
+            kind == AGG_BY_SRC ? "source" : "destination");
+
+    for (m = g->head; m != BLOCK_NONE;
+         m = agg_next(&state->blocks, kind, m)) {
+        struct block_entry *e = block_table_get(&state->blocks, m);
+
+        if (!(e->flags & BLOCK_COVERED)) {
+            e->flags |= BLOCK_COVERED;
+            if (m != fresh) {
+                /* Its delete stays behind the aggregate's add */
+                e->pass = state->next_pass_xid;
+                telex_generate_mod_flow(state, &e->key, TELEX_MOD_UNBLOCK, 0,
+                                        telex_block_switches(state, &e->key));
+            }
+            telex_flow_gone(state, m);
+        }
+    }
+}
+
+/* Undo a group's aggregate because a member is leaving, reinstalling the
+ * exact flows of the others (unless another aggregate still covers them)
+ * before the aggregate goes. */
+static void telex_split(struct telex_state *state, int kind, uint32_t group,
+                        uint32_t leaving)
+{
+    struct block_entry *g = agg_group(&state->aggs, kind, group);
+    uint32_t m;
+    int other;
+
+    g->flags = (g->flags & ~AGG_INSTALLED) | AGG_SPLIT;
+    telex_count(state, telex_aggregate_switches(state, kind, group), -1);
+
+    LogInfo(state->name, "Splitting aggregate of %u blocks", g->members);
+
+    for (m = g->head; m != BLOCK_NONE;
+         m = agg_next(&state->blocks, kind, m)) {
+        struct block_entry *e = block_table_get(&state->blocks, m);
+
+        if (m == leaving || !(e->flags & BLOCK_COVERED) ||
+            agg_covering(&state->aggs, &state->blocks, m, &other) !=
+            BLOCK_NONE) {
+            continue;
+        }
+        e->flags &= ~BLOCK_COVERED;
+        telex_generate_mod_flow(state, &e->key, e->action,
+                                TELEX_XID_BLOCK | m,
+                                telex_block_switches(state, &e->key));
+        telex_flow_added(state, m);
+    }
+
+    telex_send_aggregate(state, kind, group, OFPFC_DELETE_STRICT,
+                         telex_aggregate_switches(state, kind, group));
+    telex_make_room(state);
+}
+
+/* Forget a block, splitting any aggregate it was part of */
+static void telex_forget(struct telex_state *state, uint32_t entry)
+{
+    struct block_entry *e = block_table_get(&state->blocks, entry);
+    uint32_t group;
+    int kind;
+
+    telex_record(state, TELEX_TO_HA | TELEX_TO_JOURNAL, HA_REC_FORGET,
+                 &e->key, 0, 0, 0);
+
+    if (e->flags & BLOCK_COVERED) {
+        while ((group = agg_covering(&state->aggs, &state->blocks, entry,
+                                     &kind)) != BLOCK_NONE) {
+            telex_split(state, kind, group, entry);
+        }
+    }
+    telex_flow_gone(state, entry);
+    agg_leave(&state->aggs, &state->blocks, entry);
+    block_table_remove(&state->blocks, entry);
+}
+
+/*
+* Install a block and track it in the shadow table, so flow removed
+* messages can be matched back to it. A new plain block joins its
+* aggregation groups: it needs no flow of its own if one of them is
+* already aggregated, and may tip one over the threshold.
+*/
+static void telex_block(struct telex_state *state, struct block_key *key,
+                        uint8_t action)
+{
+    struct block_entry *e;
+    uint32_t entry, group;
+    int kind, added;
+
+    entry = block_table_insert(&state->blocks, key);
+    if (entry == BLOCK_NONE) {
+        LogError(state->name, "Could not add block to shadow table");
+        telex_generate_mod_flow(state, key, action, 0,
+                                telex_block_switches(state, key));
+        return;
+    }
+    e = block_table_get(&state->blocks, entry);
+    added = e->installed_ms == 0;
+    e->installed_ms = telex_now_ms(state);
+    telex_record(state, TELEX_TO_HA | TELEX_TO_JOURNAL, HA_REC_BLOCK, key,
+                 action, 0, e->installed_ms);
+
+    if (added) {
+        e->action = action;
+        if (telex_action_aggregates(action)) {
+            agg_join(&state->aggs, &state->blocks, entry);
+
+            if (agg_covering(&state->aggs, &state->blocks, entry,
+                             &kind) != BLOCK_NONE) {
+                block_table_get(&state->blocks, entry)->flags |=
+                    BLOCK_COVERED;
+                return;
+            }
+            group = agg_ready(&state->aggs, &state->blocks, entry, &kind);
+            if (group != BLOCK_NONE) {
+                telex_make_room(state);
+                telex_aggregate(state, kind, group, entry);
+                return;
+            }
+        }
+    } else if ((e->flags & BLOCK_COVERED) && telex_action_aggregates(action)) {
+        return;
+    }
+
+    /* Hottest first, so making room never takes this one */
+    telex_flow_added(state, entry);
+    block_table_get(&state->blocks, entry)->flags &= ~BLOCK_RETRIED;
+    telex_make_room(state);
+
+    telex_generate_mod_flow(state, key, action, TELEX_XID_BLOCK | entry,
+                            telex_block_switches(state, key));
+}
+
+static void telex_unblock(struct telex_state *state, struct block_key *key,
+                          uint8_t action)
+{
+    uint32_t entry = block_table_find(&state->blocks, key);
+
+    if (entry == BLOCK_NONE ||
+        !(block_table_get(&state->blocks, entry)->flags & BLOCK_COVERED)) {
+        telex_generate_mod_flow(state, key, action, 0,
+                                telex_block_switches(state, key));
+    }
+    if (entry != BLOCK_NONE) {
+        telex_forget(state, entry);
+    } else {
+        /* Only so a new primary repeats the delete */
+        telex_record(state, TELEX_TO_HA, HA_REC_FORGET, key, 0, 0, 0);
+    }
+}
+
+void telex_handle_mod_flow(struct telex_state *state,
+                           struct telex_mod_flow *flow)
+{
+    char src_ip[INET_ADDRSTRLEN];
+    char dst_ip[INET_ADDRSTRLEN];
+    struct block_key key;
+
+    inet_ntop(AF_INET, &flow->src_ip, src_ip, INET_ADDRSTRLEN);
+    inet_ntop(AF_INET, &flow->dst_ip, dst_ip, INET_ADDRSTRLEN);
+
+    LogDebug(state->name, "flow command(%d): %s:%d <-> %s:%d",
+             flow->action, src_ip, ntohs(flow->src_port), dst_ip,
+             ntohs(flow->dst_port));
+
+    key.src_ip = flow->src_ip;
+    key.dst_ip = flow->dst_ip;
+    key.src_port = flow->src_port;
+    key.dst_port = flow->dst_port;
+
+    if (telex_action_installs(flow->action)) {
+        telex_block(state, &key, flow->action);
+    } else {
+        telex_unblock(state, &key, flow->action);
+    }
+}
+
+static void telex_sched_wake(struct telex_state *state, uint32_t delay_ms)
+{
+    struct timeval tv;
+
+    if (evtimer_pending(state->sched_ev, NULL)) {
+        return;
+    }
+    tv.tv_sec = delay_ms / 1000;
+    tv.tv_usec = (delay_ms % 1000) * 1000;
+    evtimer_add(state->sched_ev, &tv);
+}
+
+static size_t telex_client_pending(struct telex_client *client)
+{
+    return evbuffer_get_length(bufferevent_get_input(client->bev)) /
+           sizeof(struct telex_mod_flow);
+}
+
+static void telex_client_enqueue(struct telex_client *client)
+{
+    struct telex_state *state = client->state;
+
+    client->active = 1;
+    client->active_next = NULL;
+    if (state->active_tail != NULL) {
+        state->active_tail->active_next = client;
+    } else {
+        state->active_head = client;
+    }
+    state->active_tail = client;
+}
+
+static struct telex_client *telex_client_dequeue(struct telex_state *state)
+{
+    struct telex_client *client = state->active_head;
+
+    state->active_head = client->active_next;
+    if (state->active_head == NULL) {
+        state->active_tail = NULL;
+    }
+    client->active_next = NULL;
+
+    return client;
+}
+
+/* Any switch with too much queued, or too many passes unconfirmed */
+static int telex_switch_backlogged(struct telex_state *state)
+{
+    uint32_t i;
+
+    if (state->n_passes == TELEX_MAX_PASSES) {
+        return 1;
+    }
+    for (i=0; i<MAX_SWITCHES; i++) {
+        if (state->controllers[i] != NULL &&
+            controller_pending(telex_channel(state, i)) >
+            state->config.switch_high_water) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static struct telex_pass *telex_pass_get(struct telex_state *state,
+                                         uint32_t n)
+{
+    return &state->passes[(state->passes_head + n) % TELEX_MAX_PASSES];
+}
+
+/* Retire the oldest pass, answering the clients that had requests in it */
+static void telex_pass_done(struct telex_state *state)
+{
+    struct telex_pass *pass = telex_pass_get(state, 0);
+    struct telex_client *client;
+    struct {
+        struct telex_notify_hdr hdr;
+        struct telex_applied    applied;
+    } __attribute__((__packed__)) msg;
+
+    if (pass->n_confirmed < pass->n_switches) {
+        LogWarn(state->name, "Only %u of %u switches confirmed a pass",
+                pass->n_confirmed, pass->n_switches);
+    } else {
+        telex_record(state, TELEX_TO_HA, HA_REC_CONFIRMED, NULL, 0, 0,
+                     pass->xid);
+    }
+
+    msg.hdr.type = TELEX_MSG_APPLIED;
+    msg.hdr.count = htons(1);
+    msg.applied.switches = pass->n_switches;
+    msg.applied.unconfirmed = pass->n_switches - pass->n_confirmed;
+
+    for (client = state->clients; client != NULL; client = client->next) {
+        struct telex_client_pass *cp = &client->passes[client->passes_head];
+
+        if (client->n_passes == 0 || cp->xid != pass->xid) {
+            continue;
+        }
+        msg.applied.requests = htonl(cp->requests);
+        bufferevent_write(client->bev, &msg, sizeof(msg));
+
+        client->passes_head = (client->passes_head + 1) % TELEX_MAX_PASSES;
+        client->n_passes--;
+    }
+
+    state->passes_head = (state->passes_head + 1) % TELEX_MAX_PASSES;
+    state->n_passes--;
+}
+
+/* Retire passes, oldest first, that every switch has confirmed or that
+ * have waited TELEX_PASS_TIMEOUT_MS */
+static void telex_pass_check(struct telex_state *state)
+{
+    uint64_t now = telex_now_ms(state);
+    struct telex_pass *pass;
+    struct timeval tv;
+    uint64_t left;
+
+    while (state->n_passes > 0) {
+        pass = telex_pass_get(state, 0);
+        if (pass->waiting != 0 && now - pass->sent_ms < TELEX_PASS_TIMEOUT_MS) {
+            break;
+        }
+        telex_pass_done(state);
+    }
+
+    if (state->n_passes == 0 || evtimer_pending(state->pass_timer, NULL)) {
+        return;
+    }
+    left = telex_pass_get(state, 0)->sent_ms + TELEX_PASS_TIMEOUT_MS - now;
+    tv.tv_sec = left / 1000;
+    tv.tv_usec = (left % 1000) * 1000;
+    evtimer_add(state->pass_timer, &tv);
+}
+
+void telex_pass_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+    telex_pass_check(arg);
+}
+
+/*
+* Close a pass: queue a barrier behind every switch's flow mods, so the
+* switch's reply marks the point where all of them are in its table. The
+* requests clients had in the pass are answered when it is done.
+*/
+static void telex_send_barrier(struct telex_state *state)
+{
+    struct telex_client *client;
+    struct telex_pass *pass;
+    struct ofp_header barrier;
+    uint32_t i;
+
+    if (state->n_passes == TELEX_MAX_PASSES) {
+        telex_pass_done(state);
+    }
+    pass = telex_pass_get(state, state->n_passes++);
+    memset(pass, 0, sizeof(*pass));
+    pass->xid = state->next_pass_xid++;
+    pass->sent_ms = telex_now_ms(state);
+    telex_record(state, TELEX_TO_HA, HA_REC_PASS, NULL, 0, 0, pass->xid);
+
+    for (i=0; i<MAX_SWITCHES; i++) {
+        if (!(state->batch_switches & 1u << i)) {
+            continue;
+        }
+        pass->n_switches++;
+        if (state->unsent[i] != 0) {
+            LogWarn(state->name, "Switch %u not connected, dropped %zu "
+                    "bytes of flow mods", i, state->unsent[i]);
+            state->unsent[i] = 0;
+        }
+
+        memset(&barrier, 0, sizeof(barrier));
+        barrier.type = OFPT_BARRIER_REQUEST;
+        barrier.xid = htonl(pass->xid);
+        if (controller_send_hdr(telex_channel(state, i), &barrier,
+                                sizeof(barrier)) == 0) {
+            pass->waiting |= 1u << i;
+        }
+    }
+    state->batch_switches = 0;
+
+    for (client = state->clients; client != NULL; client = client->next) {
+        if (client->pass_requests == 0) {
+            continue;
+        }
+        if (state->config.ack_requests) {
+            struct telex_client_pass *cp;
+
+            cp = &client->passes[(client->passes_head + client->n_passes++) %
+                                 TELEX_MAX_PASSES];
+            cp->xid = pass->xid;
+            cp->requests = client->pass_requests;
+        }
+        client->pass_requests = 0;
+    }
+
+    telex_pass_check(state);
+}
+
+void telex_barrier_reply_cb(struct fox_state *sw, void *payload)
+{
+    struct telex_state *state = sw->user_ptr;
+    struct ofp_header *hdr = payload;
+    uint32_t xid = ntohl(hdr->xid);
+    int i = telex_switch_index(state, sw);
+    uint32_t n;
+
+    LogTrace(sw->name, "Barrier reply %u", xid);
+
+    if (i < 0) {
+        return;
+    }
+    for (n=0; n<state->n_passes; n++) {
+        struct telex_pass *pass = telex_pass_get(state, n);
+
+        if (pass->xid == xid && (pass->waiting & 1u << i)) {
+            pass->waiting &= ~(1u << i);
+            pass->n_confirmed++;
+            break;
+        }
+    }
+    telex_pass_check(state);
+}
+
+/* One scheduling pass: deficit round robin over clients with pending
+* requests, so a noisy client gets its quantum per round like everyone
+* else instead of draining its whole buffer first. */
+void telex_sched_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct telex_state *state = arg;
+    uint32_t budget = state->config.sched_budget;
+
+    while (state->active_head != NULL && budget > 0) {
+        struct telex_client *client;
+        struct evbuffer *input;
+        struct telex_mod_flow *flows;
+        size_t n, i;
+
+        if (telex_switch_backlogged(state)) {
+            LogTrace(state->name, "Switch backlogged, deferring requests");
+            telex_sched_wake(state, state->config.sched_retry_ms);
+            break;
+        }
+
+        client = telex_client_dequeue(state);
+        input = bufferevent_get_input(client->bev);
+
+        client->deficit += state->config.sched_quantum;
+        n = telex_client_pending(client);
+        if (n > client->deficit) {
+            n = client->deficit;
+        }
+        if (n > budget) {
+            n = budget;
+        }
+
+        flows = (struct telex_mod_flow *)evbuffer_pullup(input,
+                                                n * sizeof(*flows));
+        for (i=0; i<n; i++) {
+            telex_handle_mod_flow(state, &flows[i]);
+        }
+        evbuffer_drain(input, n * sizeof(*flows));
+
+        client->deficit -= n;
+        client->n_requests += n;
+        client->pass_requests += n;
+        budget -= n;
+
+        if (telex_client_pending(client) > 0) {
+            telex_client_enqueue(client);
+        } else {
+            client->active = 0;
+            client->deficit = 0;
+        }
+    }
+
+    if (budget < state->config.sched_budget) {
+        telex_send_barrier(state);
+    }
+
+    if (state->active_head != NULL) {
+        telex_sched_wake(state, 0);
+    }
+}
+
+void telex_read_cb(struct bufferevent *bev, void *ctx)
+{
+    struct telex_client *client = ctx;
+
+    if (client->active || telex_client_pending(client) == 0) {
+        return;
+    }
+
+    telex_client_enqueue(client);
+    telex_sched_wake(client->state, 0);
+}
+
+void telex_client_free(struct telex_client *client)
+{
+    struct telex_state *state = client->state;
+    struct telex_client **prev = &state->clients;
+
+    while (*prev != NULL && *prev != client) {
+        prev = &(*prev)->next;
+    }
+    if (*prev != NULL) {
+        *prev = client->next;
+    }
+
+    if (client->active) {
+        struct telex_client *prev_active = NULL;
+        struct telex_client *c;
+
+        for (c = state->active_head; c != client; c = c->active_next) {
+            prev_active = c;
+        }
+        if (prev_active != NULL) {
+            prev_active->active_next = client->active_next;
+        } else {
+            state->active_head = client->active_next;
+        }
+        if (state->active_tail == client) {
+            state->active_tail = prev_active;
+        }
+    }
+
+    LogDebug(state->name, "Client %s gone after %llu requests", client->name,
+             (unsigned long long)client->n_requests);
+
+    bufferevent_free(client->bev);
+    free(client);
+}
+
+void telex_error_cb(struct bufferevent *bev, short events, void *ctx)
+{
+    struct telex_client *client = ctx;
+    struct telex_state *state = client->state;
+
+    assert(state != NULL);
+
+    if (events & BEV_EVENT_ERROR) {
+        LogError(state->name, "Error from bufferevent (%s): %s",
+                 client->name,
+                 evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    }
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        LogDebug(state->name, "%s disconnected", client->name);
+        telex_client_free(client);
+    }
+}
+
+void telex_accept_cb(struct evconnlistener *listener,
+                     evutil_socket_t fd, struct sockaddr *address,
+                     int socklen, void *ctx)
+{
+    struct telex_state *state = ctx;
+    struct telex_client *client;
+    char src_ip[INET_ADDRSTRLEN];
+
+    client = malloc(sizeof(*client));
+    if (client == NULL) {
+        LogError(state->name, "Unable to malloc %d bytes", sizeof(*client));
+        evutil_closesocket(fd);
+        return;
+    }
+    memset(client, 0, sizeof(*client));
+
+    client->state = state;
+    client->bev = bufferevent_socket_new(state->base, fd,
+                                         BEV_OPT_CLOSE_ON_FREE);
+    if (client->bev == NULL) {
+        LogError(state->name, "Could not create client bufferevent");
+        evutil_closesocket(fd);
+        free(client);
+        return;
+    }
+
+    if (address->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)address;
+        inet_ntop(AF_INET, &sin->sin_addr.s_addr, src_ip, INET_ADDRSTRLEN);
+        snprintf(client->name, sizeof(client->name), "%s:%d",
+                 src_ip, ntohs(sin->sin_port));
+    } else {
+        snprintf(client->name, sizeof(client->name), "unix:%d", fd);
+    }
+    LogDebug(state->name, "%s connected", client->name);
+
+    client->next = state->clients;
+    state->clients = client;
+
+    /* Past the rate limit or the buffered input cap we simply stop reading
+     * from the client's socket, and TCP pushes back on it */
+    bufferevent_set_rate_limit(client->bev, state->client_rate);
+    bufferevent_setwatermark(client->bev, EV_READ, 0,
+                             state->config.client_max_buffered);
+
+    bufferevent_setcb(client->bev, telex_read_cb, NULL, telex_error_cb,
+                      client);
+    bufferevent_enable(client->bev, EV_READ);
+}
+
+void telex_accept_error_cb(struct evconnlistener *listener, void *ctx)
+{
+    struct event_base *base = evconnlistener_get_base(listener);
+    int err = EVUTIL_SOCKET_ERROR();
+
+    LogError("telex", "Accept error %d (%s)", err,
+             evutil_socket_error_to_string(err));
+}
+
+
+int telex_listen_tcp(struct telex_state *state, char *ip, uint16_t port)
+{
+    struct sockaddr_in sin;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = inet_addr(ip);
+    sin.sin_port = htons(port);
+
+    state->listener = evconnlistener_new_bind(state->base, 
+                            telex_accept_cb, state,
+                            LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
+                            (struct sockaddr*)&sin, sizeof(sin));
+    if (!state->listener) {
+        LogError("telex", "Error binding %s:%d", ip, port);
+        return -1;
+    }
+
+    evconnlistener_set_error_cb(state->listener, telex_accept_error_cb);
+
+    return 0;
+}
+
+/* Same protocol as TCP, minus the loopback stack */
+int telex_listen_unix(struct telex_state *state, char *path)
+{
+    struct sockaddr_un sun;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        LogError("telex", "Unix socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(sun.sun_path, path);
+    unlink(path);
+
+    state->unix_listener = evconnlistener_new_bind(state->base,
+                            telex_accept_cb, state,
+                            LEV_OPT_CLOSE_ON_FREE, -1,
+                            (struct sockaddr*)&sun, sizeof(sun));
+    if (!state->unix_listener) {
+        LogError("telex", "Error binding %s", path);
+        return -1;
+    }
+
+    evconnlistener_set_error_cb(state->unix_listener, telex_accept_error_cb);
+
+    return 0;
+}
+
+void telex_ring_record_cb(void *record, void *arg)
+{
+    telex_handle_mod_flow(arg, record);
+}
+
+/* Drain the shared memory ring, then either come straight back (more
+* waiting), or sleep on the wakeup FIFO with the poll timer as a backstop
+* for producers that could not open it. The FIFO event is only added once
+* shm_ring_arm has emptied it: a wake byte left in it while we cannot take
+* requests would otherwise fire the event on every pass of the loop. */
+void telex_ring_cb(evutil_socket_t fd, short what, void *arg)
+{
+    struct telex_state *state = arg;
+    struct timeval tv = {0, 0};
+    size_t n;
+
+    if (telex_switch_backlogged(state)) {
+        if (state->ring_ev != NULL) {
+            event_del(state->ring_ev);
+        }
+        tv.tv_sec = state->config.sched_retry_ms / 1000;
+        tv.tv_usec = (state->config.sched_retry_ms % 1000) * 1000;
+        evtimer_add(state->ring_timer, &tv);
+        return;
+    }
+
+    n = shm_ring_consume(state->ring, state->config.sched_budget,
+                         telex_ring_record_cb, state);
+    if (n > 0) {
+        telex_send_barrier(state);
+    }
+
+    if (n < state->config.sched_budget && !shm_ring_arm(state->ring)) {
+        if (state->ring_ev != NULL) {
+            event_add(state->ring_ev, NULL);
+        }
+        tv.tv_sec = state->config.ring_poll_ms / 1000;
+        tv.tv_usec = (state->config.ring_poll_ms % 1000) * 1000;
+    }
+    evtimer_add(state->ring_timer, &tv);
+}
+
+void telex_close_ring(struct telex_state *state)
+{
+    if (state->ring_ev) {
+        event_free(state->ring_ev);
+        state->ring_ev = NULL;
+    }
+    if (state->ring_timer) {
+        event_free(state->ring_timer);
+        state->ring_timer = NULL;
+    }
+    shm_ring_close(state->ring);
+    state->ring = NULL;
+}
+
+int telex_init_ring(struct telex_state *state, char *name, uint32_t slots)
+{
+    state->ring = shm_ring_create(name, slots,
+                                  sizeof(struct telex_mod_flow));
+    if (state->ring == NULL) {
+        return -1;
+    }
+
+    state->ring_timer = evtimer_new(state->base, telex_ring_cb, state);
+    if (state->ring_timer == NULL) {
+        LogError(state->name, "Could not create ring timer");
+        return -1;
+    }
+
+    if (state->ring->wake_fd >= 0) {
+        state->ring_ev = event_new(state->base, state->ring->wake_fd,
+                                   EV_READ, telex_ring_cb, state);
+        if (state->ring_ev == NULL) {
+            LogError(state->name, "Could not create ring event");
+            return -1;
+        }
+    }
+
+    telex_ring_cb(-1, 0, state);
+
+    LogInfo(state->name, "Taking requests from shared memory ring %s", name);
+
+    return 0;
+}
+
+/* Send everything that has expired since the last flush to every client,
+* as one message per client. */
+void telex_notify_flush(struct telex_state *state)
+{
+    struct telex_notify_hdr hdr;
+    struct telex_client *client;
+    size_t len = state->notify_count * sizeof(struct telex_flow_expired);
+
+    if (state->notify_count == 0) {
+        return;
+    }
+
+    LogInfo(state->name, "%d blocks expired", state->notify_count);
+
+    hdr.type = TELEX_MSG_FLOW_EXPIRED;
+    hdr.count = htons(state->notify_count);
+
+    for (client = state->clients; client != NULL; client = client->next) {
+        bufferevent_write(client->bev, &hdr, sizeof(hdr));
+        bufferevent_write(client->bev, state->notify_pending, len);
+    }
+
+    state->notify_count = 0;
+}
+
+void telex_notify_cb(evutil_socket_t fd, short what, void *arg)
+{
+    telex_notify_flush(arg);
+}
+
+/* Queue a block the switch removed for the clients. A block that went
+ * with an aggregate gets the aggregate's duration and no counts. */
+static void telex_notify_expired(struct telex_state *state,
+                                 const struct block_key *key,
+                                 const struct ofp_flow_removed *removed,
+                                 int counts)
+{
+    struct telex_flow_expired *expired;
+
+    expired = &state->notify_pending[state->notify_count++];
+    expired->src_ip = key->src_ip;
+    expired->dst_ip = key->dst_ip;
+    expired->src_port = key->src_port;
+    expired->dst_port = key->dst_port;
+    expired->reason = removed->reason;
+    expired->duration_sec = removed->duration_sec;
+    expired->packet_count = counts ? removed->packet_count : 0;
+    expired->byte_count = counts ? removed->byte_count : 0;
+
+    if (state->notify_count >= state->config.notify_batch) {
+        evtimer_del(state->notify_timer);
+        telex_notify_flush(state);
+    } else if (!evtimer_pending(state->notify_timer, NULL)) {
+        struct timeval tv;
+        tv.tv_sec = state->config.notify_window_ms / 1000;
+        tv.tv_usec = (state->config.notify_window_ms % 1000) * 1000;
+        evtimer_add(state->notify_timer, &tv);
+    }
+}
+
+/* An aggregate went away: its members go with it, except any the other
+ * kind of aggregate still covers */
+static void telex_aggregate_gone(struct telex_state *state, int kind,
+                                 uint32_t group,
+                                 struct ofp_flow_removed *removed)
+{
+    struct block_entry *g = agg_group(&state->aggs, kind, group);
+    uint32_t m, next;
+    int other;
+
+    g->flags &= ~AGG_INSTALLED;
+    telex_count(state, telex_aggregate_switches(state, kind, group), -1);
+
+    for (m = g->head; m != BLOCK_NONE; m = next) {
+        struct block_entry *e = block_table_get(&state->blocks, m);
+
+        next = agg_next(&state->blocks, kind, m);
+        if (agg_covering(&state->aggs, &state->blocks, m, &other) !=
+            BLOCK_NONE) {
+            continue;
+        }
+        telex_notify_expired(state, &e->key, removed, 0);
+        telex_forget(state, m);
+    }
+}
+
+static void telex_aggregate_removed(struct telex_state *state,
+                                    struct fox_state *sw, int kind,
+                                    struct block_key *key,
+                                    struct ofp_flow_removed *removed)
+{
+    uint32_t group;
+
+    group = block_table_find(&state->aggs.groups[kind], key);
+    if (group == BLOCK_NONE ||
+        !(agg_group(&state->aggs, kind, group)->flags & AGG_INSTALLED)) {
+        LogTrace(sw->name, "Flow removed for old aggregate (reason %d)",
+                 removed->reason);
+        return;
+    }
+    telex_aggregate_gone(state, kind, group, removed);
+}
+
+void telex_flow_removed_cb(struct fox_state *sw, void *payload)
+{
+    struct telex_state *state = sw->user_ptr;
+    struct ofp_flow_removed *removed = payload;
+    uint64_t cookie = be64toh(removed->cookie);
+    struct block_key key;
+    uint32_t entry;
+
+    key.src_ip = removed->match.nw_src;
+    key.dst_ip = removed->match.nw_dst;
+    key.src_port = removed->match.tp_src;
+    key.dst_port = removed->match.tp_dst;
+
+    if (cookie >= TELEX_COOKIE_AGGREGATE &&
+        cookie < TELEX_COOKIE_AGGREGATE + AGG_KINDS) {
+        telex_aggregate_removed(state, sw, cookie - TELEX_COOKIE_AGGREGATE,
+                                &key, removed);
+        return;
+    }
+
+    /* Only blocks we still think are installed are news to the client;
+     * removals caused by its own unblocks were already forgotten, and
+     * covered blocks' flows were deleted by us when they were
+     * aggregated. A delete of one of our flows that was not sent for the
+     * block there now is an unblock's, arriving after the key was blocked
+     * again (and the freed entry likely reused). */
+    entry = block_table_find_at(&state->blocks,
+                                telex_cookie_entry(cookie), &key);
+    if (entry == BLOCK_NONE ||
+        (block_table_get(&state->blocks, entry)->flags & BLOCK_COVERED) ||
+        (removed->reason == OFPRR_DELETE &&
+         telex_cookie_entry(cookie) != BLOCK_NONE &&
+         !telex_cookie_current(state, cookie, entry))) {
+        LogTrace(sw->name, "Flow removed for unknown block (reason %d)",
+                 removed->reason);
+        return;
+    }
+    telex_forget(state, entry);
+
+    telex_notify_expired(state, &key, removed, 1);
+}
+
+/* Drop a block telex cannot keep on the switch, telling the clients */
+static void telex_evict(struct telex_state *state, uint32_t entry)
+{
+    struct block_entry *e = block_table_get(&state->blocks, entry);
+    struct ofp_flow_removed removed;
+
+    memset(&removed, 0, sizeof(removed));
+    removed.reason = TELEX_REASON_EVICTED;
+    removed.duration_sec = htonl((telex_now_ms(state) - e->installed_ms) /
+                                 1000);
+
+    if (e->flags & BLOCK_HAS_FLOW) {
+        telex_generate_mod_flow(state, &e->key, TELEX_MOD_UNBLOCK, 0,
+                                telex_block_switches(state, &e->key));
+    }
+    telex_notify_expired(state, &e->key, &removed, 0);
+    telex_forget(state, entry);
+    state->capacity.n_evicted++;
+}
+
+/*
+* Once telex's flows pass the high water mark of what switch i has room
+* for, evict the coldest blocks on it down to the low water mark, so new
+* blocks are not refused in the middle of an incident. An evicted block
+* goes from every switch it was on. The hottest block is never taken: it
+* is usually the one being made room for.
+*/
+static void telex_make_room_on(struct telex_state *state, uint32_t i)
+{
+    struct telex_capacity *cap = &state->capacity;
+    struct telex_room *room = &cap->room[i];
+    uint64_t high, low;
+    uint32_t m, next, n = 0;
+
+    if (room->limit == 0) {
+        return;
+    }
+    high = (uint64_t)room->limit * state->config.evict_high_pct / 100;
+    low = (uint64_t)room->limit * state->config.evict_low_pct / 100;
+    if (room->n_flows <= high) {
+        return;
+    }
+    if (low > high) {
+        low = high;
+    }
+
+    for (m = cap->lru_head; room->n_flows > low && m != BLOCK_NONE &&
+         m != cap->lru_tail; m = next) {
+        struct block_entry *e = block_table_get(&state->blocks, m);
+
+        next = e->lru_next;
+        if (telex_block_switches(state, &e->key) & 1u << i) {
+            telex_evict(state, m);
+            n++;
+        }
+    }
+    room->evict_sent = cap->n_sent;
+
+    LogWarn(state->name, "Flow table of %s:%d nearly full: evicted %u "
+            "blocks, %u of %u flows in use", state->config.switches[i].ip,
+            state->config.switches[i].port, n, room->n_flows, room->limit);
+}
+
+static void telex_make_room(struct telex_state *state)
+{
+    uint32_t i;
+
+    for (i=0; i<state->config.n_switches; i++) {
+        telex_make_room_on(state, i);
+    }
+}
+
+/* Switch i says its tables are full at (about) what we have now. Errors
+ * for adds sent before the last eviction say nothing new. */
+static void telex_table_full(struct telex_state *state, uint32_t i,
+                             uint32_t sent)
+{
+    struct telex_room *room = &state->capacity.room[i];
+
+    room->n_table_full++;
+    if (sent <= room->evict_sent || room->n_flows == 0 ||
+        (room->limit != 0 && room->n_flows - 1 >= room->limit)) {
+        return;
+    }
+    room->limit = room->n_flows - 1;
+    LogWarn(state->name, "Flow table of %s:%d full at %u flows",
+            state->config.switches[i].ip, state->config.switches[i].port,
+            room->limit);
+}
+
+static void telex_retry_block(struct telex_state *state, uint32_t i,
+                              uint32_t entry)
+{
+    struct block_entry *e;
+
+    if (entry >= state->blocks.n_entries) {
+        return;
+    }
+    e = block_table_get(&state->blocks, entry);
+    if (!e->used || !(e->flags & BLOCK_HAS_FLOW)) {
+        return;     /* unblocked or evicted since */
+    }
+    telex_table_full(state, i, e->sent);
+
+    if (e->flags & BLOCK_RETRIED) {
+        LogError(state->name, "No room on the switch for a block, "
+                 "dropping it");
+        telex_evict(state, entry);
+        return;
+    }
+    e->flags |= BLOCK_RETRIED;
+
+    telex_flow_added(state, entry);
+    telex_make_room(state);
+
+    e = block_table_get(&state->blocks, entry);
+    telex_generate_mod_flow(state, &e->key, e->action,
+                            TELEX_XID_BLOCK | entry, 1u << i);
+}
+
+/* Its members' own flows are gone already, so the aggregate has to go
+ * back in, or they go */
+static void telex_retry_aggregate(struct telex_state *state, uint32_t i,
+                                  int kind, uint32_t group)
+{
+    struct ofp_flow_removed removed;
+    struct block_entry *g;
+
+    if (group >= state->aggs.groups[kind].n_entries) {
+        return;
+    }
+    g = agg_group(&state->aggs, kind, group);
+    if (!g->used || !(g->flags & AGG_INSTALLED)) {
+        return;
+    }
+    telex_table_full(state, i, 0);
+
+    if (g->flags & BLOCK_RETRIED) {
+        LogError(state->name, "No room on the switch for an aggregate of "
+                 "%u blocks, dropping them", g->members);
+        memset(&removed, 0, sizeof(removed));
+        removed.reason = TELEX_REASON_EVICTED;
+        telex_aggregate_gone(state, kind, group, &removed);
+        return;
+    }
+    g->flags |= BLOCK_RETRIED;
+
+    telex_make_room(state);
+    telex_send_aggregate(state, kind, group, OFPFC_ADD, 1u << i);
+}
+
+void telex_switch_error_cb(struct fox_state *sw, void *payload)
+{
+    struct telex_state *state = sw->user_ptr;
+    struct ofp_error_msg *err = payload;
+    uint32_t xid = ntohl(err->header.xid);
+    int i = telex_switch_index(state, sw);
+
+    if (i < 0 ||
+        ntohs(err->type) != OFPET_FLOW_MOD_FAILED ||
+        ntohs(err->code) != OFPFMFC_ALL_TABLES_FULL) {
+        return;
+    }
+
+    if (xid & TELEX_XID_AGGREGATE) {
+        telex_retry_aggregate(state, i, (xid >> TELEX_XID_KIND_SHIFT) & 1,
+                              xid & TELEX_XID_INDEX_MASK);
+    } else if (xid & TELEX_XID_BLOCK) {
+        telex_retry_block(state, i, xid & TELEX_XID_INDEX_MASK);
+    } else {
+        state->capacity.room[i].n_table_full++;
+        LogWarn(sw->name, "Switch flow table full");
+    }
+}
+
+/* Room for telex's flows: the tables' total less what other flows use.
+ * Only 1.0 has max_entries in its table stats; on 1.3 the limit comes
+ * from the config or the first table full error. */
+void telex_stats_reply_cb(struct fox_state *sw, void *payload)
+{
+    struct telex_state *state = sw->user_ptr;
+    struct ofp_stats_reply *reply = payload;
+    struct ofp_table_stats table;
+    struct telex_room *room;
+    uint64_t max_entries = 0, active = 0, foreign;
+    size_t i, n;
+    int index = telex_switch_index(state, sw);
+
+    if (index >= 0 && ntohs(reply->type) == OFPST_FLOW) {
+        telex_reconcile_reply(state, index, reply);
+        return;
+    }
+    if (index < 0 || ntohs(reply->type) != OFPST_TABLE ||
+        state->config.flow_capacity != 0) {
+        return;
+    }
+    room = &state->capacity.room[index];
+
+    n = (ntohs(reply->header.length) - sizeof(*reply)) / sizeof(table);
+    if (sw->n_tables != 0 && n > sw->n_tables) {
+        n = sw->n_tables;
+    }
+    for (i=0; i<n; i++) {
+        /* The body is only 4-byte aligned */
+        memcpy(&table, reply->body + i * sizeof(table), sizeof(table));
+        max_entries += ntohl(table.max_entries);
+        active += ntohl(table.active_count);
+    }
+
+    foreign = active > room->n_flows ? active - room->n_flows : 0;
+    if (max_entries <= foreign) {
+        return;
+    }
+    max_entries -= foreign;
+    room->limit = max_entries < UINT32_MAX ? max_entries : UINT32_MAX;
+
+    LogInfo(sw->name, "Room for %u telex flows in %zu tables", room->limit,
+            n);
+    telex_make_room_on(state, index);
+}
+
+
+/* (Re)install the throttle meter. ADD fails harmlessly if the switch kept
+ * it from an earlier connection, so follow with MODIFY to set the rate. */
+static void telex_install_meter(struct telex_state *state,
+                                struct fox_state *sw, int add)
+{
+    uint32_t kbps = state->config.throttle_kbps;
+
+    if (sw->version != OFP13_VERSION) {
+        return;
+    }
+    if (kbps == 0) {
+        of13_send_meter_mod(sw, OFPMC_DELETE, TELEX_METER_ID, 0, 0, 0);
+        return;
+    }
+    if (add) {
+        of13_send_meter_mod(sw, OFPMC_ADD, TELEX_METER_ID, OFPMF_KBPS,
+                            kbps, kbps / 10);
+    }
+    of13_send_meter_mod(sw, OFPMC_MODIFY, TELEX_METER_ID, OFPMF_KBPS,
+                        kbps, kbps / 10);
+}
+
+/* Sampled blocks share one packets-per-second meter. It is always there
+ * on 1.3 switches, as any request may ask for sampling. */
+static void telex_install_sample_meter(struct telex_state *state,
+                                       struct fox_state *sw, int add)
+{
+    uint32_t pps = state->config.punt_sample_pps;
+
+    if (sw->version != OFP13_VERSION) {
+        return;
+    }
+    if (add) {
+        of13_send_meter_mod(sw, OFPMC_ADD, TELEX_SAMPLE_METER_ID,
+                            OFPMF_PKTPS, pps, 0);
+    }
+    of13_send_meter_mod(sw, OFPMC_MODIFY, TELEX_SAMPLE_METER_ID,
+                        OFPMF_PKTPS, pps, 0);
+}
+
+/*
+* Resending after taking over from another primary (see ha.h), for
+* blocks and groups in the resync sets, or what a reconcile found
+* missing. A block gets its own flow again, or a delete if it is gone. A
+* group gets its aggregate again if it is installed. A split group gets a
+* delete of its aggregate and its members' own flows, which were deleted
+* when it was aggregated, and a group that is gone gets the delete.
+*/
+static void telex_resend_block(struct telex_state *state, uint32_t entry,
+                               uint32_t switches)
+{
+    struct block_entry *e = block_table_get(&state->blocks, entry);
+
+    if (e->flags & BLOCK_HAS_FLOW) {
+        telex_generate_mod_flow(state, &e->key, e->action,
+                                TELEX_XID_BLOCK | entry,
+                                switches & telex_block_switches(state,
+                                                                &e->key));
+    }
+}
+
+static void telex_resync_group(struct telex_state *state, int kind,
+                               struct block_key *gkey, uint32_t switches)
+{
+    uint32_t group = block_table_find(&state->aggs.groups[kind], gkey);
+    uint32_t on = switches & telex_group_switches(state, kind, gkey);
+    struct block_entry *g;
+    uint32_t m;
+
+    if (group == BLOCK_NONE) {
+        telex_aggregate_mod(state, kind, gkey, 0, OFPFC_DELETE_STRICT, on);
+        return;
+    }
+    g = agg_group(&state->aggs, kind, group);
+    if (g->flags & AGG_INSTALLED) {
+        telex_send_aggregate(state, kind, group, OFPFC_ADD, on);
+    } else if (g->flags & AGG_SPLIT) {
+        telex_send_aggregate(state, kind, group, OFPFC_DELETE_STRICT, on);
+        for (m = g->head; m != BLOCK_NONE;
+             m = agg_next(&state->blocks, kind, m)) {
+            telex_resend_block(state, m, switches);
+        }
+    }
+}
+
+static void telex_resync_done(struct telex_state *state)
+{
+    int kind;
+
+    block_table_free(&state->resync);
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        block_table_free(&state->resync_groups[kind]);
+    }
+    state->resync_switches = 0;
+}
+
+static void telex_resync(struct telex_state *state, uint32_t i)
+{
+    uint32_t m, entry, n = 0;
+    int kind;
+
+    state->resync_switches &= ~(1u << i);
+
+    for (m=0; m<state->resync.n_entries; m++) {
+        struct block_entry *r = block_table_get(&state->resync, m);
+
+        if (!r->used) {
+            continue;
+        }
+        entry = block_table_find(&state->blocks, &r->key);
+        if (entry != BLOCK_NONE) {
+            telex_resend_block(state, entry, 1u << i);
+        } else {
+            telex_generate_mod_flow(state, &r->key, TELEX_MOD_UNBLOCK, 0,
+                (1u << i) & telex_block_switches(state, &r->key));
+        }
+        n++;
+    }
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        for (m=0; m<state->resync_groups[kind].n_entries; m++) {
+            struct block_entry *r;
+
+            r = block_table_get(&state->resync_groups[kind], m);
+            if (r->used) {
+                telex_resync_group(state, kind, &r->key, 1u << i);
+            }
+        }
+    }
+
+    LogInfo(state->name, "Resent %u blocks to %s:%d", n,
+            state->config.switches[i].ip, state->config.switches[i].port);
+
+    if (state->resync_switches == 0) {
+        telex_resync_done(state);
+    }
+}
+
+/*
+* Reconciling a switch that comes up with no resync owed. Its TCP flows
+* are dumped and hash joined against the shadow table as they come in:
+* those at telex's priorities it should not have are deleted there and
+* then, and the rest remembered. Once the dump is complete, what it should
+* have and did not list is added. A block or unblock made meanwhile at
+* worst gets its add or delete twice.
+*/
+static void telex_reconcile_done(struct telex_state *state, uint32_t i)
+{
+    struct telex_reconcile *rc = &state->reconcile[i];
+    int kind;
+
+    block_table_free(&rc->seen);
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        block_table_free(&rc->seen_groups[kind]);
+    }
+    rc->n_flows = 0;
+    rc->n_deleted = 0;
+    state->reconcile_switches &= ~(1u << i);
+}
+
+static void telex_reconcile_start(struct telex_state *state,
+                                  struct fox_state *sw, uint32_t i)
+{
+    struct telex_reconcile *rc = &state->reconcile[i];
+    struct ofp_match match;
+    int kind, err;
+
+    telex_reconcile_done(state, i);
+
+    err = block_table_init(&rc->seen);
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        err |= block_table_init(&rc->seen_groups[kind]);
+    }
+    if (err) {
+        LogError(state->name, "Unable to allocate reconcile sets");
+        telex_reconcile_done(state, i);
+        return;
+    }
+
+    memset(&match, 0, sizeof(match));
+    match.wildcards = htonl(OFPFW_ALL & ~OFPFW_DL_TYPE & ~OFPFW_NW_PROTO);
+    match.dl_type = htons(ETH_P_IP);
+    match.nw_proto = IPPROTO_TCP;
+
+    rc->xid = ++state->reconcile_xid;
+    if (controller_send_flow_stats_request(sw, &match, rc->xid)) {
+        telex_reconcile_done(state, i);
+        return;
+    }
+    state->reconcile_switches |= 1u << i;
+}
+
+/* Is fs a flow switch i should have? Remembers it if so. Anything at
+ * telex's priorities that is not is deleted. */
+static void telex_reconcile_flow(struct telex_state *state, uint32_t i,
+                                 const struct ofp_flow_stats *fs)
+{
+    struct telex_reconcile *rc = &state->reconcile[i];
+    uint32_t wc = ntohl(fs->match.wildcards);
+    uint16_t priority = ntohs(fs->priority);
+    uint64_t cookie = be64toh(fs->cookie);
+    struct block_key key, gkey;
+    struct flow_mod mod;
+    uint32_t entry, bits;
+    int kind, wanted = 0;
+
+    key.src_ip = fs->match.nw_src;
+    key.dst_ip = fs->match.nw_dst;
+    key.src_port = fs->match.tp_src;
+    key.dst_port = fs->match.tp_dst;
+
+    if (priority == TELEX_PRIORITY &&
+        (cookie == 0 ||
+         (cookie & TELEX_COOKIE_TAG_MASK) == TELEX_COOKIE_BLOCK)) {
+        entry = block_table_find_at(&state->blocks,
+                                    telex_cookie_entry(cookie), &key);
+        wanted = !(wc & (OFPFW_NW_SRC_MASK | OFPFW_NW_DST_MASK |
+                         OFPFW_TP_SRC | OFPFW_TP_DST)) &&
+                 entry != BLOCK_NONE &&
+                 (block_table_get(&state->blocks, entry)->flags &
+                  BLOCK_HAS_FLOW) &&
+                 (telex_block_switches(state, &key) & 1u << i);
+        if (wanted) {
+            block_table_insert(&rc->seen, &key);
+        }
+    } else if (priority == TELEX_PRIORITY_AGGREGATE &&
+               cookie >= TELEX_COOKIE_AGGREGATE &&
+               cookie < TELEX_COOKIE_AGGREGATE + AGG_KINDS) {
+        kind = cookie - TELEX_COOKIE_AGGREGATE;
+        bits = kind == AGG_BY_SRC ?
+               (wc & OFPFW_NW_SRC_MASK) >> OFPFW_NW_SRC_SHIFT :
+               (wc & OFPFW_NW_DST_MASK) >> OFPFW_NW_DST_SHIFT;
+        if (agg_enabled(&state->aggs, kind) &&
+            bits == agg_wild_bits(&state->aggs, kind)) {
+            agg_group_key(&state->aggs, kind, &key, &gkey);
+            entry = block_table_find(&state->aggs.groups[kind], &gkey);
+            wanted = entry != BLOCK_NONE &&
+                     (agg_group(&state->aggs, kind, entry)->flags &
+                      AGG_INSTALLED) &&
+                     (telex_aggregate_switches(state, kind, entry) & 1u << i);
+        }
+        if (wanted) {
+            block_table_insert(&rc->seen_groups[kind], &gkey);
+        }
+    } else {
+        return;
+    }
+
+    /* Failing to remember one only means adding it again */
+    rc->n_flows++;
+    if (wanted) {
+        return;
+    }
+
+    flow_mod_init(&mod, OFPFC_DELETE_STRICT);
+    mod.match = fs->match;
+    mod.priority = priority;
+    telex_queue_flow_mod(state, i, &mod, CONTROLLER_CLASS_UNBLOCK);
+    rc->n_deleted++;
+}
+
+/* The dump is complete: add what was not in it */
+static void telex_reconcile_end(struct telex_state *state, uint32_t i)
 {
-    struct ofp_flow_mod *ofmod;
+    struct telex_reconcile *rc = &state->reconcile[i];
+    uint32_t m, n = 0;
+    int kind;
 
-    size_t mod_len = sizeof(*ofmod);
+    for (m=0; m<state->blocks.n_entries; m++) {
+        struct block_entry *e = block_table_get(&state->blocks, m);
 
-    ofmod = malloc(sizeof(*ofmod) + sizeof(struct ofp_action_output));
+        if (e->used && (e->flags & BLOCK_HAS_FLOW) &&
+            (telex_block_switches(state, &e->key) & 1u << i) &&
+            block_table_find(&rc->seen, &e->key) == BLOCK_NONE) {
+            telex_resend_block(state, m, 1u << i);
+            n++;
+        }
+    }
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        for (m=0; m<state->aggs.groups[kind].n_entries; m++) {
+            struct block_entry *g = agg_group(&state->aggs, kind, m);
 
-    memset(ofmod, 0, sizeof(ofmod));
+            if (g->used && (g->flags & AGG_INSTALLED) &&
+                (telex_aggregate_switches(state, kind, m) & 1u << i) &&
+                block_table_find(&rc->seen_groups[kind], &g->key) ==
+                BLOCK_NONE) {
+                telex_send_aggregate(state, kind, m, OFPFC_ADD, 1u << i);
+                n++;
+            }
+        }
+    }
 
-    ofmod->header.type = OFPT_FLOW_MOD;
-    ofmod->match.wildcards = htonl(OFPFW_ALL & 
-                                   ~OFPFW_NW_SRC_MASK & ~OFPFW_NW_DST_MASK &
-                                   ~OFPFW_TP_SRC & ~OFPFW_TP_DST &
-                                   ~OFPFW_NW_PROTO & ~OFPFW_DL_TYPE);
-    ofmod->match.in_port = htons(0);
-    ofmod->match.dl_type = htons(ETH_P_IP); 
-    ofmod->match.nw_src = src_ip;
-    ofmod->match.nw_dst = dst_ip;
-    ofmod->match.nw_proto = IPPROTO_TCP;
-    ofmod->match.tp_src = src_port;
-    ofmod->match.tp_dst = dst_port;
+    LogInfo(state->name, "Reconciled %s:%d: %u telex flows, %u added, "
+            "%u deleted", state->config.switches[i].ip,
+            state->config.switches[i].port, rc->n_flows, n, rc->n_deleted);
+    telex_reconcile_done(state, i);
+}
 
-    ofmod->buffer_id = htonl(UINT32_MAX);
-    ofmod->idle_timeout = htons(TELEX_IDLE_FLOW_TIMEOUT);
-    ofmod->hard_timeout = htons(OFP_FLOW_PERMANENT);
-    ofmod->priority = htons(OFP_DEFAULT_PRIORITY + 100);
-    ofmod->flags = htons(OFPFF_SEND_FLOW_REM);
-    ofmod->out_port = htons(OFPP_NONE);
+static void telex_reconcile_reply(struct telex_state *state, uint32_t i,
+                                  struct ofp_stats_reply *reply)
+{
+    size_t len = ntohs(reply->header.length) - sizeof(*reply);
+    struct ofp_flow_stats fs;
+    size_t off;
 
-    if (add) {
-        struct ofp_action_output *action;
-        
-        mod_len += sizeof(*action);
-
-        action = (struct ofp_action_output *)&ofmod->actions[0];
-        memset(action, 0, sizeof(*action));
-        action->type = htons(OFPAT_OUTPUT);
-        action->len = htons(sizeof(*action));
-        action->max_len = htons(1500); // MTU?
-        action->port = htons(OFPP_CONTROLLER);
-
-        ofmod->command = htons(OFPFC_ADD);
-    } else {
-        ofmod->command = htons(OFPFC_DELETE);
+    if (!(state->reconcile_switches & 1u << i) ||
+        ntohl(reply->header.xid) != state->reconcile[i].xid) {
+        return;
     }
 
-    LogDebug(state->name, "mod_len: %d", mod_len);
+    for (off = 0; off + sizeof(fs) <= len; off += ntohs(fs.length)) {
+        /* The body is only 4-byte aligned */
+        memcpy(&fs, reply->body + off, sizeof(fs));
+        if (ntohs(fs.length) < sizeof(fs)) {
+            break;
+        }
+        telex_reconcile_flow(state, i, &fs);
+    }
 
-    controller_send_hdr(state->controllers[0], ofmod, mod_len);
+    if (!(ntohs(reply->flags) & OFPSF_REPLY_MORE)) {
+        telex_reconcile_end(state, i);
+    }
 }
 
-void telex_handle_mod_flow(struct telex_state *state,
-                           struct telex_mod_flow *flow)
+void telex_features_cb(struct fox_state *sw, void *payload)
 {
-    char src_ip[INET_ADDRSTRLEN];
-    char dst_ip[INET_ADDRSTRLEN];
+    struct telex_state *state = sw->user_ptr;
+    int i = telex_switch_index(state, sw);
 
-    inet_ntop(AF_INET, &flow->src_ip, src_ip, INET_ADDRSTRLEN);
-    inet_ntop(AF_INET, &flow->dst_ip, dst_ip, INET_ADDRSTRLEN);
+    /* A switch that still takes flow mods from the old primary would let
+     * it undo ours */
+    if (state->ha != NULL && ha_primary(state->ha)) {
+        of13_send_role_request(sw, OFPCR_ROLE_MASTER, state->ha->generation);
+    }
 
-    LogDebug(state->name, "block command(%d): %s:%d <-> %s:%d",
-             flow->action, src_ip, ntohs(flow->src_port), dst_ip,
-             ntohs(flow->dst_port));
- 
-    telex_generate_mod_flow(state, flow->src_ip, flow->dst_ip,
-                            flow->src_port, flow->dst_port,
-                            flow->action == TELEX_MOD_BLOCK ||
-                            flow->action == TELEX_MOD_BLOCK_BIDIRECTIONAL);
+    if (i >= 0 && state->config.switches[i].blocks != CONFIG_BLOCKS_NONE &&
+        sw->version == OFP_VERSION && state->config.flow_capacity == 0) {
+        struct ofp_stats_request req;
+
+        memset(&req, 0, sizeof(req));
+        req.header.type = OFPT_STATS_REQUEST;
+        req.type = htons(OFPST_TABLE);
+        controller_send_raw(sw, &req, sizeof(req));
+    }
+
+    if (state->config.throttle_kbps != 0) {
+        telex_install_meter(state, sw, 1);
+    }
+    telex_install_sample_meter(state, sw, 1);
+
+    if (sw->version != OFP13_VERSION &&
+        state->config.block_action == TELEX_MOD_BLOCK_SAMPLE) {
+        LogWarn(sw->name, "1.0 switch cannot sample; punting every packet");
+    }
+
+    if (i >= 0 && (state->resync_switches & 1u << i)) {
+        telex_resync(state, i);
+    } else if (i >= 0 && state->controllers[i] == sw &&
+               state->config.switches[i].blocks != CONFIG_BLOCKS_NONE) {
+        telex_reconcile_start(state, sw, i);
+    }
 }
 
-void telex_read_cb(struct bufferevent *bev, void *ctx)
+/* Packets from blocks that punt, a read's worth at a time. Nothing to do
+ * with them yet beyond keeping them out of the unknown message log. */
+void telex_packet_in_cb(struct fox_state *sw, void **payloads, size_t n)
 {
-    struct telex_state *state = ctx;
-    struct evbuffer *input;
+    struct telex_state *state = sw->user_ptr;
+
+    state->n_punted += n;
+    LogTrace(sw->name, "Punted %u packets from blocked flows (%llu)",
+             (unsigned)n, (unsigned long long)state->n_punted);
+}
+
+/*
+* libevent refills a bucket of at most one tick's worth of tokens, so the
+* burst sets the tick length: e.g. 20000/s with a burst of 2000 is 2000
+* requests every 100ms.
+*/
+static struct ev_token_bucket_cfg *telex_client_rate_new(uint32_t rate,
+                                                        uint32_t burst)
+{
+    struct timeval tick;
+    uint32_t tick_ms;
+
+    tick_ms = (uint64_t)burst * 1000 / rate;
+    if (tick_ms > 1000) {
+        tick_ms = 1000;
+    } else if (tick_ms == 0) {
+        tick_ms = 1;
+    }
+    tick.tv_sec = tick_ms / 1000;
+    tick.tv_usec = (tick_ms % 1000) * 1000;
+
+    rate = (uint64_t)rate * tick_ms / 1000;
+    if (rate == 0) {
+        rate = 1;
+    }
+    if (burst < rate) {
+        burst = rate;
+    }
+
+    return ev_token_bucket_cfg_new(rate * sizeof(struct telex_mod_flow),
+                                   burst * sizeof(struct telex_mod_flow),
+                                   EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX,
+                                   &tick);
+}
+
+static struct fox_state *telex_add_switch(struct telex_state *state,
+                                          struct config_switch *conf)
+{
+    struct fox_state *sw;
+
+    LogInfo(state->name, "Adding switch %s:%d (%s)", conf->ip, conf->port,
+            conf->connect ? "connect" : "listen");
+
+    sw = controller_new(state->base, conf->ip, conf->port,
+                        conf->echo_period_ms, conf->connect);
+    if (sw == NULL) {
+        return NULL;
+    }
+    sw->user_ptr = state;
+    sw->admit = state->admit;
+
+    /* Openflow only sends flow removed by connecting to us, nevermind that
+     * we already have a connection open with them, so listen on all. */
+    controller_register_handler(sw, OFPT_FLOW_REMOVED,
+                                telex_flow_removed_cb);
+    controller_register_handler(sw, OFPT_BARRIER_REPLY,
+                                telex_barrier_reply_cb);
+    controller_register_handler(sw, OFPT_FEATURES_REPLY, telex_features_cb);
+    controller_register_batch_handler(sw, OFPT_PACKET_IN, telex_packet_in_cb);
+    controller_register_handler(sw, OFPT_ERROR, telex_switch_error_cb);
+    controller_register_handler(sw, OFPT_STATS_REPLY, telex_stats_reply_cb);
+
+    if (state->discovery != NULL) {
+        discovery_add_switch(sw);
+    }
+
+    return sw;
+}
 
-    input = bufferevent_get_input(bev);
+static void telex_remove_switch(struct telex_state *state,
+                                struct fox_state *sw)
+{
+    LogInfo(state->name, "Removing switch %s", sw->name);
+
+    if (state->discovery != NULL) {
+        discovery_remove_switch(sw);
+    }
+    controller_free(sw);
+}
+
+/* Switches kept across a reload may have moved in controllers: moved[j]
+ * is the new index of old switch j, or -1 if it is gone. Their rooms, the
+ * barriers passes are waiting on and any resync or reconcile they are owed
+ * move with them. */
+static void telex_renumber(struct telex_state *state, const int *moved)
+{
+    struct telex_room room[MAX_SWITCHES];
+    struct telex_reconcile reconcile[MAX_SWITCHES];
+    uint32_t j, n;
+
+    memset(room, 0, sizeof(room));
+    memset(reconcile, 0, sizeof(reconcile));
+    for (j=0; j<MAX_SWITCHES; j++) {
+        if (moved[j] >= 0) {
+            room[moved[j]] = state->capacity.room[j];
+            reconcile[moved[j]] = state->reconcile[j];
+        } else {
+            telex_reconcile_done(state, j);
+        }
+    }
+    memcpy(state->capacity.room, room, sizeof(room));
+    memcpy(state->reconcile, reconcile, sizeof(reconcile));
 
-    while (evbuffer_get_length(input) > 0) {
-        size_t buf_len;
-        struct telex_mod_flow flow;
-        buf_len = evbuffer_get_length(input);
+    for (j=0, n=0; j<MAX_SWITCHES; j++) {
+        if ((state->resync_switches & 1u << j) && moved[j] >= 0) {
+            n |= 1u << moved[j];
+        }
+    }
+    state->resync_switches = n;
 
-        if (buf_len < sizeof(flow)) {
-            return;
+    for (j=0, n=0; j<MAX_SWITCHES; j++) {
+        if ((state->reconcile_switches & 1u << j) && moved[j] >= 0) {
+            n |= 1u << moved[j];
         }
+    }
+    state->reconcile_switches = n;
 
-        evbuffer_remove(input, &flow, sizeof(flow));
+    for (n=0; n<state->n_passes; n++) {
+        struct telex_pass *pass = telex_pass_get(state, n);
+        uint32_t waiting = 0;
 
-        telex_handle_mod_flow(state, &flow);
+        for (j=0; j<MAX_SWITCHES; j++) {
+            if ((pass->waiting & 1u << j) && moved[j] >= 0) {
+                waiting |= 1u << moved[j];
+            }
+        }
+        pass->waiting = waiting;
     }
 }
 
-void telex_error_cb(struct bufferevent *bev, short events, void *ctx)
+/* Count every switch's flows again under the current blocks policies */
+static void telex_recount(struct telex_state *state)
 {
-    struct telex_state *state = ctx;
-    evutil_socket_t fd = bufferevent_getfd(bev);
-    struct sockaddr_in sin;
-    socklen_t sin_size = sizeof(sin);
-    char src_ip[INET_ADDRSTRLEN];
+    uint32_t i, m;
+    int kind;
 
-    assert(state != NULL);
+    for (i=0; i<MAX_SWITCHES; i++) {
+        state->capacity.room[i].n_flows = 0;
+    }
+    for (m=0; m<state->blocks.n_entries; m++) {
+        struct block_entry *e = block_table_get(&state->blocks, m);
+
+        if (e->used && (e->flags & BLOCK_HAS_FLOW)) {
+            telex_count(state, telex_block_switches(state, &e->key), 1);
+        }
+    }
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        for (m=0; m<state->aggs.groups[kind].n_entries; m++) {
+            struct block_entry *g = agg_group(&state->aggs, kind, m);
+
+            if (g->used && (g->flags & AGG_INSTALLED)) {
+                telex_count(state, telex_aggregate_switches(state, kind, m),
+                            1);
+            }
+        }
+    }
+}
+
+/*
+* Move from the running configuration to cfg, touching only what changed:
+* switch connections that appear in both are kept as they are, and
+* listeners are only reopened if their address changed. Problems are
+* logged and skipped so one bad setting does not take the rest down.
+* A switch's blocks policy applies to blocks made after the reload.
+*/
+int telex_reconfigure(struct telex_state *state, struct fox_config *cfg)
+{
+    struct fox_state *controllers[MAX_SWITCHES];
+    int moved[MAX_SWITCHES];
+    struct fox_config *old = &state->config;
+    struct fox_config standby;
+    struct telex_client *client;
+    int throttle_added, throttle_changed, sample_changed;
+    int errors = 0;
+    uint32_t i, j;
+
+    if (state->ha == NULL ? cfg->ha.role != CONFIG_HA_OFF :
+        !config_ha_equal(&cfg->ha, &state->primary_config.ha)) {
+        LogWarn(state->name, "HA cannot be changed until restart");
+        cfg->ha = state->primary_config.ha;
+    }
+
+    /* A standby holds on to the rest for when it takes over */
+    if (state->ha != NULL) {
+        state->primary_config = *cfg;
+        if (!ha_primary(state->ha)) {
+            standby = *cfg;
+            standby.n_switches = 0;
+            standby.listen_ip[0] = '\0';
+            standby.unix_path[0] = '\0';
+            standby.ring_name[0] = '\0';
+            cfg = &standby;
+        }
+    }
+
+    if (cfg->discovery_tick_ms != 0) {
+        if (state->discovery == NULL) {
+            state->discovery = discovery_init(state->base,
+                                              cfg->discovery_tick_ms,
+                                              cfg->discovery_probes,
+                                              cfg->discovery_timeout_ms);
+            for (j=0; j<old->n_switches && state->discovery; j++) {
+                if (state->controllers[j] != NULL) {
+                    discovery_add_switch(state->controllers[j]);
+                }
+            }
+        }
+        if (state->discovery != NULL) {
+            state->discovery->tick_ms = cfg->discovery_tick_ms;
+            state->discovery->probes_per_tick = cfg->discovery_probes;
+            state->discovery->link_timeout_ms = cfg->discovery_timeout_ms;
+        } else {
+            errors++;
+        }
+    } else if (state->discovery != NULL) {
+        LogWarn(state->name, "Discovery cannot be turned off until restart");
+        cfg->discovery_tick_ms = old->discovery_tick_ms;
+        cfg->discovery_probes = old->discovery_probes;
+        cfg->discovery_timeout_ms = old->discovery_timeout_ms;
+    }
+
+    /* Aggregates already on the switch were formed under the old rules */
+    if (cfg->agg_threshold != state->aggs.threshold ||
+        cfg->agg_src_prefix != state->aggs.prefix_len[AGG_BY_SRC] ||
+        cfg->agg_dst_prefix != state->aggs.prefix_len[AGG_BY_DST]) {
+        LogWarn(state->name, "Aggregation cannot be changed until restart");
+        cfg->agg_threshold = state->aggs.threshold;
+        cfg->agg_src_prefix = state->aggs.prefix_len[AGG_BY_SRC];
+        cfg->agg_dst_prefix = state->aggs.prefix_len[AGG_BY_DST];
+    }
+
+    /* Flow mods already queued go out under the old numbering */
+    if (state->batch_switches != 0) {
+        telex_send_barrier(state);
+    }
+
+    /* Switches: controllers[i] always belongs to config.switches[i] */
+    memset(controllers, 0, sizeof(controllers));
+    for (j=0; j<MAX_SWITCHES; j++) {
+        moved[j] = -1;
+    }
+    for (i=0; i<cfg->n_switches; i++) {
+        for (j=0; j<old->n_switches; j++) {
+            if (state->controllers[j] != NULL &&
+                config_switch_equal(&old->switches[j], &cfg->switches[i])) {
+                break;
+            }
+        }
+        if (j < old->n_switches) {
+            controllers[i] = state->controllers[j];
+            state->controllers[j] = NULL;
+            moved[j] = i;
+            if (cfg->switches[i].connect) {
+                controllers[i]->echo_period_ms =
+                    cfg->switches[i].echo_period_ms;
+            }
+            continue;
+        }
+
+        controllers[i] = telex_add_switch(state, &cfg->switches[i]);
+        if (controllers[i] == NULL) {
+            errors++;
+        }
+    }
+    for (j=0; j<old->n_switches; j++) {
+        if (state->controllers[j] != NULL) {
+            telex_remove_switch(state, state->controllers[j]);
+        }
+    }
+    memcpy(state->controllers, controllers, sizeof(controllers));
+    telex_renumber(state, moved);
+    for (i=0; i<cfg->n_switches; i++) {
+        if (controllers[i] != NULL) {
+            controller_set_flow_mod_rate(controllers[i], cfg->flow_mod_rate,
+                                         cfg->flow_mod_burst);
+        }
+    }
+    admit_set_rate(state->admit, cfg->packet_in_rate, cfg->packet_in_burst,
+                   cfg->packet_in_flow_rate, cfg->packet_in_flow_burst,
+                   cfg->packet_in_sample);
+
+    /* Listeners */
+    if (state->listener == NULL || strcmp(old->listen_ip, cfg->listen_ip) ||
+        old->listen_port != cfg->listen_port) {
+        if (state->listener != NULL) {
+            evconnlistener_free(state->listener);
+            state->listener = NULL;
+        }
+        if (cfg->listen_ip[0] != '\0' &&
+            telex_listen_tcp(state, cfg->listen_ip, cfg->listen_port)) {
+            errors++;
+        }
+    }
+    if (state->unix_listener == NULL || strcmp(old->unix_path,
+                                               cfg->unix_path)) {
+        if (state->unix_listener != NULL) {
+            evconnlistener_free(state->unix_listener);
+            state->unix_listener = NULL;
+            unlink(old->unix_path);
+        }
+        if (cfg->unix_path[0] != '\0' &&
+            telex_listen_unix(state, cfg->unix_path)) {
+            errors++;
+        }
+    }
+    if (state->ring == NULL || strcmp(old->ring_name, cfg->ring_name) ||
+        old->ring_slots != cfg->ring_slots) {
+        if (state->ring != NULL) {
+            telex_close_ring(state);
+        }
+        if (cfg->ring_name[0] != '\0' &&
+            telex_init_ring(state, cfg->ring_name, cfg->ring_slots)) {
+            errors++;
+        }
+    }
+
+    /* Client limits apply to clients already connected, too */
+    if (state->client_rate == NULL || old->client_rate != cfg->client_rate ||
+        old->client_burst != cfg->client_burst) {
+        struct ev_token_bucket_cfg *rate;
+
+        rate = telex_client_rate_new(cfg->client_rate, cfg->client_burst);
+        if (rate == NULL) {
+            LogError(state->name, "Unable to allocate client rate limit");
+            cfg->client_rate = old->client_rate;
+            cfg->client_burst = old->client_burst;
+            errors++;
+        } else {
+            for (client = state->clients; client; client = client->next) {
+                bufferevent_set_rate_limit(client->bev, rate);
+            }
+            if (state->client_rate != NULL) {
+                ev_token_bucket_cfg_free(state->client_rate);
+            }
+            state->client_rate = rate;
+        }
+    }
+    if (old->client_max_buffered != cfg->client_max_buffered) {
+        for (client = state->clients; client; client = client->next) {
+            bufferevent_setwatermark(client->bev, EV_READ, 0,
+                                     cfg->client_max_buffered);
+        }
+    }
+
+    if (state->notify_pending == NULL ||
+        old->notify_batch != cfg->notify_batch) {
+        struct telex_flow_expired *pending;
+
+        telex_notify_flush(state);
+        pending = realloc(state->notify_pending, cfg->notify_batch *
+                          sizeof(struct telex_flow_expired));
+        if (pending == NULL) {
+            LogError(state->name, "Unable to allocate notification queue");
+            cfg->notify_batch = old->notify_batch;
+            errors++;
+        } else {
+            state->notify_pending = pending;
+        }
+    }
+
+    /* A configured capacity replaces whatever was learned */
+    if (cfg->flow_capacity != 0 || old->flow_capacity != 0) {
+        for (i=0; i<MAX_SWITCHES; i++) {
+            state->capacity.room[i].limit = cfg->flow_capacity;
+        }
+    }
+
+    /* Switches that were already up have the old meter rates */
+    throttle_added = old->throttle_kbps == 0;
+    throttle_changed = old->throttle_kbps != cfg->throttle_kbps;
+    sample_changed = old->punt_sample_pps != cfg->punt_sample_pps;
+
+    state->config = *cfg;
+
+    telex_recount(state);
+    telex_make_room(state);
+
+    for (i=0; i<cfg->n_switches; i++) {
+        if (state->controllers[i] == NULL) {
+            continue;
+        }
+        if (throttle_changed) {
+            telex_install_meter(state, state->controllers[i], throttle_added);
+        }
+        if (sample_changed) {
+            telex_install_sample_meter(state, state->controllers[i], 0);
+        }
+    }
+
+    return errors ? -1 : 0;
+}
+
+/* Start the shadow table over, keeping the old one if that fails */
+static void telex_clear(struct telex_state *state)
+{
+    struct block_table blocks;
+    struct agg_table aggs;
 
-    if (getpeername(fd, (struct sockaddr *)&sin, &sin_size) != 0) {
-        LogError(state->name, "(%d) Could not getsockname for fd %d",
-                 errno, fd);
-        perror("   ");
+    if (block_table_init(&blocks)) {
+        block_table_free(&blocks);
+        LogError(state->name, "Unable to allocate block table");
+        return;
+    }
+    if (agg_init(&aggs, state->aggs.threshold,
+                 state->aggs.prefix_len[AGG_BY_SRC],
+                 state->aggs.prefix_len[AGG_BY_DST])) {
+        block_table_free(&blocks);
+        LogError(state->name, "Unable to allocate block table");
         return;
     }
 
-    inet_ntop(sin.sin_family, &sin.sin_addr, src_ip, INET_ADDRSTRLEN);
+    block_table_free(&state->blocks);
+    agg_free(&state->aggs);
+    state->blocks = blocks;
+    state->aggs = aggs;
+    state->capacity.lru_head = BLOCK_NONE;
+    state->capacity.lru_tail = BLOCK_NONE;
+    telex_recount(state);
 
-    if (events & BEV_EVENT_ERROR) {
-        LogError(state->name, "Error from bufferevent (%s:%d):",
-                 src_ip, ntohs(sin.sin_port));
-        perror("    ");
+    if (state->journal != NULL) {
+        journal_compact(state->journal);
     }
-    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
-        LogDebug(state->name, "%s:%d disconnected", src_ip,
-                ntohs(sin.sin_port));
+}
+
+/*
+* Snapshots of the block table, for a standby (ha.h) or the journal
+* (journal.h). Replaying the changes that led up to it would not tell
+* split groups apart, so the entries and groups are written as they are,
+* blocks on the LRU last and coldest first so they come back in order.
+*/
+static void telex_snapshot(struct telex_state *state, int to)
+{
+    uint32_t m;
+    int kind;
+
+    for (m=0; m<state->blocks.n_entries; m++) {
+        struct block_entry *e = block_table_get(&state->blocks, m);
+
+        if (e->used && !(e->flags & BLOCK_HAS_FLOW)) {
+            telex_record(state, to, HA_REC_ENTRY, &e->key, e->action,
+                         e->flags & BLOCK_COVERED, e->installed_ms);
+        }
+    }
+    for (m = state->capacity.lru_head; m != BLOCK_NONE;
+         m = block_table_get(&state->blocks, m)->lru_next) {
+        struct block_entry *e = block_table_get(&state->blocks, m);
+
+        telex_record(state, to, HA_REC_ENTRY, &e->key, e->action,
+                     e->flags & (BLOCK_COVERED | BLOCK_HAS_FLOW),
+                     e->installed_ms);
+    }
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        for (m=0; m<state->aggs.groups[kind].n_entries; m++) {
+            struct block_entry *g = agg_group(&state->aggs, kind, m);
+
+            if (g->used && (g->flags & (AGG_INSTALLED | AGG_SPLIT))) {
+                telex_record(state, to, HA_REC_GROUP, &g->key, kind,
+                             g->flags & (AGG_INSTALLED | AGG_SPLIT), 0);
+            }
+        }
     }
 }
 
-void telex_accept_cb(struct evconnlistener *listener,
-                     evutil_socket_t fd, struct sockaddr *address,
-                     int socklen, void *ctx)
+static void telex_journal_snapshot(void *arg)
 {
-    struct telex_state *state = ctx;
+    telex_snapshot(arg, TELEX_TO_JOURNAL);
+}
 
-    struct bufferevent *bev = bufferevent_socket_new(
-                state->base, fd, BEV_OPT_CLOSE_ON_FREE);
-    struct sockaddr_in *sin = (struct sockaddr_in *)address;
-    char src_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &sin->sin_addr.s_addr, src_ip, INET_ADDRSTRLEN);
-    LogDebug(state->name, "%s:%d connected",
-             src_ip, ntohs(sin->sin_port));
+/*
+* High availability. A standby has no switches, so it can run the
+* primary's changes through telex_block and telex_forget to keep its
+* table in step, aggregates and all.
+*/
+static void telex_ha_snapshot(void *arg)
+{
+    struct telex_state *state = arg;
+    uint32_t xid = 0;
+
+    /* Flow mods still batched are only settled by the next pass */
+    if (state->batch_switches != 0) {
+        telex_send_barrier(state);
+    }
+
+    telex_snapshot(state, TELEX_TO_HA);
 
-    bufferevent_setcb(bev, telex_read_cb, NULL, telex_error_cb, state);
-    bufferevent_enable(bev, EV_READ);
+    if (state->n_passes > 0) {
+        xid = telex_pass_get(state, state->n_passes - 1)->xid;
+    }
+    ha_log(state->ha, HA_REC_SNAPSHOT_END, NULL, 0, state->n_passes > 0,
+           xid);
 }
 
-void telex_accept_error_cb(struct evconnlistener *listener, void *ctx)
+static void telex_restore_entry(struct telex_state *state,
+                                const struct ha_record *rec)
 {
-    struct event_base *base = evconnlistener_get_base(listener);
-    int err = EVUTIL_SOCKET_ERROR();
+    struct block_key key = rec->key;
+    struct block_entry *e;
+    uint32_t entry;
 
-    LogError("telex", "Accept error %d (%s)", err,
-             evutil_socket_error_to_string(err));
+    entry = block_table_insert(&state->blocks, &key);
+    if (entry == BLOCK_NONE) {
+        LogError(state->name, "Could not add block to shadow table");
+        return;
+    }
+    e = block_table_get(&state->blocks, entry);
+    e->action = rec->action;
+    e->installed_ms = be64toh(rec->value);
+    e->flags = rec->flags & BLOCK_COVERED;
+
+    if (telex_action_aggregates(e->action)) {
+        agg_join(&state->aggs, &state->blocks, entry);
+    }
+    if (rec->flags & BLOCK_HAS_FLOW) {
+        telex_flow_added(state, entry);
+    }
+}
+
+static void telex_restore_group(struct telex_state *state,
+                                const struct ha_record *rec)
+{
+    struct block_key key = rec->key;
+    int kind = rec->action;
+    uint32_t group;
+
+    if (kind >= AGG_KINDS) {
+        return;
+    }
+    group = block_table_find(&state->aggs.groups[kind], &key);
+    if (group == BLOCK_NONE) {
+        return;
+    }
+    agg_group(&state->aggs, kind, group)->flags =
+        rec->flags & (AGG_INSTALLED | AGG_SPLIT);
+    if (rec->flags & AGG_INSTALLED) {
+        telex_count(state, telex_aggregate_switches(state, kind, group), 1);
+    }
 }
 
+/* A record from the primary, or from the journal at startup */
+static void telex_apply(void *arg, const struct ha_record *rec)
+{
+    struct telex_state *state = arg;
+    struct block_key key = rec->key;
+    uint32_t entry;
+
+    switch (rec->type) {
+    case HA_REC_SNAPSHOT:
+        telex_clear(state);
+        break;
+    case HA_REC_ENTRY:
+        telex_restore_entry(state, rec);
+        break;
+    case HA_REC_GROUP:
+        telex_restore_group(state, rec);
+        break;
+    case HA_REC_SNAPSHOT_END:
+        LogInfo(state->name, "Standing by with %u blocks",
+                state->blocks.count);
+        /* The restored entries went around the journal */
+        if (state->journal != NULL) {
+            journal_compact(state->journal);
+        }
+        break;
+    case HA_REC_BLOCK:
+        telex_block(state, &key, rec->action);
+        entry = block_table_find(&state->blocks, &key);
+        if (entry != BLOCK_NONE) {
+            block_table_get(&state->blocks, entry)->installed_ms =
+                be64toh(rec->value);
+        }
+        break;
+    case HA_REC_FORGET:
+        entry = block_table_find(&state->blocks, &key);
+        if (entry != BLOCK_NONE) {
+            telex_forget(state, entry);
+        }
+        break;
+    }
+}
 
-int telex_init_listener(struct telex_state *state)
+/* Every switch that gets blocks is owed the resync, if there is one */
+static void telex_resync_owed(struct telex_state *state)
 {
-    struct sockaddr_in sin;
+    uint32_t i;
 
-    memset(&sin, 0, sizeof(sin));
-    sin.sin_family = AF_INET;
-    sin.sin_addr.s_addr = inet_addr("127.0.0.1");
-    sin.sin_port = htons(2603);
+    if (state->resync.count > 0) {
+        for (i=0; i<state->config.n_switches; i++) {
+            if (state->config.switches[i].blocks != CONFIG_BLOCKS_NONE) {
+                state->resync_switches |= 1u << i;
+            }
+        }
+    }
+    if (state->resync_switches == 0) {
+        telex_resync_done(state);
+    }
+}
 
-    state->listener = evconnlistener_new_bind(state->base, 
-                            telex_accept_cb, state,
-                            LEV_OPT_CLOSE_ON_FREE|LEV_OPT_REUSEABLE, -1,
-                            (struct sockaddr*)&sin, sizeof(sin));
-    if (!state->listener) {
-        LogError("telex", "Error binding");
-        return -1;
+/* What the standby's tail says may not have reached the switches, as sets
+ * of block and group keys. If it never settled there is no telling, and
+ * the switches are reconciled instead. */
+static void telex_resync_start(struct telex_state *state)
+{
+    struct ha_state *ha = state->ha;
+    struct block_key gkey;
+    uint32_t k;
+    int kind, err;
+
+    telex_resync_done(state);
+    if (!ha->synced || !ha->settled) {
+        return;
     }
 
-    evconnlistener_set_error_cb(state->listener, telex_accept_error_cb);
+    err = block_table_init(&state->resync);
+    for (kind=0; kind<AGG_KINDS; kind++) {
+        err |= block_table_init(&state->resync_groups[kind]);
+    }
+    for (k=0; k<ha->n_tail && !err; k++) {
+        struct block_key key = ha->tail[k].key;
 
-    return 0;
+        if (ha->tail[k].type != HA_REC_BLOCK &&
+            ha->tail[k].type != HA_REC_FORGET) {
+            continue;
+        }
+        err = block_table_insert(&state->resync, &key) == BLOCK_NONE;
+        for (kind=0; kind<AGG_KINDS && !err; kind++) {
+            if (agg_enabled(&state->aggs, kind)) {
+                agg_group_key(&state->aggs, kind, &key, &gkey);
+                err = block_table_insert(&state->resync_groups[kind],
+                                         &gkey) == BLOCK_NONE;
+            }
+        }
+    }
+    if (err) {
+        LogError(state->name, "Unable to allocate resync sets");
+        telex_resync_done(state);
+    }
 }
 
-void telex_flow_removed_cb(struct fox_state *state, void *payload)
+static void telex_ha_role(void *arg, uint8_t role)
 {
-    struct ofp_flow_removed *removed = payload;
-    char src_ip[INET_ADDRSTRLEN];
-    char dst_ip[INET_ADDRSTRLEN];
-    char *reason;
+    struct telex_state *state = arg;
+    struct fox_config cfg = state->primary_config;
+
+    if (role == HA_ROLE_PRIMARY) {
+        telex_resync_start(state);
+        if (telex_reconfigure(state, &cfg)) {
+            LogWarn(state->name, "Configuration only partly applied");
+        }
+        telex_resync_owed(state);
+        return;
+    }
 
-    inet_ntop(AF_INET, &removed->match.nw_src, src_ip, INET_ADDRSTRLEN);
-    inet_ntop(AF_INET, &removed->match.nw_dst, dst_ip, INET_ADDRSTRLEN);
-    
-    switch (removed->reason) {
-    case OFPRR_IDLE_TIMEOUT:    reason = "idle timeout"; break;
-    case OFPRR_HARD_TIMEOUT:    reason = "hard timeout"; break;
-    case OFPRR_DELETE:          reason = "delete";       break;
-    default:                    reason = "unknown";
+    /* The new primary has the switches and clients now, and will send
+     * us its table */
+    memset(state->unsent, 0, sizeof(state->unsent));
+    state->batch_switches = 0;
+    state->n_passes = 0;
+    evtimer_del(state->pass_timer);
+    while (state->clients != NULL) {
+        telex_client_free(state->clients);
     }
+    state->notify_count = 0;
+    telex_resync_done(state);
 
-    LogInfo(state->name, "Flow removed: %s:%d -> %s:%d reason: %s (%d)", 
-            src_ip, ntohs(removed->match.tp_src),
-            dst_ip, ntohs(removed->match.tp_dst), reason, removed->reason);
+    if (telex_reconfigure(state, &cfg)) {
+        LogWarn(state->name, "Configuration only partly applied");
+    }
+    telex_clear(state);
 }
 
+void telex_sighup_cb(evutil_socket_t sig, short what, void *arg)
+{
+    struct telex_state *state = arg;
+    struct fox_config cfg;
+
+    if (state->config_path == NULL) {
+        LogWarn(state->name, "SIGHUP, but there is no config file to reload");
+        return;
+    }
+
+    config_defaults(&cfg);
+    if (config_load(&cfg, state->config_path)) {
+        LogError(state->name, "Keeping the running configuration");
+        return;
+    }
+
+    LogInfo(state->name, "Reloading %s", state->config_path);
+    if (telex_reconfigure(state, &cfg)) {
+        LogWarn(state->name, "Configuration only partly applied");
+    }
+}
 
-/* TODO: take configuration */
-int telex_init(struct event_base *base)
+/* config_path may be NULL to run with the built-in defaults */
+int telex_init(struct event_base *base, char *config_path)
 { 
-    struct fox_state *controller;
     struct telex_state *state;
+    struct fox_config cfg;
+
+    config_defaults(&cfg);
+    if (config_path != NULL && config_load(&cfg, config_path)) {
+        return -1;
+    }
 
     state = malloc(sizeof(*state));
     if (state == NULL) {
@@ -226,24 +2670,51 @@ int telex_init(struct event_base *base)
 
     state->base = base;
     state->name = "Telex";
+    state->config_path = config_path;
+    state->capacity.lru_head = BLOCK_NONE;
+    state->capacity.lru_tail = BLOCK_NONE;
 
-    state->controllers[0] = controller_new(base, 
-                                    "10.1.0.1", 6633, 90*1000, 1);
-    state->controllers[1] = controller_new(base, 
-                                    "10.1.0.5", 6633, 90*1000, 0);
-    if (state->controllers[0] == NULL || state->controllers[1] == NULL) {
+    if (block_table_init(&state->blocks) ||
+        agg_init(&state->aggs, cfg.agg_threshold, cfg.agg_src_prefix,
+                 cfg.agg_dst_prefix)) {
+        LogError(state->name, "Unable to allocate block table");
         return -1;
     }
-    state->controllers[0]->user_ptr = state;
-    state->controllers[1]->user_ptr = state;
 
-    /* Openflow only sends flow removed by connecting to us, nevermind that
-     * we already have a connection open with them. */
-    controller_register_handler(state->controllers[1], OFPT_FLOW_REMOVED,
-                                telex_flow_removed_cb);
+    state->sched_ev = evtimer_new(base, telex_sched_cb, state);
+    state->pass_timer = evtimer_new(base, telex_pass_timer_cb, state);
+    state->notify_timer = evtimer_new(base, telex_notify_cb, state);
+    state->sighup_ev = evsignal_new(base, SIGHUP, telex_sighup_cb, state);
+    state->admit = admit_new(base, "Admit");
+    if (state->sched_ev == NULL || state->pass_timer == NULL || state->notify_timer == NULL ||
+        state->sighup_ev == NULL || state->admit == NULL) {
+        LogError(state->name, "Unable to allocate events");
+        return -1;
+    }
+    event_add(state->sighup_ev, NULL);
+
+    /* Recovered blocks go through the same paths as a standby's, before
+     * there are any switches to send them to */
+    if (cfg.journal_path[0] != '\0') {
+        state->journal = journal_open(base, &cfg, telex_apply,
+                                      telex_journal_snapshot, state);
+        if (state->journal == NULL || journal_compact(state->journal)) {
+            return -1;
+        }
+        LogInfo(state->name, "Recovered %u blocks", state->blocks.count);
+    }
 
+    /* Standing by until ha says otherwise */
+    state->primary_config = cfg;
+    if (cfg.ha.role != CONFIG_HA_OFF) {
+        state->ha = ha_init(base, &cfg, telex_ha_role, telex_apply,
+                            telex_ha_snapshot, state);
+        if (state->ha == NULL) {
+            return -1;
+        }
+    }
 
-    if (telex_init_listener(state)) {
+    if (telex_reconfigure(state, &cfg)) {
         return -1;
     }
 
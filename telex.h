@@ -5,23 +5,279 @@
 #include <event2/listener.h>
 #include <event2/bufferevent.h>
 #include "fox.h"
+#include "blocktable.h"
+#include "aggregate.h"
+#include "config.h"
+#include "ha.h"
+#include "journal.h"
 
-#define MAX_SWITCHES    10
+#define MAX_SWITCHES    CONFIG_MAX_SWITCHES
+
+/* Scheduling passes that may wait on switches at once */
+#define TELEX_MAX_PASSES    64
+
+struct telex_state;
+struct telex_flow_expired;
+
+/* A client's requests in a pass that is still waiting on switches */
+struct telex_client_pass {
+    uint32_t                xid;
+    uint32_t                requests;
+};
+
+struct telex_client {
+    struct telex_client     *next;
+    struct telex_state      *state;
+    struct bufferevent      *bev;
+    char                    name[32];
+
+    /* Deficit round robin: queued while it has unprocessed requests */
+    struct telex_client     *active_next;
+    int                     active;
+    uint32_t                deficit;
+
+    uint64_t                n_requests;
+
+    /* Requests taken in the current pass, and earlier passes not yet
+     * acknowledged (only with config.ack_requests), oldest first */
+    uint32_t                pass_requests;
+    struct telex_client_pass passes[TELEX_MAX_PASSES];
+    uint32_t                passes_head;
+    uint32_t                n_passes;
+};
+
+/* Room for telex's flows on one switch. limit comes from the config, 1.0
+ * table stats or the first table full error; 0 means unknown, and
+ * nothing is evicted ahead of time. */
+struct telex_room {
+    uint32_t                limit;
+    uint32_t                n_flows;    /* own-flow blocks + aggregates */
+    uint32_t                evict_sent; /* n_sent at the last eviction */
+    uint64_t                n_table_full;
+};
+
+/* One LRU across switches; each block counts towards the room of every
+ * switch its flow goes to (see telex_block_switches) */
+struct telex_capacity {
+    struct telex_room       room[MAX_SWITCHES];
+    uint32_t                lru_head;   /* coldest block with a flow */
+    uint32_t                lru_tail;
+    uint32_t                n_sent;     /* adds so far */
+
+    uint64_t                n_evicted;
+};
+
+/* A switch's flow dump being diffed against the shadow table: the flows
+ * it should have and does, as sets of block and group keys */
+struct telex_reconcile {
+    uint32_t                xid;        /* of the flow stats request */
+    struct block_table      seen;
+    struct block_table      seen_groups[AGG_KINDS];
+    uint32_t                n_flows;    /* telex's flows in the dump */
+    uint32_t                n_deleted;
+};
+
+/* A scheduling pass, closed by a barrier to every switch it sent flow mods
+ * to and done once they have all replied or TELEX_PASS_TIMEOUT_MS passed.
+ * Bits are indexes into telex_state.controllers. */
+struct telex_pass {
+    uint32_t                xid;        /* of its barriers */
+    uint32_t                waiting;    /* switches yet to reply */
+    uint8_t                 n_switches; /* that it went to */
+    uint8_t                 n_confirmed;
+    uint64_t                sent_ms;
+};
 
 struct telex_state {
     char                    *name;
     struct event_base       *base;
     struct evconnlistener   *listener;
+    struct evconnlistener   *unix_listener;
+    struct shm_ring_handle  *ring;
+    struct event            *ring_ev;
+    struct event            *ring_timer;
     struct fox_state        *controllers[MAX_SWITCHES]; 
+
+    /* Switches sent flow mods since the last barrier, and bytes of them
+     * that could not be queued for want of a connection */
+    uint32_t                batch_switches;
+    size_t                  unsent[MAX_SWITCHES];
+
+    /* Passes waiting on barrier replies, oldest first */
+    struct telex_pass       passes[TELEX_MAX_PASSES];
+    uint32_t                passes_head;
+    uint32_t                n_passes;
+    uint32_t                next_pass_xid;
+    struct event            *pass_timer;
+
+    struct fox_config       config;
+    char                    *config_path;
+    struct event            *sighup_ev;
+    struct discovery_state  *discovery;
+
+    struct telex_client     *clients;
+    struct ev_token_bucket_cfg *client_rate;
+
+    /* Clients with requests waiting to be scheduled onto the switch */
+    struct telex_client     *active_head;
+    struct telex_client     *active_tail;
+    struct event            *sched_ev;
+
+    /* What we believe is installed on the switches */
+    struct block_table      blocks;
+    struct agg_table        aggs;
+    struct telex_capacity   capacity;
+    struct journal          *journal;   /* the same on disk, if configured */
+
+    /* High availability (ha.h). A standby runs primary_config without its
+     * switches, listeners and ring until it takes over. */
+    struct ha_state         *ha;
+    struct fox_config       primary_config;
+
+    /* After taking over: blocks the old primary may not have got onto the
+     * switches, resent to each switch in resync_switches as it comes up.
+     * The tables are used as sets of block and group keys. */
+    uint32_t                resync_switches;
+    struct block_table      resync;
+    struct block_table      resync_groups[AGG_KINDS];
+
+    /* Any other switch that comes up is reconciled with its flow dump */
+    uint32_t                reconcile_switches;
+    uint32_t                reconcile_xid;
+    struct telex_reconcile  reconcile[MAX_SWITCHES];
+
+    /* Expired blocks waiting to be sent to clients */
+    struct event            *notify_timer;
+    struct telex_flow_expired *notify_pending;
+    uint16_t                notify_count;
+
+    /* Packets from blocked flows that reached us, after admission */
+    uint64_t                n_punted;
+    struct admit            *admit;
 };
 
 #define TELEX_MOD_BLOCK               0x01
 #define TELEX_MOD_UNBLOCK             0x02
 #define TELEX_MOD_BLOCK_BIDIRECTIONAL 0x03
 #define TELEX_MOD_UNBLOCK_BIDIRECTIONAL 0x04
+/* Rate limit instead of block; undone with the matching unblock. On 1.3
+ * switches the flow goes through a meter of config.throttle_kbps, on 1.0
+ * through a queue the switch has been set up with out of band. */
+#define TELEX_MOD_THROTTLE            0x05
+#define TELEX_MOD_THROTTLE_BIDIRECTIONAL 0x06
+
+/* The low nibble of telex_mod_flow.action is one of the commands above.
+ * For blocks, the two bits above it can pick what happens to the flow's
+ * packets instead of config.block_action: dropped by the switch, sent to
+ * us (the first punt_max_len bytes), or sent to us at no more than
+ * punt_sample_pps packets per second across all blocks. Sampling needs
+ * 1.3 meters; 1.0 switches punt every packet instead. */
+#define TELEX_MOD_CMD_MASK              0x0f
+#define TELEX_MOD_BLOCK_MASK            0x30
+#define TELEX_MOD_BLOCK_DEFAULT         0x00
+#define TELEX_MOD_BLOCK_DROP            0x10
+#define TELEX_MOD_BLOCK_PUNT            0x20
+#define TELEX_MOD_BLOCK_SAMPLE          0x30
+
+/* block_entry.flags telex keeps beside aggregate.h's */
+#define BLOCK_HAS_FLOW                  0x08    /* own flow, on the LRU */
+#define BLOCK_RETRIED                   0x10    /* resent after table full */
+
+/* Adds that may need retrying say what they were for in their xid: a
+ * block's entry, or an aggregate's kind and group */
+#define TELEX_XID_BLOCK                 0x40000000
+#define TELEX_XID_AGGREGATE             0x80000000
+#define TELEX_XID_KIND_SHIFT            29
+#define TELEX_XID_INDEX_MASK            0x1fffffff
+
+/* Priorities of telex's flows. An aggregate sits just below the exact
+ * flows, so a member's own flow wins while both are installed. */
+#define TELEX_PRIORITY                  (OFP_DEFAULT_PRIORITY + 100)
+#define TELEX_PRIORITY_AGGREGATE        (OFP_DEFAULT_PRIORITY + 99)
+
+/* Cookies of telex's flows. An exact block's carries its entry, so its
+ * flow removed finds it without hashing the match, and the entry's gen,
+ * so a removal for an earlier block that had the entry can be told from
+ * one for the block there now; the top 16 bits alone (masked with
+ * TELEX_COOKIE_TAG_MASK) pick out every exact block. Flows sent before a
+ * restart or by another primary have other entries, or 0, and are looked
+ * up by their match. */
+#define TELEX_COOKIE_AGGREGATE          0x7e1e0000  /* + AGG_BY_* */
+#define TELEX_COOKIE_BLOCK              0x7e1e000000000000ULL
+#define TELEX_COOKIE_TAG_MASK           0xffff000000000000ULL
+#define TELEX_COOKIE_GEN_SHIFT          32      /* gen << shift + entry */
+
+/* The meters throttled and sampled flows share on 1.3 switches */
+#define TELEX_METER_ID                  1
+#define TELEX_SAMPLE_METER_ID           2
 
 #define TELEX_IDLE_FLOW_TIMEOUT         15*60
 
+/* Blocks are aggregated once this many share a source or destination
+ * prefix of these lengths (see aggregate.h); 0 leaves them all exact */
+#define TELEX_AGG_THRESHOLD             0
+#define TELEX_AGG_PREFIX_LEN            24
+
+/* With a flow table of known size, blocks are evicted coldest first once
+ * telex's flows pass the high water mark, down to the low one */
+#define TELEX_EVICT_HIGH_PCT            95
+#define TELEX_EVICT_LOW_PCT             90
+
+#define TELEX_BLOCK_ACTION              TELEX_MOD_BLOCK_PUNT
+#define TELEX_PUNT_MAX_LEN              1500
+#define TELEX_PUNT_SAMPLE_PPS           100
+
+/* Built-in defaults for the settings in struct fox_config; see config.h
+ * and README.md for the config file. */
+
+/* Where clients reach us. Requests can also come from a shared memory
+ * ring (see shmring.h) if one is configured; producers that cannot wake us
+ * through the ring's FIFO are polled every TELEX_RING_POLL_MS. */
+#define TELEX_LISTEN_IP                 "127.0.0.1"
+#define TELEX_LISTEN_PORT               2603
+#define TELEX_UNIX_PATH                 "/tmp/telex.sock"
+#define TELEX_RING_NAME                 "/telex-ring"
+#define TELEX_RING_SLOTS                65536
+#define TELEX_RING_POLL_MS              10
+
+/* Requests are taken from clients in deficit round robin order, at most
+ * TELEX_SCHED_QUANTUM per client per round and TELEX_SCHED_BUDGET per
+ * pass through the event loop. Scheduling pauses while more than
+ * TELEX_SWITCH_HIGH_WATER bytes are waiting to go to the switch. */
+#define TELEX_SCHED_QUANTUM             16
+#define TELEX_SCHED_BUDGET              1024
+#define TELEX_SCHED_RETRY_MS            1
+#define TELEX_SWITCH_HIGH_WATER         (1 << 20)
+
+/* Flow mods per second each switch is sent at most, and the burst above
+ * it; a rate of 0 is no limit */
+#define TELEX_FLOW_MOD_RATE             0
+#define TELEX_FLOW_MOD_BURST            1000
+
+/* Packet-ins per second from all switches together, and from each flow,
+ * that reach the handlers (admit.h); one in TELEX_PACKET_IN_SAMPLE of a
+ * flow's excess still does */
+#define TELEX_PACKET_IN_RATE            5000
+#define TELEX_PACKET_IN_BURST           1000
+#define TELEX_PACKET_IN_FLOW_RATE       50
+#define TELEX_PACKET_IN_FLOW_BURST      100
+#define TELEX_PACKET_IN_SAMPLE          100
+
+/* A switch that has not answered a pass's barrier by then is counted as
+ * not having confirmed it */
+#define TELEX_PASS_TIMEOUT_MS           5000
+
+/* Per-client limits: requests per second (and burst), and how much unread
+ * input we hold before we stop reading from its socket */
+#define TELEX_CLIENT_RATE               20000
+#define TELEX_CLIENT_BURST              2000
+#define TELEX_CLIENT_MAX_BUFFERED       (64 * 1024)
+
+/* Flow removed notifications are coalesced for up to this long, or until
+ * this many are pending, before going out to clients */
+#define TELEX_NOTIFY_WINDOW_MS          100
+#define TELEX_NOTIFY_BATCH              256
+
 struct telex_mod_flow 
 {
   uint8_t     action;  
@@ -31,4 +287,49 @@ struct telex_mod_flow
   uint16_t    dst_port;
 } __attribute__((__packed__));
 
+/* Messages from telex back to its clients. Each starts with a
+ * telex_notify_hdr and is followed by count records of the given type.
+ * All multi-byte fields are in network byte order. */
+#define TELEX_MSG_FLOW_EXPIRED          0x81
+#define TELEX_MSG_APPLIED               0x82
+
+/* telex_flow_expired.reason for a block dropped to make room */
+#define TELEX_REASON_EVICTED            0x80
+
+struct telex_notify_hdr
+{
+  uint8_t     type;
+  uint16_t    count;
+} __attribute__((__packed__));
+
+/* A block the switch removed on its own (timeout or external delete).
+ * Blocks that were part of an aggregate flow report the aggregate's
+ * duration and zero counts. */
+struct telex_flow_expired
+{
+  uint32_t    src_ip;
+  uint32_t    dst_ip;
+  uint16_t    src_port;
+  uint16_t    dst_port;
+  uint8_t     reason;       /* OFPRR_* */
+  uint32_t    duration_sec;
+  uint64_t    packet_count;
+  uint64_t    byte_count;
+} __attribute__((__packed__));
+
+/* With ack_requests set, each scheduling pass that took requests from a
+ * client is answered with one of these once the switches it went to have
+ * confirmed it (or timed out). It covers the client's oldest requests not
+ * yet acknowledged; a request that needed no flow mod counts as applied. */
+struct telex_applied
+{
+  uint32_t    requests;
+  uint8_t     switches;     /* that the pass's flow mods went to */
+  uint8_t     unconfirmed;  /* of those, how many never confirmed them */
+} __attribute__((__packed__));
+
+int telex_init(struct event_base *base, char *config_path);
+
+int telex_reconfigure(struct telex_state *state, struct fox_config *cfg);
+
 #endif